@@ -1,6 +1,6 @@
 @ECHO off
 
-SET COMPILER_FLAGS=-nologo -Z7 -Od -FC -diagnostics:column
+SET COMPILER_FLAGS=-nologo -Z7 -Od -FC -diagnostics:column -arch:AVX2
 SET LINKER_FLAGS=-incremental:no user32.lib gdi32.lib winmm.lib
 
 IF NOT EXIST ..\build mkdir ..\build
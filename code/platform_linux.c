@@ -2,11 +2,17 @@
 /* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
 /* /////////////////////////////////////////////////////////////////////////// */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
@@ -18,21 +24,23 @@
 #include <GL/glu.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #define LINUX_LOG_MAX_LENGTH 1024
-
-typedef sem_t platform_semaphore;
+#define LINUX_FRAME_BITMAP_COUNT 2
 
 #include "raw.c"
+#include "platform_linux_common.c"
 #include "renderer_opengl.c"
 
-#define LINUX_SECONDS_ELAPSED(start, end) ((float)((end).tv_sec - (start).tv_sec) \
-        + (1e-9f * (float)((end).tv_nsec - (start).tv_nsec)))
-
 struct linux_window_dimensions
 {
    s32 width;
@@ -43,133 +51,6 @@ global bool linux_global_is_running;
 global bool linux_global_is_paused;
 global Display *linux_global_display;
 
-function
-PLATFORM_LOG(platform_log)
-{
-   char message[LINUX_LOG_MAX_LENGTH];
-
-   va_list arguments;
-   va_start(arguments, format);
-   {
-      vsnprintf(message, sizeof(message), format, arguments);
-   }
-   va_end(arguments);
-
-   printf("%s", message);
-}
-
-function
-PLATFORM_ENQUEUE_WORK(platform_enqueue_work)
-{
-   u32 new_write_index = (queue->write_index + 1) % ARRAY_LENGTH(queue->entries);
-   assert(new_write_index != queue->read_index);
-
-   struct queue_entry *entry = queue->entries + queue->write_index;
-   entry->data = data;
-   entry->callback = callback;
-
-   queue->completion_target++;
-
-   asm volatile("" ::: "memory");
-
-   queue->write_index = new_write_index;
-   sem_post(&queue->semaphore);
-}
-
-function bool
-linux_dequeue_work(struct platform_work_queue *queue)
-{
-   // NOTE(law): Return whether this thread should be made to wait until more
-   // work becomes available.
-
-   u32 read_index = queue->read_index;
-   u32 new_read_index = (read_index + 1) % ARRAY_LENGTH(queue->entries);
-   if(read_index == queue->write_index)
-   {
-      return(true);
-   }
-
-   u32 index = __sync_val_compare_and_swap(&queue->read_index, read_index, new_read_index);
-   if(index == read_index)
-   {
-      struct queue_entry entry = queue->entries[index];
-      entry.callback(queue, entry.data);
-
-      __sync_add_and_fetch(&queue->completion_count, 1);
-   }
-
-   return(false);
-}
-
-function
-PLATFORM_COMPLETE_QUEUE(platform_complete_queue)
-{
-   while(queue->completion_target > queue->completion_count)
-   {
-      linux_dequeue_work(queue);
-   }
-
-   queue->completion_target = 0;
-   queue->completion_count = 0;
-}
-
-function void *
-linux_thread_procedure(void *data)
-{
-   struct platform_work_queue *queue = (struct platform_work_queue *)data;
-   platform_log("Worker thread launched.\n");
-
-   while(1)
-   {
-      if(linux_dequeue_work(queue))
-      {
-         sem_wait(&queue->semaphore);
-      }
-   }
-
-   platform_log("Worker thread terminated.\n");
-
-   return(0);
-}
-
-function void *
-linux_allocate(size_t size)
-{
-   // NOTE(law): munmap() requires the size of the allocation in order to free
-   // the virtual memory. This function smuggles the allocation size just before
-   // the address that it actually returns.
-
-   size_t allocation_size = size + sizeof(size_t);
-   void *allocation = mmap(0, allocation_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-
-   if(allocation == MAP_FAILED)
-   {
-      platform_log("ERROR: Linux failed to allocate virtual memory.");
-      return(0);
-   }
-
-   *(size_t *)allocation = allocation_size;
-
-   void *result = (void *)((u8 *)allocation + sizeof(size_t));
-   return(result);
-}
-
-function void
-linux_deallocate(void *memory)
-{
-   // NOTE(law): munmap() requires the size of the allocation in order to free
-   // the virtual memory. We always just want to dump the entire thing, so
-   // allocate() hides the allocation size just before the address it returns.
-
-   void *allocation = (void *)((u8 *)memory - sizeof(size_t));
-   size_t allocation_size = *(size_t *)allocation;
-
-   if(munmap(allocation, allocation_size) != 0)
-   {
-      platform_log("ERROR: Linux failed to deallocate virtual memory.");
-   }
-}
-
 function void
 linux_get_window_dimensions(Window window, struct linux_window_dimensions *dimensions)
 {
@@ -368,7 +249,7 @@ linux_initialize_opengl(struct render_bitmap bitmap)
 #undef X
 
    // NOTE(law): Initialize the platform-independent side of OpenGL.
-   opengl_initialize();
+   opengl_initialize(bitmap.allocated_width, bitmap.allocated_height, bitmap.format);
 
    return(window);
 }
@@ -592,94 +473,384 @@ linux_process_events(Window window, struct user_input *input)
    }
 }
 
-function u32
-linux_get_processor_count()
+#define LINUX_VIEWER_FRAME_TIMEOUT_NS 16000000ull
+#define LINUX_VIEWER_ATTACH_INTERVAL_US 250000
+
+function int
+linux_run_viewer(char *name)
 {
-   u32 result = sysconf(_SC_NPROCESSORS_ONLN);
-   return(result);
+   // NOTE(law): Viewer mode presents frames that another process, e.g. a
+   // headless render node, publishes to a shared frame ring. Nothing is
+   // rendered here and no workers are launched. Frames are uploaded straight
+   // from the shared memory, and presenting at the display's rate never holds
+   // up the publisher. When the publisher goes away the viewer waits for the
+   // next one, which must publish frames of the same size.
+   struct linux_shared_frames frames;
+
+   platform_log("Waiting for frames to be published to %s (at most %u viewers attach at a time).\n",
+                name, LINUX_SHARED_MAX_VIEWER_COUNT);
+   while(!linux_attach_shared_frames(&frames, name))
+   {
+      usleep(LINUX_VIEWER_ATTACH_INTERVAL_US);
+   }
+
+   struct render_bitmap bitmap = linux_get_shared_bitmap(&frames, 0);
+   bitmap.allocated_width = bitmap.width;
+   bitmap.allocated_height = bitmap.height;
+
+   linux_global_display = XOpenDisplay(0);
+   Window window = linux_initialize_opengl(bitmap);
+   opengl_set_external_memory(frames.header, frames.size);
+
+   struct user_input input = {0};
+   u64 presented_count = 0;
+   u64 skipped_count = 0;
+
+   linux_global_is_running = true;
+   while(linux_global_is_running)
+   {
+      linux_process_events(window, &input);
+
+      if(!frames.header)
+      {
+         if(!linux_attach_shared_frames(&frames, name))
+         {
+            usleep(LINUX_VIEWER_ATTACH_INTERVAL_US);
+            continue;
+         }
+
+         struct linux_shared_header *header = frames.header;
+         if(header->width != bitmap.width || header->height != bitmap.height || header->format != bitmap.format)
+         {
+            platform_log("ERROR: %s now publishes %ux%u %s frames, restart the viewer to present them.\n",
+                         name, header->width, header->height, render_format_names[header->format]);
+            linux_close_shared_frames(&frames);
+            break;
+         }
+
+         opengl_set_external_memory(frames.header, frames.size);
+      }
+
+      struct render_bitmap frame;
+      if(linux_acquire_latest_shared_bitmap(&frames, &frame, LINUX_VIEWER_FRAME_TIMEOUT_NS))
+      {
+         linux_display_bitmap(window, frame);
+      }
+      else if(linux_shared_publisher_is_gone(&frames))
+      {
+         platform_log("The publisher of %s went away, waiting for the next one.\n", name);
+
+         presented_count += frames.presented_count;
+         skipped_count += frames.skipped_count;
+
+         opengl_set_external_memory(0, 0);
+         linux_close_shared_frames(&frames);
+      }
+   }
+
+   if(frames.header)
+   {
+      presented_count += frames.presented_count;
+      skipped_count += frames.skipped_count;
+      linux_close_shared_frames(&frames);
+   }
+
+   XCloseDisplay(linux_global_display);
+
+   platform_log("Presented %llu frames from %s, skipped %llu that were replaced before they could be shown.\n",
+                (unsigned long long)presented_count, name, (unsigned long long)skipped_count);
+
+   return(0);
 }
 
 int
 main(int argument_count, char **arguments)
 {
-   struct platform_work_queue queue = {0};
-   sem_init(&queue.semaphore, 0, 0);
+   // NOTE(law): Frames can be streamed to a file or pipe with --record <path>
+   // (- for stdout), --record-format y4m|ppm|bgra, --record-ring <count>,
+   // --record-drop and --record-fps <rate>, or RAW_RECORD. Read these first,
+   // since recording to stdout moves the log to stderr.
+   struct linux_output_options output_options = {0};
+   linux_get_output_options(&output_options, argument_count, arguments);
+
+   char *trace_path = linux_get_trace_path(argument_count, arguments);
+   if(trace_path)
+   {
+      profile_initialize();
+   }
+
+   // NOTE(law): With --view <name> or RAW_VIEW, present frames published by
+   // another process instead of rendering, see linux_run_viewer().
+   char *view_name = linux_get_view_name(argument_count, arguments);
+   if(view_name)
+   {
+      return(linux_run_viewer(view_name));
+   }
 
    u32 processor_count = linux_get_processor_count();
    platform_log("%u processors currently online.\n", processor_count);
 
-   for(long index = 1; index < processor_count; ++index)
+   // NOTE(law): The worker count and thread placement can be set with
+   // --workers, --cpus, --no-smt and --numa, or the matching RAW_WORKERS,
+   // RAW_CPUS, RAW_NO_SMT and RAW_NUMA environment variables.
+   struct linux_placement_options placement_options = {0};
+   linux_get_placement_options(&placement_options, argument_count, arguments);
+
+   struct linux_thread_placement placement;
+   u32 worker_count;
+   if(!linux_initialize_placement(&placement, &placement_options, &worker_count))
    {
-      pthread_t id;
-      pthread_create(&id, 0, linux_thread_procedure, &queue);
-      pthread_detach(id);
+      return(1);
    }
+   linux_log_placement(&placement, worker_count);
 
-   // NOTE(law) Set up the rendering bitmap.
-   struct render_bitmap bitmap = {RESOLUTION_BASE_WIDTH, RESOLUTION_BASE_HEIGHT};
+   struct platform_work_queue queue = {0};
+   linux_initialize_queue(&queue, &placement);
 
-   size_t bytes_per_pixel = sizeof(u32);
-   size_t bitmap_size = bitmap.width * bitmap.height * bytes_per_pixel;
-   bitmap.memory = linux_allocate(bitmap_size);
-   if(!bitmap.memory)
+   for(u32 index = 0; index < worker_count; ++index)
    {
-      return(1);
+      linux_launch_worker(&queue);
+   }
+
+   // NOTE(law) Set up the rendering bitmaps. Frames are pipelined: workers
+   // trace the next frame into one bitmap while the main thread presents the
+   // previous frame from the other.
+   struct render_bitmap bitmaps[LINUX_FRAME_BITMAP_COUNT];
+   u64 bitmap_input_timestamps[LINUX_FRAME_BITMAP_COUNT] = {0};
+
+   // NOTE(law): BGRA8 is the cheapest to upload and is the default. The float
+   // formats can be picked with --format, and F6 cycles the output transform.
+   u32 bitmap_format = RENDER_FORMAT_BGRA8;
+   for(int index = 1; index + 1 < argument_count; ++index)
+   {
+      if(strcmp(arguments[index], "--format") == 0)
+      {
+         for(u32 format = 0; format < RENDER_FORMAT_COUNT; ++format)
+         {
+            if(strcmp(arguments[index + 1], render_format_names[format]) == 0)
+            {
+               bitmap_format = format;
+            }
+         }
+      }
+   }
+
+   for(u32 index = 0; index < LINUX_FRAME_BITMAP_COUNT; ++index)
+   {
+      struct render_bitmap *bitmap = bitmaps + index;
+      bitmap->width = RESOLUTION_BASE_WIDTH;
+      bitmap->height = RESOLUTION_BASE_HEIGHT;
+      bitmap->allocated_width = RESOLUTION_BASE_WIDTH;
+      bitmap->allocated_height = RESOLUTION_BASE_HEIGHT;
+      bitmap->memory = 0;
+      bitmap->format = bitmap_format;
    }
 
    // NOTE(law): Initialize the global display here.
    linux_global_display = XOpenDisplay(0);
-   Window window = linux_initialize_opengl(bitmap);
+   Window window = linux_initialize_opengl(bitmaps[0]);
+
+   // NOTE(law): When the driver supports persistent mapping, bitmaps live
+   // directly in OpenGL pixel buffers and are uploaded without a copy. Those
+   // buffers are mapped for writing only, so a recording, which reads every
+   // frame back, renders into ordinary memory instead.
+   for(u32 index = 0; index < LINUX_FRAME_BITMAP_COUNT; ++index)
+   {
+      struct render_bitmap *bitmap = bitmaps + index;
+
+      bitmap->memory = (output_options.path) ? 0 : opengl_get_pixel_buffer_memory(index);
+      if(!bitmap->memory)
+      {
+         size_t bytes_per_pixel = get_render_format_bytes_per_pixel(bitmap->format);
+         size_t bitmap_size = bitmap->width * bitmap->height * bytes_per_pixel;
+         bitmap->memory = linux_allocate(bitmap_size);
+         if(!bitmap->memory)
+         {
+            return(1);
+         }
+      }
+
+      linux_first_touch_bitmap(&queue, bitmap);
+   }
+
+   // NOTE(law): Scene capacities and frame memory can be set with
+   // --max-planes, --max-primitives and --frame-memory <MB>, or the matching
+   // RAW_MAX_PLANES, RAW_MAX_PRIMITIVES and RAW_FRAME_MEMORY variables.
+   struct linux_memory_options memory_options = {0};
+   linux_get_memory_options(&memory_options, argument_count, arguments);
+   if(!linux_initialize_memory(&memory_options))
+   {
+      return(1);
+   }
+
+   char *scene_path = linux_get_scene_path(argument_count, arguments);
+   if(scene_path && !load_scene(scene_path))
+   {
+      return(1);
+   }
 
    struct user_input input = {0};
 
+   // NOTE(law): Accumulate samples while the camera is still. F3 toggles it.
+   renderer.progressive_enabled = true;
+
+   // NOTE(law): Reuse primary hits while the camera moves. F7 toggles it.
+   renderer.reprojection_enabled = true;
+
+   // NOTE(law): Spend up to half a ray per pixel on edges. F5 toggles it.
+   configure_adaptive_sampling(0.5f);
+
    float target_seconds_per_frame = 1.0f / 60.0f;
    float frame_seconds_elapsed = 0;
 
+   // NOTE(law): Leave part of the frame for presenting and input. The allowed
+   // scale range can be set with --min-scale and --max-scale, and F4 toggles
+   // dynamic resolution.
+   float minimum_resolution_scale = 0.5f;
+   float maximum_resolution_scale = 1.0f;
+   for(int index = 1; index + 1 < argument_count; ++index)
+   {
+      if(strcmp(arguments[index], "--min-scale") == 0)
+      {
+         minimum_resolution_scale = (float)atof(arguments[index + 1]);
+      }
+      else if(strcmp(arguments[index], "--max-scale") == 0)
+      {
+         maximum_resolution_scale = (float)atof(arguments[index + 1]);
+      }
+   }
+
+   // NOTE(law): Recorded streams have a fixed frame size, so recording keeps
+   // the resolution at full scale. Bitmaps are handed to OpenGL for display,
+   // so they cannot be the output ring's own, and completed frames are copied
+   // into it while the workers trace the next one.
+   struct linux_output_sink output = {0};
+   bool is_recording = false;
+   bool has_unrecorded_frame = false;
+   if(output_options.path)
+   {
+      if(bitmap_format != RENDER_FORMAT_BGRA8)
+      {
+         platform_log("ERROR: --record needs --format bgra8.\n");
+         return(1);
+      }
+      if(!linux_open_output(&output, &output_options, RESOLUTION_BASE_WIDTH, RESOLUTION_BASE_HEIGHT))
+      {
+         return(1);
+      }
+
+      is_recording = true;
+      minimum_resolution_scale = 1.0f;
+      maximum_resolution_scale = 1.0f;
+   }
+
+   configure_dynamic_resolution(0.8f * target_seconds_per_frame, minimum_resolution_scale, maximum_resolution_scale);
+
+   u32 present_index = 0;
+   bool has_presentable_frame = false;
+   float frame_latency_seconds = 0;
+   float worst_frame_latency_seconds = 0;
+
+   struct linux_frame_pacer pacer;
+   linux_initialize_pacer(&pacer, target_seconds_per_frame);
+
    struct timespec frame_start_count;
    clock_gettime(CLOCK_MONOTONIC, &frame_start_count);
 
    linux_global_is_running = true;
    while(linux_global_is_running)
    {
+      // TODO(law): For now, function keys capture the initial key press, so
+      // they get cleared here every frame. Improve input state management
+      // instead.
+
+      for(unsigned int index = 0; index < ARRAY_LENGTH(input.function_keys); ++index)
+      {
+         input.function_keys[index] = 0;
+      }
+
       linux_process_events(window, &input);
 
-      update(&bitmap, &input, &queue, frame_seconds_elapsed);
+      // NOTE(law): Start tracing the next frame, then present the last
+      // completed one while the workers are busy. A frame is therefore shown
+      // one iteration after its input was sampled. When no new frame was
+      // needed (e.g. a converged progressive image), the last frame is shown
+      // again.
+      u32 render_index = (present_index + 1) % LINUX_FRAME_BITMAP_COUNT;
+      struct render_bitmap *render_bitmap = bitmaps + render_index;
 
-      // NOTE(law): Blit bitmap to screen.
-      linux_display_bitmap(window, bitmap);
+      opengl_prepare_bitmap_for_writing(render_bitmap);
 
-      // NOTE(law): Calculate elapsed frame time.
-      struct timespec frame_end_count;
-      clock_gettime(CLOCK_MONOTONIC, &frame_end_count);
-      frame_seconds_elapsed = LINUX_SECONDS_ELAPSED(frame_start_count, frame_end_count);
+      u64 input_timestamp = platform_timestamp();
+      bool is_rendering = begin_frame(render_bitmap, &input, &queue, frame_seconds_elapsed);
 
-      u32 sleep_us = 0;
-      float sleep_fraction = 0.9f;
-      if(frame_seconds_elapsed < target_seconds_per_frame)
+      if(has_presentable_frame)
       {
-         sleep_us = (u32)((target_seconds_per_frame - frame_seconds_elapsed) * 1000.0f * 1000.0f * sleep_fraction);
-         if(sleep_us > 0)
+         u64 latency = platform_timestamp() - bitmap_input_timestamps[present_index];
+         frame_latency_seconds = (float)latency / 1e9f;
+         worst_frame_latency_seconds = MAXIMUM(worst_frame_latency_seconds, frame_latency_seconds);
+
+         // NOTE(law): Blit bitmap to screen.
+         u64 profile_start = profile_begin();
+         linux_display_bitmap(window, bitmaps[present_index]);
+         profile_end(PROFILE_EVENT_DISPLAY, profile_start, 0, 0);
+
+         if(has_unrecorded_frame)
          {
-            usleep(sleep_us);
+            linux_copy_output_bitmap(&output, bitmaps + present_index);
+            has_unrecorded_frame = false;
          }
       }
 
-      while(frame_seconds_elapsed < target_seconds_per_frame)
+      if(is_rendering)
       {
-         clock_gettime(CLOCK_MONOTONIC, &frame_end_count);
-         frame_seconds_elapsed = LINUX_SECONDS_ELAPSED(frame_start_count, frame_end_count);
+         end_frame(render_bitmap, &queue);
+
+         bitmap_input_timestamps[render_index] = input_timestamp;
+         present_index = render_index;
+         has_presentable_frame = true;
+         has_unrecorded_frame = is_recording;
       }
+
+      // NOTE(law): Wait for the next frame deadline and calculate the elapsed
+      // frame time.
+      linux_wait_for_next_frame(&pacer);
+
+      struct timespec frame_end_count;
+      clock_gettime(CLOCK_MONOTONIC, &frame_end_count);
+      frame_seconds_elapsed = LINUX_SECONDS_ELAPSED(frame_start_count, frame_end_count);
       frame_start_count = frame_end_count;
 
       static u32 frame_count = 0;
       if((frame_count++ % 30) == 0)
       {
          platform_log("Frame time: %0.03fms, ", frame_seconds_elapsed * 1000.0f);
-         platform_log("Sleep: %uus\n", sleep_us);
+         platform_log("Missed: %llu, ", (unsigned long long)pacer.missed_deadline_count);
+         platform_log("Scale: %.2f (%ux%u), ", renderer.resolution_scale,
+                      bitmaps[present_index].width, bitmaps[present_index].height);
+         platform_log("Latency: %0.03fms (worst %0.03fms)\n", frame_latency_seconds * 1000.0f,
+                      worst_frame_latency_seconds * 1000.0f);
+         worst_frame_latency_seconds = 0;
       }
    }
 
    XCloseDisplay(linux_global_display);
 
+   if(is_recording)
+   {
+      if(has_unrecorded_frame)
+      {
+         linux_copy_output_bitmap(&output, bitmaps + present_index);
+      }
+      linux_close_output(&output);
+   }
+
+   linux_log_pacer_statistics(&pacer);
+
+   if(trace_path)
+   {
+      profile_write_chrome_trace(trace_path);
+   }
+
    return(0);
 }
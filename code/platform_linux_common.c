@@ -0,0 +1,2423 @@
+/* /////////////////////////////////////////////////////////////////////////// */
+/* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
+/* /////////////////////////////////////////////////////////////////////////// */
+
+// NOTE(law): This file contains the parts of the Linux platform layer that do
+// not depend on X11 or OpenGL. It is shared by the windowed and headless entry
+// points, and expects raw.c to have been #include'd first.
+
+global bool linux_log_to_stderr;
+
+#define LINUX_SECONDS_ELAPSED(start, end) ((float)((end).tv_sec - (start).tv_sec) \
+        + (1e-9f * (float)((end).tv_nsec - (start).tv_nsec)))
+
+function
+PLATFORM_LOG(platform_log)
+{
+   char message[LINUX_LOG_MAX_LENGTH];
+
+   va_list arguments;
+   va_start(arguments, format);
+   {
+      vsnprintf(message, sizeof(message), format, arguments);
+   }
+   va_end(arguments);
+
+   // NOTE(law): Frames recorded to stdout push the log over to stderr.
+   fputs(message, (linux_log_to_stderr) ? stderr : stdout);
+}
+
+function void *
+linux_allocate(size_t size)
+{
+   // NOTE(law): munmap() requires the size of the allocation in order to free
+   // the virtual memory. This function smuggles the allocation size just before
+   // the address that it actually returns.
+
+   // NOTE(law): Pages are only backed once touched, and MAP_NORESERVE keeps
+   // large, mostly unused blocks like the arenas from being refused under
+   // strict overcommit accounting.
+
+   size_t allocation_size = size + sizeof(size_t);
+   void *allocation = mmap(0, allocation_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE|MAP_NORESERVE, -1, 0);
+
+   if(allocation == MAP_FAILED)
+   {
+      platform_log("ERROR: Linux failed to allocate virtual memory.");
+      return(0);
+   }
+
+   *(size_t *)allocation = allocation_size;
+
+   void *result = (void *)((u8 *)allocation + sizeof(size_t));
+   return(result);
+}
+
+function void
+linux_deallocate(void *memory)
+{
+   // NOTE(law): munmap() requires the size of the allocation in order to free
+   // the virtual memory. We always just want to dump the entire thing, so
+   // allocate() hides the allocation size just before the address it returns.
+
+   void *allocation = (void *)((u8 *)memory - sizeof(size_t));
+   size_t allocation_size = *(size_t *)allocation;
+
+   if(munmap(allocation, allocation_size) != 0)
+   {
+      platform_log("ERROR: Linux failed to deallocate virtual memory.");
+   }
+}
+
+function
+PLATFORM_ALLOCATE(platform_allocate)
+{
+   void *result = linux_allocate(size);
+   return(result);
+}
+
+function
+PLATFORM_DEALLOCATE(platform_deallocate)
+{
+   linux_deallocate(memory);
+}
+
+function
+PLATFORM_MAP_FILE(platform_map_file)
+{
+   void *result = 0;
+
+   int file = open(path, O_RDONLY);
+   if(file >= 0)
+   {
+      struct stat status;
+      if(fstat(file, &status) == 0 && status.st_size > 0)
+      {
+         void *memory = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+         if(memory != MAP_FAILED)
+         {
+            result = memory;
+            *size = status.st_size;
+         }
+      }
+
+      // NOTE(law): The mapping keeps its own reference to the file.
+      close(file);
+   }
+
+   return(result);
+}
+
+function
+PLATFORM_UNMAP_FILE(platform_unmap_file)
+{
+   if(munmap(memory, size) != 0)
+   {
+      platform_log("ERROR: Linux failed to unmap a file.\n");
+   }
+}
+
+function
+PLATFORM_TIMESTAMP(platform_timestamp)
+{
+   struct timespec count;
+   clock_gettime(CLOCK_MONOTONIC, &count);
+
+   u64 result = ((u64)count.tv_sec * 1000000000ull) + (u64)count.tv_nsec;
+   return(result);
+}
+
+// NOTE(law): The frame pacer sleeps on an absolute deadline with
+// clock_nanosleep(TIMER_ABSTIME) and only spins for a short, calibrated margin
+// at the end. The margin tracks how late the kernel actually wakes the thread,
+// so the wait costs next to no CPU while staying within tens of microseconds.
+
+#define LINUX_PACER_HISTOGRAM_BUCKET_COUNT 16
+#define LINUX_PACER_INITIAL_SPIN_NS   200000
+#define LINUX_PACER_MINIMUM_SPIN_NS    20000
+#define LINUX_PACER_MAXIMUM_SPIN_NS  2000000
+
+struct linux_frame_pacer
+{
+   u64 period_ns;
+   u64 next_deadline_ns;
+   u64 spin_ns;
+   u64 wake_latency_ns;
+
+   // NOTE(law): Statistics. Bucket n of the jitter histogram counts frames
+   // whose wait ended between 2^(n-1) and 2^n microseconds after the deadline
+   // (bucket 0 means less than a microsecond). Missed deadlines are frames
+   // whose work alone ran past the deadline.
+   u64 frame_count;
+   u64 missed_deadline_count;
+   u64 missed_period_count;
+   u64 spin_ns_total;
+   u64 maximum_jitter_ns;
+   u64 jitter_histogram[LINUX_PACER_HISTOGRAM_BUCKET_COUNT];
+};
+
+function void
+linux_initialize_pacer(struct linux_frame_pacer *pacer, float seconds_per_frame)
+{
+   memset(pacer, 0, sizeof(*pacer));
+
+   pacer->period_ns = (u64)((double)seconds_per_frame * 1e9);
+   pacer->spin_ns = LINUX_PACER_INITIAL_SPIN_NS;
+   pacer->next_deadline_ns = platform_timestamp() + pacer->period_ns;
+
+   // NOTE(law): The default timer slack of 50us would dominate the wake-up
+   // latency, so ask for a tighter one on this thread.
+   prctl(PR_SET_TIMERSLACK, 1000, 0, 0, 0);
+}
+
+function u32
+linux_pacer_histogram_bucket(u64 jitter_ns)
+{
+   u64 microseconds = jitter_ns / 1000;
+
+   u32 result = 0;
+   while(microseconds && result < (LINUX_PACER_HISTOGRAM_BUCKET_COUNT - 1))
+   {
+      microseconds >>= 1;
+      result++;
+   }
+
+   return(result);
+}
+
+function void
+linux_wait_for_next_frame(struct linux_frame_pacer *pacer)
+{
+   u64 deadline = pacer->next_deadline_ns;
+   u64 now = platform_timestamp();
+
+   if(now >= deadline)
+   {
+      // NOTE(law): The frame ran over. Skip the periods that were already
+      // missed rather than rushing through a burst of catch-up frames.
+      u64 late_periods = ((now - deadline) / pacer->period_ns) + 1;
+
+      pacer->missed_deadline_count++;
+      pacer->missed_period_count += late_periods - 1;
+      pacer->next_deadline_ns = deadline + (late_periods * pacer->period_ns);
+   }
+   else
+   {
+      u64 sleep_until = deadline - MINIMUM(pacer->spin_ns, deadline - now);
+      if(sleep_until > now)
+      {
+         struct timespec wake_time;
+         wake_time.tv_sec = sleep_until / 1000000000ull;
+         wake_time.tv_nsec = sleep_until % 1000000000ull;
+         while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_time, 0) == EINTR);
+
+         // NOTE(law): Calibrate the spin margin against a decaying maximum of
+         // the observed wake-up latency, with some headroom.
+         u64 woke = platform_timestamp();
+         u64 wake_latency = (woke > sleep_until) ? woke - sleep_until : 0;
+         pacer->wake_latency_ns = MAXIMUM(wake_latency, pacer->wake_latency_ns - (pacer->wake_latency_ns / 16));
+
+         u64 spin_ns = pacer->wake_latency_ns + (pacer->wake_latency_ns / 2);
+         pacer->spin_ns = MINIMUM(MAXIMUM(spin_ns, LINUX_PACER_MINIMUM_SPIN_NS), LINUX_PACER_MAXIMUM_SPIN_NS);
+      }
+
+      u64 spin_start = platform_timestamp();
+      while((now = platform_timestamp()) < deadline)
+      {
+         _mm_pause();
+      }
+      pacer->spin_ns_total += (now > spin_start) ? now - spin_start : 0;
+
+      pacer->next_deadline_ns = deadline + pacer->period_ns;
+   }
+
+   u64 jitter = now - deadline;
+   pacer->maximum_jitter_ns = MAXIMUM(pacer->maximum_jitter_ns, jitter);
+   pacer->jitter_histogram[linux_pacer_histogram_bucket(jitter)]++;
+   pacer->frame_count++;
+}
+
+function void
+linux_log_pacer_statistics(struct linux_frame_pacer *pacer)
+{
+   platform_log("Frame pacing: %llu frames, %llu missed deadlines (%llu skipped periods), "
+                "max jitter %.1fus, spin margin %.1fus, mean spin %.1fus\n",
+                (unsigned long long)pacer->frame_count,
+                (unsigned long long)pacer->missed_deadline_count,
+                (unsigned long long)pacer->missed_period_count,
+                (double)pacer->maximum_jitter_ns / 1000.0,
+                (double)pacer->spin_ns / 1000.0,
+                (pacer->frame_count) ? (double)pacer->spin_ns_total / (1000.0 * (double)pacer->frame_count) : 0.0);
+
+   platform_log("Jitter histogram:\n");
+   for(u32 bucket = 0; bucket < LINUX_PACER_HISTOGRAM_BUCKET_COUNT; ++bucket)
+   {
+      if(pacer->jitter_histogram[bucket])
+      {
+         u64 upper = 1ull << bucket;
+         platform_log("  %s%6lluus  %llu\n", (bucket == LINUX_PACER_HISTOGRAM_BUCKET_COUNT - 1) ? ">=" : " <",
+                      (unsigned long long)((bucket == LINUX_PACER_HISTOGRAM_BUCKET_COUNT - 1) ? (upper >> 1) : upper),
+                      (unsigned long long)pacer->jitter_histogram[bucket]);
+      }
+   }
+}
+
+function char *
+linux_get_path_option(int argument_count, char **arguments, char *option, char *variable)
+{
+   // NOTE(law): Paths can be given as <option> <path> on the command line or
+   // through an environment variable, the command line taking precedence.
+   char *result = getenv(variable);
+   for(int index = 1; index + 1 < argument_count; ++index)
+   {
+      if(strcmp(arguments[index], option) == 0)
+      {
+         result = arguments[index + 1];
+      }
+   }
+
+   if(result && !result[0])
+   {
+      result = 0;
+   }
+
+   return(result);
+}
+
+function char *
+linux_get_trace_path(int argument_count, char **arguments)
+{
+   // NOTE(law): Profiling is enabled with --trace <path> on the command line or
+   // the RAW_TRACE environment variable. The trace is written on exit.
+   char *result = linux_get_path_option(argument_count, arguments, "--trace", "RAW_TRACE");
+   return(result);
+}
+
+function char *
+linux_get_scene_path(int argument_count, char **arguments)
+{
+   // NOTE(law): A text or compiled scene file to load instead of the default
+   // scene, given with --scene <path> or RAW_SCENE.
+   char *result = linux_get_path_option(argument_count, arguments, "--scene", "RAW_SCENE");
+   return(result);
+}
+
+// NOTE(law): Memory options size the arenas, see initialize_memory(). Zero
+// means the default.
+
+struct linux_memory_options
+{
+   u32 plane_capacity;
+   u32 primitive_capacity;
+   u32 frame_megabytes;
+};
+
+function u32
+linux_parse_memory_argument(struct linux_memory_options *options, char *argument, char *value)
+{
+   // NOTE(law): Returns how many arguments were consumed, or zero if argument
+   // is not a memory option.
+   u32 result = 0;
+
+   if(value && strcmp(argument, "--max-planes") == 0)
+   {
+      options->plane_capacity = (u32)atoi(value);
+      result = 2;
+   }
+   else if(value && strcmp(argument, "--max-primitives") == 0)
+   {
+      options->primitive_capacity = (u32)atoi(value);
+      result = 2;
+   }
+   else if(value && strcmp(argument, "--frame-memory") == 0)
+   {
+      options->frame_megabytes = (u32)atoi(value);
+      result = 2;
+   }
+
+   return(result);
+}
+
+function void
+linux_get_memory_options(struct linux_memory_options *options, int argument_count, char **arguments)
+{
+   // NOTE(law): Environment variables are read first, so that command line
+   // arguments can override them.
+   char *plane_capacity = getenv("RAW_MAX_PLANES");
+   if(plane_capacity && plane_capacity[0])
+   {
+      options->plane_capacity = (u32)atoi(plane_capacity);
+   }
+
+   char *primitive_capacity = getenv("RAW_MAX_PRIMITIVES");
+   if(primitive_capacity && primitive_capacity[0])
+   {
+      options->primitive_capacity = (u32)atoi(primitive_capacity);
+   }
+
+   char *frame_megabytes = getenv("RAW_FRAME_MEMORY");
+   if(frame_megabytes && frame_megabytes[0])
+   {
+      options->frame_megabytes = (u32)atoi(frame_megabytes);
+   }
+
+   for(int index = 1; index < argument_count; ++index)
+   {
+      char *value = (index + 1 < argument_count) ? arguments[index + 1] : 0;
+
+      u32 consumed = linux_parse_memory_argument(options, arguments[index], value);
+      if(consumed)
+      {
+         index += consumed - 1;
+      }
+   }
+}
+
+function bool
+linux_initialize_memory(struct linux_memory_options *options)
+{
+   u32 plane_capacity = (options->plane_capacity) ? options->plane_capacity : SCENE_DEFAULT_PLANE_CAPACITY;
+   u32 primitive_capacity = (options->primitive_capacity) ? options->primitive_capacity : SCENE_DEFAULT_PRIMITIVE_CAPACITY;
+   size_t frame_size = (options->frame_megabytes) ? (size_t)options->frame_megabytes * 1024 * 1024 : FRAME_ARENA_DEFAULT_SIZE;
+
+   bool result = initialize_memory(plane_capacity, primitive_capacity, frame_size);
+   return(result);
+}
+
+function u32
+linux_get_processor_count()
+{
+   u32 result = sysconf(_SC_NPROCESSORS_ONLN);
+   return(result);
+}
+
+// NOTE(law): Thread placement decides how many workers to launch and which CPU
+// each thread is pinned to. By default nothing is pinned and one worker is
+// launched per online processor, minus the main thread. Restricting the CPU
+// set, skipping SMT siblings or enabling NUMA placement all turn pinning on.
+// With NUMA placement, CPUs are handed out round-robin across nodes, and work
+// enqueued for a node is only ever run by threads pinned to that node.
+
+#define LINUX_MAX_NODE_COUNT 64
+#define LINUX_TOPOLOGY_TEXT_LENGTH 1024
+
+struct linux_placement_options
+{
+   u32 worker_count; // NOTE(law): Zero means one per usable CPU.
+   char *cpu_list;
+   bool skip_smt;
+   bool numa;
+};
+
+struct linux_thread_placement
+{
+   bool pin_threads;
+
+   // NOTE(law): Thread n runs on cpus[n % cpu_count]. The main thread is
+   // thread 0.
+   u32 cpu_count;
+   u32 cpus[CPU_SETSIZE];
+   u32 cpu_nodes[CPU_SETSIZE];
+
+   // NOTE(law): Nodes are numbered densely over the usable CPUs, so node 0 is
+   // always the main thread's, and system_nodes maps back to the kernel's
+   // numbering.
+   u32 node_count;
+   u32 system_nodes[LINUX_MAX_NODE_COUNT];
+   cpu_set_t node_cpus[LINUX_MAX_NODE_COUNT];
+};
+
+function u32
+linux_parse_placement_argument(struct linux_placement_options *options, char *argument, char *value)
+{
+   // NOTE(law): Returns how many arguments were consumed, or zero if argument
+   // is not a placement option.
+   u32 result = 0;
+
+   if(strcmp(argument, "--no-smt") == 0)
+   {
+      options->skip_smt = true;
+      result = 1;
+   }
+   else if(strcmp(argument, "--numa") == 0)
+   {
+      options->numa = true;
+      result = 1;
+   }
+   else if(value && strcmp(argument, "--workers") == 0)
+   {
+      options->worker_count = (u32)atoi(value);
+      result = 2;
+   }
+   else if(value && strcmp(argument, "--cpus") == 0)
+   {
+      options->cpu_list = value;
+      result = 2;
+   }
+
+   return(result);
+}
+
+function void
+linux_get_placement_options(struct linux_placement_options *options, int argument_count, char **arguments)
+{
+   // NOTE(law): Environment variables are read first, so that command line
+   // arguments can override them.
+   char *workers = getenv("RAW_WORKERS");
+   if(workers && workers[0])
+   {
+      options->worker_count = (u32)atoi(workers);
+   }
+
+   char *cpu_list = getenv("RAW_CPUS");
+   if(cpu_list && cpu_list[0])
+   {
+      options->cpu_list = cpu_list;
+   }
+
+   char *skip_smt = getenv("RAW_NO_SMT");
+   if(skip_smt && skip_smt[0] && strcmp(skip_smt, "0") != 0)
+   {
+      options->skip_smt = true;
+   }
+
+   char *numa = getenv("RAW_NUMA");
+   if(numa && numa[0] && strcmp(numa, "0") != 0)
+   {
+      options->numa = true;
+   }
+
+   for(int index = 1; index < argument_count; ++index)
+   {
+      char *value = (index + 1 < argument_count) ? arguments[index + 1] : 0;
+
+      u32 consumed = linux_parse_placement_argument(options, arguments[index], value);
+      if(consumed)
+      {
+         index += consumed - 1;
+      }
+   }
+}
+
+function bool
+linux_parse_cpu_list(char *text, cpu_set_t *set)
+{
+   // NOTE(law): Parse the kernel's CPU list format, e.g. "0-3,8,10-11", as used
+   // by taskset and the files under /sys/devices/system.
+   CPU_ZERO(set);
+
+   char *at = text;
+   while(*at && *at != '\n')
+   {
+      char *end;
+      long first = strtol(at, &end, 10);
+      if(end == at || first < 0)
+      {
+         return(false);
+      }
+
+      long last = first;
+      at = end;
+      if(*at == '-')
+      {
+         at++;
+         last = strtol(at, &end, 10);
+         if(end == at || last < first)
+         {
+            return(false);
+         }
+         at = end;
+      }
+
+      for(long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+      {
+         CPU_SET(cpu, set);
+      }
+
+      if(*at == ',')
+      {
+         at++;
+      }
+      else if(*at && *at != '\n')
+      {
+         return(false);
+      }
+   }
+
+   return(true);
+}
+
+function bool
+linux_read_topology_cpu_list(char *path, cpu_set_t *set)
+{
+   char text[LINUX_TOPOLOGY_TEXT_LENGTH];
+
+   FILE *file = fopen(path, "r");
+   if(!file)
+   {
+      return(false);
+   }
+
+   bool result = (fgets(text, sizeof(text), file) != 0) && linux_parse_cpu_list(text, set);
+   fclose(file);
+
+   return(result);
+}
+
+function bool
+linux_cpu_is_first_sibling(u32 cpu, cpu_set_t *usable)
+{
+   // NOTE(law): A CPU stands in for its physical core when it is the lowest
+   // numbered usable hardware thread of that core.
+   char path[256];
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+
+   cpu_set_t siblings;
+   if(!linux_read_topology_cpu_list(path, &siblings))
+   {
+      return(true);
+   }
+
+   for(u32 sibling = 0; sibling < cpu; ++sibling)
+   {
+      if(CPU_ISSET(sibling, &siblings) && CPU_ISSET(sibling, usable))
+      {
+         return(false);
+      }
+   }
+
+   return(true);
+}
+
+function bool
+linux_initialize_placement(struct linux_thread_placement *placement, struct linux_placement_options *options,
+                           u32 *worker_count)
+{
+   memset(placement, 0, sizeof(*placement));
+   placement->pin_threads = (options->cpu_list || options->skip_smt || options->numa);
+
+   // NOTE(law): Start from the CPUs this process is allowed to run on, so that
+   // restrictions from taskset or cgroups are respected.
+   cpu_set_t usable;
+   if(sched_getaffinity(0, sizeof(usable), &usable) != 0)
+   {
+      CPU_ZERO(&usable);
+      for(u32 cpu = 0; cpu < linux_get_processor_count() && cpu < CPU_SETSIZE; ++cpu)
+      {
+         CPU_SET(cpu, &usable);
+      }
+   }
+
+   if(options->cpu_list)
+   {
+      cpu_set_t requested;
+      if(!linux_parse_cpu_list(options->cpu_list, &requested))
+      {
+         platform_log("ERROR: Failed to parse CPU list \"%s\".\n", options->cpu_list);
+         return(false);
+      }
+      CPU_AND(&usable, &usable, &requested);
+   }
+
+   if(options->skip_smt)
+   {
+      cpu_set_t cores;
+      CPU_ZERO(&cores);
+      for(u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      {
+         if(CPU_ISSET(cpu, &usable) && linux_cpu_is_first_sibling(cpu, &usable))
+         {
+            CPU_SET(cpu, &cores);
+         }
+      }
+      usable = cores;
+   }
+
+   if(CPU_COUNT(&usable) == 0)
+   {
+      platform_log("ERROR: No usable CPUs left to run on.\n");
+      return(false);
+   }
+
+   // NOTE(law): Look up the node of every usable CPU. Without NUMA placement,
+   // or on kernels without node information, everything is node 0.
+   u32 system_node_of_cpu[CPU_SETSIZE] = {0};
+   if(options->numa)
+   {
+      for(u32 node = 0; node < LINUX_MAX_NODE_COUNT; ++node)
+      {
+         char path[256];
+         snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+
+         cpu_set_t node_cpus;
+         if(linux_read_topology_cpu_list(path, &node_cpus))
+         {
+            for(u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+               if(CPU_ISSET(cpu, &node_cpus))
+               {
+                  system_node_of_cpu[cpu] = node;
+               }
+            }
+         }
+      }
+   }
+
+   // NOTE(law): Number the nodes densely in order of their first usable CPU,
+   // then deal CPUs out one node at a time, so that any prefix of the thread
+   // list is spread evenly over the nodes.
+   u32 node_cpu_counts[LINUX_MAX_NODE_COUNT] = {0};
+   u32 dense_node_of_cpu[CPU_SETSIZE] = {0};
+   for(u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+   {
+      if(!CPU_ISSET(cpu, &usable))
+      {
+         continue;
+      }
+
+      u32 node = 0;
+      while(node < placement->node_count && placement->system_nodes[node] != system_node_of_cpu[cpu])
+      {
+         node++;
+      }
+      if(node == placement->node_count)
+      {
+         placement->system_nodes[placement->node_count++] = system_node_of_cpu[cpu];
+         CPU_ZERO(&placement->node_cpus[node]);
+      }
+
+      CPU_SET(cpu, &placement->node_cpus[node]);
+      dense_node_of_cpu[cpu] = node;
+      node_cpu_counts[node]++;
+   }
+
+   u32 dealt_counts[LINUX_MAX_NODE_COUNT] = {0};
+   u32 usable_count = CPU_COUNT(&usable);
+   while(placement->cpu_count < usable_count)
+   {
+      for(u32 node = 0; node < placement->node_count; ++node)
+      {
+         if(dealt_counts[node] == node_cpu_counts[node])
+         {
+            continue;
+         }
+
+         // NOTE(law): Take this node's next CPU in ascending order.
+         u32 skip = dealt_counts[node]++;
+         for(u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+         {
+            if(CPU_ISSET(cpu, &placement->node_cpus[node]) && skip-- == 0)
+            {
+               placement->cpus[placement->cpu_count] = cpu;
+               placement->cpu_nodes[placement->cpu_count] = dense_node_of_cpu[cpu];
+               placement->cpu_count++;
+               break;
+            }
+         }
+      }
+   }
+
+   *worker_count = (options->worker_count) ? options->worker_count : placement->cpu_count - 1;
+
+   // NOTE(law): Nodes that no thread will ever be pinned to could never run
+   // their work, so they are not offered to the renderer.
+   u32 thread_count = MINIMUM(*worker_count + 1, placement->cpu_count);
+   u32 active_node_count = 0;
+   for(u32 index = 0; index < thread_count; ++index)
+   {
+      active_node_count = MAXIMUM(active_node_count, placement->cpu_nodes[index] + 1);
+   }
+   placement->node_count = active_node_count;
+
+   return(true);
+}
+
+function void
+linux_log_placement(struct linux_thread_placement *placement, u32 worker_count)
+{
+   if(!placement->pin_threads)
+   {
+      platform_log("Launching %u workers, unpinned.\n", worker_count);
+      return;
+   }
+
+   platform_log("Launching %u workers pinned to %u CPUs on %u node%s:", worker_count,
+                placement->cpu_count, placement->node_count, (placement->node_count == 1) ? "" : "s");
+   for(u32 index = 0; index < placement->cpu_count; ++index)
+   {
+      platform_log(" %u", placement->cpus[index]);
+      if(placement->node_count > 1)
+      {
+         platform_log("@%u", placement->system_nodes[placement->cpu_nodes[index]]);
+      }
+   }
+   platform_log("\n");
+}
+
+function void
+linux_pin_thread(struct linux_thread_placement *placement, u32 thread_index)
+{
+   if(placement && placement->pin_threads)
+   {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(placement->cpus[thread_index % placement->cpu_count], &set);
+
+      if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      {
+         platform_log("WARNING: Failed to pin thread %u.\n", thread_index);
+      }
+   }
+}
+
+function u32
+linux_get_thread_node(struct linux_thread_placement *placement, u32 thread_index)
+{
+   u32 result = 0;
+   if(placement && placement->node_count > 1)
+   {
+      result = placement->cpu_nodes[thread_index % placement->cpu_count];
+   }
+
+   return(result);
+}
+
+// NOTE(law): The work queue is a set of Chase-Lev work-stealing deques, one per
+// thread. A thread pushes and pops work at the bottom of its own deque without
+// contending with anyone, while idle threads steal from the top of a randomly
+// chosen victim. Threads that find no work park on a futex, and producers only
+// make a system call when someone is actually parked.
+
+// NOTE(law): With NUMA placement the queue is split into nodes. Each node has
+// an extra deque, owned by the thread that initialized the queue, which takes
+// batches enqueued for that node. Threads only steal from deques on their own
+// node and park on their own node's futex, so work never crosses nodes. The
+// one exception is the main thread, which also drains nodes that no thread has
+// been launched on yet.
+
+#define LINUX_MAX_THREAD_COUNT 256
+#define LINUX_DEQUE_CAPACITY 4096 // NOTE(law): Must be a power of two.
+#define LINUX_IDLE_SPIN_COUNT 256
+#define LINUX_CACHE_LINE_SIZE 64
+
+struct linux_work_deque
+{
+   volatile s64 top;
+   u8 top_padding[LINUX_CACHE_LINE_SIZE - sizeof(s64)];
+
+   volatile s64 bottom;
+   u8 bottom_padding[LINUX_CACHE_LINE_SIZE - sizeof(s64)];
+
+   struct queue_entry entries[LINUX_DEQUE_CAPACITY];
+};
+
+struct linux_node_parking
+{
+   // NOTE(law): Parking state. wake_sequence is the futex word. wake_pending
+   // keeps a burst of enqueues from issuing one wake per job: only the first
+   // enqueue wakes a thread, which passes the wake along once it has
+   // successfully stolen work.
+   volatile u32 sleeping_count;
+   volatile u32 wake_pending;
+   volatile u32 wake_sequence;
+   volatile u32 thread_count;
+   u8 padding[LINUX_CACHE_LINE_SIZE - 4*sizeof(u32)];
+};
+
+struct platform_work_queue
+{
+   // NOTE(law): Fields written by different threads are kept at least a cache
+   // line apart, so e.g. workers bumping completion_count do not keep stealing
+   // the line that the producer writes completion_target to.
+
+   // NOTE(law): Deque 0 belongs to the thread that initialized the queue.
+   // Worker threads reserve the following slots as they launch.
+   volatile u32 deque_count;
+   struct linux_work_deque *deques[LINUX_MAX_THREAD_COUNT];
+   u32 deque_nodes[LINUX_MAX_THREAD_COUNT];
+
+   u32 node_count;
+   struct linux_work_deque *node_deques[LINUX_MAX_NODE_COUNT];
+   struct linux_thread_placement *placement;
+   u8 deques_padding[LINUX_CACHE_LINE_SIZE];
+
+   volatile u32 completion_target;
+   u8 completion_target_padding[LINUX_CACHE_LINE_SIZE];
+
+   volatile u32 completion_count;
+   u8 completion_count_padding[LINUX_CACHE_LINE_SIZE];
+
+   struct linux_node_parking parking[LINUX_MAX_NODE_COUNT];
+};
+
+global __thread u32 linux_thread_deque_index;
+global __thread u32 linux_thread_node;
+global __thread u32 linux_thread_random_state;
+
+function void
+linux_futex_wait(volatile u32 *address, u32 expected)
+{
+   syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, 0, 0, 0);
+}
+
+function void
+linux_futex_wake(volatile u32 *address, u32 count)
+{
+   syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+}
+
+function bool
+linux_deque_push(struct linux_work_deque *deque, struct queue_entry entry)
+{
+   // NOTE(law): Only the owning thread may push. Returns false without
+   // touching the deque if it is full.
+   s64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+   s64 top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+   if((bottom - top) >= LINUX_DEQUE_CAPACITY)
+   {
+      return(false);
+   }
+
+   deque->entries[bottom & (LINUX_DEQUE_CAPACITY - 1)] = entry;
+
+   __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+
+   return(true);
+}
+
+function u32
+linux_deque_push_batch(struct linux_work_deque *deque, u8 *data, size_t data_stride, u32 count,
+                       queue_callback *callback)
+{
+   // NOTE(law): Only the owning thread may push. Writes as many entries as fit
+   // and publishes all of them with a single release store of bottom. Returns
+   // the number of entries pushed.
+   s64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+   s64 top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+   u32 free_count = (u32)(LINUX_DEQUE_CAPACITY - (bottom - top));
+   u32 push_count = MINIMUM(count, free_count);
+
+   for(u32 index = 0; index < push_count; ++index)
+   {
+      struct queue_entry *entry = deque->entries + ((bottom + index) & (LINUX_DEQUE_CAPACITY - 1));
+      entry->data = data + (index * data_stride);
+      entry->callback = callback;
+   }
+
+   if(push_count)
+   {
+      __atomic_store_n(&deque->bottom, bottom + push_count, __ATOMIC_RELEASE);
+   }
+
+   return(push_count);
+}
+
+function bool
+linux_deque_pop(struct linux_work_deque *deque, struct queue_entry *entry)
+{
+   // NOTE(law): Only the owning thread may pop. The last remaining entry is
+   // raced for against thieves through the top index.
+   s64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+   __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   s64 top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+   bool result = false;
+   if(top <= bottom)
+   {
+      *entry = deque->entries[bottom & (LINUX_DEQUE_CAPACITY - 1)];
+      result = true;
+
+      if(top == bottom)
+      {
+         result = __atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+         __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+      }
+   }
+   else
+   {
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+   }
+
+   return(result);
+}
+
+function bool
+linux_deque_steal(struct linux_work_deque *deque, struct queue_entry *entry)
+{
+   s64 top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   s64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+   bool result = false;
+   if(top < bottom)
+   {
+      *entry = deque->entries[top & (LINUX_DEQUE_CAPACITY - 1)];
+      result = __atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+   }
+
+   return(result);
+}
+
+function bool
+linux_deque_is_empty(struct linux_work_deque *deque)
+{
+   s64 top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+   s64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+   bool result = (top >= bottom);
+   return(result);
+}
+
+function u32
+linux_random_next(void)
+{
+   // NOTE(law): Xorshift, only used to pick steal victims.
+   u32 x = linux_thread_random_state;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   linux_thread_random_state = x;
+
+   return(x);
+}
+
+function void
+linux_wake_one_worker(struct platform_work_queue *queue, u32 node)
+{
+   struct linux_node_parking *parking = queue->parking + node;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   if(__atomic_load_n(&parking->sleeping_count, __ATOMIC_RELAXED) > 0 &&
+      __sync_bool_compare_and_swap(&parking->wake_pending, 0, 1))
+   {
+      __atomic_add_fetch(&parking->wake_sequence, 1, __ATOMIC_RELEASE);
+      linux_futex_wake(&parking->wake_sequence, 1);
+   }
+}
+
+function void
+linux_wake_workers(struct platform_work_queue *queue, u32 node, u32 count)
+{
+   // NOTE(law): Wake up to count parked threads with a single futex call. The
+   // pending flag stops the single enqueue path from piling on more wakes.
+   struct linux_node_parking *parking = queue->parking + node;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   u32 sleeping_count = __atomic_load_n(&parking->sleeping_count, __ATOMIC_RELAXED);
+   if(sleeping_count > 0)
+   {
+      __atomic_store_n(&parking->wake_pending, 1, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&parking->wake_sequence, 1, __ATOMIC_RELEASE);
+      linux_futex_wake(&parking->wake_sequence, MINIMUM(count, sleeping_count));
+   }
+}
+
+function bool
+linux_can_take_node_work(struct platform_work_queue *queue, u32 node)
+{
+   bool result = (node == linux_thread_node);
+   if(!result && linux_thread_deque_index == 0)
+   {
+      result = (__atomic_load_n(&queue->parking[node].thread_count, __ATOMIC_ACQUIRE) == 0);
+   }
+
+   return(result);
+}
+
+function bool
+linux_steal_from(struct platform_work_queue *queue, struct linux_work_deque *victim, u32 node,
+                 struct queue_entry *entry)
+{
+   bool result = (victim && linux_deque_steal(victim, entry));
+   if(result)
+   {
+      // NOTE(law): Pass the wake-up along, since there may be more work that
+      // other parked threads could be stealing.
+      __atomic_store_n(&queue->parking[node].wake_pending, 0, __ATOMIC_RELEASE);
+      if(!linux_deque_is_empty(victim))
+      {
+         linux_wake_one_worker(queue, node);
+      }
+   }
+
+   return(result);
+}
+
+function bool
+linux_find_work(struct platform_work_queue *queue, struct queue_entry *entry)
+{
+   // NOTE(law): Try the calling thread's own deque first, then the node deques
+   // it may take work from, then make one pass over the other deques on the
+   // same node starting from a random victim.
+
+   u32 own_index = linux_thread_deque_index;
+   if(linux_deque_pop(queue->deques[own_index], entry))
+   {
+      return(true);
+   }
+
+   u32 own_node = linux_thread_node;
+   for(u32 node = 0; node < queue->node_count; ++node)
+   {
+      if(linux_can_take_node_work(queue, node) &&
+         linux_steal_from(queue, queue->node_deques[node], node, entry))
+      {
+         return(true);
+      }
+   }
+
+   u32 deque_count = __atomic_load_n(&queue->deque_count, __ATOMIC_ACQUIRE);
+   u32 start = linux_random_next();
+   for(u32 attempt = 0; attempt < deque_count; ++attempt)
+   {
+      u32 victim_index = (start + attempt) % deque_count;
+      if(victim_index == own_index || queue->deque_nodes[victim_index] != own_node)
+      {
+         continue;
+      }
+
+      struct linux_work_deque *victim = __atomic_load_n(&queue->deques[victim_index], __ATOMIC_ACQUIRE);
+      if(linux_steal_from(queue, victim, own_node, entry))
+      {
+         return(true);
+      }
+   }
+
+   return(false);
+}
+
+function bool
+linux_work_is_available(struct platform_work_queue *queue, u32 node)
+{
+   struct linux_work_deque *node_deque = queue->node_deques[node];
+   if(node_deque && !linux_deque_is_empty(node_deque))
+   {
+      return(true);
+   }
+
+   u32 deque_count = __atomic_load_n(&queue->deque_count, __ATOMIC_ACQUIRE);
+   for(u32 index = 0; index < deque_count; ++index)
+   {
+      struct linux_work_deque *deque = __atomic_load_n(&queue->deques[index], __ATOMIC_ACQUIRE);
+      if(deque && queue->deque_nodes[index] == node && !linux_deque_is_empty(deque))
+      {
+         return(true);
+      }
+   }
+
+   return(false);
+}
+
+function void
+linux_execute_work(struct platform_work_queue *queue, struct queue_entry entry)
+{
+   entry.callback(queue, entry.data);
+   __atomic_add_fetch(&queue->completion_count, 1, __ATOMIC_RELEASE);
+}
+
+function void
+linux_register_thread(struct platform_work_queue *queue, u32 deque_index)
+{
+   // NOTE(law): Pin before allocating, so the deque is first touched from the
+   // node that will be using it.
+   linux_pin_thread(queue->placement, deque_index);
+
+   linux_thread_deque_index = deque_index;
+   linux_thread_node = linux_get_thread_node(queue->placement, deque_index);
+   linux_thread_random_state = (0x9E3779B9 ^ (deque_index * 0x85EBCA6B)) | 1;
+
+   struct linux_work_deque *deque = linux_allocate(sizeof(struct linux_work_deque));
+   assert(deque);
+
+   queue->deque_nodes[deque_index] = linux_thread_node;
+   __atomic_store_n(&queue->deques[deque_index], deque, __ATOMIC_RELEASE);
+   __atomic_add_fetch(&queue->parking[linux_thread_node].thread_count, 1, __ATOMIC_RELEASE);
+
+   profile_register_thread(deque_index);
+}
+
+function void
+linux_initialize_queue(struct platform_work_queue *queue, struct linux_thread_placement *placement)
+{
+   // NOTE(law): The calling thread owns deque 0 and is the one expected to call
+   // platform_complete_queue(). It also owns the node deques. The placement is
+   // optional, and must outlive the queue.
+   queue->placement = placement;
+   queue->node_count = (placement && placement->node_count > 1) ? placement->node_count : 1;
+
+   queue->deque_count = 1;
+   linux_register_thread(queue, 0);
+
+   if(queue->node_count > 1)
+   {
+      for(u32 node = 0; node < queue->node_count; ++node)
+      {
+         queue->node_deques[node] = linux_allocate(sizeof(struct linux_work_deque));
+         assert(queue->node_deques[node]);
+      }
+   }
+}
+
+function
+PLATFORM_GET_QUEUE_NODE_COUNT(platform_get_queue_node_count)
+{
+   u32 result = queue->node_count;
+   return(result);
+}
+
+function void
+linux_first_touch_bitmap(struct platform_work_queue *queue, struct render_bitmap *bitmap)
+{
+   // NOTE(law): Write each node's share of the bitmap from that node's CPUs, so
+   // that the kernel backs it with the node's local memory. The renderer sends
+   // every tile to the node owning its rows. Memory that is already backed,
+   // e.g. by the graphics driver, stays wherever it is.
+   if(queue->node_count <= 1)
+   {
+      return;
+   }
+
+   struct linux_thread_placement *placement = queue->placement;
+   u64 bytes_per_pixel = get_render_format_bytes_per_pixel(bitmap->format);
+   for(u32 node = 0; node < queue->node_count; ++node)
+   {
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement->node_cpus[node]);
+
+      u64 first = get_bitmap_node_first_pixel(bitmap, node, queue->node_count);
+      u64 end = get_bitmap_node_first_pixel(bitmap, node + 1, queue->node_count);
+      memset((u8 *)bitmap->memory + (first * bytes_per_pixel), 0, (end - first) * bytes_per_pixel);
+   }
+
+   linux_pin_thread(placement, linux_thread_deque_index);
+}
+
+function
+PLATFORM_ENQUEUE_WORK(platform_enqueue_work)
+{
+   struct queue_entry entry;
+   entry.data = data;
+   entry.callback = callback;
+
+   __atomic_add_fetch(&queue->completion_target, 1, __ATOMIC_RELAXED);
+   if(linux_deque_push(queue->deques[linux_thread_deque_index], entry))
+   {
+      linux_wake_one_worker(queue, linux_thread_node);
+   }
+   else
+   {
+      // NOTE(law): The deque is full, which means every other thread already
+      // has plenty to steal. Just do the work here instead of failing.
+      linux_execute_work(queue, entry);
+   }
+}
+
+function
+PLATFORM_ENQUEUE_WORK_BATCH(platform_enqueue_work_batch)
+{
+   __atomic_add_fetch(&queue->completion_target, count, __ATOMIC_RELAXED);
+
+   // NOTE(law): Batches for a specific node go through that node's deque, which
+   // only the thread that initialized the queue may push to.
+   struct linux_work_deque *deque = queue->deques[linux_thread_deque_index];
+   u32 wake_node = linux_thread_node;
+   if(queue->node_count > 1 && node < queue->node_count)
+   {
+      assert(linux_thread_deque_index == 0);
+      deque = queue->node_deques[node];
+      wake_node = node;
+   }
+
+   u8 *entry_data = (u8 *)data;
+   u32 index = 0;
+   while(index < count)
+   {
+      u32 push_count = linux_deque_push_batch(deque, entry_data + (index * data_stride), data_stride,
+                                              count - index, callback);
+      if(push_count)
+      {
+         linux_wake_workers(queue, wake_node, push_count);
+         index += push_count;
+      }
+      else
+      {
+         // NOTE(law): The deque is full. Do one job here while the thieves make
+         // room, then try again.
+         struct queue_entry entry;
+         entry.data = entry_data + (index * data_stride);
+         entry.callback = callback;
+
+         linux_execute_work(queue, entry);
+         index++;
+      }
+   }
+}
+
+function
+PLATFORM_COMPLETE_QUEUE(platform_complete_queue)
+{
+   u64 profile_start = profile_begin();
+
+   while(__atomic_load_n(&queue->completion_target, __ATOMIC_RELAXED) >
+         __atomic_load_n(&queue->completion_count, __ATOMIC_ACQUIRE))
+   {
+      struct queue_entry entry;
+      if(linux_find_work(queue, &entry))
+      {
+         linux_execute_work(queue, entry);
+      }
+      else
+      {
+         _mm_pause();
+      }
+   }
+
+   queue->completion_target = 0;
+   queue->completion_count = 0;
+
+   profile_end(PROFILE_EVENT_COMPLETE_QUEUE, profile_start, 0, 0);
+}
+
+function void *
+linux_thread_procedure(void *data)
+{
+   struct platform_work_queue *queue = (struct platform_work_queue *)data;
+
+   u32 deque_index = __atomic_fetch_add(&queue->deque_count, 1, __ATOMIC_ACQ_REL);
+   assert(deque_index < LINUX_MAX_THREAD_COUNT);
+   linux_register_thread(queue, deque_index);
+
+   platform_log("Worker thread launched.\n");
+
+   while(1)
+   {
+      // NOTE(law): The wait runs from the end of the last job to the start of
+      // the next one, including any time spent parked in between.
+      struct queue_entry entry;
+      u64 profile_start = profile_begin();
+
+      bool found = false;
+      while(!found)
+      {
+         for(u32 spin = 0; !found && spin < LINUX_IDLE_SPIN_COUNT; ++spin)
+         {
+            found = linux_find_work(queue, &entry);
+            if(!found)
+            {
+               _mm_pause();
+            }
+         }
+
+         if(!found)
+         {
+            // NOTE(law): Announce that this thread is about to park, then check
+            // for work once more. A producer that pushed before seeing the
+            // announcement is caught by the re-check, and one that pushes after
+            // it sees the sleeping count and bumps the sequence, so the wait
+            // returns at once.
+            struct linux_node_parking *parking = queue->parking + linux_thread_node;
+
+            u32 sequence = __atomic_load_n(&parking->wake_sequence, __ATOMIC_ACQUIRE);
+            __atomic_add_fetch(&parking->sleeping_count, 1, __ATOMIC_SEQ_CST);
+
+            if(!linux_work_is_available(queue, linux_thread_node))
+            {
+               linux_futex_wait(&parking->wake_sequence, sequence);
+            }
+
+            __atomic_sub_fetch(&parking->sleeping_count, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&parking->wake_pending, 0, __ATOMIC_RELEASE);
+         }
+      }
+
+      profile_end(PROFILE_EVENT_QUEUE_WAIT, profile_start, 0, 0);
+      linux_execute_work(queue, entry);
+   }
+
+   platform_log("Worker thread terminated.\n");
+
+   return(0);
+}
+
+function void
+linux_launch_worker(struct platform_work_queue *queue)
+{
+   pthread_t id;
+   pthread_create(&id, 0, linux_thread_procedure, queue);
+   pthread_detach(id);
+}
+
+// NOTE(law): The output sink streams rendered frames to a file or to stdout,
+// e.g. to pipe them into an encoder. The renderer draws straight into a ring of
+// pooled BGRA8 bitmaps and submits each finished one to a dedicated I/O thread,
+// which formats and writes it. Rendering only ever waits for that thread when
+// every bitmap in the ring is still queued. The sink then either applies
+// backpressure and waits for a bitmap to come back, or drops the frame.
+
+// NOTE(law): Raw BGRA frames are written straight from the ring. Into a pipe
+// they are vmsplice'd, so the pipe references the bitmap pages instead of
+// copying them. Those pages must stay untouched until the reader has consumed
+// them, which is only known for sure once a full pipe's worth of later data
+// has gone in after them. Spliced bitmaps are therefore returned to the ring
+// one frame late, and frames smaller than the pipe are always copied. A
+// reader that tee()s the pipe onward keeps references longer than that, and
+// should be given a file or --record-format ppm/y4m instead. PPM and Y4M
+// frames are converted into a buffer owned by the I/O thread, so their
+// bitmaps go back to the ring before the write even starts.
+
+#define LINUX_OUTPUT_DEFAULT_RING_COUNT 4
+#define LINUX_OUTPUT_MAX_RING_COUNT 64
+#define LINUX_OUTPUT_DEFAULT_FPS 60
+#define LINUX_OUTPUT_HEADER_LENGTH 64
+
+enum linux_output_format
+{
+   LINUX_OUTPUT_FORMAT_Y4M,
+   LINUX_OUTPUT_FORMAT_PPM,
+   LINUX_OUTPUT_FORMAT_BGRA,
+
+   LINUX_OUTPUT_FORMAT_COUNT,
+};
+
+global char *linux_output_format_names[] =
+{
+   "y4m",
+   "ppm",
+   "bgra",
+};
+
+struct linux_output_options
+{
+   char *path; // NOTE(law): "-" means stdout.
+   u32 format;
+   u32 ring_count;
+   u32 fps;
+   bool drop;
+};
+
+struct linux_output_sink
+{
+   int file;
+   bool is_pipe;
+   size_t pipe_size;
+
+   u32 format;
+   u32 fps;
+   bool drop;
+   u32 width;
+   u32 height;
+   size_t frame_size;
+
+   u32 ring_count;
+   struct render_bitmap bitmaps[LINUX_OUTPUT_MAX_RING_COUNT];
+
+   // NOTE(law): Stream position past which each queued bitmap may be reused.
+   // Only the I/O thread touches these.
+   u64 release_positions[LINUX_OUTPUT_MAX_RING_COUNT];
+
+   // NOTE(law): submit_count is only written by the renderer and
+   // release_count only by the I/O thread. Their difference is the number of
+   // bitmaps that are queued or in flight. The I/O thread parks on
+   // wake_sequence, which is bumped by submits and by closing, and the
+   // renderer parks on release_count itself.
+   volatile u32 submit_count;
+   volatile u32 consumer_sleeping;
+   volatile u32 wake_sequence;
+   u8 submit_padding[LINUX_CACHE_LINE_SIZE - 3*sizeof(u32)];
+
+   volatile u32 release_count;
+   volatile u32 producer_sleeping;
+   u8 release_padding[LINUX_CACHE_LINE_SIZE - 2*sizeof(u32)];
+
+   volatile u32 closing;
+   pthread_t thread;
+
+   // NOTE(law): I/O thread state.
+   u8 *scratch;
+   u64 position;
+   bool failed;
+
+   // NOTE(law): Statistics. The first group is written by the renderer, the
+   // second by the I/O thread, and both are read once the thread is joined.
+   u64 dropped_count;
+   u64 wait_count;
+   u64 wait_ns;
+   u32 maximum_depth;
+
+   u64 written_count;
+   u64 spliced_count;
+   u64 write_ns;
+};
+
+function u32
+linux_parse_output_argument(struct linux_output_options *options, char *argument, char *value)
+{
+   // NOTE(law): Returns how many arguments were consumed, or zero if argument
+   // is not an output option. Unknown formats leave the format unchanged and
+   // are caught by linux_open_output().
+   u32 result = 0;
+
+   if(strcmp(argument, "--record-drop") == 0)
+   {
+      options->drop = true;
+      result = 1;
+   }
+   else if(value && strcmp(argument, "--record") == 0)
+   {
+      options->path = value;
+      result = 2;
+   }
+   else if(value && strcmp(argument, "--record-format") == 0)
+   {
+      options->format = LINUX_OUTPUT_FORMAT_COUNT;
+      for(u32 format = 0; format < LINUX_OUTPUT_FORMAT_COUNT; ++format)
+      {
+         if(strcmp(value, linux_output_format_names[format]) == 0)
+         {
+            options->format = format;
+         }
+      }
+      result = 2;
+   }
+   else if(value && strcmp(argument, "--record-ring") == 0)
+   {
+      options->ring_count = (u32)atoi(value);
+      result = 2;
+   }
+   else if(value && strcmp(argument, "--record-fps") == 0)
+   {
+      options->fps = (u32)atoi(value);
+      result = 2;
+   }
+
+   // NOTE(law): Frames written to stdout must not be interleaved with log
+   // messages, so those move to stderr before anything else is logged.
+   if(options->path && strcmp(options->path, "-") == 0)
+   {
+      linux_log_to_stderr = true;
+   }
+
+   return(result);
+}
+
+function void
+linux_get_output_options(struct linux_output_options *options, int argument_count, char **arguments)
+{
+   // NOTE(law): Environment variables are read first, so that command line
+   // arguments can override them.
+   char *path = getenv("RAW_RECORD");
+   if(path && path[0])
+   {
+      linux_parse_output_argument(options, "--record", path);
+   }
+
+   for(int index = 1; index < argument_count; ++index)
+   {
+      char *value = (index + 1 < argument_count) ? arguments[index + 1] : 0;
+
+      u32 consumed = linux_parse_output_argument(options, arguments[index], value);
+      if(consumed)
+      {
+         index += consumed - 1;
+      }
+   }
+}
+
+function bool
+linux_output_write(struct linux_output_sink *sink, struct iovec *vectors, u32 vector_count)
+{
+   // NOTE(law): Retries until everything is written, since pipes in particular
+   // accept partial writes.
+   while(vector_count)
+   {
+      ssize_t written = writev(sink->file, vectors, vector_count);
+      if(written < 0)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         return(false);
+      }
+
+      sink->position += (u64)written;
+      while(vector_count && (size_t)written >= vectors->iov_len)
+      {
+         written -= vectors->iov_len;
+         vectors++;
+         vector_count--;
+      }
+      if(vector_count)
+      {
+         vectors->iov_base = (u8 *)vectors->iov_base + written;
+         vectors->iov_len -= written;
+      }
+   }
+
+   return(true);
+}
+
+function bool
+linux_output_splice(struct linux_output_sink *sink, void *memory, size_t size)
+{
+   struct iovec vector = {memory, size};
+   while(vector.iov_len)
+   {
+      ssize_t spliced = vmsplice(sink->file, &vector, 1, 0);
+      if(spliced < 0)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         return(false);
+      }
+
+      sink->position += (u64)spliced;
+      vector.iov_base = (u8 *)vector.iov_base + spliced;
+      vector.iov_len -= spliced;
+   }
+
+   return(true);
+}
+
+function void
+linux_convert_output_frame(struct linux_output_sink *sink, struct render_bitmap *bitmap, u8 *destination)
+{
+   u32 *pixels = bitmap->memory;
+   u32 pixel_count = bitmap->width * bitmap->height;
+
+   if(sink->format == LINUX_OUTPUT_FORMAT_PPM)
+   {
+      for(u32 index = 0; index < pixel_count; ++index)
+      {
+         u32 pixel = pixels[index];
+         destination[0] = (u8)(pixel >> 16);
+         destination[1] = (u8)(pixel >> 8);
+         destination[2] = (u8)pixel;
+         destination += 3;
+      }
+   }
+   else
+   {
+      // NOTE(law): Y4M frames are planar 4:4:4 YCbCr with BT.601 coefficients
+      // in limited range, which is what encoders assume when the stream header
+      // does not say otherwise.
+      u8 *y = destination;
+      u8 *cb = y + pixel_count;
+      u8 *cr = cb + pixel_count;
+      for(u32 index = 0; index < pixel_count; ++index)
+      {
+         u32 pixel = pixels[index];
+         s32 r = (s32)((pixel >> 16) & 0xFF);
+         s32 g = (s32)((pixel >> 8) & 0xFF);
+         s32 b = (s32)(pixel & 0xFF);
+
+         y[index]  = (u8)(((  66*r + 129*g +  25*b + 128) >> 8) +  16);
+         cb[index] = (u8)((( -38*r -  74*g + 112*b + 128) >> 8) + 128);
+         cr[index] = (u8)((( 112*r -  94*g -  18*b + 128) >> 8) + 128);
+      }
+   }
+}
+
+function void
+linux_release_output_bitmaps(struct linux_output_sink *sink, u32 consumed_count, bool release_all)
+{
+   // NOTE(law): Bitmaps go back in submission order, each once the stream has
+   // moved past its release position.
+   u32 release_count = sink->release_count;
+   while(release_count != consumed_count)
+   {
+      u64 release_position = sink->release_positions[release_count % sink->ring_count];
+      if(!release_all && sink->position < release_position)
+      {
+         break;
+      }
+      release_count++;
+   }
+
+   if(release_count != sink->release_count)
+   {
+      __atomic_store_n(&sink->release_count, release_count, __ATOMIC_SEQ_CST);
+      if(__atomic_load_n(&sink->producer_sleeping, __ATOMIC_SEQ_CST))
+      {
+         linux_futex_wake(&sink->release_count, 1);
+      }
+   }
+}
+
+function void
+linux_write_output_frame(struct linux_output_sink *sink, u32 index)
+{
+   u32 slot = index % sink->ring_count;
+   struct render_bitmap *bitmap = sink->bitmaps + slot;
+
+   // NOTE(law): By default a bitmap can be reused as soon as it has been read.
+   sink->release_positions[slot] = 0;
+   if(sink->failed)
+   {
+      return;
+   }
+
+   u64 profile_start = profile_begin();
+   u64 write_start = platform_timestamp();
+
+   char header[LINUX_OUTPUT_HEADER_LENGTH];
+   struct iovec vectors[2];
+   vectors[0].iov_base = header;
+   vectors[0].iov_len = 0;
+
+   bool result;
+   if(sink->format == LINUX_OUTPUT_FORMAT_BGRA)
+   {
+      if(sink->is_pipe && sink->frame_size >= sink->pipe_size)
+      {
+         result = linux_output_splice(sink, bitmap->memory, sink->frame_size);
+         sink->release_positions[slot] = sink->position + sink->pipe_size;
+         sink->spliced_count++;
+      }
+      else
+      {
+         vectors[0].iov_base = bitmap->memory;
+         vectors[0].iov_len = sink->frame_size;
+         result = linux_output_write(sink, vectors, 1);
+      }
+   }
+   else
+   {
+      linux_convert_output_frame(sink, bitmap, sink->scratch);
+      linux_release_output_bitmaps(sink, index + 1, false);
+
+      if(sink->format == LINUX_OUTPUT_FORMAT_PPM)
+      {
+         vectors[0].iov_len = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", sink->width, sink->height);
+      }
+      else
+      {
+         vectors[0].iov_len = snprintf(header, sizeof(header), "FRAME\n");
+      }
+      vectors[1].iov_base = sink->scratch;
+      vectors[1].iov_len = sink->frame_size;
+      result = linux_output_write(sink, vectors, 2);
+   }
+
+   if(result)
+   {
+      sink->written_count++;
+   }
+   else
+   {
+      // NOTE(law): Typically the reader went away. Keep draining the ring so
+      // the renderer is not blocked, but stop writing.
+      platform_log("ERROR: Failed to write frame %u of the output stream (%s).\n", index, strerror(errno));
+      sink->failed = true;
+   }
+
+   profile_end(PROFILE_EVENT_OUTPUT_WRITE, profile_start, 0, 0);
+   sink->write_ns += platform_timestamp() - write_start;
+}
+
+function void *
+linux_output_thread_procedure(void *data)
+{
+   struct linux_output_sink *sink = (struct linux_output_sink *)data;
+   profile_register_thread(PROFILE_OUTPUT_THREAD_INDEX);
+
+   if(sink->format == LINUX_OUTPUT_FORMAT_Y4M)
+   {
+      char header[LINUX_OUTPUT_HEADER_LENGTH];
+      struct iovec vector;
+      vector.iov_base = header;
+      vector.iov_len = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n",
+                                sink->width, sink->height, sink->fps);
+      if(!linux_output_write(sink, &vector, 1))
+      {
+         platform_log("ERROR: Failed to write the output stream header (%s).\n", strerror(errno));
+         sink->failed = true;
+      }
+   }
+
+   u32 consumed_count = 0;
+   while(1)
+   {
+      u32 submit_count = __atomic_load_n(&sink->submit_count, __ATOMIC_ACQUIRE);
+      if(consumed_count == submit_count)
+      {
+         if(__atomic_load_n(&sink->closing, __ATOMIC_ACQUIRE))
+         {
+            break;
+         }
+
+         // NOTE(law): Same parking protocol as the work queue: announce, check
+         // again, then sleep unless the sequence moved in the meantime.
+         u32 sequence = __atomic_load_n(&sink->wake_sequence, __ATOMIC_ACQUIRE);
+         __atomic_store_n(&sink->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+         if(__atomic_load_n(&sink->submit_count, __ATOMIC_SEQ_CST) == submit_count &&
+            !__atomic_load_n(&sink->closing, __ATOMIC_SEQ_CST))
+         {
+            linux_futex_wait(&sink->wake_sequence, sequence);
+         }
+         __atomic_store_n(&sink->consumer_sleeping, 0, __ATOMIC_SEQ_CST);
+         continue;
+      }
+
+      linux_write_output_frame(sink, consumed_count);
+      consumed_count++;
+
+      linux_release_output_bitmaps(sink, consumed_count, sink->failed);
+   }
+
+   linux_release_output_bitmaps(sink, consumed_count, true);
+
+   return(0);
+}
+
+function bool
+linux_open_output(struct linux_output_sink *sink, struct linux_output_options *options, u32 width, u32 height)
+{
+   memset(sink, 0, sizeof(*sink));
+
+   if(options->format >= LINUX_OUTPUT_FORMAT_COUNT)
+   {
+      platform_log("ERROR: Unknown --record-format, expected y4m, ppm or bgra.\n");
+      return(false);
+   }
+
+   sink->format = options->format;
+   sink->fps = (options->fps) ? options->fps : LINUX_OUTPUT_DEFAULT_FPS;
+   sink->drop = options->drop;
+   sink->width = width;
+   sink->height = height;
+
+   // NOTE(law): Spliced bitmaps are held for an extra frame, so a ring needs
+   // at least two of them to make progress.
+   u32 ring_count = (options->ring_count) ? options->ring_count : LINUX_OUTPUT_DEFAULT_RING_COUNT;
+   sink->ring_count = MINIMUM(MAXIMUM(ring_count, 2), LINUX_OUTPUT_MAX_RING_COUNT);
+
+   size_t pixel_count = (size_t)width * (size_t)height;
+   sink->frame_size = pixel_count * ((sink->format == LINUX_OUTPUT_FORMAT_BGRA) ? 4 : 3);
+
+   for(u32 index = 0; index < sink->ring_count; ++index)
+   {
+      struct render_bitmap *bitmap = sink->bitmaps + index;
+      bitmap->width = width;
+      bitmap->height = height;
+      bitmap->format = RENDER_FORMAT_BGRA8;
+      bitmap->memory = linux_allocate(pixel_count * sizeof(u32));
+      if(!bitmap->memory)
+      {
+         return(false);
+      }
+   }
+
+   if(sink->format != LINUX_OUTPUT_FORMAT_BGRA)
+   {
+      sink->scratch = linux_allocate(sink->frame_size);
+      if(!sink->scratch)
+      {
+         return(false);
+      }
+   }
+
+   if(strcmp(options->path, "-") == 0)
+   {
+      sink->file = STDOUT_FILENO;
+   }
+   else
+   {
+      sink->file = open(options->path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if(sink->file < 0)
+      {
+         platform_log("ERROR: Failed to open %s for writing.\n", options->path);
+         return(false);
+      }
+   }
+
+   struct stat status;
+   if(fstat(sink->file, &status) == 0 && S_ISFIFO(status.st_mode))
+   {
+      int pipe_size = fcntl(sink->file, F_GETPIPE_SZ);
+      sink->is_pipe = (pipe_size > 0);
+      sink->pipe_size = (size_t)MAXIMUM(pipe_size, 0);
+   }
+
+   // NOTE(law): A reader going away should show up as a failed write, not kill
+   // the process.
+   signal(SIGPIPE, SIG_IGN);
+
+   if(pthread_create(&sink->thread, 0, linux_output_thread_procedure, sink) != 0)
+   {
+      platform_log("ERROR: Failed to launch the output thread.\n");
+      return(false);
+   }
+
+   platform_log("Recording %ux%u %s frames to %s through a ring of %u bitmaps%s.\n",
+                width, height, linux_output_format_names[sink->format],
+                (sink->file == STDOUT_FILENO) ? "stdout" : options->path, sink->ring_count,
+                (sink->drop) ? ", dropping frames when it is full" : "");
+
+   return(true);
+}
+
+function struct render_bitmap *
+linux_acquire_output_bitmap(struct linux_output_sink *sink)
+{
+   // NOTE(law): Returns the bitmap to render the next frame into, or 0 if the
+   // ring is full and the sink drops frames. Every acquired bitmap must be
+   // submitted before the next one is acquired.
+   u32 submit_count = sink->submit_count;
+   if(submit_count - __atomic_load_n(&sink->release_count, __ATOMIC_ACQUIRE) >= sink->ring_count)
+   {
+      if(sink->drop)
+      {
+         sink->dropped_count++;
+         return(0);
+      }
+
+      u64 profile_start = profile_begin();
+      u64 wait_start = platform_timestamp();
+
+      while(1)
+      {
+         __atomic_store_n(&sink->producer_sleeping, 1, __ATOMIC_SEQ_CST);
+         u32 release_count = __atomic_load_n(&sink->release_count, __ATOMIC_SEQ_CST);
+         if(submit_count - release_count < sink->ring_count)
+         {
+            break;
+         }
+         linux_futex_wait(&sink->release_count, release_count);
+      }
+      __atomic_store_n(&sink->producer_sleeping, 0, __ATOMIC_SEQ_CST);
+
+      sink->wait_count++;
+      sink->wait_ns += platform_timestamp() - wait_start;
+      profile_end(PROFILE_EVENT_OUTPUT_WAIT, profile_start, 0, 0);
+   }
+
+   struct render_bitmap *result = sink->bitmaps + (submit_count % sink->ring_count);
+   return(result);
+}
+
+function void
+linux_submit_output_bitmap(struct linux_output_sink *sink, struct render_bitmap *bitmap)
+{
+   assert(bitmap == sink->bitmaps + (sink->submit_count % sink->ring_count));
+
+   u32 submit_count = sink->submit_count + 1;
+   __atomic_store_n(&sink->submit_count, submit_count, __ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&sink->consumer_sleeping, __ATOMIC_SEQ_CST))
+   {
+      __atomic_add_fetch(&sink->wake_sequence, 1, __ATOMIC_SEQ_CST);
+      linux_futex_wake(&sink->wake_sequence, 1);
+   }
+
+   u32 depth = submit_count - __atomic_load_n(&sink->release_count, __ATOMIC_ACQUIRE);
+   sink->maximum_depth = MAXIMUM(sink->maximum_depth, depth);
+}
+
+function void
+linux_copy_output_bitmap(struct linux_output_sink *sink, struct render_bitmap *bitmap)
+{
+   // NOTE(law): For renderers that cannot draw into the ring directly, e.g.
+   // because their bitmaps are also uploaded for display. The bitmap is read
+   // back, so it must not live in write-only mapped graphics memory.
+   assert(bitmap->format == RENDER_FORMAT_BGRA8);
+   assert(bitmap->width == sink->width && bitmap->height == sink->height);
+
+   struct render_bitmap *output = linux_acquire_output_bitmap(sink);
+   if(output)
+   {
+      memcpy(output->memory, bitmap->memory, (size_t)bitmap->width * (size_t)bitmap->height * sizeof(u32));
+      linux_submit_output_bitmap(sink, output);
+   }
+}
+
+function void
+linux_close_output(struct linux_output_sink *sink)
+{
+   // NOTE(law): Waits for every submitted frame to be written, then reports
+   // how often the renderer had to wait for or drop frames.
+   __atomic_store_n(&sink->closing, 1, __ATOMIC_SEQ_CST);
+   __atomic_add_fetch(&sink->wake_sequence, 1, __ATOMIC_SEQ_CST);
+   linux_futex_wake(&sink->wake_sequence, 1);
+   pthread_join(sink->thread, 0);
+
+   if(sink->file != STDOUT_FILENO)
+   {
+      close(sink->file);
+   }
+   else
+   {
+      // NOTE(law): Let a reader like an encoder see the end of the stream.
+      close(STDOUT_FILENO);
+   }
+
+   double write_seconds = (double)sink->write_ns / 1e9;
+   double megabytes = (double)sink->position / (1024.0 * 1024.0);
+   platform_log("Recorded %llu frames (%.1f MB, %.1f MB/s while writing, %llu spliced)%s.\n",
+                (unsigned long long)sink->written_count, megabytes,
+                (write_seconds > 0) ? megabytes / write_seconds : 0.0,
+                (unsigned long long)sink->spliced_count, (sink->failed) ? ", stopped after a write error" : "");
+   platform_log("Output ring: %llu frames dropped, waited %llu times (%.3f ms total), at most %u of %u bitmaps queued.\n",
+                (unsigned long long)sink->dropped_count, (unsigned long long)sink->wait_count,
+                (double)sink->wait_ns / 1e6, sink->maximum_depth, sink->ring_count);
+
+   for(u32 index = 0; index < sink->ring_count; ++index)
+   {
+      if(sink->bitmaps[index].memory)
+      {
+         linux_deallocate(sink->bitmaps[index].memory);
+      }
+   }
+   if(sink->scratch)
+   {
+      linux_deallocate(sink->scratch);
+   }
+}
+
+// NOTE(law): Shared frame rings publish completed frames to other processes
+// through POSIX shared memory, so that e.g. a render node without a display
+// can be watched from elsewhere. The publisher renders straight into the
+// ring's slots, and viewers present straight out of them, so a frame is never
+// copied between the processes.
+
+// NOTE(law): The publisher never waits for viewers. Each viewer pins the one
+// slot it is presenting, and the publisher only writes into slots that are
+// neither pinned nor holding the latest frame, of which there is always one
+// since the ring has two more slots than there can be viewers. A slot's
+// sequence number is zero while it is being written. The publisher clears it
+// before checking the pins, and a viewer sets its pin before checking the
+// sequence again, so one of the two always sees the other. New frames bump
+// frame_sequence, which viewers sleep on with a shared futex.
+
+#define LINUX_SHARED_MAGIC 0x46574152 // NOTE(law): "RAWF"
+#define LINUX_SHARED_VERSION 1
+#define LINUX_SHARED_MAX_VIEWER_COUNT 4
+#define LINUX_SHARED_SLOT_COUNT (LINUX_SHARED_MAX_VIEWER_COUNT + 2)
+#define LINUX_SHARED_NO_SLOT 0xFFFFFFFF
+#define LINUX_SHARED_PAGE_SIZE 4096
+
+struct linux_shared_viewer
+{
+   volatile u32 pid; // NOTE(law): Zero when the entry is free.
+   volatile u32 slot;
+   u8 padding[LINUX_CACHE_LINE_SIZE - 2*sizeof(u32)];
+};
+
+struct linux_shared_header
+{
+   u32 magic;
+   u32 version;
+   u32 width;
+   u32 height;
+   u32 format;
+   u32 slot_count;
+   u64 slot_offset;
+   u64 slot_size;
+   u32 publisher_pid;
+   u8 layout_padding[LINUX_CACHE_LINE_SIZE - 8*sizeof(u32) - 2*sizeof(u64)];
+
+   // NOTE(law): frame_sequence is the sequence number of the latest frame,
+   // zero before the first one, and is the futex word viewers wait on.
+   volatile u32 frame_sequence;
+   volatile u32 latest_slot;
+   volatile u32 closed;
+   u8 frame_padding[LINUX_CACHE_LINE_SIZE - 3*sizeof(u32)];
+
+   volatile u32 slot_sequences[LINUX_SHARED_SLOT_COUNT];
+   u8 slot_padding[LINUX_CACHE_LINE_SIZE - LINUX_SHARED_SLOT_COUNT*sizeof(u32)];
+
+   struct linux_shared_viewer viewers[LINUX_SHARED_MAX_VIEWER_COUNT];
+};
+
+struct linux_shared_frames
+{
+   char name[NAME_MAX];
+   int file;
+   size_t size;
+   struct linux_shared_header *header;
+   bool is_publisher;
+
+   // NOTE(law): Publisher state.
+   u32 next_slot;
+   u32 frame_sequence;
+   u64 published_count;
+
+   // NOTE(law): Viewer state.
+   struct linux_shared_viewer *viewer;
+   u32 presented_sequence;
+   u64 presented_count;
+   u64 skipped_count;
+};
+
+function void
+linux_futex_wait_shared(volatile u32 *address, u32 expected, u64 timeout_ns)
+{
+   // NOTE(law): Unlike the queue's futexes, these are waited on and woken from
+   // different processes, so they cannot use the private variants.
+   struct timespec timeout;
+   timeout.tv_sec = (time_t)(timeout_ns / 1000000000ull);
+   timeout.tv_nsec = (long)(timeout_ns % 1000000000ull);
+   syscall(SYS_futex, address, FUTEX_WAIT, expected, &timeout, 0, 0);
+}
+
+function void
+linux_futex_wake_shared(volatile u32 *address)
+{
+   syscall(SYS_futex, address, FUTEX_WAKE, INT32_MAX, 0, 0, 0);
+}
+
+function char *
+linux_get_publish_name(int argument_count, char **arguments)
+{
+   // NOTE(law): The name of the shared frame ring to publish to, given with
+   // --publish <name> or RAW_PUBLISH.
+   char *result = linux_get_path_option(argument_count, arguments, "--publish", "RAW_PUBLISH");
+   return(result);
+}
+
+function char *
+linux_get_view_name(int argument_count, char **arguments)
+{
+   // NOTE(law): The name of the shared frame ring to present instead of
+   // rendering, given with --view <name> or RAW_VIEW.
+   char *result = linux_get_path_option(argument_count, arguments, "--view", "RAW_VIEW");
+   return(result);
+}
+
+function void
+linux_get_shared_name(char *destination, size_t size, char *name)
+{
+   // NOTE(law): shm_open() wants a single leading slash.
+   snprintf(destination, size, "%s%s", (name[0] == '/') ? "" : "/", name);
+}
+
+function struct render_bitmap
+linux_get_shared_bitmap(struct linux_shared_frames *frames, u32 slot)
+{
+   struct linux_shared_header *header = frames->header;
+
+   struct render_bitmap result = {header->width, header->height};
+   result.memory = (u8 *)header + header->slot_offset + ((u64)slot * header->slot_size);
+   result.format = header->format;
+
+   return(result);
+}
+
+function bool
+linux_create_shared_frames(struct linux_shared_frames *frames, char *name, u32 width, u32 height, u32 format)
+{
+   memset(frames, 0, sizeof(*frames));
+   linux_get_shared_name(frames->name, sizeof(frames->name), name);
+   frames->is_publisher = true;
+
+   // NOTE(law): A ring left behind by a publisher that crashed is replaced.
+   // Viewers still mapping it notice the publisher is gone and reattach.
+   shm_unlink(frames->name);
+   frames->file = shm_open(frames->name, O_CREAT|O_EXCL|O_RDWR, 0644);
+   if(frames->file < 0)
+   {
+      platform_log("ERROR: Failed to create the shared frame ring %s (%s).\n", frames->name, strerror(errno));
+      return(false);
+   }
+
+   u64 bitmap_size = (u64)width * (u64)height * get_render_format_bytes_per_pixel(format);
+   u64 page_mask = LINUX_SHARED_PAGE_SIZE - 1;
+   u64 slot_offset = (sizeof(struct linux_shared_header) + page_mask) & ~page_mask;
+   u64 slot_size = (bitmap_size + page_mask) & ~page_mask;
+
+   frames->size = slot_offset + (LINUX_SHARED_SLOT_COUNT * slot_size);
+   if(ftruncate(frames->file, frames->size) != 0)
+   {
+      platform_log("ERROR: Failed to size the shared frame ring %s (%s).\n", frames->name, strerror(errno));
+      return(false);
+   }
+
+   void *memory = mmap(0, frames->size, PROT_READ|PROT_WRITE, MAP_SHARED, frames->file, 0);
+   if(memory == MAP_FAILED)
+   {
+      platform_log("ERROR: Failed to map the shared frame ring %s (%s).\n", frames->name, strerror(errno));
+      return(false);
+   }
+
+   // NOTE(law): The new object is zero filled, so only the nonzero fields are
+   // set. The magic goes last, since viewers check it before anything else.
+   struct linux_shared_header *header = memory;
+   header->version = LINUX_SHARED_VERSION;
+   header->width = width;
+   header->height = height;
+   header->format = format;
+   header->slot_count = LINUX_SHARED_SLOT_COUNT;
+   header->slot_offset = slot_offset;
+   header->slot_size = slot_size;
+   header->publisher_pid = (u32)getpid();
+   header->latest_slot = LINUX_SHARED_NO_SLOT;
+   for(u32 index = 0; index < LINUX_SHARED_MAX_VIEWER_COUNT; ++index)
+   {
+      header->viewers[index].slot = LINUX_SHARED_NO_SLOT;
+   }
+   __atomic_store_n(&header->magic, LINUX_SHARED_MAGIC, __ATOMIC_RELEASE);
+
+   frames->header = header;
+
+   platform_log("Publishing %ux%u %s frames to the shared frame ring %s (%u slots, up to %u viewers).\n",
+                width, height, render_format_names[format], frames->name,
+                LINUX_SHARED_SLOT_COUNT, LINUX_SHARED_MAX_VIEWER_COUNT);
+
+   return(true);
+}
+
+function bool
+linux_shared_slot_is_pinned(struct linux_shared_header *header, u32 slot)
+{
+   bool result = false;
+   for(u32 index = 0; index < LINUX_SHARED_MAX_VIEWER_COUNT; ++index)
+   {
+      if(__atomic_load_n(&header->viewers[index].slot, __ATOMIC_SEQ_CST) == slot)
+      {
+         result = true;
+      }
+   }
+
+   return(result);
+}
+
+function struct render_bitmap
+linux_acquire_shared_bitmap(struct linux_shared_frames *frames)
+{
+   // NOTE(law): Returns the bitmap to render the next frame into. This always
+   // succeeds without waiting, see above.
+   struct linux_shared_header *header = frames->header;
+   u32 latest_slot = __atomic_load_n(&header->latest_slot, __ATOMIC_RELAXED);
+
+   u32 slot = LINUX_SHARED_NO_SLOT;
+   for(u32 attempt = 0; attempt < LINUX_SHARED_SLOT_COUNT && slot == LINUX_SHARED_NO_SLOT; ++attempt)
+   {
+      u32 candidate = (frames->next_slot + attempt) % LINUX_SHARED_SLOT_COUNT;
+      if(candidate == latest_slot)
+      {
+         continue;
+      }
+
+      u32 previous_sequence = header->slot_sequences[candidate];
+      __atomic_store_n(&header->slot_sequences[candidate], 0, __ATOMIC_SEQ_CST);
+      if(linux_shared_slot_is_pinned(header, candidate))
+      {
+         __atomic_store_n(&header->slot_sequences[candidate], previous_sequence, __ATOMIC_SEQ_CST);
+      }
+      else
+      {
+         slot = candidate;
+      }
+   }
+   assert(slot != LINUX_SHARED_NO_SLOT);
+
+   frames->next_slot = (slot + 1) % LINUX_SHARED_SLOT_COUNT;
+
+   struct render_bitmap result = linux_get_shared_bitmap(frames, slot);
+   return(result);
+}
+
+function void
+linux_publish_shared_bitmap(struct linux_shared_frames *frames, struct render_bitmap *bitmap)
+{
+   struct linux_shared_header *header = frames->header;
+
+   u32 slot = (u32)(((u8 *)bitmap->memory - ((u8 *)header + header->slot_offset)) / header->slot_size);
+   assert(slot < LINUX_SHARED_SLOT_COUNT);
+
+   // NOTE(law): Zero marks a slot that is being written, so wrapping skips it.
+   u32 sequence = frames->frame_sequence + 1;
+   if(!sequence)
+   {
+      sequence = 1;
+   }
+   frames->frame_sequence = sequence;
+   frames->published_count++;
+
+   __atomic_store_n(&header->slot_sequences[slot], sequence, __ATOMIC_RELEASE);
+   __atomic_store_n(&header->latest_slot, slot, __ATOMIC_RELEASE);
+   __atomic_store_n(&header->frame_sequence, sequence, __ATOMIC_RELEASE);
+   linux_futex_wake_shared(&header->frame_sequence);
+}
+
+function void
+linux_close_shared_frames(struct linux_shared_frames *frames)
+{
+   struct linux_shared_header *header = frames->header;
+   if(header)
+   {
+      if(frames->is_publisher)
+      {
+         // NOTE(law): Viewers keep their mapping, and with it the last frame,
+         // until they notice the flag. Unlinking only removes the name.
+         __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+         linux_futex_wake_shared(&header->frame_sequence);
+         shm_unlink(frames->name);
+
+         platform_log("Published %llu frames to %s.\n", (unsigned long long)frames->published_count, frames->name);
+      }
+      else if(frames->viewer)
+      {
+         __atomic_store_n(&frames->viewer->slot, LINUX_SHARED_NO_SLOT, __ATOMIC_SEQ_CST);
+         __atomic_store_n(&frames->viewer->pid, 0, __ATOMIC_RELEASE);
+      }
+
+      munmap(header, frames->size);
+   }
+
+   if(frames->file >= 0)
+   {
+      close(frames->file);
+   }
+
+   frames->header = 0;
+   frames->viewer = 0;
+   frames->file = -1;
+}
+
+function bool
+linux_attach_shared_frames(struct linux_shared_frames *frames, char *name)
+{
+   // NOTE(law): Returns false without logging while there is nothing to
+   // attach to yet, or every viewer entry is taken, so callers can simply
+   // retry.
+   memset(frames, 0, sizeof(*frames));
+   linux_get_shared_name(frames->name, sizeof(frames->name), name);
+
+   frames->file = shm_open(frames->name, O_RDWR, 0);
+   if(frames->file < 0)
+   {
+      return(false);
+   }
+
+   struct stat status;
+   if(fstat(frames->file, &status) != 0 || (size_t)status.st_size < sizeof(struct linux_shared_header))
+   {
+      linux_close_shared_frames(frames);
+      return(false);
+   }
+
+   frames->size = (size_t)status.st_size;
+   void *memory = mmap(0, frames->size, PROT_READ|PROT_WRITE, MAP_SHARED, frames->file, 0);
+   if(memory == MAP_FAILED)
+   {
+      linux_close_shared_frames(frames);
+      return(false);
+   }
+   frames->header = memory;
+
+   struct linux_shared_header *header = frames->header;
+   if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != LINUX_SHARED_MAGIC ||
+      header->version != LINUX_SHARED_VERSION ||
+      header->slot_count != LINUX_SHARED_SLOT_COUNT ||
+      header->slot_offset + (header->slot_count * header->slot_size) > frames->size ||
+      header->format >= RENDER_FORMAT_COUNT ||
+      (u64)header->width * header->height * get_render_format_bytes_per_pixel(header->format) > header->slot_size)
+   {
+      linux_close_shared_frames(frames);
+      return(false);
+   }
+
+   // NOTE(law): Claim a free viewer entry, or one left behind by a viewer
+   // that no longer exists.
+   u32 pid = (u32)getpid();
+   for(u32 pass = 0; pass < 2 && !frames->viewer; ++pass)
+   {
+      for(u32 index = 0; index < LINUX_SHARED_MAX_VIEWER_COUNT && !frames->viewer; ++index)
+      {
+         struct linux_shared_viewer *viewer = header->viewers + index;
+
+         u32 expected = __atomic_load_n(&viewer->pid, __ATOMIC_ACQUIRE);
+         bool is_available = (pass == 0) ? (expected == 0) : (kill((pid_t)expected, 0) != 0 && errno == ESRCH);
+         if(is_available && __atomic_compare_exchange_n(&viewer->pid, &expected, pid, false,
+                                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+         {
+            __atomic_store_n(&viewer->slot, LINUX_SHARED_NO_SLOT, __ATOMIC_SEQ_CST);
+            frames->viewer = viewer;
+         }
+      }
+   }
+
+   if(!frames->viewer)
+   {
+      linux_close_shared_frames(frames);
+      return(false);
+   }
+
+   platform_log("Viewing %ux%u %s frames from the shared frame ring %s (publisher %u).\n",
+                header->width, header->height, render_format_names[header->format], frames->name,
+                header->publisher_pid);
+
+   return(true);
+}
+
+function bool
+linux_shared_publisher_is_gone(struct linux_shared_frames *frames)
+{
+   struct linux_shared_header *header = frames->header;
+
+   bool result = (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) ||
+                  (kill((pid_t)header->publisher_pid, 0) != 0 && errno == ESRCH));
+   return(result);
+}
+
+function bool
+linux_acquire_latest_shared_bitmap(struct linux_shared_frames *frames, struct render_bitmap *bitmap, u64 timeout_ns)
+{
+   // NOTE(law): Waits up to timeout_ns for a frame newer than the last one
+   // acquired, then pins it and returns true. The pin holds until the next
+   // call, so present the bitmap before asking for another.
+   struct linux_shared_header *header = frames->header;
+   struct linux_shared_viewer *viewer = frames->viewer;
+
+   __atomic_store_n(&viewer->slot, LINUX_SHARED_NO_SLOT, __ATOMIC_SEQ_CST);
+
+   u32 frame_sequence = __atomic_load_n(&header->frame_sequence, __ATOMIC_ACQUIRE);
+   if(frame_sequence == frames->presented_sequence && !header->closed)
+   {
+      linux_futex_wait_shared(&header->frame_sequence, frame_sequence, timeout_ns);
+   }
+
+   bool result = false;
+   while(!result)
+   {
+      frame_sequence = __atomic_load_n(&header->frame_sequence, __ATOMIC_ACQUIRE);
+      if(frame_sequence == frames->presented_sequence)
+      {
+         break;
+      }
+
+      u32 slot = __atomic_load_n(&header->latest_slot, __ATOMIC_ACQUIRE);
+      u32 slot_sequence = __atomic_load_n(&header->slot_sequences[slot], __ATOMIC_SEQ_CST);
+
+      __atomic_store_n(&viewer->slot, slot, __ATOMIC_SEQ_CST);
+      if(slot_sequence && __atomic_load_n(&header->slot_sequences[slot], __ATOMIC_SEQ_CST) == slot_sequence)
+      {
+         // NOTE(law): Sequence numbers are consecutive, so any gap is frames
+         // the publisher replaced before this viewer got to them.
+         if(frames->presented_sequence && slot_sequence - frames->presented_sequence > 1)
+         {
+            frames->skipped_count += slot_sequence - frames->presented_sequence - 1;
+         }
+
+         frames->presented_sequence = slot_sequence;
+         frames->presented_count++;
+
+         *bitmap = linux_get_shared_bitmap(frames, slot);
+         result = true;
+      }
+      else
+      {
+         __atomic_store_n(&viewer->slot, LINUX_SHARED_NO_SLOT, __ATOMIC_SEQ_CST);
+      }
+   }
+
+   return(result);
+}
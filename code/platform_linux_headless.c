@@ -0,0 +1,1508 @@
+/* /////////////////////////////////////////////////////////////////////////// */
+/* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
+/* /////////////////////////////////////////////////////////////////////////// */
+
+// NOTE(law): Headless entry point for measuring raw tracing throughput. It
+// drives update() through the regular work queue without ever touching X11 or
+// OpenGL, so it can run on machines without a display.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LINUX_LOG_MAX_LENGTH 1024
+
+#include "raw.c"
+#include "platform_linux_common.c"
+
+#define HEADLESS_MAX_RUNS 256
+
+struct headless_options
+{
+   u32 width;
+   u32 height;
+   u32 frame_count;
+   u32 warmup_count;
+   u32 thread_count;
+   u32 primitive_count;
+   u32 tile_width;
+   u32 tile_height;
+   u32 tile_order;
+   u32 format;
+   u32 output_transform;
+   bool sweep;
+   char *json_path;
+   char *trace_path;
+   char *scene_path;
+   char *compiled_scene_path;
+
+   float pacing_fps;
+   float adaptive_sample_budget;
+   bool reproject;
+   bool turn;
+   u32 bounce_count;
+
+   bool queue_benchmark;
+   u32 job_iterations;
+   u32 round_count;
+
+   char *regression_path;
+   char *baseline_path;
+   bool update_references;
+   bool update_baseline;
+   u32 tolerance;
+   float maximum_slowdown;
+
+   struct linux_placement_options placement;
+   struct linux_memory_options memory;
+   struct linux_output_options output;
+   char *publish_name;
+};
+
+struct headless_run
+{
+   u32 thread_count;
+
+   double total_seconds;
+   double mrays_per_second;
+   double adaptive_rays_per_frame;
+   double secondary_rays_per_frame;
+   double reused_fraction;
+   double scaling_efficiency;
+
+   double frame_ms_mean;
+   double frame_ms_min;
+   double frame_ms_p50;
+   double frame_ms_p90;
+   double frame_ms_p99;
+   double frame_ms_max;
+};
+
+function double
+headless_get_seconds(void)
+{
+   struct timespec count;
+   clock_gettime(CLOCK_MONOTONIC, &count);
+
+   double result = (double)count.tv_sec + (1e-9 * (double)count.tv_nsec);
+   return(result);
+}
+
+function int
+headless_compare_doubles(const void *a, const void *b)
+{
+   double value_a = *(double *)a;
+   double value_b = *(double *)b;
+
+   int result = (value_a > value_b) - (value_a < value_b);
+   return(result);
+}
+
+function double
+headless_percentile(double *sorted_values, u32 count, double percentile)
+{
+   // NOTE(law): Nearest-rank percentile over an already sorted array.
+   u32 rank = (u32)((percentile / 100.0) * (double)count + 0.5);
+   if(rank < 1) rank = 1;
+   if(rank > count) rank = count;
+
+   double result = sorted_values[rank - 1];
+   return(result);
+}
+
+function void
+headless_add_primitive_field(u32 count)
+{
+   // NOTE(law): Scatter a deterministic mix of bounded primitives over the
+   // ground planes, to measure how frame cost grows with scene size.
+
+   u32 state = 0x9E3779B9;
+   for(u32 index = 0; index < count; ++index)
+   {
+      float random[3];
+      for(u32 component = 0; component < 3; ++component)
+      {
+         state ^= state << 13;
+         state ^= state >> 17;
+         state ^= state << 5;
+         random[component] = (float)(state & 0xFFFF) / 65535.0f;
+      }
+
+      v3 position = vec3(-20.0f + 40.0f*random[0], -20.0f + 40.0f*random[1], 4.0f*random[2]);
+      v3 color = vec3(random[2], random[0], random[1]);
+
+      switch(index % 3)
+      {
+         case 0: add_sphere(position, 0.2f, color, 0); break;
+         case 1: add_box(position, add3(position, vec3(0.3f, 0.2f, 0.4f)), color, 0); break;
+         case 2: add_triangle(position, add3(position, vec3(0.4f, 0, 0)), add3(position, vec3(0, 0.1f, 0.4f)), color, 0); break;
+      }
+   }
+}
+
+// NOTE(law): Frames can also leave the process, by being recorded with
+// --record or published with --publish. Those frames are rendered straight into
+// the output or shared ring instead of the benchmark bitmap.
+
+global struct linux_output_sink *headless_output;
+global struct linux_shared_frames *headless_publisher;
+global struct render_bitmap headless_shared_bitmap;
+
+function struct render_bitmap *
+headless_get_frame_bitmap(struct render_bitmap *bitmap)
+{
+   // NOTE(law): Waiting for a free output bitmap counts against the frame.
+   // Frames the output ring drops are still rendered, into the benchmark
+   // bitmap. Published frames that are also recorded are copied into the
+   // output ring afterwards.
+   struct render_bitmap *result = bitmap;
+   if(headless_publisher)
+   {
+      headless_shared_bitmap = linux_acquire_shared_bitmap(headless_publisher);
+      result = &headless_shared_bitmap;
+   }
+   else if(headless_output)
+   {
+      struct render_bitmap *output_bitmap = linux_acquire_output_bitmap(headless_output);
+      result = (output_bitmap) ? output_bitmap : bitmap;
+   }
+
+   return(result);
+}
+
+function void
+headless_finish_frame(struct render_bitmap *bitmap, struct render_bitmap *target)
+{
+   if(headless_publisher)
+   {
+      if(headless_output)
+      {
+         linux_copy_output_bitmap(headless_output, target);
+      }
+      linux_publish_shared_bitmap(headless_publisher, target);
+   }
+   else if(target != bitmap)
+   {
+      linux_submit_output_bitmap(headless_output, target);
+   }
+}
+
+function void
+headless_close_outputs(void)
+{
+   if(headless_output)
+   {
+      linux_close_output(headless_output);
+   }
+   if(headless_publisher)
+   {
+      linux_close_shared_frames(headless_publisher);
+   }
+}
+
+function void
+headless_render(struct headless_run *run, struct headless_options *options,
+                struct render_bitmap *bitmap, struct platform_work_queue *queue,
+                double *frame_seconds)
+{
+   struct user_input input = {0};
+
+   // NOTE(law): Turning holds the right arrow key with a fixed 60 Hz frame
+   // time, so that runs are repeatable.
+   float frame_seconds_elapsed = 0;
+   if(options->turn)
+   {
+      input.right = true;
+      frame_seconds_elapsed = 1.0f / 60.0f;
+   }
+
+   for(u32 index = 0; index < options->warmup_count; ++index)
+   {
+      update(bitmap, &input, queue, frame_seconds_elapsed);
+   }
+
+   double adaptive_rays = 0;
+   double secondary_rays = 0;
+   double reused_pixels = 0;
+
+   double run_start = headless_get_seconds();
+   for(u32 index = 0; index < options->frame_count; ++index)
+   {
+      double frame_start = headless_get_seconds();
+
+      struct render_bitmap *target = headless_get_frame_bitmap(bitmap);
+      update(target, &input, queue, frame_seconds_elapsed);
+      headless_finish_frame(bitmap, target);
+
+      double frame_end = headless_get_seconds();
+
+      frame_seconds[index] = frame_end - frame_start;
+      if(!options->turn)
+      {
+         frame_seconds_elapsed = (float)frame_seconds[index];
+      }
+
+      if(renderer.adaptive_active)
+      {
+         adaptive_rays += (double)renderer.adaptive_ray_count;
+      }
+      if(renderer.wavefront_active)
+      {
+         secondary_rays += (double)renderer.wavefront_ray_count - ((double)target->width * (double)target->height);
+      }
+      if(renderer.reprojection_active)
+      {
+         reused_pixels += (double)renderer.reprojection_reused_count;
+      }
+   }
+   run->total_seconds = headless_get_seconds() - run_start;
+   run->adaptive_rays_per_frame = adaptive_rays / (double)options->frame_count;
+   run->secondary_rays_per_frame = secondary_rays / (double)options->frame_count;
+   run->reused_fraction = reused_pixels / ((double)bitmap->width * (double)bitmap->height * (double)options->frame_count);
+
+   double total_rays = (double)bitmap->width * (double)bitmap->height * (double)options->frame_count;
+   total_rays += adaptive_rays + secondary_rays;
+   run->mrays_per_second = (total_rays / run->total_seconds) / 1e6;
+
+   qsort(frame_seconds, options->frame_count, sizeof(double), headless_compare_doubles);
+
+   double sum = 0;
+   for(u32 index = 0; index < options->frame_count; ++index)
+   {
+      sum += frame_seconds[index];
+   }
+
+   run->frame_ms_mean = 1000.0 * sum / (double)options->frame_count;
+   run->frame_ms_min  = 1000.0 * frame_seconds[0];
+   run->frame_ms_p50  = 1000.0 * headless_percentile(frame_seconds, options->frame_count, 50);
+   run->frame_ms_p90  = 1000.0 * headless_percentile(frame_seconds, options->frame_count, 90);
+   run->frame_ms_p99  = 1000.0 * headless_percentile(frame_seconds, options->frame_count, 99);
+   run->frame_ms_max  = 1000.0 * frame_seconds[options->frame_count - 1];
+}
+
+function bool
+headless_write_json(char *path, struct headless_options *options, struct headless_run *runs, u32 run_count)
+{
+   FILE *file = fopen(path, "w");
+   if(!file)
+   {
+      platform_log("ERROR: Failed to open %s for writing.\n", path);
+      return(false);
+   }
+
+   fprintf(file, "{\n");
+   fprintf(file, "  \"width\": %u,\n", options->width);
+   fprintf(file, "  \"height\": %u,\n", options->height);
+   fprintf(file, "  \"frames\": %u,\n", options->frame_count);
+   fprintf(file, "  \"warmup_frames\": %u,\n", options->warmup_count);
+   fprintf(file, "  \"lane_width\": %u,\n", LANE_WIDTH);
+   fprintf(file, "  \"extra_primitives\": %u,\n", options->primitive_count);
+   fprintf(file, "  \"tile_width\": %u,\n", renderer.tile_width);
+   fprintf(file, "  \"tile_height\": %u,\n", renderer.tile_height);
+   fprintf(file, "  \"tile_order\": \"%s\",\n", tile_order_names[renderer.tile_order]);
+   fprintf(file, "  \"format\": \"%s\",\n", render_format_names[options->format]);
+   fprintf(file, "  \"output_transform\": \"%s\",\n", output_transform_names[options->output_transform]);
+   fprintf(file, "  \"adaptive_sample_budget\": %.3f,\n", options->adaptive_sample_budget);
+   fprintf(file, "  \"reproject\": %s,\n", (options->reproject) ? "true" : "false");
+   fprintf(file, "  \"turn\": %s,\n", (options->turn) ? "true" : "false");
+   fprintf(file, "  \"bounces\": %u,\n", options->bounce_count);
+   fprintf(file, "  \"runs\": [\n");
+
+   for(u32 index = 0; index < run_count; ++index)
+   {
+      struct headless_run *run = runs + index;
+
+      fprintf(file, "    {\n");
+      fprintf(file, "      \"threads\": %u,\n", run->thread_count);
+      fprintf(file, "      \"total_seconds\": %.6f,\n", run->total_seconds);
+      fprintf(file, "      \"mrays_per_second\": %.3f,\n", run->mrays_per_second);
+      fprintf(file, "      \"adaptive_rays_per_frame\": %.1f,\n", run->adaptive_rays_per_frame);
+      fprintf(file, "      \"secondary_rays_per_frame\": %.1f,\n", run->secondary_rays_per_frame);
+      fprintf(file, "      \"reused_fraction\": %.4f,\n", run->reused_fraction);
+      fprintf(file, "      \"scaling_efficiency\": %.4f,\n", run->scaling_efficiency);
+      fprintf(file, "      \"frame_ms\": {\"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}\n",
+              run->frame_ms_mean, run->frame_ms_min, run->frame_ms_p50,
+              run->frame_ms_p90, run->frame_ms_p99, run->frame_ms_max);
+      fprintf(file, "    }%s\n", (index + 1 < run_count) ? "," : "");
+   }
+
+   fprintf(file, "  ]\n");
+   fprintf(file, "}\n");
+
+   fclose(file);
+
+   return(true);
+}
+
+// NOTE(law): The single shared ring that the work-stealing queue replaced. It
+// is only kept around as the baseline for --queue-benchmark.
+
+#define RING_QUEUE_ENTRY_COUNT 512
+
+struct ring_work_queue
+{
+   volatile u32 read_index;
+   volatile u32 write_index;
+
+   volatile u32 completion_target;
+   volatile u32 completion_count;
+
+   sem_t semaphore;
+
+   struct queue_entry entries[RING_QUEUE_ENTRY_COUNT];
+};
+
+function void
+ring_enqueue_work(struct ring_work_queue *queue, void *data, queue_callback *callback)
+{
+   u32 new_write_index = (queue->write_index + 1) % ARRAY_LENGTH(queue->entries);
+   assert(new_write_index != queue->read_index);
+
+   struct queue_entry *entry = queue->entries + queue->write_index;
+   entry->data = data;
+   entry->callback = callback;
+
+   queue->completion_target++;
+
+   asm volatile("" ::: "memory");
+
+   queue->write_index = new_write_index;
+   sem_post(&queue->semaphore);
+}
+
+function bool
+ring_dequeue_work(struct ring_work_queue *queue)
+{
+   u32 read_index = queue->read_index;
+   u32 new_read_index = (read_index + 1) % ARRAY_LENGTH(queue->entries);
+   if(read_index == queue->write_index)
+   {
+      return(true);
+   }
+
+   u32 index = __sync_val_compare_and_swap(&queue->read_index, read_index, new_read_index);
+   if(index == read_index)
+   {
+      struct queue_entry entry = queue->entries[index];
+      entry.callback(0, entry.data);
+
+      __sync_add_and_fetch(&queue->completion_count, 1);
+   }
+
+   return(false);
+}
+
+function void
+ring_complete_queue(struct ring_work_queue *queue)
+{
+   while(queue->completion_target > queue->completion_count)
+   {
+      ring_dequeue_work(queue);
+   }
+
+   queue->completion_target = 0;
+   queue->completion_count = 0;
+}
+
+function void *
+ring_thread_procedure(void *data)
+{
+   struct ring_work_queue *queue = (struct ring_work_queue *)data;
+   while(1)
+   {
+      if(ring_dequeue_work(queue))
+      {
+         sem_wait(&queue->semaphore);
+      }
+   }
+
+   return(0);
+}
+
+struct headless_job
+{
+   u32 iterations;
+   volatile u32 result;
+};
+
+function
+PLATFORM_QUEUE_CALLBACK(headless_job_callback)
+{
+   // NOTE(law): Synthetic job that burns a fixed amount of ALU work.
+   struct headless_job *job = (struct headless_job *)data;
+
+   u32 x = job->iterations | 1;
+   for(u32 index = 0; index < job->iterations; ++index)
+   {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+   }
+   job->result = x;
+}
+
+function bool
+headless_benchmark_queues(struct headless_options *options, u32 *thread_counts, u32 run_count)
+{
+   // NOTE(law): Push rounds of small synthetic jobs through the ring queue and
+   // the work-stealing queue at each thread count, the latter both one job at a
+   // time and as a single batch. A round is sized to fit in
+   // the ring.
+
+   u32 job_count = RING_QUEUE_ENTRY_COUNT - 1;
+   struct headless_job *jobs = linux_allocate(job_count * sizeof(struct headless_job));
+   if(!jobs)
+   {
+      return(false);
+   }
+
+   for(u32 index = 0; index < job_count; ++index)
+   {
+      jobs[index].iterations = options->job_iterations;
+   }
+
+   struct ring_work_queue *ring = linux_allocate(sizeof(struct ring_work_queue));
+   struct platform_work_queue *queue = linux_allocate(sizeof(struct platform_work_queue));
+   if(!ring || !queue)
+   {
+      return(false);
+   }
+
+   sem_init(&ring->semaphore, 0, 0);
+   linux_initialize_queue(queue, 0);
+
+   double ring_jobs_per_second[HEADLESS_MAX_RUNS];
+   double stealing_jobs_per_second[HEADLESS_MAX_RUNS];
+   double batched_jobs_per_second[HEADLESS_MAX_RUNS];
+
+   u32 active_thread_count = 1;
+   for(u32 run_index = 0; run_index < run_count; ++run_index)
+   {
+      u32 thread_count = thread_counts[run_index];
+      while(active_thread_count < thread_count)
+      {
+         pthread_t id;
+         pthread_create(&id, 0, ring_thread_procedure, ring);
+         pthread_detach(id);
+
+         linux_launch_worker(queue);
+
+         active_thread_count++;
+      }
+
+      double start = headless_get_seconds();
+      for(u32 round = 0; round < options->round_count; ++round)
+      {
+         for(u32 index = 0; index < job_count; ++index)
+         {
+            ring_enqueue_work(ring, jobs + index, headless_job_callback);
+         }
+         ring_complete_queue(ring);
+      }
+      double ring_seconds = headless_get_seconds() - start;
+
+      start = headless_get_seconds();
+      for(u32 round = 0; round < options->round_count; ++round)
+      {
+         for(u32 index = 0; index < job_count; ++index)
+         {
+            platform_enqueue_work(queue, jobs + index, headless_job_callback);
+         }
+         platform_complete_queue(queue);
+      }
+      double stealing_seconds = headless_get_seconds() - start;
+
+      start = headless_get_seconds();
+      for(u32 round = 0; round < options->round_count; ++round)
+      {
+         platform_enqueue_work_batch(queue, 0, jobs, sizeof(struct headless_job), job_count, headless_job_callback);
+         platform_complete_queue(queue);
+      }
+      double batched_seconds = headless_get_seconds() - start;
+
+      double total_jobs = (double)job_count * (double)options->round_count;
+      ring_jobs_per_second[run_index] = total_jobs / ring_seconds;
+      stealing_jobs_per_second[run_index] = total_jobs / stealing_seconds;
+      batched_jobs_per_second[run_index] = total_jobs / batched_seconds;
+   }
+
+   platform_log("\n");
+   platform_log("Queue benchmark: %u rounds of %u jobs, %u iterations per job\n",
+                options->round_count, job_count, options->job_iterations);
+   platform_log("threads  ring Mjobs/s  efficiency  stealing Mjobs/s  efficiency  batched Mjobs/s  efficiency  speedup\n");
+
+   for(u32 run_index = 0; run_index < run_count; ++run_index)
+   {
+      double thread_count = (double)thread_counts[run_index];
+      platform_log("%7u  %12.3f  %9.1f%%  %16.3f  %9.1f%%  %15.3f  %9.1f%%  %6.2fx\n",
+                   thread_counts[run_index],
+                   ring_jobs_per_second[run_index] / 1e6,
+                   100.0 * ring_jobs_per_second[run_index] / (ring_jobs_per_second[0] * thread_count),
+                   stealing_jobs_per_second[run_index] / 1e6,
+                   100.0 * stealing_jobs_per_second[run_index] / (stealing_jobs_per_second[0] * thread_count),
+                   batched_jobs_per_second[run_index] / 1e6,
+                   100.0 * batched_jobs_per_second[run_index] / (batched_jobs_per_second[0] * thread_count),
+                   batched_jobs_per_second[run_index] / ring_jobs_per_second[run_index]);
+   }
+
+   if(options->json_path)
+   {
+      FILE *file = fopen(options->json_path, "w");
+      if(!file)
+      {
+         platform_log("ERROR: Failed to open %s for writing.\n", options->json_path);
+         return(false);
+      }
+
+      fprintf(file, "{\n");
+      fprintf(file, "  \"rounds\": %u,\n", options->round_count);
+      fprintf(file, "  \"jobs_per_round\": %u,\n", job_count);
+      fprintf(file, "  \"job_iterations\": %u,\n", options->job_iterations);
+      fprintf(file, "  \"runs\": [\n");
+      for(u32 run_index = 0; run_index < run_count; ++run_index)
+      {
+         fprintf(file, "    {\"threads\": %u, \"ring_jobs_per_second\": %.1f, \"stealing_jobs_per_second\": %.1f, "
+                 "\"batched_jobs_per_second\": %.1f}%s\n",
+                 thread_counts[run_index], ring_jobs_per_second[run_index], stealing_jobs_per_second[run_index],
+                 batched_jobs_per_second[run_index], (run_index + 1 < run_count) ? "," : "");
+      }
+      fprintf(file, "  ]\n");
+      fprintf(file, "}\n");
+
+      fclose(file);
+   }
+
+   return(true);
+}
+
+// NOTE(law): The regression suite renders a fixed set of scenes and camera
+// poses through update() and checks them two ways. Images are compared with
+// reference PPMs, which are checked in under data/regression and are the same
+// on every machine, give or take the tolerance. Throughput is compared with a
+// baseline file, which only makes sense for the machine and thread count it was
+// written on, so it lives wherever the caller keeps it.
+
+#define HEADLESS_REGRESSION_WIDTH 192
+#define HEADLESS_REGRESSION_HEIGHT 108
+#define HEADLESS_REGRESSION_DEFAULT_TOLERANCE 2
+#define HEADLESS_REGRESSION_DEFAULT_SLOWDOWN 10.0f
+#define HEADLESS_REGRESSION_MAX_BASELINES 64
+
+// NOTE(law): Pixels can land on the other side of a silhouette when the
+// approximate reciprocals differ between instruction sets, so a few pixels per
+// thousand may exceed the tolerance.
+#define HEADLESS_REGRESSION_DIFFERING_FRACTION 0.002
+
+struct headless_regression_case
+{
+   char *name;
+
+   v3 camera_position;
+   v3 target_position;
+   float focal_length;
+
+   u32 primitive_count;
+   bool progressive;
+   float adaptive_sample_budget;
+
+   // NOTE(law): Frames rendered before the image is compared. Progressive
+   // cases accumulate one sample per frame, adaptive cases need a frame to
+   // find the edges.
+   u32 frame_count;
+
+   u32 bounce_count;
+};
+
+global struct headless_regression_case headless_regression_cases[] =
+{
+   {"default",     {0, 15.0f, 1.5f},     {0, 0, 1.5f},       1.0f,    0, false, 0,     1, 0},
+   {"close-up",    {3.0f, 6.0f, 2.5f},   {0, 0, 1.5f},       1.5f,    0, false, 0,     1, 0},
+   {"overhead",    {2.0f, 8.0f, 20.0f},  {0, 0, 0},          0.75f,   0, false, 0,     1, 0},
+   {"field",       {0, 15.0f, 1.5f},     {0, 0, 1.5f},       1.0f,  200, false, 0,     1, 0},
+   {"field-low",   {-10.0f, 12.0f, 3.0f}, {5.0f, -5.0f, 1.0f}, 1.0f, 1000, false, 0,     1, 0},
+   {"progressive", {3.0f, 6.0f, 2.5f},   {0, 0, 1.5f},       1.5f,  200, true,  0,    16, 0},
+   {"adaptive",    {3.0f, 6.0f, 2.5f},   {0, 0, 1.5f},       1.5f,  200, false, 0.5f,  4, 0},
+   {"reflections", {3.0f, 6.0f, 2.5f},   {0, 0, 1.5f},       1.5f,  200, false, 0,     1, 2},
+};
+
+struct headless_baseline
+{
+   char name[64];
+   double mrays_per_second;
+};
+
+function bool
+headless_write_ppm(char *path, struct render_bitmap *bitmap)
+{
+   FILE *file = fopen(path, "wb");
+   if(!file)
+   {
+      platform_log("ERROR: Failed to open %s for writing.\n", path);
+      return(false);
+   }
+
+   fprintf(file, "P6\n%u %u\n255\n", bitmap->width, bitmap->height);
+
+   u32 *pixels = bitmap->memory;
+   for(u32 index = 0; index < bitmap->width * bitmap->height; ++index)
+   {
+      u8 rgb[3] = {(u8)(pixels[index] >> 16), (u8)(pixels[index] >> 8), (u8)pixels[index]};
+      fwrite(rgb, 1, sizeof(rgb), file);
+   }
+
+   bool result = !ferror(file);
+   fclose(file);
+
+   return(result);
+}
+
+function u8 *
+headless_read_ppm(char *path, u32 *width, u32 *height)
+{
+   // NOTE(law): Returns tightly packed RGB triples, or 0 if the file is
+   // missing or is not an 8-bit binary PPM.
+   u8 *result = 0;
+
+   FILE *file = fopen(path, "rb");
+   if(file)
+   {
+      u32 max_value;
+      if(fscanf(file, "P6 %u %u %u", width, height, &max_value) == 3 && max_value == 255 && fgetc(file) != EOF)
+      {
+         size_t size = (size_t)*width * *height * 3;
+         result = linux_allocate(size);
+         if(result && fread(result, 1, size, file) != size)
+         {
+            linux_deallocate(result);
+            result = 0;
+         }
+      }
+      fclose(file);
+   }
+
+   return(result);
+}
+
+function u32
+headless_read_baselines(char *path, struct headless_baseline *baselines, u32 capacity)
+{
+   // NOTE(law): Baselines are "<case> <Mrays/s>" lines. Lines starting with #
+   // are comments.
+   u32 result = 0;
+
+   FILE *file = fopen(path, "r");
+   if(file)
+   {
+      char line[256];
+      while(result < capacity && fgets(line, sizeof(line), file))
+      {
+         struct headless_baseline *baseline = baselines + result;
+         if(line[0] != '#' && sscanf(line, "%63s %lf", baseline->name, &baseline->mrays_per_second) == 2)
+         {
+            result++;
+         }
+      }
+      fclose(file);
+   }
+
+   return(result);
+}
+
+function bool
+headless_run_regression(struct headless_options *options, struct platform_work_queue *queue)
+{
+   struct render_bitmap bitmap = {HEADLESS_REGRESSION_WIDTH, HEADLESS_REGRESSION_HEIGHT};
+   bitmap.format = RENDER_FORMAT_BGRA8;
+   bitmap.memory = linux_allocate(bitmap.width * bitmap.height * sizeof(u32));
+   if(!bitmap.memory)
+   {
+      return(false);
+   }
+
+   renderer.output_transform = OUTPUT_TRANSFORM_LINEAR;
+
+   struct headless_baseline baselines[HEADLESS_REGRESSION_MAX_BASELINES];
+   u32 baseline_count = 0;
+   if(options->baseline_path && !options->update_baseline)
+   {
+      baseline_count = headless_read_baselines(options->baseline_path, baselines, ARRAY_LENGTH(baselines));
+      if(!baseline_count)
+      {
+         platform_log("No baselines in %s, so throughput is not checked. Write them with --update-baseline.\n",
+                      options->baseline_path);
+      }
+   }
+
+   FILE *baseline_file = 0;
+   if(options->baseline_path && options->update_baseline)
+   {
+      baseline_file = fopen(options->baseline_path, "w");
+      if(!baseline_file)
+      {
+         platform_log("ERROR: Failed to open %s for writing.\n", options->baseline_path);
+         return(false);
+      }
+      fprintf(baseline_file, "# Regression throughput in Mrays/s: %ux%u, %u-wide lanes, %u threads.\n",
+              bitmap.width, bitmap.height, LANE_WIDTH, options->thread_count);
+   }
+
+   double maximum_slowdown = (double)options->maximum_slowdown / 100.0;
+   u32 failure_count = 0;
+
+   platform_log("\n");
+   platform_log("case            image        differing  max diff    Mrays/s   baseline    change\n");
+
+   struct user_input input = {0};
+   for(u32 case_index = 0; case_index < ARRAY_LENGTH(headless_regression_cases); ++case_index)
+   {
+      struct headless_regression_case *test = headless_regression_cases + case_index;
+
+      reset_scene();
+      headless_add_primitive_field(test->primitive_count);
+      point_camera(test->camera_position, test->target_position, vec3(0, 0, 1));
+      scene.focal_length = test->focal_length;
+
+      renderer.progressive_enabled = test->progressive;
+      renderer.accumulation_width = 0;
+      configure_adaptive_sampling(test->adaptive_sample_budget);
+      renderer.bounce_count = test->bounce_count;
+
+      for(u32 frame = 0; frame < test->frame_count; ++frame)
+      {
+         update(&bitmap, &input, queue, 0);
+      }
+
+      // NOTE(law): Compare or update the reference image.
+      char path[1024];
+      snprintf(path, sizeof(path), "%s/%s.ppm", options->regression_path, test->name);
+
+      char *image_status = "ok";
+      u32 differing_count = 0;
+      u32 maximum_difference = 0;
+      bool image_failed = false;
+
+      if(options->update_references)
+      {
+         image_status = "updated";
+         if(!headless_write_ppm(path, &bitmap))
+         {
+            image_status = "unwritable";
+            image_failed = true;
+         }
+      }
+      else
+      {
+         u32 reference_width;
+         u32 reference_height;
+         u8 *reference = headless_read_ppm(path, &reference_width, &reference_height);
+         if(!reference)
+         {
+            image_status = "missing";
+            image_failed = true;
+         }
+         else if(reference_width != bitmap.width || reference_height != bitmap.height)
+         {
+            image_status = "wrong size";
+            image_failed = true;
+         }
+         else
+         {
+            u32 *pixels = bitmap.memory;
+            for(u32 index = 0; index < bitmap.width * bitmap.height; ++index)
+            {
+               u32 pixel_difference = 0;
+               for(u32 channel = 0; channel < 3; ++channel)
+               {
+                  s32 value = (pixels[index] >> (16 - 8*channel)) & 0xFF;
+                  s32 difference = value - (s32)reference[(3 * index) + channel];
+                  pixel_difference = MAXIMUM(pixel_difference, (u32)((difference < 0) ? -difference : difference));
+               }
+
+               maximum_difference = MAXIMUM(maximum_difference, pixel_difference);
+               if(pixel_difference > options->tolerance)
+               {
+                  differing_count++;
+               }
+            }
+
+            double allowed = HEADLESS_REGRESSION_DIFFERING_FRACTION * (double)(bitmap.width * bitmap.height);
+            if((double)differing_count > allowed)
+            {
+               image_status = "FAILED";
+               image_failed = true;
+            }
+         }
+
+         if(reference)
+         {
+            linux_deallocate(reference);
+         }
+      }
+
+      // NOTE(law): Measure throughput as the best frame of the run, which is
+      // far steadier than the mean on a busy machine. Progressive cases stop
+      // rendering once converged, so they are only checked for their image.
+      double mrays_per_second = 0;
+      if(!test->progressive)
+      {
+         for(u32 frame = 0; frame < options->warmup_count + options->frame_count; ++frame)
+         {
+            double frame_start = headless_get_seconds();
+            update(&bitmap, &input, queue, 0);
+            double frame_seconds = headless_get_seconds() - frame_start;
+
+            double ray_count = (double)bitmap.width * (double)bitmap.height;
+            if(renderer.adaptive_active)
+            {
+               ray_count += (double)renderer.adaptive_ray_count;
+            }
+            if(renderer.wavefront_active)
+            {
+               ray_count = (double)renderer.wavefront_ray_count;
+            }
+
+            if(frame >= options->warmup_count && frame_seconds > 0)
+            {
+               mrays_per_second = MAXIMUM(mrays_per_second, (ray_count / frame_seconds) / 1e6);
+            }
+         }
+      }
+
+      double baseline_mrays_per_second = 0;
+      for(u32 index = 0; index < baseline_count; ++index)
+      {
+         if(strcmp(baselines[index].name, test->name) == 0)
+         {
+            baseline_mrays_per_second = baselines[index].mrays_per_second;
+         }
+      }
+
+      bool timing_failed = false;
+      double change = 0;
+      if(mrays_per_second > 0 && baseline_mrays_per_second > 0)
+      {
+         change = (mrays_per_second / baseline_mrays_per_second) - 1.0;
+         timing_failed = (change < -maximum_slowdown);
+      }
+
+      if(baseline_file && mrays_per_second > 0)
+      {
+         fprintf(baseline_file, "%s %.3f\n", test->name, mrays_per_second);
+      }
+
+      if(image_failed || timing_failed)
+      {
+         failure_count++;
+      }
+
+      platform_log("%-14s  %-10s  %9u  %8u  %9.2f  %9.2f  %+7.1f%%%s\n", test->name, image_status,
+                   differing_count, maximum_difference, mrays_per_second, baseline_mrays_per_second,
+                   100.0 * change, (timing_failed) ? "  SLOWER" : "");
+   }
+
+   if(baseline_file)
+   {
+      fclose(baseline_file);
+   }
+
+   platform_log("\n");
+   platform_log("%u of %u regression cases failed (tolerance %u, max slowdown %.0f%%, %u threads).\n",
+                failure_count, (u32)ARRAY_LENGTH(headless_regression_cases), options->tolerance,
+                options->maximum_slowdown, options->thread_count);
+
+   bool result = (failure_count == 0);
+   return(result);
+}
+
+function bool
+headless_compile_scene(char *path)
+{
+   size_t size = compile_scene(0, 0);
+   void *memory = linux_allocate(size);
+   if(!memory)
+   {
+      return(false);
+   }
+   compile_scene(memory, size);
+
+   FILE *file = fopen(path, "wb");
+   if(!file)
+   {
+      platform_log("ERROR: Failed to open %s for writing.\n", path);
+      return(false);
+   }
+
+   bool result = (fwrite(memory, 1, size, file) == size);
+   result = (fclose(file) == 0) && result;
+
+   if(result)
+   {
+      platform_log("Compiled %u planes, %u primitives and %u BVH nodes into %s (%zu bytes).\n",
+                   scene.planes.count, scene.primitive_count, scene.bvh.node_count, path, size);
+   }
+   else
+   {
+      platform_log("ERROR: Failed to write %s.\n", path);
+   }
+
+   linux_deallocate(memory);
+
+   return(result);
+}
+
+function void
+headless_print_usage(char *program)
+{
+   platform_log("Usage: %s [options]\n", program);
+   platform_log("  --width <pixels>      Render width (default %u).\n", RESOLUTION_BASE_WIDTH);
+   platform_log("  --height <pixels>     Render height (default %u).\n", RESOLUTION_BASE_HEIGHT);
+   platform_log("  --frames <count>      Measured frames per run (default 100).\n");
+   platform_log("  --warmup <count>      Unmeasured frames before each run (default 10).\n");
+   platform_log("  --threads <count>     Maximum thread count, including the main thread (default: all usable CPUs).\n");
+   platform_log("  --workers <count>     Same as --threads <count + 1> (or set RAW_WORKERS).\n");
+   platform_log("  --cpus <list>         Pin threads to the given CPUs, e.g. 0-3,8 (or set RAW_CPUS).\n");
+   platform_log("  --no-smt              Pin threads to one hardware thread per core (or set RAW_NO_SMT=1).\n");
+   platform_log("  --numa                Pin threads across NUMA nodes and keep tiles on their node (or set RAW_NUMA=1).\n");
+   platform_log("  --scene <path>        Load a text or compiled scene instead of the default one (or set RAW_SCENE).\n");
+   platform_log("  --primitives <count>  Add a field of bounded primitives to the scene (default 0).\n");
+   platform_log("  --compile-scene <path> Write the scene in compiled form to <path> instead of rendering.\n");
+   platform_log("  --max-planes <count>  Planes a runtime scene can hold (default %u, or set RAW_MAX_PLANES).\n",
+                SCENE_DEFAULT_PLANE_CAPACITY);
+   platform_log("  --max-primitives <n>  Bounded primitives a runtime scene can hold (default %u, or set RAW_MAX_PRIMITIVES).\n",
+                SCENE_DEFAULT_PRIMITIVE_CAPACITY);
+   platform_log("  --frame-memory <MB>   Size of the per-frame scratch arena (default %u, or set RAW_FRAME_MEMORY).\n",
+                FRAME_ARENA_DEFAULT_SIZE / (1024 * 1024));
+   platform_log("  --tile-size <WxH>     Tile size in pixels, width rounded up to a cache line (default %ux%u).\n",
+                TILE_DEFAULT_WIDTH, TILE_DEFAULT_HEIGHT);
+   platform_log("  --tile-order <name>   Tile dispatch order: row-major, morton, hilbert or spiral (default row-major).\n");
+   platform_log("  --format <name>       Bitmap format: bgra8, rgba16f or rgba32f (default bgra8).\n");
+   platform_log("  --output <name>       Output transform: linear, srgb or tone-map (default linear).\n");
+   platform_log("  --sweep               Measure every thread count from 1 up to --threads.\n");
+   platform_log("  --json <path>         Also write the results as JSON.\n");
+   platform_log("  --trace <path>        Write a Chrome trace of the last frames (or set RAW_TRACE).\n");
+   platform_log("  --pace <fps>          Pace --frames frames with the frame pacer at the given rate and report its jitter.\n");
+   platform_log("  --adaptive <budget>   Refine edges with up to <budget> extra rays per pixel per frame (default 0, off).\n");
+   platform_log("  --reproject           Reuse the previous frame's primary hits where they reproject cleanly.\n");
+   platform_log("  --turn                Turn the camera as if holding the right arrow at 60 fps.\n");
+   platform_log("  --bounces <count>     Trace shadows and up to <count> reflection bounces, at most %u (default 0, off).\n",
+                WAVEFRONT_MAX_BOUNCE_COUNT);
+   platform_log("  --record <path>       Write the measured frames to <path>, or to stdout for - (or set RAW_RECORD).\n");
+   platform_log("  --record-format <name> Recorded frame format: y4m, ppm or bgra (default y4m).\n");
+   platform_log("  --record-ring <count> Bitmaps queued for the output thread before rendering waits (default %u).\n",
+                LINUX_OUTPUT_DEFAULT_RING_COUNT);
+   platform_log("  --record-drop         Drop frames instead of waiting when the output ring is full.\n");
+   platform_log("  --record-fps <rate>   Frame rate stored in Y4M stream headers (default %u).\n",
+                LINUX_OUTPUT_DEFAULT_FPS);
+   platform_log("  --publish <name>      Publish the measured frames to the shared frame ring <name> (or set RAW_PUBLISH).\n");
+   platform_log("  --queue-benchmark     Compare the work-stealing queue against the old shared ring instead of rendering.\n");
+   platform_log("  --job-iterations <n>  ALU iterations per synthetic queue benchmark job (default 2000).\n");
+   platform_log("  --rounds <count>      Rounds of jobs per queue benchmark run (default 200).\n");
+   platform_log("  --regress <dir>       Render the regression cases and compare them with the reference images in <dir>.\n");
+   platform_log("  --update-references   Write the regression cases' images to the --regress directory instead.\n");
+   platform_log("  --tolerance <levels>  Per-channel difference a regression pixel may have (default %u).\n",
+                HEADLESS_REGRESSION_DEFAULT_TOLERANCE);
+   platform_log("  --baseline <path>     Compare the regression cases' throughput with this machine's baseline file.\n");
+   platform_log("  --update-baseline     Write the measured throughput to the --baseline file instead.\n");
+   platform_log("  --max-slowdown <pct>  Throughput loss against the baseline that fails a case (default %.0f).\n",
+                HEADLESS_REGRESSION_DEFAULT_SLOWDOWN);
+}
+
+function double
+headless_get_thread_cpu_seconds(void)
+{
+   struct timespec count;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &count);
+
+   double result = (double)count.tv_sec + ((double)count.tv_nsec / 1e9);
+   return(result);
+}
+
+function void
+headless_benchmark_pacing(struct headless_options *options, struct render_bitmap *bitmap,
+                          struct platform_work_queue *queue)
+{
+   // NOTE(law): Render frames at a fixed rate through the same pacer as the
+   // windowed build, and measure how much of the main thread's CPU time the
+   // waits cost.
+   struct user_input input = {0};
+   input.right = options->turn;
+
+   struct linux_frame_pacer pacer;
+   linux_initialize_pacer(&pacer, 1.0f / options->pacing_fps);
+
+   double wait_cpu_seconds = 0;
+   double wait_wall_seconds = 0;
+
+   for(u32 index = 0; index < options->frame_count; ++index)
+   {
+      struct render_bitmap *target = headless_get_frame_bitmap(bitmap);
+      update(target, &input, queue, 1.0f / options->pacing_fps);
+      headless_finish_frame(bitmap, target);
+
+      double cpu_start = headless_get_thread_cpu_seconds();
+      double wall_start = headless_get_seconds();
+      linux_wait_for_next_frame(&pacer);
+      wait_cpu_seconds += headless_get_thread_cpu_seconds() - cpu_start;
+      wait_wall_seconds += headless_get_seconds() - wall_start;
+   }
+
+   platform_log("\n");
+   platform_log("Paced %u frames at %.1f fps, %ux%u\n", options->frame_count, options->pacing_fps,
+                bitmap->width, bitmap->height);
+   linux_log_pacer_statistics(&pacer);
+   platform_log("Waiting took %.1fms of CPU time over %.1fms (%.1f%% busy)\n",
+                wait_cpu_seconds * 1000.0, wait_wall_seconds * 1000.0,
+                (wait_wall_seconds > 0) ? 100.0 * wait_cpu_seconds / wait_wall_seconds : 0.0);
+}
+
+function bool
+headless_parse_options(struct headless_options *options, int argument_count, char **arguments)
+{
+   for(int index = 1; index < argument_count; ++index)
+   {
+      char *argument = arguments[index];
+      char *value = (index + 1 < argument_count) ? arguments[index + 1] : 0;
+
+      u32 consumed = linux_parse_placement_argument(&options->placement, argument, value);
+      if(!consumed)
+      {
+         consumed = linux_parse_memory_argument(&options->memory, argument, value);
+      }
+      if(!consumed)
+      {
+         consumed = linux_parse_output_argument(&options->output, argument, value);
+      }
+      if(consumed)
+      {
+         index += consumed - 1;
+         continue;
+      }
+
+      if(strcmp(argument, "--sweep") == 0)
+      {
+         options->sweep = true;
+         continue;
+      }
+      if(strcmp(argument, "--reproject") == 0)
+      {
+         options->reproject = true;
+         continue;
+      }
+      if(strcmp(argument, "--turn") == 0)
+      {
+         options->turn = true;
+         continue;
+      }
+      if(strcmp(argument, "--queue-benchmark") == 0)
+      {
+         options->queue_benchmark = true;
+         continue;
+      }
+      if(strcmp(argument, "--update-references") == 0)
+      {
+         options->update_references = true;
+         continue;
+      }
+      if(strcmp(argument, "--update-baseline") == 0)
+      {
+         options->update_baseline = true;
+         continue;
+      }
+
+      if(!value)
+      {
+         return(false);
+      }
+
+      if(strcmp(argument, "--width") == 0)        options->width = (u32)atoi(value);
+      else if(strcmp(argument, "--height") == 0)  options->height = (u32)atoi(value);
+      else if(strcmp(argument, "--frames") == 0)  options->frame_count = (u32)atoi(value);
+      else if(strcmp(argument, "--warmup") == 0)  options->warmup_count = (u32)atoi(value);
+      else if(strcmp(argument, "--threads") == 0) options->thread_count = (u32)atoi(value);
+      else if(strcmp(argument, "--json") == 0)    options->json_path = value;
+      else if(strcmp(argument, "--trace") == 0)   options->trace_path = value;
+      else if(strcmp(argument, "--scene") == 0)   options->scene_path = value;
+      else if(strcmp(argument, "--compile-scene") == 0) options->compiled_scene_path = value;
+      else if(strcmp(argument, "--pace") == 0)    options->pacing_fps = (float)atof(value);
+      else if(strcmp(argument, "--adaptive") == 0) options->adaptive_sample_budget = (float)atof(value);
+      else if(strcmp(argument, "--bounces") == 0) options->bounce_count = (u32)atoi(value);
+      else if(strcmp(argument, "--publish") == 0) options->publish_name = value;
+      else if(strcmp(argument, "--primitives") == 0) options->primitive_count = (u32)atoi(value);
+      else if(strcmp(argument, "--job-iterations") == 0) options->job_iterations = (u32)atoi(value);
+      else if(strcmp(argument, "--rounds") == 0) options->round_count = (u32)atoi(value);
+      else if(strcmp(argument, "--regress") == 0) options->regression_path = value;
+      else if(strcmp(argument, "--baseline") == 0) options->baseline_path = value;
+      else if(strcmp(argument, "--tolerance") == 0) options->tolerance = (u32)atoi(value);
+      else if(strcmp(argument, "--max-slowdown") == 0) options->maximum_slowdown = (float)atof(value);
+      else if(strcmp(argument, "--tile-size") == 0)
+      {
+         if(sscanf(value, "%ux%u", &options->tile_width, &options->tile_height) != 2)
+         {
+            return(false);
+         }
+      }
+      else if(strcmp(argument, "--tile-order") == 0)
+      {
+         u32 order = 0;
+         while(order < TILE_ORDER_COUNT && strcmp(value, tile_order_names[order]) != 0)
+         {
+            order++;
+         }
+         if(order == TILE_ORDER_COUNT)
+         {
+            return(false);
+         }
+         options->tile_order = order;
+      }
+      else if(strcmp(argument, "--format") == 0)
+      {
+         u32 format = 0;
+         while(format < RENDER_FORMAT_COUNT && strcmp(value, render_format_names[format]) != 0)
+         {
+            format++;
+         }
+         if(format == RENDER_FORMAT_COUNT)
+         {
+            return(false);
+         }
+         options->format = format;
+      }
+      else if(strcmp(argument, "--output") == 0)
+      {
+         u32 transform = 0;
+         while(transform < OUTPUT_TRANSFORM_COUNT && strcmp(value, output_transform_names[transform]) != 0)
+         {
+            transform++;
+         }
+         if(transform == OUTPUT_TRANSFORM_COUNT)
+         {
+            return(false);
+         }
+         options->output_transform = transform;
+      }
+      else return(false);
+
+      index++;
+   }
+
+   bool result = (options->width && options->height && options->frame_count &&
+                  options->bounce_count <= WAVEFRONT_MAX_BOUNCE_COUNT);
+   if((options->update_references || options->baseline_path) && !options->regression_path)
+   {
+      result = false;
+   }
+   return(result);
+}
+
+int
+main(int argument_count, char **arguments)
+{
+   struct headless_options options = {0};
+   options.width = RESOLUTION_BASE_WIDTH;
+   options.height = RESOLUTION_BASE_HEIGHT;
+   options.frame_count = 100;
+   options.warmup_count = 10;
+   options.job_iterations = 2000;
+   options.round_count = 200;
+   options.tile_width = TILE_DEFAULT_WIDTH;
+   options.tile_height = TILE_DEFAULT_HEIGHT;
+   options.tolerance = HEADLESS_REGRESSION_DEFAULT_TOLERANCE;
+   options.maximum_slowdown = HEADLESS_REGRESSION_DEFAULT_SLOWDOWN;
+   options.trace_path = linux_get_trace_path(argument_count, arguments);
+   options.scene_path = linux_get_scene_path(argument_count, arguments);
+   options.publish_name = linux_get_publish_name(0, 0);
+
+   // NOTE(law): Only read the environment here, the placement and memory
+   // arguments are parsed along with everything else.
+   linux_get_placement_options(&options.placement, 0, 0);
+   linux_get_memory_options(&options.memory, 0, 0);
+   linux_get_output_options(&options.output, 0, 0);
+
+   if(!headless_parse_options(&options, argument_count, arguments))
+   {
+      headless_print_usage(arguments[0]);
+      return(1);
+   }
+
+   if(options.placement.worker_count)
+   {
+      options.thread_count = options.placement.worker_count + 1;
+   }
+
+   struct linux_thread_placement placement;
+   u32 worker_count;
+   if(!linux_initialize_placement(&placement, &options.placement, &worker_count))
+   {
+      return(1);
+   }
+
+   if(!options.thread_count)
+   {
+      options.thread_count = worker_count + 1;
+   }
+
+   // NOTE(law): Build the list of thread counts to measure. Worker threads can
+   // only be added, never removed, so the counts must be ascending.
+   u32 thread_counts[HEADLESS_MAX_RUNS];
+   u32 run_count = 0;
+
+   if(options.sweep)
+   {
+      for(u32 count = 1; count <= options.thread_count && run_count < HEADLESS_MAX_RUNS; ++count)
+      {
+         thread_counts[run_count++] = count;
+      }
+   }
+   else
+   {
+      thread_counts[run_count++] = 1;
+      if(options.thread_count > 1)
+      {
+         thread_counts[run_count++] = options.thread_count;
+      }
+   }
+
+   if(options.queue_benchmark)
+   {
+      bool result = headless_benchmark_queues(&options, thread_counts, run_count);
+      return(result ? 0 : 1);
+   }
+
+   if(options.trace_path)
+   {
+      profile_initialize();
+   }
+
+   // NOTE(law): Rebuild the placement for the final thread count, so that only
+   // nodes that will have threads on them are handed work.
+   options.placement.worker_count = options.thread_count - 1;
+   linux_initialize_placement(&placement, &options.placement, &worker_count);
+   linux_log_placement(&placement, worker_count);
+
+   struct platform_work_queue queue = {0};
+   linux_initialize_queue(&queue, &placement);
+
+   struct render_bitmap bitmap = {options.width, options.height};
+   bitmap.format = options.format;
+
+   size_t bytes_per_pixel = get_render_format_bytes_per_pixel(bitmap.format);
+   size_t bitmap_size = bitmap.width * bitmap.height * bytes_per_pixel;
+   bitmap.memory = linux_allocate(bitmap_size);
+   if(!bitmap.memory)
+   {
+      return(1);
+   }
+   linux_first_touch_bitmap(&queue, &bitmap);
+
+   // NOTE(law): Unless told otherwise, make room for the primitive field on top
+   // of whatever the scene itself may need.
+   if(options.primitive_count && !options.memory.primitive_capacity)
+   {
+      options.memory.primitive_capacity = SCENE_DEFAULT_PRIMITIVE_CAPACITY + options.primitive_count;
+   }
+
+   if(!linux_initialize_memory(&options.memory))
+   {
+      return(1);
+   }
+
+   if(options.scene_path)
+   {
+      if(!load_scene(options.scene_path))
+      {
+         return(1);
+      }
+   }
+   else
+   {
+      reset_scene();
+   }
+
+   if(options.primitive_count)
+   {
+      if(scene.file_memory)
+      {
+         platform_log("ERROR: Compiled scenes cannot be added to, so --primitives needs a text scene.\n");
+         return(1);
+      }
+      if(scene.primitive_capacity - scene.primitive_count < options.primitive_count)
+      {
+         platform_log("ERROR: --primitives %u does not fit in --max-primitives %u.\n",
+                      options.primitive_count, scene.primitive_capacity);
+         return(1);
+      }
+      headless_add_primitive_field(options.primitive_count);
+   }
+
+   if(options.compiled_scene_path)
+   {
+      bool result = headless_compile_scene(options.compiled_scene_path);
+      return(result ? 0 : 1);
+   }
+
+   set_tile_size(options.tile_width, options.tile_height);
+   renderer.tile_order = options.tile_order;
+   renderer.output_transform = options.output_transform;
+   configure_adaptive_sampling(options.adaptive_sample_budget);
+   renderer.reprojection_enabled = options.reproject;
+   renderer.bounce_count = options.bounce_count;
+
+   double *frame_seconds = linux_allocate(options.frame_count * sizeof(double));
+   if(!frame_seconds)
+   {
+      return(1);
+   }
+
+   if(options.regression_path)
+   {
+      for(u32 index = 1; index < options.thread_count; ++index)
+      {
+         linux_launch_worker(&queue);
+      }
+
+      bool result = headless_run_regression(&options, &queue);
+      return(result ? 0 : 1);
+   }
+
+   if(options.output.path)
+   {
+      if(bitmap.format != RENDER_FORMAT_BGRA8)
+      {
+         platform_log("ERROR: --record needs --format bgra8.\n");
+         return(1);
+      }
+
+      headless_output = linux_allocate(sizeof(struct linux_output_sink));
+      if(!headless_output || !linux_open_output(headless_output, &options.output, bitmap.width, bitmap.height))
+      {
+         return(1);
+      }
+
+      for(u32 index = 0; index < headless_output->ring_count; ++index)
+      {
+         linux_first_touch_bitmap(&queue, headless_output->bitmaps + index);
+      }
+   }
+
+   if(options.publish_name)
+   {
+      headless_publisher = linux_allocate(sizeof(struct linux_shared_frames));
+      if(!headless_publisher ||
+         !linux_create_shared_frames(headless_publisher, options.publish_name, bitmap.width, bitmap.height, bitmap.format))
+      {
+         return(1);
+      }
+   }
+
+   if(options.pacing_fps > 0)
+   {
+      for(u32 index = 1; index < options.thread_count; ++index)
+      {
+         linux_launch_worker(&queue);
+      }
+
+      headless_benchmark_pacing(&options, &bitmap, &queue);
+      headless_close_outputs();
+      return(0);
+   }
+
+   struct headless_run runs[HEADLESS_MAX_RUNS] = {0};
+
+   u32 active_thread_count = 1;
+   for(u32 run_index = 0; run_index < run_count; ++run_index)
+   {
+      struct headless_run *run = runs + run_index;
+      run->thread_count = thread_counts[run_index];
+
+      // NOTE(law): The main thread participates in platform_complete_queue(),
+      // so a run with N threads launches N - 1 workers.
+      while(active_thread_count < run->thread_count)
+      {
+         linux_launch_worker(&queue);
+         active_thread_count++;
+      }
+
+      headless_render(run, &options, &bitmap, &queue, frame_seconds);
+
+      // NOTE(law): The first run always uses a single thread.
+      double linear_mrays_per_second = runs[0].mrays_per_second * (double)run->thread_count;
+      run->scaling_efficiency = run->mrays_per_second / linear_mrays_per_second;
+   }
+
+   headless_close_outputs();
+
+   platform_log("\n");
+   platform_log("Resolution: %ux%u, %u frames (+%u warmup), %u-wide lanes, %u extra primitives\n",
+                options.width, options.height, options.frame_count, options.warmup_count, LANE_WIDTH,
+                options.primitive_count);
+   platform_log("Tiles: %ux%u, %s order\n",
+                renderer.tile_width, renderer.tile_height, tile_order_names[renderer.tile_order]);
+   platform_log("Output: %s, %s\n",
+                render_format_names[bitmap.format], output_transform_names[renderer.output_transform]);
+   if(renderer.adaptive_enabled)
+   {
+      double pixel_count = (double)options.width * (double)options.height;
+      platform_log("Adaptive sampling: %u edge pixels, %.0f extra rays per frame (%.2f per pixel, budget %.2f)\n",
+                   renderer.adaptive_edge_count, runs[run_count - 1].adaptive_rays_per_frame,
+                   runs[run_count - 1].adaptive_rays_per_frame / pixel_count, options.adaptive_sample_budget);
+   }
+   if(renderer.bounce_count)
+   {
+      platform_log("Secondary rays: %.0f per frame, up to %u reflection bounces\n",
+                   runs[run_count - 1].secondary_rays_per_frame, renderer.bounce_count);
+   }
+   if(renderer.reprojection_enabled)
+   {
+      platform_log("Reprojection: %.1f%% of pixels reused per frame%s\n",
+                   100.0 * runs[run_count - 1].reused_fraction, (options.turn) ? ", turning" : "");
+   }
+   platform_log("threads   Mrays/s  efficiency   mean ms    p50 ms    p90 ms    p99 ms    max ms\n");
+
+   for(u32 run_index = 0; run_index < run_count; ++run_index)
+   {
+      struct headless_run *run = runs + run_index;
+      platform_log("%7u  %8.2f  %9.1f%%  %8.3f  %8.3f  %8.3f  %8.3f  %8.3f\n",
+                   run->thread_count, run->mrays_per_second, 100.0 * run->scaling_efficiency,
+                   run->frame_ms_mean, run->frame_ms_p50, run->frame_ms_p90,
+                   run->frame_ms_p99, run->frame_ms_max);
+   }
+
+   if(options.json_path)
+   {
+      if(!headless_write_json(options.json_path, &options, runs, run_count))
+      {
+         return(1);
+      }
+   }
+
+   if(options.trace_path)
+   {
+      if(!profile_write_chrome_trace(options.trace_path))
+      {
+         return(1);
+      }
+   }
+
+   return(0);
+}
@@ -7,20 +7,44 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
-
-typedef HANDLE platform_semaphore;
+#include <stdlib.h>
 
 #include "raw.c"
 
+#define WIN32_CACHE_LINE_SIZE 64
+
+struct platform_work_queue
+{
+   // NOTE(law): read_index is contended by the workers, write_index and
+   // completion_target are only written by the producer, and completion_count
+   // is bumped by the workers. Each group gets its own cache line.
+   volatile u32 read_index;
+   u8 read_index_padding[WIN32_CACHE_LINE_SIZE - sizeof(u32)];
+
+   volatile u32 write_index;
+   volatile u32 completion_target;
+   u8 write_index_padding[WIN32_CACHE_LINE_SIZE - 2*sizeof(u32)];
+
+   volatile u32 completion_count;
+   u8 completion_count_padding[WIN32_CACHE_LINE_SIZE - sizeof(u32)];
+
+   HANDLE semaphore;
+   LONG semaphore_maximum;
+
+   struct queue_entry entries[512];
+};
+
 #define WIN32_SECONDS_ELAPSED(start, end) ((float)((end).QuadPart - (start).QuadPart) \
       / (float)win32_global_counts_per_second.QuadPart)
 
 #define WIN32_LOG_MAX_LENGTH 1024
+#define WIN32_FRAME_BITMAP_COUNT 2
 #define WIN32_DEFAULT_DPI 96
 
 global int win32_global_dpi = WIN32_DEFAULT_DPI;
 global bool win32_global_is_running;
 global LARGE_INTEGER win32_global_counts_per_second;
+global volatile LONG win32_global_thread_count;
 global BITMAPINFO *win32_global_bitmap_info;
 global struct render_bitmap *win32_global_bitmap;
 global WINDOWPLACEMENT win32_global_previous_window_placement =
@@ -47,7 +71,13 @@ function
 PLATFORM_ENQUEUE_WORK(platform_enqueue_work)
 {
    u32 new_write_index = (queue->write_index + 1) % ARRAY_LENGTH(queue->entries);
-   assert(new_write_index != queue->read_index);
+   if(new_write_index == queue->read_index)
+   {
+      // NOTE(law): The ring is full, so do the work on this thread instead of
+      // overwriting entries that have not been claimed yet.
+      callback(queue, data);
+      return;
+   }
 
    struct queue_entry *entry = queue->entries + queue->write_index;
    entry->data = data;
@@ -61,6 +91,62 @@ PLATFORM_ENQUEUE_WORK(platform_enqueue_work)
    ReleaseSemaphore(queue->semaphore, 1, 0);
 }
 
+function
+PLATFORM_ENQUEUE_WORK_BATCH(platform_enqueue_work_batch)
+{
+   u8 *entry_data = (u8 *)data;
+
+   u32 index = 0;
+   while(index < count)
+   {
+      u32 entry_count = ARRAY_LENGTH(queue->entries);
+      u32 write_index = queue->write_index;
+      u32 free_count = (queue->read_index + entry_count - write_index - 1) % entry_count;
+      u32 push_count = MINIMUM(count - index, free_count);
+
+      if(push_count == 0)
+      {
+         // NOTE(law): The ring is full. Do one job here while the workers make
+         // room, then try again.
+         callback(queue, entry_data + (index * data_stride));
+         index++;
+         continue;
+      }
+
+      for(u32 push_index = 0; push_index < push_count; ++push_index)
+      {
+         struct queue_entry *entry = queue->entries + ((write_index + push_index) % entry_count);
+         entry->data = entry_data + ((index + push_index) * data_stride);
+         entry->callback = callback;
+      }
+
+      queue->completion_target += push_count;
+
+      _WriteBarrier();
+
+      // NOTE(law): Publish the whole batch at once, then wake as many workers
+      // as there are new jobs. The release fails if it would push the count
+      // past the maximum, in which case enough threads are already signaled to
+      // drain the ring and one more wake is plenty.
+      queue->write_index = (write_index + push_count) % entry_count;
+
+      LONG release_count = MINIMUM((LONG)push_count, queue->semaphore_maximum);
+      if(!ReleaseSemaphore(queue->semaphore, release_count, 0))
+      {
+         ReleaseSemaphore(queue->semaphore, 1, 0);
+      }
+
+      index += push_count;
+   }
+}
+
+function
+PLATFORM_GET_QUEUE_NODE_COUNT(platform_get_queue_node_count)
+{
+   // NOTE(law): Threads are not placed on Windows, so there is only one node.
+   return(1);
+}
+
 function bool
 win32_dequeue_work(struct platform_work_queue *queue)
 {
@@ -89,6 +175,8 @@ win32_dequeue_work(struct platform_work_queue *queue)
 function
 PLATFORM_COMPLETE_QUEUE(platform_complete_queue)
 {
+   u64 profile_start = profile_begin();
+
    while(queue->completion_target > queue->completion_count)
    {
       win32_dequeue_work(queue);
@@ -96,6 +184,8 @@ PLATFORM_COMPLETE_QUEUE(platform_complete_queue)
 
    queue->completion_target = 0;
    queue->completion_count = 0;
+
+   profile_end(PROFILE_EVENT_COMPLETE_QUEUE, profile_start, 0, 0);
 }
 
 function DWORD WINAPI
@@ -104,11 +194,15 @@ win32_thread_procedure(void *parameter)
    struct platform_work_queue *queue = (struct platform_work_queue *)parameter;
    platform_log("Worker thread launched.\n");
 
+   profile_register_thread(InterlockedIncrement(&win32_global_thread_count));
+
    while(1)
    {
       if(win32_dequeue_work(queue))
       {
+         u64 profile_start = profile_begin();
          WaitForSingleObjectEx(queue->semaphore, INFINITE, FALSE);
+         profile_end(PROFILE_EVENT_QUEUE_WAIT, profile_start, 0, 0);
       }
    }
 
@@ -138,6 +232,71 @@ win32_deallocate(void *memory)
    }
 }
 
+function
+PLATFORM_ALLOCATE(platform_allocate)
+{
+   void *result = win32_allocate(size);
+   return(result);
+}
+
+function
+PLATFORM_DEALLOCATE(platform_deallocate)
+{
+   win32_deallocate(memory);
+}
+
+function
+PLATFORM_MAP_FILE(platform_map_file)
+{
+   void *result = 0;
+
+   HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+   if(file != INVALID_HANDLE_VALUE)
+   {
+      LARGE_INTEGER file_size;
+      if(GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+      {
+         // NOTE(law): The view keeps its own references to the mapping and the
+         // file, so both handles can be closed right away.
+         HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+         if(mapping)
+         {
+            result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if(result)
+            {
+               *size = (size_t)file_size.QuadPart;
+            }
+            CloseHandle(mapping);
+         }
+      }
+      CloseHandle(file);
+   }
+
+   return(result);
+}
+
+function
+PLATFORM_UNMAP_FILE(platform_unmap_file)
+{
+   if(!UnmapViewOfFile(memory))
+   {
+      platform_log("ERROR: Failed to unmap a file.\n");
+   }
+}
+
+function
+PLATFORM_TIMESTAMP(platform_timestamp)
+{
+   LARGE_INTEGER count;
+   QueryPerformanceCounter(&count);
+
+   u64 seconds = count.QuadPart / win32_global_counts_per_second.QuadPart;
+   u64 remainder = count.QuadPart % win32_global_counts_per_second.QuadPart;
+
+   u64 result = (seconds * 1000000000ull) + ((remainder * 1000000000ull) / win32_global_counts_per_second.QuadPart);
+   return(result);
+}
+
 function void
 win32_display_bitmap(struct render_bitmap bitmap, HWND window, HDC device_context)
 {
@@ -194,6 +353,10 @@ win32_display_bitmap(struct render_bitmap bitmap, HWND window, HDC device_contex
    int target_x = (int)gutter_width;
    int target_y = (int)(gutter_height + toolbar_height);
 
+   // NOTE(law): Dynamic resolution can change the bitmap size every frame.
+   win32_global_bitmap_info->bmiHeader.biWidth = bitmap.width;
+   win32_global_bitmap_info->bmiHeader.biHeight = (s32)bitmap.height;
+
    StretchDIBits(device_context,
                  target_x, target_y, (int)target_width, (int)target_height, // Destination
                  0, 0, bitmap.width, bitmap.height, // Source
@@ -539,10 +702,20 @@ WinMain(HINSTANCE instance, HINSTANCE previous_instance, LPSTR command_line, INT
    QueryPerformanceFrequency(&win32_global_counts_per_second);
    bool sleep_is_granular = (timeBeginPeriod(1) == TIMERR_NOERROR);
 
+   // NOTE(law): Profiling is enabled by pointing the RAW_TRACE environment
+   // variable at the trace file to write on exit.
+   char *trace_path = getenv("RAW_TRACE");
+   if(trace_path && trace_path[0])
+   {
+      profile_initialize();
+      profile_register_thread(0);
+   }
+
    u32 processor_count = win32_get_processor_count();
 
    struct platform_work_queue queue = {0};
    queue.semaphore = CreateSemaphoreExA(0, 0, processor_count, 0, 0, SEMAPHORE_ALL_ACCESS);
+   queue.semaphore_maximum = processor_count;
 
    for(u32 index = 1; index < processor_count; ++index)
    {
@@ -593,37 +766,83 @@ WinMain(HINSTANCE instance, HINSTANCE previous_instance, LPSTR command_line, INT
       return(1);
    }
 
-   // NOTE(law) Set up the rendering bitmap.
-   struct render_bitmap bitmap = {RESOLUTION_BASE_WIDTH, RESOLUTION_BASE_HEIGHT};
+   // NOTE(law) Set up the rendering bitmaps. Frames are pipelined: workers
+   // trace the next frame into one bitmap while the main thread presents the
+   // previous frame from the other.
+   struct render_bitmap bitmaps[WIN32_FRAME_BITMAP_COUNT];
+   u64 bitmap_input_timestamps[WIN32_FRAME_BITMAP_COUNT] = {0};
 
-   SIZE_T bytes_per_pixel = sizeof(u32);
-   SIZE_T bitmap_size = bitmap.width * bitmap.height * bytes_per_pixel;
-   bitmap.memory = win32_allocate(bitmap_size);
-   if(!bitmap.memory)
+   for(u32 index = 0; index < WIN32_FRAME_BITMAP_COUNT; ++index)
    {
-      return(1);
+      struct render_bitmap *bitmap = bitmaps + index;
+      bitmap->width = RESOLUTION_BASE_WIDTH;
+      bitmap->height = RESOLUTION_BASE_HEIGHT;
+      bitmap->allocated_width = RESOLUTION_BASE_WIDTH;
+      bitmap->allocated_height = RESOLUTION_BASE_HEIGHT;
+
+      // NOTE(law): StretchDIBits() only takes 8-bit channels.
+      bitmap->format = RENDER_FORMAT_BGRA8;
+
+      SIZE_T bytes_per_pixel = get_render_format_bytes_per_pixel(bitmap->format);
+      SIZE_T bitmap_size = bitmap->width * bitmap->height * bytes_per_pixel;
+      bitmap->memory = win32_allocate(bitmap_size);
+      if(!bitmap->memory)
+      {
+         return(1);
+      }
    }
 
    BITMAPINFOHEADER bitmap_header = {0};
    bitmap_header.biSize = sizeof(BITMAPINFOHEADER);
-   bitmap_header.biWidth = bitmap.width;
-   bitmap_header.biHeight = (s32)bitmap.height; // NOTE(law): Negative will indicate a top-down bitmap.
+   bitmap_header.biWidth = RESOLUTION_BASE_WIDTH;
+   bitmap_header.biHeight = RESOLUTION_BASE_HEIGHT; // NOTE(law): Negative will indicate a top-down bitmap.
    bitmap_header.biPlanes = 1;
    bitmap_header.biBitCount = 32;
    bitmap_header.biCompression = BI_RGB;
 
    BITMAPINFO bitmap_info = {bitmap_header};
 
-   win32_global_bitmap = &bitmap;
+   u32 present_index = 0;
+   bool has_presentable_frame = false;
+   float frame_latency_seconds = 0;
+   float worst_frame_latency_seconds = 0;
+
+   win32_global_bitmap = bitmaps + present_index;
    win32_global_bitmap_info = &bitmap_info;
 
    // NOTE(law): Display the created window.
    ShowWindow(window, show_command);
    UpdateWindow(window);
 
+   if(!initialize_memory(SCENE_DEFAULT_PLANE_CAPACITY, SCENE_DEFAULT_PRIMITIVE_CAPACITY, FRAME_ARENA_DEFAULT_SIZE))
+   {
+      return(1);
+   }
+
+   // NOTE(law): The RAW_SCENE environment variable can point at a text or
+   // compiled scene to load instead of the default one.
+   char *scene_path = getenv("RAW_SCENE");
+   if(scene_path && scene_path[0] && !load_scene(scene_path))
+   {
+      return(1);
+   }
+
    struct user_input input = {0};
 
+   // NOTE(law): Accumulate samples while the camera is still. F3 toggles it.
+   renderer.progressive_enabled = true;
+
+   // NOTE(law): Reuse primary hits while the camera moves. F7 toggles it.
+   renderer.reprojection_enabled = true;
+
+   // NOTE(law): Spend up to half a ray per pixel on edges. F5 toggles it.
+   configure_adaptive_sampling(0.5f);
+
    float target_seconds_per_frame = 1.0f / 60.0f;
+
+   // NOTE(law): Leave part of the frame for presenting and input. F4 toggles
+   // dynamic resolution.
+   configure_dynamic_resolution(0.8f * target_seconds_per_frame, 0.5f, 1.0f);
    float frame_seconds_elapsed = 0;
 
    LARGE_INTEGER frame_start_count;
@@ -668,12 +887,40 @@ WinMain(HINSTANCE instance, HINSTANCE previous_instance, LPSTR command_line, INT
       input.mouse_x = cursor_position.x;
       input.mouse_y = cursor_position.y;
 
-      update(&bitmap, &input, &queue, frame_seconds_elapsed);
+      // NOTE(law): Start tracing the next frame, then present the last
+      // completed one while the workers are busy. A frame is therefore shown
+      // one iteration after its input was sampled. When no new frame was
+      // needed (e.g. a converged progressive image), the last frame is shown
+      // again.
+      u32 render_index = (present_index + 1) % WIN32_FRAME_BITMAP_COUNT;
+      struct render_bitmap *render_bitmap = bitmaps + render_index;
+
+      u64 input_timestamp = platform_timestamp();
+      bool is_rendering = begin_frame(render_bitmap, &input, &queue, frame_seconds_elapsed);
 
-      // NOTE(law): Blit bitmap to screen.
-      HDC device_context = GetDC(window);
-      win32_display_bitmap(bitmap, window, device_context);
-      ReleaseDC(window, device_context);
+      if(has_presentable_frame)
+      {
+         u64 latency = platform_timestamp() - bitmap_input_timestamps[present_index];
+         frame_latency_seconds = (float)latency / 1e9f;
+         worst_frame_latency_seconds = MAXIMUM(worst_frame_latency_seconds, frame_latency_seconds);
+
+         // NOTE(law): Blit bitmap to screen.
+         u64 profile_start = profile_begin();
+         HDC device_context = GetDC(window);
+         win32_display_bitmap(bitmaps[present_index], window, device_context);
+         ReleaseDC(window, device_context);
+         profile_end(PROFILE_EVENT_DISPLAY, profile_start, 0, 0);
+      }
+
+      if(is_rendering)
+      {
+         end_frame(render_bitmap, &queue);
+
+         bitmap_input_timestamps[render_index] = input_timestamp;
+         present_index = render_index;
+         has_presentable_frame = true;
+         win32_global_bitmap = bitmaps + present_index;
+      }
 
       // NOTE(law): Calculate elapsed frame time.
       LARGE_INTEGER frame_end_count;
@@ -706,9 +953,19 @@ WinMain(HINSTANCE instance, HINSTANCE previous_instance, LPSTR command_line, INT
       if((frame_count++ % 30) == 0)
       {
          platform_log("Frame time: %0.03fms, ", frame_seconds_elapsed * 1000.0f);
-         platform_log("Sleep: %ums\n", sleep_ms);
+         platform_log("Sleep: %ums, ", sleep_ms);
+         platform_log("Scale: %.2f (%ux%u), ", renderer.resolution_scale,
+                      bitmaps[present_index].width, bitmaps[present_index].height);
+         platform_log("Latency: %0.03fms (worst %0.03fms)\n", frame_latency_seconds * 1000.0f,
+                      worst_frame_latency_seconds * 1000.0f);
+         worst_frame_latency_seconds = 0;
       }
    }
 
+   if(profiler.enabled)
+   {
+      profile_write_chrome_trace(trace_path);
+   }
+
    return(0);
 }
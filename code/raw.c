@@ -2,10 +2,14 @@
 /* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
 /* /////////////////////////////////////////////////////////////////////////// */
 
+#include <assert.h>
 #include <float.h>
+#include <stddef.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define RESOLUTION_BASE_WIDTH  320
 #define RESOLUTION_BASE_HEIGHT 240
@@ -17,14 +21,18 @@
 
 #define ARRAY_LENGTH(a) (sizeof(a) / sizeof((a)[0]))
 #define MINIMUM(a, b) ((a) < (b) ? (a) : (b))
+#define MAXIMUM(a, b) ((a) > (b) ? (a) : (b))
 #define LERP(a, t, b) (((1 - (t)) * (a)) + ((t) * (b)))
 
 typedef uint8_t  u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 typedef  int32_t s32;
 typedef  int64_t s64;
 
+#include "raw_simd.c"
+
 #define PLATFORM_LOG(name) void name(char *format, ...)
 function PLATFORM_LOG(platform_log);
 
@@ -39,28 +47,71 @@ struct queue_entry
    queue_callback *callback;
 };
 
-// NOTE(law): Each platform should typedef the appropriate platform-specific
-// semaphore type to platform_semaphore before #include'ing this file.
-
-struct platform_work_queue
-{
-   volatile u32 read_index;
-   volatile u32 write_index;
-
-   volatile u32 completion_target;
-   volatile u32 completion_count;
-
-   platform_semaphore semaphore;
-
-   struct queue_entry entries[512];
-};
+// NOTE(law): The layout of platform_work_queue is owned by each platform
+// layer. Platform-independent code only ever passes pointers to it through the
+// functions below.
 
 #define PLATFORM_ENQUEUE_WORK(name) void name(struct platform_work_queue *queue, void *data, queue_callback *callback)
 function PLATFORM_ENQUEUE_WORK(platform_enqueue_work);
 
+// NOTE(law): Enqueue count jobs at once, job n receiving data + n*data_stride.
+// Cheaper than count separate enqueues, since the platform can publish the
+// whole batch and wake its workers in one go. Platforms that split their
+// threads into nodes (e.g. one per NUMA node) only run the batch on threads of
+// the given node. Others ignore it.
+#define PLATFORM_ENQUEUE_WORK_BATCH(name) void name(struct platform_work_queue *queue, u32 node, void *data, \
+                                                    size_t data_stride, u32 count, queue_callback *callback)
+function PLATFORM_ENQUEUE_WORK_BATCH(platform_enqueue_work_batch);
+
+#define PLATFORM_GET_QUEUE_NODE_COUNT(name) u32 name(struct platform_work_queue *queue)
+function PLATFORM_GET_QUEUE_NODE_COUNT(platform_get_queue_node_count);
+
 #define PLATFORM_COMPLETE_QUEUE(name) void name(struct platform_work_queue *queue)
 function PLATFORM_COMPLETE_QUEUE(platform_complete_queue);
 
+#define PLATFORM_ALLOCATE(name) void *name(size_t size)
+function PLATFORM_ALLOCATE(platform_allocate);
+
+#define PLATFORM_DEALLOCATE(name) void name(void *memory)
+function PLATFORM_DEALLOCATE(platform_deallocate);
+
+// NOTE(law): Map a whole file into memory, read-only. Returns 0 if the file
+// cannot be opened, otherwise the mapping and its size. Mappings are at least
+// page-aligned.
+#define PLATFORM_MAP_FILE(name) void *name(char *path, size_t *size)
+function PLATFORM_MAP_FILE(platform_map_file);
+
+#define PLATFORM_UNMAP_FILE(name) void name(void *memory, size_t size)
+function PLATFORM_UNMAP_FILE(platform_unmap_file);
+
+// NOTE(law): Monotonic time in nanoseconds.
+#define PLATFORM_TIMESTAMP(name) u64 name(void)
+function PLATFORM_TIMESTAMP(platform_timestamp);
+
+#include "raw_profile.c"
+#include "raw_memory.c"
+
+// NOTE(law): The scene arena holds everything whose size follows the scene
+// (planes, materials, primitives and BVH nodes), and is reset along with it.
+// The frame arena holds everything that only lives for one frame (tile
+// descriptors, per-frame plane terms, adaptive sampling buffers, and scratch
+// for BVH builds), and is reset at the start of every frame.
+
+#define SCENE_DEFAULT_PLANE_CAPACITY 64
+#define SCENE_DEFAULT_PRIMITIVE_CAPACITY (64 * 1024)
+#define FRAME_ARENA_DEFAULT_SIZE (256 * 1024 * 1024)
+
+global struct
+{
+   bool is_initialized;
+
+   u32 plane_capacity;
+   u32 primitive_capacity;
+
+   struct memory_arena scene;
+   struct memory_arena frame;
+} arenas;
+
 function float sine(float turns)
 {
    float result = sinf(turns * TAU32);
@@ -288,12 +339,292 @@ function v3 transform3(v3 vector, matrix4 transform)
    return(result);
 }
 
+// NOTE(law): lane_v3 is the packet counterpart of v3: LANE_WIDTH vectors stored
+// as one lane_f32 per component, so it is 4 vectors wide on SSE2 builds and 8
+// on AVX2. Each operation performs the same float operations in the same order
+// as its scalar counterpart, so a lane of the result matches the scalar result
+// bit for bit. The exception is lane_noz3(), which trades the last couple of
+// bits for a reciprocal square root estimate.
+
+// NOTE(law): These are meant to be inlined. Functions that are not, like
+// trace_film_packet(), should take lane_v3 arguments by pointer. Passed by
+// value they go through the stack, which was measured to cost a third of
+// the frame time in the ray tracing loop.
+
+typedef union
+{
+   struct {lane_f32 x, y, z;};
+   struct {lane_f32 r, g, b;};
+} lane_v3;
+
+function lane_v3 lane_vec3(lane_f32 x, lane_f32 y, lane_f32 z)
+{
+   lane_v3 result;
+
+   result.x = x;
+   result.y = y;
+   result.z = z;
+
+   return(result);
+}
+
+function lane_v3 lane_v3_from_v3(v3 vector)
+{
+   lane_v3 result;
+
+   result.x = lane_f32_from_float(vector.x);
+   result.y = lane_f32_from_float(vector.y);
+   result.z = lane_f32_from_float(vector.z);
+
+   return(result);
+}
+
+function lane_v3 lane_v3_load(float *x, float *y, float *z)
+{
+   // NOTE(law): Loads LANE_WIDTH vectors from aligned structure-of-arrays
+   // storage.
+   lane_v3 result;
+
+   result.x = lane_f32_load(x);
+   result.y = lane_f32_load(y);
+   result.z = lane_f32_load(z);
+
+   return(result);
+}
+
+function lane_v3 lane_add3(lane_v3 a, lane_v3 b)
+{
+   a.x = lane_add(a.x, b.x);
+   a.y = lane_add(a.y, b.y);
+   a.z = lane_add(a.z, b.z);
+
+   return(a);
+}
+
+function lane_v3 lane_sub3(lane_v3 a, lane_v3 b)
+{
+   a.x = lane_sub(a.x, b.x);
+   a.y = lane_sub(a.y, b.y);
+   a.z = lane_sub(a.z, b.z);
+
+   return(a);
+}
+
+function lane_v3 lane_mul3(lane_v3 vector, lane_f32 value)
+{
+   vector.x = lane_mul(vector.x, value);
+   vector.y = lane_mul(vector.y, value);
+   vector.z = lane_mul(vector.z, value);
+
+   return(vector);
+}
+
+function lane_v3 lane_hadamard3(lane_v3 a, lane_v3 b)
+{
+   a.x = lane_mul(a.x, b.x);
+   a.y = lane_mul(a.y, b.y);
+   a.z = lane_mul(a.z, b.z);
+
+   return(a);
+}
+
+function lane_v3 lane_negate3(lane_v3 vector)
+{
+   lane_f32 zero = lane_f32_from_float(0.0f);
+
+   vector.x = lane_sub(zero, vector.x);
+   vector.y = lane_sub(zero, vector.y);
+   vector.z = lane_sub(zero, vector.z);
+
+   return(vector);
+}
+
+function lane_f32 lane_dot3(lane_v3 a, lane_v3 b)
+{
+   lane_f32 result = lane_add(lane_add(lane_mul(a.x, b.x), lane_mul(a.y, b.y)), lane_mul(a.z, b.z));
+   return(result);
+}
+
+function lane_v3 lane_cross3(lane_v3 a, lane_v3 b)
+{
+   lane_v3 result;
+
+   result.x = lane_sub(lane_mul(a.y, b.z), lane_mul(a.z, b.y));
+   result.y = lane_sub(lane_mul(a.z, b.x), lane_mul(a.x, b.z));
+   result.z = lane_sub(lane_mul(a.x, b.y), lane_mul(a.y, b.x));
+
+   return(result);
+}
+
+function lane_v3 lane_min3(lane_v3 a, lane_v3 b)
+{
+   a.x = lane_min(a.x, b.x);
+   a.y = lane_min(a.y, b.y);
+   a.z = lane_min(a.z, b.z);
+
+   return(a);
+}
+
+function lane_v3 lane_max3(lane_v3 a, lane_v3 b)
+{
+   a.x = lane_max(a.x, b.x);
+   a.y = lane_max(a.y, b.y);
+   a.z = lane_max(a.z, b.z);
+
+   return(a);
+}
+
+function lane_v3 lane_select3(lane_f32 mask, lane_v3 a, lane_v3 b)
+{
+   // NOTE(law): Like lane_select(), lanes with the mask set take b.
+   a.x = lane_select(mask, a.x, b.x);
+   a.y = lane_select(mask, a.y, b.y);
+   a.z = lane_select(mask, a.z, b.z);
+
+   return(a);
+}
+
+function lane_f32 lane_horizontal_min3(lane_v3 vector)
+{
+   lane_f32 result = lane_min(lane_min(vector.x, vector.y), vector.z);
+   return(result);
+}
+
+function lane_f32 lane_horizontal_max3(lane_v3 vector)
+{
+   lane_f32 result = lane_max(lane_max(vector.x, vector.y), vector.z);
+   return(result);
+}
+
+function lane_v3 lane_noz3(lane_v3 vector)
+{
+   // NOTE(law): Vectors too short to normalize come back as zero, like noz3().
+   lane_f32 epsilon_squared = lane_f32_from_float(square(0.0001f));
+   lane_f32 length_squared = lane_dot3(vector, vector);
+
+   lane_f32 length_mask = lane_greater(length_squared, epsilon_squared);
+   lane_f32 inverse_length = lane_and(lane_reciprocal_square_root(length_squared), length_mask);
+
+   lane_v3 result = lane_mul3(vector, inverse_length);
+   return(result);
+}
+
+function lane_v3 lane_transform3(lane_v3 vector, matrix4 transform)
+{
+   lane_v3 result;
+
+   lane_f32 m00 = lane_f32_from_float(transform.matrix[0][0]);
+   lane_f32 m01 = lane_f32_from_float(transform.matrix[0][1]);
+   lane_f32 m02 = lane_f32_from_float(transform.matrix[0][2]);
+   lane_f32 m10 = lane_f32_from_float(transform.matrix[1][0]);
+   lane_f32 m11 = lane_f32_from_float(transform.matrix[1][1]);
+   lane_f32 m12 = lane_f32_from_float(transform.matrix[1][2]);
+   lane_f32 m20 = lane_f32_from_float(transform.matrix[2][0]);
+   lane_f32 m21 = lane_f32_from_float(transform.matrix[2][1]);
+   lane_f32 m22 = lane_f32_from_float(transform.matrix[2][2]);
+
+   result.x = lane_add(lane_add(lane_mul(vector.x, m00), lane_mul(vector.y, m01)), lane_mul(vector.z, m02));
+   result.y = lane_add(lane_add(lane_mul(vector.x, m10), lane_mul(vector.y, m11)), lane_mul(vector.z, m12));
+   result.z = lane_add(lane_add(lane_mul(vector.x, m20), lane_mul(vector.y, m21)), lane_mul(vector.z, m22));
+
+   return(result);
+}
+
+function void transform3_array(v3 *destination, v3 *source, u32 count, matrix4 transform)
+{
+   // NOTE(law): Transform count vectors a lane group at a time. The vectors
+   // are stored as v3 arrays, so each group is transposed into lanes and back.
+   // destination may alias source.
+   for(u32 first = 0; first < count; first += LANE_WIDTH)
+   {
+      u32 group_count = MINIMUM(count - first, LANE_WIDTH);
+
+      LANE_ALIGNED float x[LANE_WIDTH] = {0};
+      LANE_ALIGNED float y[LANE_WIDTH] = {0};
+      LANE_ALIGNED float z[LANE_WIDTH] = {0};
+      for(u32 index = 0; index < group_count; ++index)
+      {
+         x[index] = source[first + index].x;
+         y[index] = source[first + index].y;
+         z[index] = source[first + index].z;
+      }
+
+      lane_v3 vectors = lane_transform3(lane_v3_load(x, y, z), transform);
+      lane_f32_store(x, vectors.x);
+      lane_f32_store(y, vectors.y);
+      lane_f32_store(z, vectors.z);
+
+      for(u32 index = 0; index < group_count; ++index)
+      {
+         destination[first + index] = vec3(x[index], y[index], z[index]);
+      }
+   }
+}
+
+enum render_format
+{
+   RENDER_FORMAT_BGRA8,
+   RENDER_FORMAT_RGBA16F,
+   RENDER_FORMAT_RGBA32F,
+
+   RENDER_FORMAT_COUNT,
+};
+
+global char *render_format_names[] =
+{
+   "bgra8",
+   "rgba16f",
+   "rgba32f",
+};
+
+function u32
+get_render_format_bytes_per_pixel(u32 format)
+{
+   u32 result = 4;
+   switch(format)
+   {
+      case RENDER_FORMAT_BGRA8:   {result = 4;} break;
+      case RENDER_FORMAT_RGBA16F: {result = 8;} break;
+      case RENDER_FORMAT_RGBA32F: {result = 16;} break;
+      default: {assert(!"Unhandled render format.");} break;
+   }
+   return(result);
+}
+
+enum output_transform
+{
+   OUTPUT_TRANSFORM_LINEAR,
+   OUTPUT_TRANSFORM_SRGB,
+   OUTPUT_TRANSFORM_TONE_MAP,
+
+   OUTPUT_TRANSFORM_COUNT,
+};
+
+global char *output_transform_names[] =
+{
+   "linear",
+   "srgb",
+   "tone-map",
+};
+
 struct render_bitmap
 {
    u32 width;
    u32 height;
 
-   u32 *memory;
+   // NOTE(law): Pixels are stored in one of the render formats. BGRA8 matches
+   // what the platforms display directly. The float formats keep values above
+   // 1 (unless an output transform maps them into range) and are laid out as
+   // RGBA, with alpha always 1.
+   void *memory;
+
+   // NOTE(law): The size the memory was allocated for. Dynamic resolution
+   // shrinks width and height below it and renders tightly packed rows into the
+   // same memory. Zero means the memory matches width and height.
+   u32 allocated_width;
+   u32 allocated_height;
+
+   u32 format;
 };
 
 struct user_input
@@ -321,17 +652,76 @@ struct user_input
    bool move_right;
 };
 
-struct plane
+struct ray_packet
 {
-   float distance;
-   v3 normal;
+   lane_v3 origin;
+   lane_v3 direction;
+
+   // NOTE(law): Reciprocal direction, used by the slab tests.
+   lane_v3 inverse;
+};
+
+struct hit_packet
+{
+   lane_f32 t;
+   lane_f32 mask;
+
+   lane_v3 normal;
+   lane_v3 color;
+
+   // NOTE(law): Identifies the surface that was hit: plane n is n + 1, bounded
+   // primitive n is -(n + 1) and the background is 0. Primitive numbers change
+   // whenever the BVH is rebuilt, so these are only comparable within a frame.
+   lane_f32 surface;
+};
+
+#include "raw_bvh.c"
+
+
+struct scene_planes
+{
+   // NOTE(law): Planes are stored as structure-of-arrays so the intersection
+   // loop only streams the fields it needs. Every array is lane-aligned and
+   // padded out to the lane width, and unused entries are left zeroed. A zero
+   // normal never passes the denominator test, so padding lanes can never
+   // produce a hit.
+
+   u32 count;
+   u32 capacity;
+
+   float *normal_x;
+   float *normal_y;
+   float *normal_z;
+   float *distance;
+
+   float *color_r;
+   float *color_g;
+   float *color_b;
+
+   float *reflectivity;
+};
+
+#define SCENE_MATERIAL_CAPACITY 256
+#define SCENE_MATERIAL_NAME_LENGTH 32
+
+struct material
+{
+   // NOTE(law): Materials are named colors and reflectivities. Primitives copy
+   // both when they are added, so the intersection loops never look them up.
+   // The table is only kept so compiled scenes can carry the names.
+   char name[SCENE_MATERIAL_NAME_LENGTH];
    v3 color;
+   float reflectivity;
 };
 
 global struct
 {
    bool is_initialized;
 
+   // NOTE(law): Set whenever the scene contents are replaced or added to, so
+   // that accumulated samples of the old scene are thrown away.
+   bool has_changed;
+
    // NOTE(law): Both camera-space and world-space are represented using
    // right-hand coordinate systems. The camera's y-axis points up relative to
    // its image. It's z-axis points away from the scene, into the camera.
@@ -344,149 +734,3312 @@ global struct
 
    float focal_length;
 
-   u32 plane_count;
-   struct plane planes[32];
-} scene;
+   u32 material_count;
+   struct material *materials;
 
-function void
-point_camera(v3 camera_position, v3 target_position, v3 up)
-{
-   scene.camera_position = camera_position;
+   struct scene_planes planes;
 
-   scene.camera_z = noz3(sub3(camera_position, target_position));
-   scene.camera_x = noz3(cross3(noz3(up), scene.camera_z));
-   scene.camera_y = cross3(scene.camera_z, scene.camera_x);
-}
+   // NOTE(law): Bounded primitives are reordered by the BVH build, so indices
+   // into this array are only stable until the next rebuild.
+   u32 primitive_count;
+   u32 primitive_capacity;
+   struct primitive *primitives;
+
+   bool bvh_is_dirty;
+   struct bvh bvh;
+
+   // NOTE(law): When the scene was loaded from a compiled file, the arrays
+   // above point into its mapping, which is read-only. Such a scene cannot be
+   // added to, only replaced.
+   void *file_memory;
+   size_t file_size;
+} scene;
 
 function void
-render_tile(struct render_bitmap *bitmap, u32 minx, u32 miny, u32 maxx, u32 maxy)
+add_plane(v3 normal, float distance, v3 color, float reflectivity)
 {
-   u32 bitmap_width  = bitmap->width;
-   u32 bitmap_height = bitmap->height;
+   struct scene_planes *planes = &scene.planes;
+   assert(planes->count < planes->capacity);
 
-   float aspect_ratio = (float)bitmap_width / (float)bitmap_height;
+   u32 index = planes->count++;
 
-   float film_width = 1.0f;
-   float film_height = 1.0f / aspect_ratio;
-   v3 film_center = sub3(scene.camera_position, mul3(scene.camera_z, scene.focal_length));
+   planes->normal_x[index] = normal.x;
+   planes->normal_y[index] = normal.y;
+   planes->normal_z[index] = normal.z;
+   planes->distance[index] = distance;
 
-   for(u32 y = miny; y < maxy; ++y)
-   {
-      float film_v = -1.0f + (2.0f * ((float)y / (float)bitmap_height));
+   planes->color_r[index] = color.r;
+   planes->color_g[index] = color.g;
+   planes->color_b[index] = color.b;
 
-      for(u32 x = minx; x < maxx; ++x)
-      {
-         float film_u = -1.0f + (2.0f * ((float)x / (float)bitmap_width));
+   planes->reflectivity[index] = MINIMUM(MAXIMUM(reflectivity, 0.0f), 1.0f);
 
-         v3 film_position = film_center;
-         film_position = add3(film_position, mul3(scene.camera_x, film_u * 0.5f * film_width));
-         film_position = add3(film_position, mul3(scene.camera_y, film_v * 0.5f * film_height));
+   scene.has_changed = true;
+}
 
-         v3 ray_direction = noz3(sub3(film_position, scene.camera_position));
+function struct primitive *
+add_primitive(u32 kind, v3 color, float reflectivity)
+{
+   assert(scene.primitive_count < scene.primitive_capacity);
 
-         float t_minimum = FLT_MAX;
-         struct plane *t_plane = 0;
-         for(u32 plane_index = 0; plane_index < scene.plane_count; ++plane_index)
-         {
-            struct plane *p = scene.planes + plane_index;
+   reflectivity = MINIMUM(MAXIMUM(reflectivity, 0.0f), 1.0f);
 
-            float denominator = dot3(p->normal, ray_direction);
-            if(absolute_value(denominator) > 0.0001f)
-            {
-               float t = (-p->distance - dot3(p->normal, scene.camera_position)) / denominator;
-               if(t > 0 && t < t_minimum)
-               {
-                  t_minimum = t;
-                  t_plane = p;
-               }
-            }
-         }
+   struct primitive *result = scene.primitives + scene.primitive_count++;
+   result->kind = (u16)kind;
+   result->reflectivity = (u16)((reflectivity * PRIMITIVE_REFLECTIVITY_ONE) + 0.5f);
+   result->color = color;
 
-         v3 ray_color = {0, 1, 1};
-         if(t_plane)
-         {
-            float t = dot3(ray_direction, mul3(t_plane->normal, -1.0f));
-            ray_color = lerp3(vec3(0.3f, 0.8f, 0.8f), t, t_plane->color);
-         }
+   scene.bvh_is_dirty = true;
+   scene.has_changed = true;
 
-         u8 r = (u8)(ray_color.r * 255.0f);
-         u8 g = (u8)(ray_color.g * 255.0f);
-         u8 b = (u8)(ray_color.b * 255.0f);
-         u8 a = 255;
+   return(result);
+}
 
-         bitmap->memory[(y * bitmap_width) + x] = (r << 16) | (g <<  8) | (b <<  0) | (a << 24);
-      }
-   }
+function void
+add_sphere(v3 center, float radius, v3 color, float reflectivity)
+{
+   struct primitive *sphere = add_primitive(PRIMITIVE_SPHERE, color, reflectivity);
+   sphere->sphere.center = center;
+   sphere->sphere.radius = radius;
 }
 
-struct tile_data
+function void
+add_box(v3 minimum, v3 maximum, v3 color, float reflectivity)
 {
-   struct render_bitmap *bitmap;
-   u32 minx;
-   u32 miny;
-   u32 maxx;
-   u32 maxy;
-};
+   struct primitive *box = add_primitive(PRIMITIVE_BOX, color, reflectivity);
+   box->box.minimum = minimum;
+   box->box.maximum = maximum;
+}
 
-function
-PLATFORM_QUEUE_CALLBACK(render_tile_callback)
+function void
+add_triangle(v3 a, v3 b, v3 c, v3 color, float reflectivity)
 {
-   struct tile_data *tile = (struct tile_data *)data;
-   render_tile(tile->bitmap, tile->minx, tile->miny, tile->maxx, tile->maxy);
+   struct primitive *triangle = add_primitive(PRIMITIVE_TRIANGLE, color, reflectivity);
+   triangle->triangle.vertex = a;
+   triangle->triangle.edge1 = sub3(b, a);
+   triangle->triangle.edge2 = sub3(c, a);
+   triangle->triangle.normal = noz3(cross3(triangle->triangle.edge1, triangle->triangle.edge2));
 }
 
 function void
-update(struct render_bitmap *bitmap, struct user_input *input,
-       struct platform_work_queue *queue, float frame_seconds_elapsed)
+point_camera(v3 camera_position, v3 target_position, v3 up)
 {
-   v3 initial_camera_position = {0, 15.0f, 1.5f};
-   v3 initial_target_position = {0, 0, 1.5f};
-   v3 initial_up = {0, 0, 1};
-   float initial_focal_length = 1.0f;
+   scene.camera_position = camera_position;
 
-   if(!scene.is_initialized)
-   {
-      point_camera(initial_camera_position, initial_target_position, initial_up);
-      scene.focal_length = initial_focal_length;
+   scene.camera_z = noz3(sub3(camera_position, target_position));
+   scene.camera_x = noz3(cross3(noz3(up), scene.camera_z));
+   scene.camera_y = cross3(scene.camera_z, scene.camera_x);
+}
+
+#define INITIAL_CAMERA_POSITION vec3(0, 15.0f, 1.5f)
+#define INITIAL_TARGET_POSITION vec3(0, 0, 1.5f)
+#define INITIAL_CAMERA_UP vec3(0, 0, 1)
+#define INITIAL_FOCAL_LENGTH 1.0f
+
+function size_t
+get_scene_arena_size(u32 plane_capacity, u32 primitive_capacity)
+{
+   // NOTE(law): Every array can lose up to one alignment's worth of padding.
+   size_t result = 8 * (LANE_PADDED_COUNT(plane_capacity) * sizeof(float) + LANE_ALIGNMENT);
+   result += SCENE_MATERIAL_CAPACITY * sizeof(struct material) + 16;
+   result += primitive_capacity * sizeof(struct primitive) + 16;
+   result += 2 * primitive_capacity * sizeof(struct bvh_node) + 16;
 
-      struct plane *p;
+   return(result);
+}
 
-      p = scene.planes + scene.plane_count++;
-      p->distance = 0;
-      p->normal = vec3(0, 0, 1);
-      p->color = vec3(0, 1, 0);
+function bool
+initialize_memory(u32 plane_capacity, u32 primitive_capacity, size_t frame_arena_size)
+{
+   // NOTE(law): Set how large a scene can be built at runtime and how much
+   // per-frame memory is available. Both arenas are allocated once, here, so
+   // rebuilding the scene or rendering a frame never goes back to the
+   // platform. Compiled scenes are mapped instead, and are not limited by
+   // these capacities.
 
-      p = scene.planes + scene.plane_count++;
-      p->distance = 0;
-      p->normal = vec3(0.1f, 0.1f, 1);
-      p->color = vec3(1, 0, 0);
+   release_arena(&arenas.scene);
+   release_arena(&arenas.frame);
 
-      p = scene.planes + scene.plane_count++;
-      p->distance = 0;
-      p->normal = vec3(-0.1f, 0.2f, 1);
-      p->color = vec3(0, 0, 1);
+   arenas.plane_capacity = MAXIMUM(plane_capacity, 1);
+   arenas.primitive_capacity = MAXIMUM(primitive_capacity, 1);
 
-      scene.is_initialized = true;
-   }
+   size_t scene_arena_size = get_scene_arena_size(arenas.plane_capacity, arenas.primitive_capacity);
 
-   // NOTE(law): Handle user input.
-   if(input->function_keys[1])
+   bool result = (initialize_arena(&arenas.scene, scene_arena_size) &&
+                  initialize_arena(&arenas.frame, frame_arena_size));
+   if(!result)
    {
-      // NOTE(law): Reset camera.
-      point_camera(initial_camera_position, initial_target_position, initial_up);
-      scene.focal_length = initial_focal_length;
+      platform_log("ERROR: Failed to allocate %zu bytes of scene memory and %zu bytes of frame memory.\n",
+                   scene_arena_size, frame_arena_size);
+      release_arena(&arenas.scene);
+      release_arena(&arenas.frame);
    }
-   else
-   {
-      if(input->control_scroll)
-      {
-         scene.focal_length += (input->scroll_delta * 0.25f);
-      }
 
-      float move_increment = 10.0f * frame_seconds_elapsed;
-      float turn_increment = 0.25f * frame_seconds_elapsed;
+   arenas.is_initialized = result;
 
-      if(input->move_up)
+   return(result);
+}
+
+function void
+clear_scene(void)
+{
+   // NOTE(law): Empty the scene and point it back at the scene arena,
+   // releasing any compiled scene it was using. The camera is left alone.
+   if(scene.file_memory)
+   {
+      platform_unmap_file(scene.file_memory, scene.file_size);
+      scene.file_memory = 0;
+      scene.file_size = 0;
+   }
+
+   if(!arenas.is_initialized)
+   {
+      bool initialized = initialize_memory(SCENE_DEFAULT_PLANE_CAPACITY, SCENE_DEFAULT_PRIMITIVE_CAPACITY,
+                                           FRAME_ARENA_DEFAULT_SIZE);
+      assert(initialized);
+   }
+
+   struct memory_arena *arena = &arenas.scene;
+   reset_arena(arena);
+
+   struct scene_planes *planes = &scene.planes;
+   planes->count = 0;
+   planes->capacity = arenas.plane_capacity;
+   planes->normal_x = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+   planes->normal_y = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+   planes->normal_z = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+   planes->distance = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+   planes->color_r = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+   planes->color_g = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+   planes->color_b = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+   planes->reflectivity = PUSH_LANE_ARRAY(arena, planes->capacity, float);
+
+   // NOTE(law): Padding lanes are read by the packet loops, so they must go
+   // back to zero when a larger scene is replaced.
+   size_t plane_array_size = LANE_PADDED_COUNT(planes->capacity) * sizeof(float);
+   memset(planes->normal_x, 0, plane_array_size);
+   memset(planes->normal_y, 0, plane_array_size);
+   memset(planes->normal_z, 0, plane_array_size);
+   memset(planes->distance, 0, plane_array_size);
+
+   scene.material_count = 0;
+   scene.materials = PUSH_ARRAY(arena, SCENE_MATERIAL_CAPACITY, struct material);
+
+   scene.primitive_count = 0;
+   scene.primitive_capacity = arenas.primitive_capacity;
+   scene.primitives = PUSH_ARRAY(arena, scene.primitive_capacity, struct primitive);
+
+   scene.bvh.node_count = 0;
+   scene.bvh.nodes = PUSH_ARRAY(arena, 2 * scene.primitive_capacity, struct bvh_node);
+   scene.bvh_is_dirty = true;
+
+   // NOTE(law): The arena is sized for exactly these arrays.
+   assert(scene.bvh.nodes);
+
+   scene.has_changed = true;
+   scene.is_initialized = true;
+}
+
+function void
+reset_scene(void)
+{
+   // NOTE(law): Replace the scene with the default one, viewed from the initial
+   // camera. Callers can add to it or move the camera before the next frame.
+   clear_scene();
+
+   point_camera(INITIAL_CAMERA_POSITION, INITIAL_TARGET_POSITION, INITIAL_CAMERA_UP);
+   scene.focal_length = INITIAL_FOCAL_LENGTH;
+
+   add_plane(vec3(0, 0, 1), 0, vec3(0, 1, 0), 0);
+   add_plane(vec3(0.1f, 0.1f, 1), 0, vec3(1, 0, 0), 0);
+   add_plane(vec3(-0.1f, 0.2f, 1), 0, vec3(0, 0, 1), 0);
+
+   add_sphere(vec3(0, 0, 1.5f), 1.5f, vec3(1, 1, 0), 0.5f);
+   add_sphere(vec3(-3.5f, -2.0f, 1.0f), 1.0f, vec3(1, 0, 1), 0);
+   add_box(vec3(2.0f, -1.0f, 0), vec3(4.0f, 1.0f, 2.0f), vec3(1, 1, 1), 0.25f);
+   add_triangle(vec3(-2.0f, -6.0f, 0), vec3(2.0f, -6.0f, 0), vec3(0, -6.0f, 4.0f), vec3(1, 0.5f, 0), 0);
+}
+
+#include "raw_scene.c"
+
+function void
+intersect_planes(struct scene_planes *planes, float *plane_numerators, u32 *plane_indices, u32 plane_count,
+                 struct ray_packet *ray, struct hit_packet *hit)
+{
+   // NOTE(law): The numerators depend only on the ray origin, which every ray
+   // in a frame shares, so the caller computes them once per frame. Only the
+   // given planes are tested, in the order given. Without an index list, the
+   // first plane_count planes are tested in scene order.
+
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_f32 denominator_epsilon = lane_f32_from_float(0.0001f);
+
+   for(u32 index = 0; index < plane_count; ++index)
+   {
+      u32 plane_index = (plane_indices) ? plane_indices[index] : index;
+
+      lane_v3 normal = lane_vec3(lane_f32_from_float(planes->normal_x[plane_index]),
+                                 lane_f32_from_float(planes->normal_y[plane_index]),
+                                 lane_f32_from_float(planes->normal_z[plane_index]));
+
+      lane_f32 denominator = lane_dot3(normal, ray->direction);
+
+      lane_f32 t = lane_div(lane_f32_from_float(plane_numerators[plane_index]), denominator);
+
+      lane_f32 mask = lane_greater(lane_absolute_value(denominator), denominator_epsilon);
+      mask = lane_and(mask, lane_greater(t, zero));
+      mask = lane_and(mask, lane_less(t, hit->t));
+
+      if(lane_any(mask))
+      {
+         hit->t = lane_select(mask, hit->t, t);
+         hit->mask = lane_or(hit->mask, mask);
+
+         lane_v3 color = lane_vec3(lane_f32_from_float(planes->color_r[plane_index]),
+                                   lane_f32_from_float(planes->color_g[plane_index]),
+                                   lane_f32_from_float(planes->color_b[plane_index]));
+
+         hit->normal = lane_select3(mask, hit->normal, normal);
+         hit->color = lane_select3(mask, hit->color, color);
+
+         hit->surface = lane_select(mask, hit->surface, lane_f32_from_float((float)(plane_index + 1)));
+      }
+   }
+}
+
+// NOTE(law): While the view is unchanged, progressive mode adds one jittered
+// sample per pixel per frame into a float accumulation buffer and displays the
+// running average. Rendering stops entirely once every pixel has
+// PROGRESSIVE_MAX_SAMPLE_COUNT samples.
+#define PROGRESSIVE_MAX_SAMPLE_COUNT 256
+
+struct camera_state
+{
+   v3 position;
+   v3 x;
+   v3 y;
+   v3 z;
+   float focal_length;
+};
+
+#define TILE_MAX_NODE_COUNT 64
+
+global struct
+{
+   u32 tile_width;
+   u32 tile_height;
+   u32 tile_order;
+
+   // NOTE(law): Per-frame tile descriptors, pushed onto the frame arena. When
+   // the work queue has several nodes, tiles are grouped by node, and node n's
+   // tiles start at tile_node_offsets[n].
+   struct tile_data *tiles;
+   u32 tile_node_count;
+   u32 tile_node_offsets[TILE_MAX_NODE_COUNT + 1];
+
+   // NOTE(law): Per-frame plane terms, see compute_plane_numerators().
+   float *plane_numerators;
+
+   // NOTE(law): Frames short of frame memory degrade the same way every time,
+   // so the shortage is only logged the first time.
+   bool frame_memory_exhausted;
+
+   bool progressive_enabled;
+   u32 sample_count;
+   float sample_jitter_x;
+   float sample_jitter_y;
+   struct camera_state accumulated_camera;
+
+   // NOTE(law): Accumulated color is stored as three planes of floats. Rows
+   // are padded out to whole lane groups and the planes are lane-aligned, so
+   // tiles (which always start on a lane boundary) use aligned loads.
+   u32 accumulation_width;
+   u32 accumulation_height;
+   u32 accumulation_stride;
+   size_t accumulation_capacity;
+   void *accumulation_memory;
+   float *accumulation_r;
+   float *accumulation_g;
+   float *accumulation_b;
+
+   // NOTE(law): Dynamic resolution scales both bitmap dimensions by
+   // resolution_scale, which is steered to keep the measured render time
+   // inside render_seconds_budget.
+   bool dynamic_resolution_enabled;
+   float resolution_scale;
+   float minimum_resolution_scale;
+   float maximum_resolution_scale;
+   float render_seconds_budget;
+   float smoothed_render_seconds;
+
+   // NOTE(law): Adaptive sampling follows the primary pass with a refinement
+   // pass over pixels that differ from a neighbor. adaptive_sample_budget is
+   // the number of extra rays allowed per frame, as a fraction of the pixel
+   // count. It is split between the edge pixels found in the last frame, as
+   // adaptive_sample_count rays for every adaptive_pixel_stride'th edge pixel.
+   bool adaptive_enabled;
+   bool adaptive_active;
+   float adaptive_sample_budget;
+   u32 adaptive_sample_count;
+   u32 adaptive_pixel_stride;
+   u32 adaptive_edge_count;
+   u32 adaptive_ray_count;
+   u32 *adaptive_colors;
+   u32 *adaptive_surfaces;
+
+   // NOTE(law): The primary samples at full precision, for the refinement pass
+   // to average with. adaptive_colors only serves to compare neighbors.
+   // Accumulating frames keep them in the accumulation planes instead.
+   float *adaptive_r;
+   float *adaptive_g;
+   float *adaptive_b;
+
+   // NOTE(law): Temporal reprojection. Every primary pass records each pixel's
+   // hit distance and tag (surface and age) into one of two cache buffers.
+   // When the next frame can reuse them, the previous frame's hits are
+   // scattered into reprojection_targets at their pixels in the new camera,
+   // and packets whose reprojected surfaces check out are only intersected
+   // against those surfaces instead of being traced.
+   bool reprojection_enabled;
+   bool reprojection_active;
+   bool reprojection_valid;
+   u32 reprojection_width;
+   u32 reprojection_height;
+   u32 reprojection_write_index;
+   u32 reprojection_frame_index;
+   u32 reprojection_reused_count;
+   size_t reprojection_capacity;
+   void *reprojection_memory;
+   float *reprojection_distances[2];
+   u32 *reprojection_tags[2];
+   u64 *reprojection_targets;
+   struct camera_state reprojection_camera;
+   float reprojection_jitter_x;
+   float reprojection_jitter_y;
+
+   // NOTE(law): Reflection bounces traced after the primary hit. Zero renders
+   // with the tile pass, anything else with the wavefront pipeline, which
+   // also traces shadow rays. wavefront_ray_count counts every ray the
+   // pipeline traced in the last frame, primary ones included.
+   u32 bounce_count;
+   bool wavefront_active;
+   u64 wavefront_ray_count;
+
+   // NOTE(law): Reuse only pays off when tracing a pixel costs more than
+   // moving its hit, so frames that could reuse hits are timed either way, in
+   // smoothed seconds per pixel, and the cheaper way is picked.
+   bool reprojection_eligible;
+   bool reprojection_probing;
+   float reprojection_reused_cost;
+   float reprojection_traced_cost;
+   u32 reprojection_probe_countdown;
+
+   // NOTE(law): Applied when writing pixels to the bitmap, after any
+   // accumulation, so it never affects the samples themselves.
+   u32 output_transform;
+
+   // NOTE(law): Timestamps carried from begin_frame() to end_frame().
+   // render_enqueued marks when begin_frame() had finished enqueueing, so the
+   // time the platform spends presenting before end_frame() can be left out.
+   u64 frame_profile_start;
+   u64 render_start;
+   u64 render_enqueued;
+} renderer;
+
+#define RESOLUTION_SCALE_STEP 0.05f
+
+// NOTE(law): The budget over the smoothed render time, up to which the scale
+// is left alone. 1.3 holds it while rendering takes 77% to 100% of the budget.
+#define RESOLUTION_SCALE_HEADROOM 1.3f
+
+function void
+configure_dynamic_resolution(float render_seconds_budget, float minimum_scale, float maximum_scale)
+{
+   // NOTE(law): The bitmap is never larger than its allocation, so scales are
+   // capped at 1.
+   minimum_scale = MINIMUM(MAXIMUM(minimum_scale, RESOLUTION_SCALE_STEP), 1.0f);
+   maximum_scale = MINIMUM(MAXIMUM(maximum_scale, minimum_scale), 1.0f);
+
+   renderer.dynamic_resolution_enabled = true;
+   renderer.render_seconds_budget = render_seconds_budget;
+   renderer.minimum_resolution_scale = minimum_scale;
+   renderer.maximum_resolution_scale = maximum_scale;
+   renderer.resolution_scale = maximum_scale;
+   renderer.smoothed_render_seconds = 0;
+}
+
+function void
+apply_resolution_scale(struct render_bitmap *bitmap)
+{
+   if(!bitmap->allocated_width || !bitmap->allocated_height)
+   {
+      bitmap->allocated_width = bitmap->width;
+      bitmap->allocated_height = bitmap->height;
+   }
+
+   float scale = (renderer.dynamic_resolution_enabled) ? renderer.resolution_scale : 1.0f;
+
+   bitmap->width = MAXIMUM((u32)((float)bitmap->allocated_width * scale + 0.5f), 1);
+   bitmap->height = MAXIMUM((u32)((float)bitmap->allocated_height * scale + 0.5f), 1);
+}
+
+function void
+update_resolution_scale(struct render_bitmap *bitmap, float render_seconds)
+{
+   // NOTE(law): Smooth the measured render time so that single slow frames do
+   // not cause a resolution change by themselves.
+   float smoothed = renderer.smoothed_render_seconds;
+   smoothed = (smoothed > 0) ? LERP(smoothed, 0.25f, render_seconds) : render_seconds;
+   renderer.smoothed_render_seconds = smoothed;
+
+   // NOTE(law): Render time is roughly proportional to pixel count, i.e. to the
+   // square of the scale. Only react when over budget or comfortably under it,
+   // below about 77% of it, so the scale does not hunt around the target
+   // every frame.
+   float ratio = renderer.render_seconds_budget / MAXIMUM(smoothed, 1e-6f);
+   if(ratio >= 1.0f && ratio <= RESOLUTION_SCALE_HEADROOM)
+   {
+      return;
+   }
+
+   float scale = renderer.resolution_scale;
+   float target_scale = scale * square_root(ratio);
+   target_scale = LERP(scale, 0.5f, target_scale);
+
+   // NOTE(law): Round away from the current scale, by at least one step.
+   // Rounding to the nearest step would cancel small overruns, and the hold
+   // band above is meant to be the only place the scale stays put.
+   s32 step = (s32)((scale / RESOLUTION_SCALE_STEP) + 0.5f);
+   float target_steps = target_scale / RESOLUTION_SCALE_STEP;
+   s32 target_step = (s32)target_steps;
+   if(ratio < 1.0f)
+   {
+      target_step = MINIMUM(target_step, step - 1);
+   }
+   else
+   {
+      target_step += ((float)target_step < target_steps) ? 1 : 0;
+      target_step = MAXIMUM(target_step, step + 1);
+   }
+   target_scale = RESOLUTION_SCALE_STEP * (float)target_step;
+   target_scale = MINIMUM(MAXIMUM(target_scale, renderer.minimum_resolution_scale), renderer.maximum_resolution_scale);
+
+   // NOTE(law): Growing the bitmap throws away any progressive samples, so
+   // never do it while a still image is accumulating.
+   bool is_accumulating = (renderer.progressive_enabled && renderer.sample_count > 1);
+   if(target_scale > scale && is_accumulating)
+   {
+      return;
+   }
+
+   if(target_scale != scale)
+   {
+      renderer.resolution_scale = target_scale;
+      renderer.smoothed_render_seconds = 0;
+
+      platform_log("Resolution scale: %.2f (%ux%u), render time %.2fms of %.2fms budget\n", target_scale,
+                   (u32)((float)bitmap->allocated_width * target_scale + 0.5f),
+                   (u32)((float)bitmap->allocated_height * target_scale + 0.5f),
+                   smoothed * 1000.0f, renderer.render_seconds_budget * 1000.0f);
+   }
+}
+
+#define ADAPTIVE_DEFAULT_SAMPLE_COUNT 4
+#define ADAPTIVE_MAX_SAMPLE_COUNT 16
+#define ADAPTIVE_COLOR_THRESHOLD 16 // NOTE(law): Per channel, out of 255.
+
+function void
+configure_adaptive_sampling(float sample_budget)
+{
+   // NOTE(law): A budget of 0.5 allows up to half a ray per pixel on top of the
+   // primary rays. Zero turns adaptive sampling off.
+   renderer.adaptive_enabled = (sample_budget > 0);
+   renderer.adaptive_sample_budget = MAXIMUM(sample_budget, 0.0f);
+   renderer.adaptive_sample_count = ADAPTIVE_DEFAULT_SAMPLE_COUNT;
+   renderer.adaptive_pixel_stride = 1;
+}
+
+function bool
+begin_adaptive_sampling(struct render_bitmap *bitmap)
+{
+   // NOTE(law): Returns whether this frame gets a refinement pass. Once a
+   // progressive image accumulates more than one sample, the jittered samples
+   // take care of the edges on their own.
+   bool result = (renderer.adaptive_enabled && renderer.adaptive_sample_budget > 0 &&
+                  (!renderer.progressive_enabled || renderer.sample_count <= 1));
+
+   if(result)
+   {
+      u32 pixel_count = bitmap->width * bitmap->height;
+      renderer.adaptive_colors = PUSH_ARRAY(&arenas.frame, pixel_count, u32);
+      renderer.adaptive_surfaces = PUSH_ARRAY(&arenas.frame, pixel_count, u32);
+
+      bool has_samples = true;
+      if(!renderer.progressive_enabled)
+      {
+         renderer.adaptive_r = PUSH_ARRAY(&arenas.frame, pixel_count, float);
+         renderer.adaptive_g = PUSH_ARRAY(&arenas.frame, pixel_count, float);
+         renderer.adaptive_b = PUSH_ARRAY(&arenas.frame, pixel_count, float);
+         has_samples = (renderer.adaptive_r && renderer.adaptive_g && renderer.adaptive_b);
+      }
+
+      if(!renderer.adaptive_colors || !renderer.adaptive_surfaces || !has_samples)
+      {
+         platform_log("ERROR: Not enough frame memory for adaptive sampling, disabling it.\n");
+         renderer.adaptive_enabled = false;
+         result = false;
+      }
+   }
+
+   renderer.adaptive_active = result;
+
+   return(result);
+}
+
+function float
+radical_inverse(u32 index, u32 base)
+{
+   float inverse_base = 1.0f / (float)base;
+   float fraction = inverse_base;
+
+   float result = 0.0f;
+   while(index > 0)
+   {
+      result += (float)(index % base) * fraction;
+      index /= base;
+      fraction *= inverse_base;
+   }
+
+   return(result);
+}
+
+function bool
+equal3(v3 a, v3 b)
+{
+   bool result = (a.x == b.x && a.y == b.y && a.z == b.z);
+   return(result);
+}
+
+function bool
+begin_progressive_sample(struct render_bitmap *bitmap, bool scene_changed)
+{
+   // NOTE(law): Returns whether a sample should be traced this frame.
+
+   struct camera_state camera;
+   camera.position = scene.camera_position;
+   camera.x = scene.camera_x;
+   camera.y = scene.camera_y;
+   camera.z = scene.camera_z;
+   camera.focal_length = scene.focal_length;
+
+   struct camera_state *previous = &renderer.accumulated_camera;
+   bool view_changed = (scene_changed ||
+                        bitmap->width != renderer.accumulation_width ||
+                        bitmap->height != renderer.accumulation_height ||
+                        !equal3(camera.position, previous->position) ||
+                        !equal3(camera.x, previous->x) ||
+                        !equal3(camera.y, previous->y) ||
+                        !equal3(camera.z, previous->z) ||
+                        camera.focal_length != previous->focal_length);
+
+   if(view_changed)
+   {
+      u32 stride = LANE_PADDED_COUNT(bitmap->width);
+      size_t plane_size = (size_t)stride * bitmap->height * sizeof(float);
+      size_t size = (3 * plane_size) + LANE_ALIGNMENT;
+
+      if(size > renderer.accumulation_capacity)
+      {
+         if(renderer.accumulation_memory)
+         {
+            platform_deallocate(renderer.accumulation_memory);
+         }
+
+         renderer.accumulation_memory = platform_allocate(size);
+         renderer.accumulation_capacity = (renderer.accumulation_memory) ? size : 0;
+         if(!renderer.accumulation_memory)
+         {
+            renderer.progressive_enabled = false;
+            return(true);
+         }
+      }
+
+      uintptr_t base = (uintptr_t)renderer.accumulation_memory;
+      base = (base + LANE_ALIGNMENT - 1) & ~(uintptr_t)(LANE_ALIGNMENT - 1);
+
+      renderer.accumulation_r = (float *)base;
+      renderer.accumulation_g = (float *)(base + plane_size);
+      renderer.accumulation_b = (float *)(base + 2*plane_size);
+
+      renderer.accumulation_width = bitmap->width;
+      renderer.accumulation_height = bitmap->height;
+      renderer.accumulation_stride = stride;
+      renderer.accumulated_camera = camera;
+      renderer.sample_count = 0;
+   }
+
+   if(renderer.sample_count >= PROGRESSIVE_MAX_SAMPLE_COUNT)
+   {
+      return(false);
+   }
+
+   // NOTE(law): Jitter the whole frame by a Halton (2, 3) offset, shifted so
+   // that the first sample lands on the same position as a non-progressive
+   // frame.
+   u32 sample_index = renderer.sample_count++;
+
+   float jitter_x = radical_inverse(sample_index, 2) + 0.5f;
+   float jitter_y = radical_inverse(sample_index, 3) + 0.5f;
+   renderer.sample_jitter_x = jitter_x - (float)(s32)jitter_x - 0.5f;
+   renderer.sample_jitter_y = jitter_y - (float)(s32)jitter_y - 0.5f;
+
+   return(true);
+}
+
+function void
+compute_plane_numerators(float *plane_numerators)
+{
+   // NOTE(law): The numerator of the plane intersection only depends on the
+   // camera position, so compute it once per frame for every plane, a lane
+   // group of planes at a time.
+   struct scene_planes *planes = &scene.planes;
+   u32 plane_group_count = LANE_PADDED_COUNT(planes->count);
+
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_v3 camera_position = lane_v3_from_v3(scene.camera_position);
+
+   for(u32 plane_index = 0; plane_index < plane_group_count; plane_index += LANE_WIDTH)
+   {
+      lane_v3 normal = lane_v3_load(planes->normal_x + plane_index,
+                                    planes->normal_y + plane_index,
+                                    planes->normal_z + plane_index);
+      lane_f32 distance = lane_f32_load(planes->distance + plane_index);
+
+      lane_f32 projection = lane_dot3(normal, camera_position);
+
+      lane_f32 numerator = lane_sub(lane_sub(zero, distance), projection);
+      lane_f32_store(plane_numerators + plane_index, numerator);
+   }
+}
+
+// NOTE(law): Corner rays are padded by this many pixels, since progressive
+// jitter and refinement subsamples each move a ray up to half a pixel away
+// from its pixel center.
+#define TILE_FRUSTUM_MARGIN 2.0f
+#define TILE_CANDIDATE_NODE_CAPACITY 32
+
+struct tile_candidates
+{
+   // NOTE(law): Everything a tile's rays can possibly hit: plane indices in
+   // scene order, and the roots of the BVH subtrees that overlap the tile's
+   // frustum. A single root of 0 means the whole hierarchy. When both lists
+   // are empty, every ray of the tile misses.
+   u32 plane_count;
+   u32 *planes;
+
+   u32 node_count;
+   u32 nodes[TILE_CANDIDATE_NODE_CAPACITY];
+};
+
+function void
+setup_tile_candidates(struct render_bitmap *bitmap, u32 minx, u32 miny, u32 maxx, u32 maxy,
+                      struct tile_candidates *candidates)
+{
+   // NOTE(law): Build the frustum spanned by the tile's corner rays, using the
+   // same film mapping as the pixel loops, and cull everything outside of it.
+   // candidates->planes must have room for every plane in the scene. When
+   // there was no memory for it, every plane is left as a candidate.
+
+   float width = (float)bitmap->width;
+   float height = (float)bitmap->height;
+
+   float film_width = 1.0f;
+   float film_height = 1.0f / (width / height);
+   v3 film_center = sub3(scene.camera_position, mul3(scene.camera_z, scene.focal_length));
+
+   float corner_x[2] = {(float)minx - TILE_FRUSTUM_MARGIN, (float)maxx + TILE_FRUSTUM_MARGIN};
+   float corner_y[2] = {(float)miny - TILE_FRUSTUM_MARGIN, (float)maxy + TILE_FRUSTUM_MARGIN};
+
+   // NOTE(law): Corners go around the tile, so neighbors span its sides.
+   u32 corner_order[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+
+   v3 corners[4];
+   v3 center = {0};
+   for(u32 corner = 0; corner < 4; ++corner)
+   {
+      float film_u = -1.0f + (2.0f * (corner_x[corner_order[corner][0]] / width));
+      float film_v = -1.0f + (2.0f * (corner_y[corner_order[corner][1]] / height));
+
+      v3 film = add3(add3(film_center, mul3(scene.camera_x, film_u * 0.5f * film_width)),
+                     mul3(scene.camera_y, film_v * 0.5f * film_height));
+
+      corners[corner] = sub3(film, scene.camera_position);
+      center = add3(center, corners[corner]);
+   }
+
+   // NOTE(law): A ray hits a plane when its denominator has the same sign as
+   // the plane's numerator. The denominator is linear in the direction, so over
+   // the frustum it ranges between its values at the corners.
+   struct scene_planes *planes = &scene.planes;
+
+   candidates->plane_count = 0;
+   if(!candidates->planes)
+   {
+      candidates->plane_count = planes->count;
+   }
+   else
+   {
+      for(u32 plane_index = 0; plane_index < planes->count; ++plane_index)
+      {
+         v3 normal = vec3(planes->normal_x[plane_index], planes->normal_y[plane_index], planes->normal_z[plane_index]);
+
+         float minimum = FLT_MAX;
+         float maximum = -FLT_MAX;
+         for(u32 corner = 0; corner < 4; ++corner)
+         {
+            float denominator = dot3(normal, corners[corner]);
+            minimum = MINIMUM(minimum, denominator);
+            maximum = MAXIMUM(maximum, denominator);
+         }
+
+         float numerator = renderer.plane_numerators[plane_index];
+         if((numerator > 0 && maximum > 0) || (numerator < 0 && minimum < 0))
+         {
+            candidates->planes[candidates->plane_count++] = plane_index;
+         }
+      }
+   }
+
+   // NOTE(law): The side planes of the frustum pass through the camera, with
+   // normals pointing inward. A box is outside when its corner furthest along
+   // some normal is behind that side, and inside when its nearest corner is in
+   // front of every side.
+   v3 sides[4];
+   for(u32 side = 0; side < 4; ++side)
+   {
+      sides[side] = cross3(corners[side], corners[(side + 1) % 4]);
+      if(dot3(sides[side], center) < 0)
+      {
+         sides[side] = mul3(sides[side], -1.0f);
+      }
+   }
+
+   candidates->node_count = 0;
+
+   struct bvh *bvh = &scene.bvh;
+   if(bvh->node_count)
+   {
+      u32 stack[BVH_STACK_SIZE];
+      u32 stack_count = 0;
+
+      u32 node_index = 0;
+      while(1)
+      {
+         struct bvh_node *node = bvh->nodes + node_index;
+         v3 minimum = sub3(node->minimum, scene.camera_position);
+         v3 maximum = sub3(node->maximum, scene.camera_position);
+
+         bool outside = false;
+         bool inside = true;
+         for(u32 side = 0; side < 4; ++side)
+         {
+            v3 normal = sides[side];
+            v3 furthest = vec3((normal.x < 0) ? minimum.x : maximum.x,
+                               (normal.y < 0) ? minimum.y : maximum.y,
+                               (normal.z < 0) ? minimum.z : maximum.z);
+            v3 nearest = vec3((normal.x < 0) ? maximum.x : minimum.x,
+                              (normal.y < 0) ? maximum.y : minimum.y,
+                              (normal.z < 0) ? maximum.z : minimum.z);
+
+            outside = outside || (dot3(normal, furthest) < 0);
+            inside = inside && (dot3(normal, nearest) >= 0);
+         }
+
+         if(!outside)
+         {
+            if(inside || node->count)
+            {
+               if(candidates->node_count == TILE_CANDIDATE_NODE_CAPACITY)
+               {
+                  // NOTE(law): Too fragmented to be worth listing, so fall back
+                  // to traversing the whole hierarchy.
+                  candidates->nodes[0] = 0;
+                  candidates->node_count = 1;
+                  break;
+               }
+               candidates->nodes[candidates->node_count++] = node_index;
+            }
+            else
+            {
+               // NOTE(law): Visit children in the same front to back order as
+               // the packets would, so roots end up roughly sorted by depth.
+               u32 first_child = node_index + 1;
+               u32 second_child = node->offset;
+
+               assert(stack_count < BVH_STACK_SIZE);
+               if(v3_axis(center, node->axis) < 0)
+               {
+                  stack[stack_count++] = first_child;
+                  node_index = second_child;
+               }
+               else
+               {
+                  stack[stack_count++] = second_child;
+                  node_index = first_child;
+               }
+               continue;
+            }
+         }
+
+         if(!stack_count)
+         {
+            break;
+         }
+         node_index = stack[--stack_count];
+      }
+   }
+}
+
+function void
+generate_film_rays(struct ray_packet *ray, lane_v3 *film)
+{
+   // NOTE(law): Generate normalized ray directions from the packet's origin
+   // through the given points on the film.
+   lane_f32 one = lane_f32_from_float(1.0f);
+
+   ray->direction = lane_noz3(lane_sub3(*film, ray->origin));
+
+   ray->inverse.x = lane_div(one, ray->direction.x);
+   ray->inverse.y = lane_div(one, ray->direction.y);
+   ray->inverse.z = lane_div(one, ray->direction.z);
+}
+
+function void
+shade_hit_packet(struct ray_packet *ray, struct hit_packet *hit, lane_v3 *color, lane_f32 *surface, lane_f32 *distance)
+{
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_f32 one = lane_f32_from_float(1.0f);
+
+   lane_v3 background = lane_v3_from_v3(vec3(0.3f, 0.8f, 0.8f));
+
+   lane_f32 facing = lane_dot3(ray->direction, lane_negate3(hit->normal));
+
+   color->r = lane_select(hit->mask, zero, lane_lerp(background.r, facing, hit->color.r));
+   color->g = lane_select(hit->mask, one,  lane_lerp(background.g, facing, hit->color.g));
+   color->b = lane_select(hit->mask, one,  lane_lerp(background.b, facing, hit->color.b));
+   *surface = hit->surface;
+   *distance = hit->t;
+}
+
+function void
+trace_film_packet(struct ray_packet *ray, lane_v3 *film, struct tile_candidates *candidates,
+                  lane_v3 *color, lane_f32 *surface, lane_f32 *distance)
+{
+   // NOTE(law): Trace rays from the packet's origin through the given points
+   // on the film, and return their shaded colors, hit surfaces and hit
+   // distances.
+
+   generate_film_rays(ray, film);
+
+   // NOTE(law): Intersect the unbounded planes first, so their closest hits
+   // can cull BVH nodes that lie behind them.
+   struct hit_packet hit = {0};
+   hit.t = lane_f32_from_float(FLT_MAX);
+
+   intersect_planes(&scene.planes, renderer.plane_numerators, candidates->planes, candidates->plane_count, ray, &hit);
+   intersect_bvh(&scene.bvh, scene.primitives, candidates->nodes, candidates->node_count, ray, &hit, false);
+
+   shade_hit_packet(ray, &hit, color, surface, distance);
+}
+
+// NOTE(law): Reprojection tags keep the surface in the upper 24 bits and the
+// number of frames the hit has been reused for in the lower 8. Targets combine
+// a tag with the bits of its distance from the new camera above it, so that
+// the nearest hit has the smallest target.
+#define REPROJECTION_MAX_AGE 16
+#define REPROJECTION_MAX_SURFACE ((1 << 23) - 1)
+#define REPROJECTION_EMPTY_TARGET 0xFFFFFFFFFFFFFFFFull
+
+function u32
+make_reprojection_tag(s32 surface, u32 age)
+{
+   u32 result = ((u32)surface << 8) | MINIMUM(age, 0xFF);
+   return(result);
+}
+
+function s32
+get_reprojection_surface(u32 tag)
+{
+   s32 result = (s32)tag >> 8;
+   return(result);
+}
+
+function bool
+reprojection_target_matches(u64 target, s32 surface)
+{
+   bool result = (target != REPROJECTION_EMPTY_TARGET && get_reprojection_surface((u32)target) == surface);
+   return(result);
+}
+
+function bool
+trace_reprojected_packet(struct ray_packet *ray, lane_v3 *film, u32 x, u32 y, u32 lane_count, u32 width, u32 height,
+                         lane_v3 *color, lane_f32 *surface, lane_f32 *distance, u32 *ages)
+{
+   // NOTE(law): Returns false when the packet has to be traced normally. Every
+   // lane needs a reprojected hit that is not too old, and whose four
+   // neighbors received the same surface, so pixels along silhouettes and
+   // disocclusions are always traced. The packet is then only intersected with
+   // the surfaces it received, and accepted if every lane hits its own.
+   // NOTE(law): Hits found this way are exact for the surfaces tested, but
+   // nothing else is. A surface that was hidden in the previous frame and has
+   // come into view in front of the reused one, e.g. through parallax, is
+   // missed. The pixel then keeps showing the old surface until its hit
+   // reaches REPROJECTION_MAX_AGE frames and it is traced again.
+
+   u64 *targets = renderer.reprojection_targets;
+
+   s32 lane_surfaces[LANE_WIDTH];
+   s32 distinct_surfaces[LANE_WIDTH];
+   u32 distinct_count = 0;
+
+   for(u32 lane = 0; lane < lane_count; ++lane)
+   {
+      u32 pixel_x = x + lane;
+      u32 index = (y * width) + pixel_x;
+
+      u64 target = targets[index];
+      if(target == REPROJECTION_EMPTY_TARGET || (target & 0xFF) >= REPROJECTION_MAX_AGE)
+      {
+         return(false);
+      }
+
+      s32 lane_surface = get_reprojection_surface((u32)target);
+      if((pixel_x > 0 && !reprojection_target_matches(targets[index - 1], lane_surface)) ||
+         (pixel_x + 1 < width && !reprojection_target_matches(targets[index + 1], lane_surface)) ||
+         (y > 0 && !reprojection_target_matches(targets[index - width], lane_surface)) ||
+         (y + 1 < height && !reprojection_target_matches(targets[index + width], lane_surface)))
+      {
+         return(false);
+      }
+
+      lane_surfaces[lane] = lane_surface;
+      ages[lane] = (u32)target & 0xFF;
+
+      u32 distinct_index = 0;
+      while(distinct_index < distinct_count && distinct_surfaces[distinct_index] != lane_surface)
+      {
+         distinct_index++;
+      }
+      if(distinct_index == distinct_count)
+      {
+         distinct_surfaces[distinct_count++] = lane_surface;
+      }
+   }
+
+   generate_film_rays(ray, film);
+
+   struct hit_packet hit = {0};
+   hit.t = lane_f32_from_float(FLT_MAX);
+
+   for(u32 index = 0; index < distinct_count; ++index)
+   {
+      s32 distinct_surface = distinct_surfaces[index];
+      if(distinct_surface > 0)
+      {
+         u32 plane_index = (u32)distinct_surface - 1;
+         assert(plane_index < scene.planes.count);
+         intersect_planes(&scene.planes, renderer.plane_numerators, &plane_index, 1, ray, &hit);
+      }
+      else
+      {
+         u32 primitive_index = (u32)(-distinct_surface) - 1;
+         assert(primitive_index < scene.primitive_count);
+         intersect_primitive(scene.primitives + primitive_index, (float)distinct_surface, ray, &hit);
+      }
+   }
+
+   LANE_ALIGNED float hit_surfaces[LANE_WIDTH];
+   lane_f32_store(hit_surfaces, hit.surface);
+   for(u32 lane = 0; lane < lane_count; ++lane)
+   {
+      if((s32)hit_surfaces[lane] != lane_surfaces[lane])
+      {
+         return(false);
+      }
+   }
+
+   shade_hit_packet(ray, &hit, color, surface, distance);
+
+   return(true);
+}
+
+function lane_u32
+pack_bgra(lane_v3 *color)
+{
+   // NOTE(law): Clamp first, since values outside [0, 1] would otherwise wrap
+   // around into a neighboring channel's range.
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_f32 one = lane_f32_from_float(1.0f);
+   lane_f32 max_value = lane_f32_from_float(255.0f);
+   lane_u32 alpha = lane_u32_from_u32(0xFF000000);
+
+   lane_u32 r = lane_u32_from_f32(lane_mul(lane_min(lane_max(color->r, zero), one), max_value));
+   lane_u32 g = lane_u32_from_f32(lane_mul(lane_min(lane_max(color->g, zero), one), max_value));
+   lane_u32 b = lane_u32_from_f32(lane_mul(lane_min(lane_max(color->b, zero), one), max_value));
+
+   lane_u32 result = lane_u32_or(lane_u32_or(lane_u32_shift_left(r, 16), lane_u32_shift_left(g, 8)),
+                                 lane_u32_or(b, alpha));
+   return(result);
+}
+
+function void
+apply_output_transform(lane_v3 *color, u32 transform)
+{
+   switch(transform)
+   {
+      case OUTPUT_TRANSFORM_LINEAR: {} break;
+
+      case OUTPUT_TRANSFORM_TONE_MAP:
+      {
+         // NOTE(law): Reinhard, which maps [0, infinity) into [0, 1), followed
+         // by the sRGB encode.
+         lane_f32 zero = lane_f32_from_float(0.0f);
+         lane_f32 one = lane_f32_from_float(1.0f);
+         lane_f32 r = lane_max(color->r, zero);
+         lane_f32 g = lane_max(color->g, zero);
+         lane_f32 b = lane_max(color->b, zero);
+         color->r = lane_div(r, lane_add(one, r));
+         color->g = lane_div(g, lane_add(one, g));
+         color->b = lane_div(b, lane_add(one, b));
+      } // Fall through.
+
+      case OUTPUT_TRANSFORM_SRGB:
+      {
+         color->r = lane_srgb_encode(color->r);
+         color->g = lane_srgb_encode(color->g);
+         color->b = lane_srgb_encode(color->b);
+      } break;
+
+      default: {assert(!"Unhandled output transform.");} break;
+   }
+}
+
+function void
+write_pixel_span(struct render_bitmap *bitmap, u32 pixel_index, u32 count, float *r, float *g, float *b, float scale)
+{
+   // NOTE(law): Converts count linear colors, stored as lane-aligned planes of
+   // floats, into the bitmap's format starting at pixel_index. The planes must
+   // be readable up to the next whole lane group past count. Colors are
+   // multiplied by scale first, which averages accumulated samples.
+
+   u32 transform = renderer.output_transform;
+
+   lane_f32 one = lane_f32_from_float(1.0f);
+   lane_f32 scale_lanes = lane_f32_from_float(scale);
+
+   switch(bitmap->format)
+   {
+      case RENDER_FORMAT_BGRA8:
+      {
+         u32 *destination = (u32 *)bitmap->memory + pixel_index;
+         for(u32 index = 0; index < count; index += LANE_WIDTH)
+         {
+            lane_v3 color = lane_mul3(lane_v3_load(r + index, g + index, b + index), scale_lanes);
+            if(transform != OUTPUT_TRANSFORM_LINEAR)
+            {
+               apply_output_transform(&color, transform);
+            }
+
+            lane_u32 pixels = pack_bgra(&color);
+            if(count - index >= LANE_WIDTH)
+            {
+               lane_u32_store(destination + index, pixels);
+            }
+            else
+            {
+               lane_u32_store_partial(destination + index, pixels, count - index);
+            }
+         }
+      } break;
+
+      case RENDER_FORMAT_RGBA16F:
+      {
+         u16 *destination = (u16 *)bitmap->memory + (4 * pixel_index);
+         for(u32 index = 0; index < count; index += LANE_WIDTH)
+         {
+            lane_v3 color = lane_mul3(lane_v3_load(r + index, g + index, b + index), scale_lanes);
+            if(transform != OUTPUT_TRANSFORM_LINEAR)
+            {
+               apply_output_transform(&color, transform);
+            }
+
+            if(count - index >= LANE_WIDTH)
+            {
+               lane_store_interleaved4_f16(destination + (4 * index), color.r, color.g, color.b, one);
+            }
+            else
+            {
+               u16 pixels[4 * LANE_WIDTH];
+               lane_store_interleaved4_f16(pixels, color.r, color.g, color.b, one);
+               memcpy(destination + (4 * index), pixels, (count - index) * 4 * sizeof(u16));
+            }
+         }
+      } break;
+
+      case RENDER_FORMAT_RGBA32F:
+      {
+         float *destination = (float *)bitmap->memory + (4 * pixel_index);
+         for(u32 index = 0; index < count; index += LANE_WIDTH)
+         {
+            lane_v3 color = lane_mul3(lane_v3_load(r + index, g + index, b + index), scale_lanes);
+            if(transform != OUTPUT_TRANSFORM_LINEAR)
+            {
+               apply_output_transform(&color, transform);
+            }
+
+            if(count - index >= LANE_WIDTH)
+            {
+               lane_store_interleaved4(destination + (4 * index), color.r, color.g, color.b, one);
+            }
+            else
+            {
+               float pixels[4 * LANE_WIDTH];
+               lane_store_interleaved4(pixels, color.r, color.g, color.b, one);
+               memcpy(destination + (4 * index), pixels, (count - index) * 4 * sizeof(float));
+            }
+         }
+      } break;
+
+      default: {assert(!"Unhandled render format.");} break;
+   }
+}
+
+// NOTE(law): Rows of a tile are traced into float spans of up to this many
+// pixels, which are then converted to the bitmap format in one pass.
+#define RENDER_SPAN_CAPACITY 256
+
+function u32
+render_tile(struct render_bitmap *bitmap, u32 minx, u32 miny, u32 maxx, u32 maxy,
+            struct tile_candidates *candidates)
+{
+   // NOTE(law): Pixels are traced in packets of LANE_WIDTH horizontally
+   // adjacent rays. Ray generation, plane intersection and shading mirror the
+   // evaluation order of the original scalar v3 math, except that ray
+   // directions are normalized with lane_noz3(), so planes render within an
+   // ulp or two of the scalar path.
+
+   u32 bitmap_width  = bitmap->width;
+   u32 bitmap_height = bitmap->height;
+
+   float aspect_ratio = (float)bitmap_width / (float)bitmap_height;
+
+   float film_width = 1.0f;
+   float film_height = 1.0f / aspect_ratio;
+   v3 film_center = sub3(scene.camera_position, mul3(scene.camera_z, scene.focal_length));
+
+   lane_f32 two = lane_f32_from_float(2.0f);
+   lane_f32 half_film_width = lane_f32_from_float(0.5f);
+   lane_f32 width = lane_f32_from_float((float)bitmap_width);
+
+   lane_v3 camera_x = lane_v3_from_v3(scene.camera_x);
+   lane_v3 film_center_lanes = lane_v3_from_v3(film_center);
+
+   // NOTE(law): Accumulation uses aligned loads, which relies on tiles starting
+   // on a lane boundary. Accumulating tiles trace straight into the
+   // accumulation planes, others into span scratch.
+   bool accumulate = renderer.progressive_enabled;
+   assert(!accumulate || (minx % LANE_WIDTH) == 0);
+
+   bool first_sample = (renderer.sample_count <= 1);
+   float jitter_x = (accumulate) ? renderer.sample_jitter_x : 0.0f;
+   float jitter_y = (accumulate) ? renderer.sample_jitter_y : 0.0f;
+
+   lane_f32 sample_jitter_x = lane_f32_from_float(jitter_x);
+   float inverse_sample_count = (accumulate) ? 1.0f / (float)renderer.sample_count : 1.0f;
+
+   LANE_ALIGNED float span_scratch_r[RENDER_SPAN_CAPACITY];
+   LANE_ALIGNED float span_scratch_g[RENDER_SPAN_CAPACITY];
+   LANE_ALIGNED float span_scratch_b[RENDER_SPAN_CAPACITY];
+
+   // NOTE(law): When adaptive sampling runs this frame, also record every
+   // pixel's surface and color for the refinement pass to compare.
+   bool record_samples = renderer.adaptive_active;
+
+   // NOTE(law): When the tile's frustum misses everything, skip ray generation
+   // and fill it with the background. It still goes through the same
+   // accumulation and output path as traced pixels.
+   bool fill_background = (!candidates->plane_count && !candidates->node_count);
+   lane_v3 background = lane_vec3(lane_f32_from_float(0.0f), lane_f32_from_float(1.0f), lane_f32_from_float(1.0f));
+
+   // NOTE(law): Every primary pass records its hits for the next frame to
+   // reproject, whether or not this one reused any. Returns the number of
+   // pixels whose hits were reused.
+   bool record_hits = (renderer.reprojection_enabled && renderer.reprojection_memory);
+   bool reproject = renderer.reprojection_active;
+   float *cache_distances = renderer.reprojection_distances[renderer.reprojection_write_index];
+   u32 *cache_tags = renderer.reprojection_tags[renderer.reprojection_write_index];
+   u32 reused_count = 0;
+
+   struct ray_packet ray;
+   ray.origin = lane_v3_from_v3(scene.camera_position);
+
+   for(u32 y = miny; y < maxy; ++y)
+   {
+      float film_v = -1.0f + (2.0f * (((float)y + jitter_y) / (float)bitmap_height));
+
+      // NOTE(law): The vertical film offset is shared by the whole row.
+      lane_v3 row_offset = lane_v3_from_v3(mul3(scene.camera_y, film_v * 0.5f * film_height));
+
+      u32 row_index = y * bitmap_width;
+      u32 accumulation_row = y * renderer.accumulation_stride;
+
+      for(u32 span_minx = minx; span_minx < maxx; span_minx += RENDER_SPAN_CAPACITY)
+      {
+         u32 span_maxx = MINIMUM(span_minx + RENDER_SPAN_CAPACITY, maxx);
+
+         float *span_r = span_scratch_r;
+         float *span_g = span_scratch_g;
+         float *span_b = span_scratch_b;
+         if(accumulate)
+         {
+            span_r = renderer.accumulation_r + accumulation_row + span_minx;
+            span_g = renderer.accumulation_g + accumulation_row + span_minx;
+            span_b = renderer.accumulation_b + accumulation_row + span_minx;
+         }
+
+         for(u32 x = span_minx; x < span_maxx; x += LANE_WIDTH)
+         {
+            lane_v3 color = background;
+            lane_f32 surface = lane_f32_from_float(0.0f);
+            lane_f32 distance = lane_f32_from_float(FLT_MAX);
+
+            u32 lane_count = MINIMUM(span_maxx - x, LANE_WIDTH);
+            u32 ages[LANE_WIDTH] = {0};
+            bool reused = false;
+
+            if(!fill_background)
+            {
+               lane_f32 pixel_x = lane_add(lane_f32_from_u32(lane_u32_index(x)), sample_jitter_x);
+               lane_f32 film_u = lane_add(lane_f32_from_float(-1.0f), lane_mul(two, lane_div(pixel_x, width)));
+               lane_f32 film_offset = lane_mul(lane_mul(film_u, half_film_width), lane_f32_from_float(film_width));
+
+               lane_v3 film = lane_add3(lane_add3(film_center_lanes, lane_mul3(camera_x, film_offset)), row_offset);
+
+               reused = reproject && trace_reprojected_packet(&ray, &film, x, y, lane_count, bitmap_width, bitmap_height,
+                                                              &color, &surface, &distance, ages);
+               if(!reused)
+               {
+                  trace_film_packet(&ray, &film, candidates, &color, &surface, &distance);
+               }
+            }
+
+            if(record_hits)
+            {
+               // NOTE(law): Freshly traced packets start at a pseudo-random age,
+               // so that a region traced in one frame does not all expire in
+               // the same later frame.
+               u32 refresh_age = (((x / LANE_WIDTH) * 0x9E3779B1u) ^ (y * 0x85EBCA77u) ^ renderer.reprojection_frame_index);
+               refresh_age = (refresh_age >> 16) % (REPROJECTION_MAX_AGE / 2);
+
+               // NOTE(law): Same layout as make_reprojection_tag(). Reused ages
+               // are already clamped.
+               lane_u32 lane_ages = (reused) ? lane_u32_load(ages) : lane_u32_from_u32(refresh_age);
+               lane_u32 tags = lane_u32_or(lane_u32_shift_left(lane_u32_from_f32(surface), 8), lane_ages);
+               if(lane_count == LANE_WIDTH)
+               {
+                  lane_u32_store(cache_tags + row_index + x, tags);
+               }
+               else
+               {
+                  lane_u32_store_partial(cache_tags + row_index + x, tags, lane_count);
+               }
+
+               LANE_ALIGNED float lane_distances[LANE_WIDTH];
+               lane_f32_store(lane_distances, distance);
+               memcpy(cache_distances + row_index + x, lane_distances, lane_count * sizeof(float));
+
+               reused_count += (reused) ? lane_count : 0;
+            }
+
+            if(record_samples)
+            {
+               // NOTE(law): Packed and clamped, which is only good enough for
+               // comparing neighbors. The refinement pass averages with the
+               // float samples, copied below or left in the accumulation planes.
+               lane_u32 pixels = pack_bgra(&color);
+               lane_u32 surfaces = lane_u32_from_f32(surface);
+
+               u32 remaining = span_maxx - x;
+               if(remaining >= LANE_WIDTH)
+               {
+                  lane_u32_store(renderer.adaptive_colors + row_index + x, pixels);
+                  lane_u32_store(renderer.adaptive_surfaces + row_index + x, surfaces);
+               }
+               else
+               {
+                  lane_u32_store_partial(renderer.adaptive_colors + row_index + x, pixels, remaining);
+                  lane_u32_store_partial(renderer.adaptive_surfaces + row_index + x, surfaces, remaining);
+               }
+            }
+
+            float *r = span_r + (x - span_minx);
+            float *g = span_g + (x - span_minx);
+            float *b = span_b + (x - span_minx);
+
+            if(accumulate && !first_sample)
+            {
+               color = lane_add3(lane_v3_load(r, g, b), color);
+            }
+
+            lane_f32_store(r, color.r);
+            lane_f32_store(g, color.g);
+            lane_f32_store(b, color.b);
+         }
+
+         write_pixel_span(bitmap, row_index + span_minx, span_maxx - span_minx, span_r, span_g, span_b, inverse_sample_count);
+
+         if(record_samples && !accumulate)
+         {
+            size_t span_size = (span_maxx - span_minx) * sizeof(float);
+            memcpy(renderer.adaptive_r + row_index + span_minx, span_r, span_size);
+            memcpy(renderer.adaptive_g + row_index + span_minx, span_g, span_size);
+            memcpy(renderer.adaptive_b + row_index + span_minx, span_b, span_size);
+         }
+      }
+   }
+
+   return(reused_count);
+}
+
+struct tile_data
+{
+   struct render_bitmap *bitmap;
+   u32 minx;
+   u32 miny;
+   u32 maxx;
+   u32 maxy;
+
+   // NOTE(law): Written by the primary pass, and reused by the refinement pass.
+   struct tile_candidates candidates;
+
+   // NOTE(law): Pixels whose reprojected hits were reused by the primary pass.
+   u32 reused_count;
+
+   // NOTE(law): When the primary pass started and finished the tile.
+   u64 work_start;
+   u64 work_end;
+
+   // NOTE(law): Written by the adaptive refinement pass.
+   u32 edge_count;
+   u32 ray_count;
+};
+
+// NOTE(law): Stands in for the tile buffer when the frame arena has no room
+// for it, so that the frame still renders, as a single tile.
+global struct tile_data fallback_tile;
+
+function void
+report_frame_memory_shortage(char *message)
+{
+   if(!renderer.frame_memory_exhausted)
+   {
+      platform_log("ERROR: Not enough frame memory for %s.\n", message);
+      renderer.frame_memory_exhausted = true;
+   }
+}
+
+enum tile_order
+{
+   TILE_ORDER_ROW_MAJOR,
+   TILE_ORDER_MORTON,
+   TILE_ORDER_HILBERT,
+   TILE_ORDER_SPIRAL,
+
+   TILE_ORDER_COUNT,
+};
+
+global char *tile_order_names[TILE_ORDER_COUNT] =
+{
+   "row-major",
+   "morton",
+   "hilbert",
+   "spiral",
+};
+
+#define TILE_DEFAULT_WIDTH  64
+#define TILE_DEFAULT_HEIGHT 64
+
+// NOTE(law): Tile widths are rounded to whole cache lines of pixels, so
+// neighboring tiles never share a line of the framebuffer.
+#define TILE_WIDTH_GRANULARITY (64 / sizeof(u32))
+
+function void
+set_tile_size(u32 width, u32 height)
+{
+   width = MAXIMUM(width, 1);
+   width = ((width + TILE_WIDTH_GRANULARITY - 1) / TILE_WIDTH_GRANULARITY) * TILE_WIDTH_GRANULARITY;
+
+   renderer.tile_width = width;
+   renderer.tile_height = MAXIMUM(height, 1);
+}
+
+function u32
+morton_compact(u32 value)
+{
+   // NOTE(law): Gather the even bits of value into the low half.
+   value &= 0x55555555;
+   value = (value ^ (value >> 1)) & 0x33333333;
+   value = (value ^ (value >> 2)) & 0x0F0F0F0F;
+   value = (value ^ (value >> 4)) & 0x00FF00FF;
+   value = (value ^ (value >> 8)) & 0x0000FFFF;
+
+   return(value);
+}
+
+function void
+hilbert_position(u32 side, u32 distance, u32 *x, u32 *y)
+{
+   // NOTE(law): Map a distance along the Hilbert curve filling a side x side
+   // grid (side a power of two) to its grid position.
+   u32 result_x = 0;
+   u32 result_y = 0;
+
+   for(u32 step = 1; step < side; step *= 2)
+   {
+      u32 rx = 1 & (distance / 2);
+      u32 ry = 1 & (distance ^ rx);
+
+      if(ry == 0)
+      {
+         if(rx == 1)
+         {
+            result_x = step - 1 - result_x;
+            result_y = step - 1 - result_y;
+         }
+
+         u32 swap = result_x;
+         result_x = result_y;
+         result_y = swap;
+      }
+
+      result_x += step * rx;
+      result_y += step * ry;
+      distance /= 4;
+   }
+
+   *x = result_x;
+   *y = result_y;
+}
+
+function bool
+emit_tile(struct render_bitmap *bitmap, u32 *tile_index, u32 tile_x, u32 tile_y, u32 tile_count_x, u32 tile_count_y)
+{
+   // NOTE(law): Curves are generated over a padded grid, so quietly skip any
+   // positions that fall outside of the bitmap.
+   if(tile_x >= tile_count_x || tile_y >= tile_count_y)
+   {
+      return(false);
+   }
+
+   u32 minx = renderer.tile_width * tile_x;
+   u32 miny = renderer.tile_height * tile_y;
+
+   struct tile_data *data = renderer.tiles + (*tile_index)++;
+   data->bitmap = bitmap;
+   data->minx = minx;
+   data->miny = miny;
+   data->maxx = MINIMUM(minx + renderer.tile_width, bitmap->width);
+   data->maxy = MINIMUM(miny + renderer.tile_height, bitmap->height);
+
+   return(true);
+}
+
+function u64
+get_bitmap_node_first_pixel(struct render_bitmap *bitmap, u32 node, u32 node_count)
+{
+   // NOTE(law): Bitmap memory is split evenly between nodes by address, over
+   // the whole allocation. A scaled-down image only covers the front of the
+   // allocation, and so may only touch the first few nodes' memory. Passing
+   // node_count as the node gives the end of the last node's share.
+   u64 capacity = (bitmap->allocated_width && bitmap->allocated_height)
+      ? (u64)bitmap->allocated_width * bitmap->allocated_height
+      : (u64)bitmap->width * bitmap->height;
+
+   u64 result = ((u64)node * capacity + node_count - 1) / node_count;
+   return(result);
+}
+
+function u32
+get_bitmap_row_node(struct render_bitmap *bitmap, u32 row, u32 node_count)
+{
+   // NOTE(law): Return the node whose share of the bitmap holds the start of
+   // the given row.
+   u32 result = 0;
+   while(result + 1 < node_count && (u64)row * bitmap->width >= get_bitmap_node_first_pixel(bitmap, result + 1, node_count))
+   {
+      result++;
+   }
+
+   return(result);
+}
+
+function u32
+generate_tiles(struct render_bitmap *bitmap, u32 node_count)
+{
+   // NOTE(law): Fill the per-frame tile buffer in dispatch order and return the
+   // number of tiles. Workers steal from the front of the order, so
+   // neighboring tiles tend to run at the same time and share cache.
+
+   if(!renderer.tile_width || !renderer.tile_height)
+   {
+      set_tile_size(TILE_DEFAULT_WIDTH, TILE_DEFAULT_HEIGHT);
+   }
+
+   u32 tile_count_x = ((bitmap->width - 1) / renderer.tile_width) + 1;
+   u32 tile_count_y = ((bitmap->height - 1) / renderer.tile_height) + 1;
+   u32 tile_count = tile_count_x * tile_count_y;
+
+   renderer.tiles = PUSH_ARRAY(&arenas.frame, tile_count, struct tile_data);
+   if(!renderer.tiles)
+   {
+      report_frame_memory_shortage("tiles, rendering each frame as a single tile");
+
+      fallback_tile.bitmap = bitmap;
+      fallback_tile.minx = 0;
+      fallback_tile.miny = 0;
+      fallback_tile.maxx = bitmap->width;
+      fallback_tile.maxy = bitmap->height;
+      fallback_tile.candidates.planes = 0;
+
+      renderer.tiles = &fallback_tile;
+      renderer.tile_node_count = 1;
+      renderer.tile_node_offsets[0] = 0;
+      renderer.tile_node_offsets[1] = 1;
+
+      return(1);
+   }
+
+   // NOTE(law): Tiles without room for a plane list skip plane culling, see
+   // setup_tile_candidates().
+   for(u32 index = 0; index < tile_count; ++index)
+   {
+      u32 *planes = PUSH_ARRAY(&arenas.frame, scene.planes.count, u32);
+      if(!planes && scene.planes.count)
+      {
+         report_frame_memory_shortage("per-tile plane lists, skipping plane culling");
+      }
+
+      renderer.tiles[index].candidates.planes = planes;
+   }
+
+   u32 side = 1;
+   while(side < tile_count_x || side < tile_count_y)
+   {
+      side *= 2;
+   }
+
+   u32 tile_index = 0;
+   switch(renderer.tile_order)
+   {
+      case TILE_ORDER_MORTON:
+      {
+         for(u32 distance = 0; distance < side * side; ++distance)
+         {
+            u32 x = morton_compact(distance);
+            u32 y = morton_compact(distance >> 1);
+            emit_tile(bitmap, &tile_index, x, y, tile_count_x, tile_count_y);
+         }
+      } break;
+
+      case TILE_ORDER_HILBERT:
+      {
+         for(u32 distance = 0; distance < side * side; ++distance)
+         {
+            u32 x, y;
+            hilbert_position(side, distance, &x, &y);
+            emit_tile(bitmap, &tile_index, x, y, tile_count_x, tile_count_y);
+         }
+      } break;
+
+      case TILE_ORDER_SPIRAL:
+      {
+         // NOTE(law): Walk a square spiral out from the center tile, with leg
+         // lengths 1, 1, 2, 2, 3, 3, ...
+         s32 x = (s32)(tile_count_x - 1) / 2;
+         s32 y = (s32)(tile_count_y - 1) / 2;
+         s32 directions[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+
+         emit_tile(bitmap, &tile_index, x, y, tile_count_x, tile_count_y);
+         for(u32 leg = 0; tile_index < tile_count; ++leg)
+         {
+            u32 length = (leg / 2) + 1;
+            for(u32 step = 0; step < length; ++step)
+            {
+               x += directions[leg % 4][0];
+               y += directions[leg % 4][1];
+               if(x >= 0 && y >= 0)
+               {
+                  emit_tile(bitmap, &tile_index, x, y, tile_count_x, tile_count_y);
+               }
+            }
+         }
+      } break;
+
+      default:
+      {
+         for(u32 y = 0; y < tile_count_y; ++y)
+         {
+            for(u32 x = 0; x < tile_count_x; ++x)
+            {
+               emit_tile(bitmap, &tile_index, x, y, tile_count_x, tile_count_y);
+            }
+         }
+      } break;
+   }
+   assert(tile_index == tile_count);
+
+   // NOTE(law): Group the tiles by node, keeping the dispatch order within each
+   // node's group. Without room to regroup them, they all go to the first node.
+   node_count = MAXIMUM(MINIMUM(node_count, TILE_MAX_NODE_COUNT), 1);
+
+   struct temporary_memory temporary = begin_temporary_memory(&arenas.frame);
+   struct tile_data *tile_scratch = (node_count > 1) ? PUSH_ARRAY(&arenas.frame, tile_count, struct tile_data) : 0;
+   if(node_count > 1 && !tile_scratch)
+   {
+      report_frame_memory_shortage("grouping tiles by node");
+      node_count = 1;
+   }
+
+   renderer.tile_node_count = node_count;
+   renderer.tile_node_offsets[0] = 0;
+   renderer.tile_node_offsets[node_count] = tile_count;
+
+   if(node_count > 1)
+   {
+      u32 node_counts[TILE_MAX_NODE_COUNT] = {0};
+      for(u32 index = 0; index < tile_count; ++index)
+      {
+         node_counts[get_bitmap_row_node(bitmap, renderer.tiles[index].miny, node_count)]++;
+      }
+
+      for(u32 node = 1; node < node_count; ++node)
+      {
+         renderer.tile_node_offsets[node] = renderer.tile_node_offsets[node - 1] + node_counts[node - 1];
+      }
+
+      u32 write_indices[TILE_MAX_NODE_COUNT];
+      memcpy(write_indices, renderer.tile_node_offsets, sizeof(write_indices));
+
+      for(u32 index = 0; index < tile_count; ++index)
+      {
+         u32 node = get_bitmap_row_node(bitmap, renderer.tiles[index].miny, node_count);
+         tile_scratch[write_indices[node]++] = renderer.tiles[index];
+      }
+
+      memcpy(renderer.tiles, tile_scratch, tile_count * sizeof(struct tile_data));
+   }
+   end_temporary_memory(temporary);
+
+   return(tile_count);
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(render_tile_callback)
+{
+   struct tile_data *tile = (struct tile_data *)data;
+
+   tile->work_start = platform_timestamp();
+
+   u64 profile_start = profile_begin();
+   setup_tile_candidates(tile->bitmap, tile->minx, tile->miny, tile->maxx, tile->maxy, &tile->candidates);
+   tile->reused_count = render_tile(tile->bitmap, tile->minx, tile->miny, tile->maxx, tile->maxy, &tile->candidates);
+   profile_end(PROFILE_EVENT_TILE, profile_start, tile->minx, tile->miny);
+
+   tile->work_end = platform_timestamp();
+}
+
+function u32
+reverse_bits(u32 value)
+{
+   value = ((value >> 1) & 0x55555555) | ((value & 0x55555555) << 1);
+   value = ((value >> 2) & 0x33333333) | ((value & 0x33333333) << 2);
+   value = ((value >> 4) & 0x0F0F0F0F) | ((value & 0x0F0F0F0F) << 4);
+   value = ((value >> 8) & 0x00FF00FF) | ((value & 0x00FF00FF) << 8);
+   value = (value >> 16) | (value << 16);
+
+   return(value);
+}
+
+function u32
+sobol_second_dimension(u32 index)
+{
+   // NOTE(law): The first dimension of the Sobol sequence is the base 2
+   // radical inverse, i.e. reverse_bits(). This is the second.
+   u32 result = 0;
+   for(u32 direction = 1u << 31; index; index >>= 1, direction ^= direction >> 1)
+   {
+      if(index & 1)
+      {
+         result ^= direction;
+      }
+   }
+
+   return(result);
+}
+
+function u32
+hash_u32(u32 value)
+{
+   value ^= value >> 16;
+   value *= 0x7FEB352D;
+   value ^= value >> 15;
+   value *= 0x846CA68B;
+   value ^= value >> 16;
+
+   return(value);
+}
+
+function bool
+adaptive_pixels_differ(u32 a, u32 b)
+{
+   if(renderer.adaptive_surfaces[a] != renderer.adaptive_surfaces[b])
+   {
+      return(true);
+   }
+
+   u32 color_a = renderer.adaptive_colors[a];
+   u32 color_b = renderer.adaptive_colors[b];
+   if(color_a == color_b)
+   {
+      return(false);
+   }
+
+   for(u32 shift = 0; shift < 24; shift += 8)
+   {
+      s32 difference = (s32)((color_a >> shift) & 0xFF) - (s32)((color_b >> shift) & 0xFF);
+      if(difference > ADAPTIVE_COLOR_THRESHOLD || difference < -ADAPTIVE_COLOR_THRESHOLD)
+      {
+         return(true);
+      }
+   }
+
+   return(false);
+}
+
+function lane_f32
+adaptive_lanes_match(u32 *colors, u32 *surfaces, s32 offset)
+{
+   // NOTE(law): The packet version of adaptive_pixels_differ(), inverted.
+   // Compares LANE_WIDTH pixels against the neighbors offset pixels away.
+   lane_u32 zero = lane_u32_from_u32(0);
+   lane_u32 color_mask = lane_u32_from_u32(0x00FFFFFF);
+   lane_u32 threshold = lane_u32_from_u32(ADAPTIVE_COLOR_THRESHOLD * 0x010101);
+
+   lane_u32 difference = lane_u8_absolute_difference(lane_u32_load(colors), lane_u32_load(colors + offset));
+   lane_u32 excess = lane_u32_and(lane_u8_subtract_saturate(difference, threshold), color_mask);
+
+   lane_f32 result = lane_and(lane_u32_equal(lane_u32_load(surfaces), lane_u32_load(surfaces + offset)),
+                              lane_u32_equal(excess, zero));
+   return(result);
+}
+
+function void
+refine_pixels(struct render_bitmap *bitmap, struct tile_candidates *candidates, u32 *sample_offsets_u, u32 *sample_offsets_v,
+              u32 *pixel_indices, u32 pixel_count, u32 sample_count)
+{
+   // NOTE(law): Trace sample_count extra rays through each of up to LANE_WIDTH
+   // pixels, and replace the pixels with the average of those and the primary
+   // sample. The sample offsets are XOR-scrambled per pixel so neighboring
+   // pixels do not repeat the same pattern. Samples from consecutive pixels
+   // share packets, so no lanes go to waste.
+
+   u32 bitmap_width = bitmap->width;
+   u32 bitmap_height = bitmap->height;
+
+   float film_width = 1.0f;
+   float film_height = 1.0f / ((float)bitmap_width / (float)bitmap_height);
+   v3 film_center = sub3(scene.camera_position, mul3(scene.camera_z, scene.focal_length));
+
+   bool accumulate = renderer.progressive_enabled;
+   float jitter_x = (accumulate) ? renderer.sample_jitter_x : 0.0f;
+   float jitter_y = (accumulate) ? renderer.sample_jitter_y : 0.0f;
+
+   lane_f32 one = lane_f32_from_float(1.0f);
+   lane_f32 two = lane_f32_from_float(2.0f);
+   lane_f32 width = lane_f32_from_float((float)bitmap_width);
+   lane_f32 height = lane_f32_from_float((float)bitmap_height);
+   lane_f32 half_film_width = lane_f32_from_float(0.5f * film_width);
+   lane_f32 half_film_height = lane_f32_from_float(0.5f * film_height);
+
+   lane_v3 camera_x = lane_v3_from_v3(scene.camera_x);
+   lane_v3 camera_y = lane_v3_from_v3(scene.camera_y);
+   lane_v3 film_center_lanes = lane_v3_from_v3(film_center);
+
+   struct ray_packet ray;
+   ray.origin = lane_v3_from_v3(scene.camera_position);
+
+   u32 pixel_x[LANE_WIDTH];
+   u32 pixel_y[LANE_WIDTH];
+   u32 scramble_u[LANE_WIDTH];
+   u32 scramble_v[LANE_WIDTH];
+
+   for(u32 pixel = 0; pixel < pixel_count; ++pixel)
+   {
+      u32 pixel_index = pixel_indices[pixel];
+      pixel_x[pixel] = pixel_index % bitmap_width;
+      pixel_y[pixel] = pixel_index / bitmap_width;
+      scramble_u[pixel] = hash_u32(pixel_index);
+      scramble_v[pixel] = hash_u32(scramble_u[pixel]);
+   }
+
+   float sum_r[LANE_WIDTH] = {0};
+   float sum_g[LANE_WIDTH] = {0};
+   float sum_b[LANE_WIDTH] = {0};
+
+   u32 pixel = 0;
+   u32 sample = 0;
+   while(pixel < pixel_count)
+   {
+      LANE_ALIGNED float sample_x[LANE_WIDTH];
+      LANE_ALIGNED float sample_y[LANE_WIDTH];
+      u32 lane_pixels[LANE_WIDTH];
+
+      u32 lane_count = 0;
+      for(u32 lane = 0; lane < LANE_WIDTH; ++lane)
+      {
+         if(pixel < pixel_count)
+         {
+            float u = (float)(sample_offsets_u[sample] ^ scramble_u[pixel]) * (1.0f / 4294967296.0f);
+            float v = (float)(sample_offsets_v[sample] ^ scramble_v[pixel]) * (1.0f / 4294967296.0f);
+
+            sample_x[lane] = (float)pixel_x[pixel] + jitter_x + (u - 0.5f);
+            sample_y[lane] = (float)pixel_y[pixel] + jitter_y + (v - 0.5f);
+            lane_pixels[lane] = pixel;
+            lane_count++;
+
+            if(++sample == sample_count)
+            {
+               sample = 0;
+               pixel++;
+            }
+         }
+         else
+         {
+            // NOTE(law): Unused lanes repeat the last sample.
+            sample_x[lane] = sample_x[lane - 1];
+            sample_y[lane] = sample_y[lane - 1];
+         }
+      }
+
+      lane_f32 film_u = lane_sub(lane_mul(two, lane_div(lane_f32_load(sample_x), width)), one);
+      lane_f32 film_v = lane_sub(lane_mul(two, lane_div(lane_f32_load(sample_y), height)), one);
+      lane_f32 offset_u = lane_mul(film_u, half_film_width);
+      lane_f32 offset_v = lane_mul(film_v, half_film_height);
+
+      lane_v3 film = lane_add3(lane_add3(film_center_lanes, lane_mul3(camera_x, offset_u)), lane_mul3(camera_y, offset_v));
+
+      lane_v3 color;
+      lane_f32 surface;
+      lane_f32 distance;
+      trace_film_packet(&ray, &film, candidates, &color, &surface, &distance);
+
+      LANE_ALIGNED float lane_r[LANE_WIDTH];
+      LANE_ALIGNED float lane_g[LANE_WIDTH];
+      LANE_ALIGNED float lane_b[LANE_WIDTH];
+      lane_f32_store(lane_r, color.r);
+      lane_f32_store(lane_g, color.g);
+      lane_f32_store(lane_b, color.b);
+
+      for(u32 lane = 0; lane < lane_count; ++lane)
+      {
+         sum_r[lane_pixels[lane]] += lane_r[lane];
+         sum_g[lane_pixels[lane]] += lane_g[lane];
+         sum_b[lane_pixels[lane]] += lane_b[lane];
+      }
+   }
+
+   float inverse_count = 1.0f / (float)(sample_count + 1);
+   for(pixel = 0; pixel < pixel_count; ++pixel)
+   {
+      u32 pixel_index = pixel_indices[pixel];
+
+      // NOTE(law): Refinement only runs on the first progressive sample, so
+      // the accumulated value is that sample alone.
+      float primary_r, primary_g, primary_b;
+      u32 accumulation_index = (pixel_y[pixel] * renderer.accumulation_stride) + pixel_x[pixel];
+      if(accumulate)
+      {
+         primary_r = renderer.accumulation_r[accumulation_index];
+         primary_g = renderer.accumulation_g[accumulation_index];
+         primary_b = renderer.accumulation_b[accumulation_index];
+      }
+      else
+      {
+         primary_r = renderer.adaptive_r[pixel_index];
+         primary_g = renderer.adaptive_g[pixel_index];
+         primary_b = renderer.adaptive_b[pixel_index];
+      }
+
+      float r = (primary_r + sum_r[pixel]) * inverse_count;
+      float g = (primary_g + sum_g[pixel]) * inverse_count;
+      float b = (primary_b + sum_b[pixel]) * inverse_count;
+
+      if(accumulate)
+      {
+         renderer.accumulation_r[accumulation_index] = r;
+         renderer.accumulation_g[accumulation_index] = g;
+         renderer.accumulation_b[accumulation_index] = b;
+      }
+
+      LANE_ALIGNED float pixel_r[LANE_WIDTH] = {r};
+      LANE_ALIGNED float pixel_g[LANE_WIDTH] = {g};
+      LANE_ALIGNED float pixel_b[LANE_WIDTH] = {b};
+      write_pixel_span(bitmap, pixel_index, 1, pixel_r, pixel_g, pixel_b, 1.0f);
+   }
+}
+
+function void
+refine_tile(struct tile_data *tile)
+{
+   // NOTE(law): Find the pixels of the tile whose primary sample hit a
+   // different surface than one of its four neighbors, or differs noticeably
+   // in color, and give them more samples. Neighbors in other tiles are
+   // compared too. They were all traced by the primary pass, and the pixels
+   // being compared are the primary samples, not the refined output.
+
+   struct render_bitmap *bitmap = tile->bitmap;
+   u32 bitmap_width = bitmap->width;
+   u32 bitmap_height = bitmap->height;
+
+   u32 sample_count = renderer.adaptive_sample_count;
+   u32 pixel_stride = renderer.adaptive_pixel_stride;
+
+   // NOTE(law): Each tile starts its stride at its own pseudo-random phase.
+   // Starting every tile on its first edge pixel would refine about one pixel
+   // per tile more than the budget allows.
+   u32 stride_phase = ((tile->minx * 0x9E3779B1u) ^ (tile->miny * 0x85EBCA77u)) >> 16;
+   stride_phase %= pixel_stride;
+
+   // NOTE(law): Sample positions come from the first two dimensions of the
+   // Sobol sequence, which stay well stratified at every sample count. Index 0
+   // is skipped, since it would land on the pixel corner.
+   u32 sample_offsets_u[ADAPTIVE_MAX_SAMPLE_COUNT];
+   u32 sample_offsets_v[ADAPTIVE_MAX_SAMPLE_COUNT];
+   for(u32 sample = 0; sample < sample_count; ++sample)
+   {
+      sample_offsets_u[sample] = reverse_bits(sample + 1);
+      sample_offsets_v[sample] = sobol_second_dimension(sample + 1);
+   }
+
+   u32 pixel_indices[LANE_WIDTH];
+   u32 pixel_count = 0;
+
+   u32 edge_count = 0;
+   u32 ray_count = 0;
+
+   for(u32 y = tile->miny; y < tile->maxy; ++y)
+   {
+      // NOTE(law): The first and last rows compare against themselves instead
+      // of the missing row, which never differs.
+      s32 up = (y > 0) ? -(s32)bitmap_width : 0;
+      s32 down = (y + 1 < bitmap_height) ? (s32)bitmap_width : 0;
+
+      for(u32 x = tile->minx; x < tile->maxx; x += LANE_WIDTH)
+      {
+         u32 index = (y * bitmap_width) + x;
+         u32 lane_count = MINIMUM(tile->maxx - x, LANE_WIDTH);
+
+         u32 edge_bits = 0;
+         if(x > 0 && x + LANE_WIDTH < bitmap_width)
+         {
+            u32 *colors = renderer.adaptive_colors + index;
+            u32 *surfaces = renderer.adaptive_surfaces + index;
+
+            lane_f32 match = lane_and(lane_and(adaptive_lanes_match(colors, surfaces, -1),
+                                               adaptive_lanes_match(colors, surfaces, 1)),
+                                      lane_and(adaptive_lanes_match(colors, surfaces, up),
+                                               adaptive_lanes_match(colors, surfaces, down)));
+
+            edge_bits = ~lane_mask_bits(match) & ((1u << lane_count) - 1);
+         }
+         else
+         {
+            // NOTE(law): Lanes at the left and right edges of the bitmap would
+            // read outside of it, so compare them one pixel at a time.
+            for(u32 lane = 0; lane < lane_count; ++lane)
+            {
+               u32 pixel_x = x + lane;
+               u32 pixel_index = index + lane;
+               if((pixel_x > 0 && adaptive_pixels_differ(pixel_index, pixel_index - 1)) ||
+                  (pixel_x + 1 < bitmap_width && adaptive_pixels_differ(pixel_index, pixel_index + 1)) ||
+                  (up && adaptive_pixels_differ(pixel_index, pixel_index + up)) ||
+                  (down && adaptive_pixels_differ(pixel_index, pixel_index + down)))
+               {
+                  edge_bits |= (1u << lane);
+               }
+            }
+         }
+
+         for(u32 lane = 0; edge_bits; ++lane, edge_bits >>= 1)
+         {
+            if((edge_bits & 1) && ((edge_count++ + stride_phase) % pixel_stride) == 0)
+            {
+               pixel_indices[pixel_count++] = index + lane;
+               if(pixel_count == LANE_WIDTH)
+               {
+                  refine_pixels(bitmap, &tile->candidates, sample_offsets_u, sample_offsets_v, pixel_indices,
+                                pixel_count, sample_count);
+                  ray_count += pixel_count * sample_count;
+                  pixel_count = 0;
+               }
+            }
+         }
+      }
+   }
+
+   if(pixel_count)
+   {
+      refine_pixels(bitmap, &tile->candidates, sample_offsets_u, sample_offsets_v, pixel_indices, pixel_count,
+                    sample_count);
+      ray_count += pixel_count * sample_count;
+   }
+
+   tile->edge_count = edge_count;
+   tile->ray_count = ray_count;
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(refine_tile_callback)
+{
+   struct tile_data *tile = (struct tile_data *)data;
+
+   u64 profile_start = profile_begin();
+   refine_tile(tile);
+   profile_end(PROFILE_EVENT_REFINE, profile_start, tile->minx, tile->miny);
+}
+
+function void
+update_adaptive_sampling(struct render_bitmap *bitmap, struct tile_data *tiles, u32 tile_count)
+{
+   // NOTE(law): Split the next frame's budget between as many edge pixels as
+   // this frame had, assuming the view does not change much between frames.
+   u32 edge_count = 0;
+   u32 ray_count = 0;
+   for(u32 index = 0; index < tile_count; ++index)
+   {
+      edge_count += tiles[index].edge_count;
+      ray_count += tiles[index].ray_count;
+   }
+
+   renderer.adaptive_edge_count = edge_count;
+   renderer.adaptive_ray_count = ray_count;
+
+   u32 budget = (u32)(renderer.adaptive_sample_budget * (float)(bitmap->width * bitmap->height));
+   if(edge_count == 0)
+   {
+      renderer.adaptive_sample_count = ADAPTIVE_DEFAULT_SAMPLE_COUNT;
+      renderer.adaptive_pixel_stride = 1;
+   }
+   else if(budget >= edge_count)
+   {
+      renderer.adaptive_sample_count = MINIMUM(budget / edge_count, ADAPTIVE_MAX_SAMPLE_COUNT);
+      renderer.adaptive_pixel_stride = 1;
+   }
+   else
+   {
+      // NOTE(law): Not even one ray per edge pixel fits, so only refine every
+      // stride'th one.
+      renderer.adaptive_sample_count = 1;
+      renderer.adaptive_pixel_stride = (edge_count + MAXIMUM(budget, 1) - 1) / MAXIMUM(budget, 1);
+   }
+}
+
+function void
+enqueue_tiles(struct platform_work_queue *queue, queue_callback *callback)
+{
+   // NOTE(law): Hand each node the tiles generated for it.
+   for(u32 node = 0; node < renderer.tile_node_count; ++node)
+   {
+      u32 first = renderer.tile_node_offsets[node];
+      u32 count = renderer.tile_node_offsets[node + 1] - first;
+      if(count)
+      {
+         platform_enqueue_work_batch(queue, node, renderer.tiles + first, sizeof(struct tile_data), count, callback);
+      }
+   }
+}
+
+#define REPROJECTION_BAND_HEIGHT 16
+#define REPROJECTION_PROBE_INTERVAL 16
+
+struct reprojection_overflow
+{
+   u32 index;
+   u64 target;
+};
+
+struct reprojection_band
+{
+   u32 miny;
+   u32 maxy;
+
+   u32 overflow_count;
+   struct reprojection_overflow *overflows;
+};
+
+function void
+reproject_rows(struct reprojection_band *band)
+{
+   // NOTE(law): Move the previous frame's hits in the band's rows to the
+   // pixels they land on in the current camera. Several hits can land on the
+   // same pixel, so the nearest is kept. Each band only writes the target rows
+   // it owns, which keeps the pass free of atomics: hits landing in another
+   // band's rows are set aside and applied once every band is done. Hits
+   // behind the camera or outside the bitmap are dropped, and pixels nothing
+   // lands on stay empty.
+
+   u32 width = renderer.reprojection_width;
+   u32 height = renderer.reprojection_height;
+
+   u32 read_index = renderer.reprojection_write_index ^ 1;
+   float *distances = renderer.reprojection_distances[read_index];
+   u32 *tags = renderer.reprojection_tags[read_index];
+   u64 *targets = renderer.reprojection_targets;
+
+   u32 first_owned = band->miny * width;
+   u32 last_owned = band->maxy * width;
+   band->overflow_count = 0;
+
+   // NOTE(law): Rebuild the previous frame's rays the same way the pixel loop
+   // generated them.
+   struct camera_state *previous = &renderer.reprojection_camera;
+
+   float film_width = 1.0f;
+   float film_height = 1.0f / ((float)width / (float)height);
+   v3 film_center = sub3(previous->position, mul3(previous->z, previous->focal_length));
+
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_f32 two = lane_f32_from_float(2.0f);
+   lane_f32 half = lane_f32_from_float(0.5f);
+   lane_f32 lane_width = lane_f32_from_float((float)width);
+   lane_f32 lane_height = lane_f32_from_float((float)height);
+   lane_f32 jitter_x = lane_f32_from_float(renderer.reprojection_jitter_x);
+   lane_f32 minimum_depth = lane_f32_from_float(0.0001f);
+
+   lane_v3 origin = lane_v3_from_v3(previous->position);
+   lane_v3 previous_x = lane_v3_from_v3(previous->x);
+   lane_v3 film_center_lanes = lane_v3_from_v3(film_center);
+
+   // NOTE(law): Project into the current camera, whose pixels are not
+   // jittered: frames that reproject are never accumulated samples past the
+   // first.
+   lane_v3 position = lane_v3_from_v3(scene.camera_position);
+   lane_v3 camera_x = lane_v3_from_v3(scene.camera_x);
+   lane_v3 camera_y = lane_v3_from_v3(scene.camera_y);
+   lane_v3 camera_z = lane_v3_from_v3(scene.camera_z);
+   lane_f32 scale_u = lane_f32_from_float(scene.focal_length / (0.5f * film_width));
+   lane_f32 scale_v = lane_f32_from_float(scene.focal_length / (0.5f * film_height));
+
+   for(u32 y = band->miny; y < band->maxy; ++y)
+   {
+      float film_v = -1.0f + (2.0f * (((float)y + renderer.reprojection_jitter_y) / (float)height));
+      lane_v3 row_offset = lane_v3_from_v3(mul3(previous->y, film_v * 0.5f * film_height));
+
+      u32 row_index = y * width;
+      for(u32 x = 0; x < width; x += LANE_WIDTH)
+      {
+         u32 lane_count = MINIMUM(width - x, LANE_WIDTH);
+
+         u32 lane_tags[LANE_WIDTH];
+         LANE_ALIGNED float lane_distances[LANE_WIDTH] = {0};
+
+         bool any_hit = false;
+         for(u32 lane = 0; lane < lane_count; ++lane)
+         {
+            lane_tags[lane] = tags[row_index + x + lane];
+            lane_distances[lane] = distances[row_index + x + lane];
+            any_hit = any_hit || get_reprojection_surface(lane_tags[lane]);
+         }
+
+         if(!any_hit)
+         {
+            continue;
+         }
+
+         lane_f32 pixel_x = lane_add(lane_f32_from_u32(lane_u32_index(x)), jitter_x);
+         lane_f32 film_u = lane_add(lane_f32_from_float(-1.0f), lane_mul(two, lane_div(pixel_x, lane_width)));
+         lane_f32 film_offset = lane_mul(lane_mul(film_u, half), lane_f32_from_float(film_width));
+
+         lane_v3 film = lane_add3(lane_add3(film_center_lanes, lane_mul3(previous_x, film_offset)), row_offset);
+         lane_v3 direction = lane_noz3(lane_sub3(film, origin));
+
+         lane_v3 point = lane_add3(origin, lane_mul3(direction, lane_f32_load(lane_distances)));
+         lane_v3 relative = lane_sub3(point, position);
+
+         lane_f32 depth = lane_sub(zero, lane_dot3(relative, camera_z));
+         lane_f32 target_u = lane_div(lane_mul(lane_dot3(relative, camera_x), scale_u), depth);
+         lane_f32 target_v = lane_div(lane_mul(lane_dot3(relative, camera_y), scale_v), depth);
+
+         lane_f32 pixel_u = lane_round(lane_mul(lane_mul(lane_add(target_u, lane_f32_from_float(1.0f)), half), lane_width));
+         lane_f32 pixel_v = lane_round(lane_mul(lane_mul(lane_add(target_v, lane_f32_from_float(1.0f)), half), lane_height));
+
+         lane_f32 inside = lane_and(lane_greater(depth, minimum_depth),
+                                    lane_and(lane_and(lane_greater_equal(pixel_u, zero), lane_less(pixel_u, lane_width)),
+                                             lane_and(lane_greater_equal(pixel_v, zero), lane_less(pixel_v, lane_height))));
+
+         u32 inside_bits = lane_mask_bits(inside);
+         if(!inside_bits)
+         {
+            continue;
+         }
+
+         // NOTE(law): Indices are exact in single precision for bitmaps up to
+         // 2^24 pixels.
+         LANE_ALIGNED float target_distance[LANE_WIDTH];
+         u32 target_index[LANE_WIDTH];
+         lane_f32_store(target_distance, lane_square_root(lane_dot3(relative, relative)));
+         lane_u32_store(target_index, lane_u32_from_f32(lane_add(lane_mul(pixel_v, lane_width), pixel_u)));
+
+         for(u32 lane = 0; lane < lane_count; ++lane)
+         {
+            s32 surface = get_reprojection_surface(lane_tags[lane]);
+            if(!surface || !(inside_bits & (1 << lane)))
+            {
+               continue;
+            }
+
+            u32 distance_bits;
+            memcpy(&distance_bits, target_distance + lane, sizeof(distance_bits));
+
+            u32 age = (lane_tags[lane] & 0xFF) + 1;
+            u64 target = ((u64)distance_bits << 32) | make_reprojection_tag(surface, age);
+
+            u32 index = target_index[lane];
+            if(index >= first_owned && index < last_owned)
+            {
+               targets[index] = MINIMUM(targets[index], target);
+            }
+            else
+            {
+               struct reprojection_overflow *overflow = band->overflows + band->overflow_count++;
+               overflow->index = index;
+               overflow->target = target;
+            }
+         }
+      }
+   }
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(reproject_rows_callback)
+{
+   struct reprojection_band *band = (struct reprojection_band *)data;
+
+   u64 profile_start = profile_begin();
+   reproject_rows(band);
+   profile_end(PROFILE_EVENT_REPROJECT, profile_start, 0, band->miny);
+}
+
+function void
+begin_reprojection(struct render_bitmap *bitmap, struct platform_work_queue *queue, bool scene_changed)
+{
+   // NOTE(law): Decide whether this frame's primary pass can reuse the last
+   // one's hits, and if so, reproject them before any tile starts. Reuse is
+   // off whenever the scene changed, the bitmap was resized, or the frame is
+   // an accumulated sample past the first, whose jittered rays need tracing.
+
+   renderer.reprojection_active = false;
+   renderer.reprojection_eligible = false;
+   if(!renderer.reprojection_enabled)
+   {
+      renderer.reprojection_valid = false;
+      return;
+   }
+
+   u32 pixel_count = bitmap->width * bitmap->height;
+   size_t size = (size_t)pixel_count * (2 * sizeof(float) + 2 * sizeof(u32) + sizeof(u64));
+   if(size > renderer.reprojection_capacity)
+   {
+      if(renderer.reprojection_memory)
+      {
+         platform_deallocate(renderer.reprojection_memory);
+      }
+
+      renderer.reprojection_memory = platform_allocate(size);
+      renderer.reprojection_capacity = (renderer.reprojection_memory) ? size : 0;
+      renderer.reprojection_valid = false;
+      if(!renderer.reprojection_memory)
+      {
+         renderer.reprojection_enabled = false;
+         return;
+      }
+   }
+
+   if(bitmap->width != renderer.reprojection_width || bitmap->height != renderer.reprojection_height)
+   {
+      u64 *targets = (u64 *)renderer.reprojection_memory;
+      renderer.reprojection_targets = targets;
+      renderer.reprojection_distances[0] = (float *)(targets + pixel_count);
+      renderer.reprojection_distances[1] = renderer.reprojection_distances[0] + pixel_count;
+      renderer.reprojection_tags[0] = (u32 *)(renderer.reprojection_distances[1] + pixel_count);
+      renderer.reprojection_tags[1] = renderer.reprojection_tags[0] + pixel_count;
+
+      renderer.reprojection_width = bitmap->width;
+      renderer.reprojection_height = bitmap->height;
+      renderer.reprojection_valid = false;
+   }
+
+   bool accumulate = renderer.progressive_enabled;
+   renderer.reprojection_eligible = (renderer.reprojection_valid && !scene_changed &&
+                                     (!accumulate || renderer.sample_count <= 1) &&
+                                     scene.planes.count <= REPROJECTION_MAX_SURFACE &&
+                                     scene.primitive_count <= REPROJECTION_MAX_SURFACE);
+
+   if(renderer.reprojection_eligible)
+   {
+      // NOTE(law): Measure each way once, then keep the cheaper one and
+      // occasionally try the other, since the costs change with the view.
+      float reused_cost = renderer.reprojection_reused_cost;
+      float traced_cost = renderer.reprojection_traced_cost;
+
+      bool reuse = (reused_cost <= traced_cost);
+      renderer.reprojection_probing = false;
+      if(reused_cost == 0 || traced_cost == 0)
+      {
+         reuse = (reused_cost == 0);
+      }
+      else if(renderer.reprojection_probe_countdown-- == 0)
+      {
+         reuse = !reuse;
+         renderer.reprojection_probing = true;
+         renderer.reprojection_probe_countdown = REPROJECTION_PROBE_INTERVAL;
+      }
+
+      renderer.reprojection_active = reuse;
+   }
+
+   // NOTE(law): This frame records into the buffer the last frame read from.
+   renderer.reprojection_write_index ^= 1;
+
+   u32 band_count = (bitmap->height + REPROJECTION_BAND_HEIGHT - 1) / REPROJECTION_BAND_HEIGHT;
+   struct reprojection_band *bands = 0;
+   struct reprojection_overflow *overflows = 0;
+   if(renderer.reprojection_active)
+   {
+      // NOTE(law): Without room in the frame arena, trace this frame normally.
+      bands = PUSH_ARRAY(&arenas.frame, band_count, struct reprojection_band);
+      overflows = PUSH_ARRAY(&arenas.frame, pixel_count, struct reprojection_overflow);
+      renderer.reprojection_active = (bands && overflows);
+   }
+
+   if(renderer.reprojection_active)
+   {
+      memset(renderer.reprojection_targets, 0xFF, (size_t)pixel_count * sizeof(u64));
+
+      // NOTE(law): A band can set aside at most one hit per pixel it reads.
+      for(u32 index = 0; index < band_count; ++index)
+      {
+         bands[index].miny = index * REPROJECTION_BAND_HEIGHT;
+         bands[index].maxy = MINIMUM(bands[index].miny + REPROJECTION_BAND_HEIGHT, bitmap->height);
+         bands[index].overflows = overflows + (bands[index].miny * bitmap->width);
+      }
+
+      // NOTE(law): Hand each node the bands over its own rows, as with tiles.
+      u32 node_count = MAXIMUM(MINIMUM(platform_get_queue_node_count(queue), TILE_MAX_NODE_COUNT), 1);
+
+      u32 first = 0;
+      while(first < band_count)
+      {
+         u32 node = get_bitmap_row_node(bitmap, bands[first].miny, node_count);
+         u32 count = 1;
+         while(first + count < band_count && get_bitmap_row_node(bitmap, bands[first + count].miny, node_count) == node)
+         {
+            count++;
+         }
+
+         platform_enqueue_work_batch(queue, node, bands + first, sizeof(struct reprojection_band), count,
+                                     reproject_rows_callback);
+         first += count;
+      }
+
+      platform_complete_queue(queue);
+
+      u64 *targets = renderer.reprojection_targets;
+      for(u32 band_index = 0; band_index < band_count; ++band_index)
+      {
+         struct reprojection_band *band = bands + band_index;
+         for(u32 index = 0; index < band->overflow_count; ++index)
+         {
+            struct reprojection_overflow *overflow = band->overflows + index;
+            targets[overflow->index] = MINIMUM(targets[overflow->index], overflow->target);
+         }
+      }
+   }
+
+   renderer.reprojection_camera.position = scene.camera_position;
+   renderer.reprojection_camera.x = scene.camera_x;
+   renderer.reprojection_camera.y = scene.camera_y;
+   renderer.reprojection_camera.z = scene.camera_z;
+   renderer.reprojection_camera.focal_length = scene.focal_length;
+   renderer.reprojection_jitter_x = (accumulate) ? renderer.sample_jitter_x : 0.0f;
+   renderer.reprojection_jitter_y = (accumulate) ? renderer.sample_jitter_y : 0.0f;
+   renderer.reprojection_frame_index++;
+   renderer.reprojection_reused_count = 0;
+
+   // NOTE(law): The primary pass records every pixel, so the next frame can
+   // rely on the cache.
+   renderer.reprojection_valid = true;
+}
+
+// NOTE(law): Secondary rays. When renderer.bounce_count is nonzero, frames are
+// rendered by a wavefront pipeline instead of the tile pass. The bitmap is
+// split into batches of rows, and each stage runs over every ray of a batch
+// as jobs on the work queue, which is completed between stages:
+//
+//    1. ray generation writes one camera ray per pixel,
+//    2. intersection finds each ray's closest hit, or any hit for shadow rays,
+//    3. shading adds each ray's contribution to its pixel and emits the
+//       reflection and shadow rays of the next wave,
+//    4. compaction gathers the emitted rays into the next wave's array.
+//
+// Stages 2 to 4 repeat until no rays are left. Compaction groups the rays by
+// kind and direction octant, so the lanes of a packet are all live and head
+// the same way, which the BVH's front-to-back child order relies on.
+//
+// Surfaces keep the primary pass's shading. A sun lights them from
+// WAVEFRONT_SUN_DIRECTION: a surface keeps WAVEFRONT_SHADOW_AMBIENT of its
+// color in shadow, and gets the rest back if its shadow ray reaches the sky.
+// Reflective surfaces blend in what their reflection ray sees, up to
+// renderer.bounce_count reflections deep.
+
+#define WAVEFRONT_MAX_BOUNCE_COUNT 4
+#define WAVEFRONT_BATCH_PIXEL_COUNT (128 * 1024)
+#define WAVEFRONT_CHUNK_SIZE 2048 // NOTE(law): Rays per intersection, shading or compaction job.
+#define WAVEFRONT_BUCKET_COUNT 16 // NOTE(law): Two ray kinds times eight octants.
+
+#define WAVEFRONT_SUN_DIRECTION vec3(0.4f, 0.6f, 1.0f)
+#define WAVEFRONT_SHADOW_AMBIENT 0.5f
+
+// NOTE(law): Secondary rays start this far off their surface, along its normal.
+#define WAVEFRONT_RAY_OFFSET 0.001f
+
+// NOTE(law): Rays whose weight falls below this in every channel cannot change
+// an 8-bit pixel, and are not emitted.
+#define WAVEFRONT_MINIMUM_WEIGHT (1.0f / 512.0f)
+
+enum wavefront_ray_kind
+{
+   WAVEFRONT_RAY_EXTENSION,
+   WAVEFRONT_RAY_SHADOW,
+};
+
+struct wavefront_ray
+{
+   v3 origin;
+   u32 pixel; // NOTE(law): Index into the batch's color planes.
+   v3 direction;
+   u16 kind;
+   u16 depth;
+
+   // NOTE(law): Extension rays carry the fraction of what they hit that
+   // reaches their pixel. Shadow rays carry the color they add to their pixel
+   // if nothing blocks them.
+   v3 weight;
+};
+
+struct wavefront_hit
+{
+   v3 normal;
+   float t;
+   v3 color;
+   float surface;
+};
+
+struct wavefront_rows
+{
+   u32 miny;
+   u32 maxy;
+
+   // NOTE(law): When the callback started and finished the band.
+   u64 work_start;
+   u64 work_end;
+};
+
+struct wavefront_chunk
+{
+   u32 first;
+   u32 count;
+
+   // NOTE(law): Shading writes the rays a chunk emits into its own stretch of
+   // the emission buffer, and counts them per bucket. Compaction then moves
+   // them to the offsets the main thread assigned to each bucket.
+   struct wavefront_ray *emitted;
+   u32 emitted_count;
+   u32 bucket_counts[WAVEFRONT_BUCKET_COUNT];
+   u32 bucket_offsets[WAVEFRONT_BUCKET_COUNT];
+};
+
+global struct
+{
+   struct render_bitmap *bitmap;
+   v3 sun_direction;
+   u32 wave;
+
+   // NOTE(law): The rows of the current batch, and color planes holding their
+   // pixels. Planes have stride floats per row, so every row starts on a lane
+   // boundary as write_pixel_span() expects.
+   u32 batch_row_count;
+   u32 batch_miny;
+   u32 batch_maxy;
+   u32 stride;
+   float *color_r;
+   float *color_g;
+   float *color_b;
+
+   // NOTE(law): A batch never has more than one extension and one shadow ray
+   // per pixel in flight, and a chunk never emits more than two rays per ray.
+   u32 ray_capacity;
+   u32 ray_count;
+   u32 extension_count;
+   struct wavefront_ray *rays;
+   struct wavefront_ray *next_rays;
+   struct wavefront_ray *emitted;
+   struct wavefront_hit *hits;
+
+   u32 chunk_capacity;
+   u32 chunk_count;
+   struct wavefront_chunk *chunks;
+
+   u32 rows_capacity;
+   u32 rows_count;
+   struct wavefront_rows *rows;
+} wavefront;
+
+function u32
+get_wavefront_bucket(u32 kind, v3 direction)
+{
+   u32 octant = ((direction.x < 0) ? 1 : 0) | ((direction.y < 0) ? 2 : 0) | ((direction.z < 0) ? 4 : 0);
+
+   u32 result = (kind * 8) + octant;
+   return(result);
+}
+
+function float
+get_surface_reflectivity(s32 surface)
+{
+   float result = 0;
+   if(surface > 0)
+   {
+      result = scene.planes.reflectivity[surface - 1];
+   }
+   else if(surface < 0)
+   {
+      result = (float)scene.primitives[-surface - 1].reflectivity / (float)PRIMITIVE_REFLECTIVITY_ONE;
+   }
+
+   return(result);
+}
+
+function void
+add_wavefront_color(u32 pixel, v3 color)
+{
+   wavefront.color_r[pixel] += color.r;
+   wavefront.color_g[pixel] += color.g;
+   wavefront.color_b[pixel] += color.b;
+}
+
+function void
+generate_wavefront_rows(u32 miny, u32 maxy)
+{
+   // NOTE(law): Write the camera rays of the given rows, generated the same
+   // way as the tile pass's. They stay in row order: neighboring camera rays
+   // are coherent already.
+   struct render_bitmap *bitmap = wavefront.bitmap;
+   u32 bitmap_width = bitmap->width;
+   u32 bitmap_height = bitmap->height;
+
+   float aspect_ratio = (float)bitmap_width / (float)bitmap_height;
+   float film_width = 1.0f;
+   float film_height = 1.0f / aspect_ratio;
+   v3 film_center = sub3(scene.camera_position, mul3(scene.camera_z, scene.focal_length));
+
+   lane_f32 two = lane_f32_from_float(2.0f);
+   lane_f32 half_film_width = lane_f32_from_float(0.5f);
+   lane_f32 width = lane_f32_from_float((float)bitmap_width);
+
+   lane_v3 camera_x = lane_v3_from_v3(scene.camera_x);
+   lane_v3 film_center_lanes = lane_v3_from_v3(film_center);
+   lane_v3 origin = lane_v3_from_v3(scene.camera_position);
+
+   bool accumulate = renderer.progressive_enabled;
+   float jitter_x = (accumulate) ? renderer.sample_jitter_x : 0.0f;
+   float jitter_y = (accumulate) ? renderer.sample_jitter_y : 0.0f;
+   lane_f32 sample_jitter_x = lane_f32_from_float(jitter_x);
+
+   for(u32 y = miny; y < maxy; ++y)
+   {
+      float film_v = -1.0f + (2.0f * (((float)y + jitter_y) / (float)bitmap_height));
+      lane_v3 row_offset = lane_v3_from_v3(mul3(scene.camera_y, film_v * 0.5f * film_height));
+
+      u32 batch_row = y - wavefront.batch_miny;
+      u32 pixel_row = batch_row * wavefront.stride;
+      struct wavefront_ray *rays = wavefront.rays + (batch_row * bitmap_width);
+
+      memset(wavefront.color_r + pixel_row, 0, wavefront.stride * sizeof(float));
+      memset(wavefront.color_g + pixel_row, 0, wavefront.stride * sizeof(float));
+      memset(wavefront.color_b + pixel_row, 0, wavefront.stride * sizeof(float));
+
+      for(u32 x = 0; x < bitmap_width; x += LANE_WIDTH)
+      {
+         lane_f32 pixel_x = lane_add(lane_f32_from_u32(lane_u32_index(x)), sample_jitter_x);
+         lane_f32 film_u = lane_add(lane_f32_from_float(-1.0f), lane_mul(two, lane_div(pixel_x, width)));
+         lane_f32 film_offset = lane_mul(lane_mul(film_u, half_film_width), lane_f32_from_float(film_width));
+
+         lane_v3 film = lane_add3(lane_add3(film_center_lanes, lane_mul3(camera_x, film_offset)), row_offset);
+         lane_v3 direction = lane_noz3(lane_sub3(film, origin));
+
+         LANE_ALIGNED float direction_x[LANE_WIDTH];
+         LANE_ALIGNED float direction_y[LANE_WIDTH];
+         LANE_ALIGNED float direction_z[LANE_WIDTH];
+         lane_f32_store(direction_x, direction.x);
+         lane_f32_store(direction_y, direction.y);
+         lane_f32_store(direction_z, direction.z);
+
+         u32 lane_count = MINIMUM(bitmap_width - x, LANE_WIDTH);
+         for(u32 lane = 0; lane < lane_count; ++lane)
+         {
+            struct wavefront_ray *ray = rays + x + lane;
+            ray->origin = scene.camera_position;
+            ray->pixel = pixel_row + x + lane;
+            ray->direction = vec3(direction_x[lane], direction_y[lane], direction_z[lane]);
+            ray->kind = WAVEFRONT_RAY_EXTENSION;
+            ray->depth = 0;
+            ray->weight = vec3(1, 1, 1);
+         }
+      }
+   }
+}
+
+function void
+resolve_wavefront_rows(u32 miny, u32 maxy)
+{
+   // NOTE(law): Write the finished colors of the given rows to the bitmap,
+   // through the same accumulation and output path as the tile pass.
+   struct render_bitmap *bitmap = wavefront.bitmap;
+
+   bool accumulate = renderer.progressive_enabled;
+   bool first_sample = (renderer.sample_count <= 1);
+   float inverse_sample_count = (accumulate) ? 1.0f / (float)renderer.sample_count : 1.0f;
+
+   for(u32 y = miny; y < maxy; ++y)
+   {
+      u32 pixel_row = (y - wavefront.batch_miny) * wavefront.stride;
+      float *r = wavefront.color_r + pixel_row;
+      float *g = wavefront.color_g + pixel_row;
+      float *b = wavefront.color_b + pixel_row;
+
+      if(accumulate)
+      {
+         u32 accumulation_row = y * renderer.accumulation_stride;
+         float *accumulated_r = renderer.accumulation_r + accumulation_row;
+         float *accumulated_g = renderer.accumulation_g + accumulation_row;
+         float *accumulated_b = renderer.accumulation_b + accumulation_row;
+
+         for(u32 x = 0; x < bitmap->width; x += LANE_WIDTH)
+         {
+            lane_v3 color = lane_v3_load(r + x, g + x, b + x);
+            if(!first_sample)
+            {
+               color = lane_add3(lane_v3_load(accumulated_r + x, accumulated_g + x, accumulated_b + x), color);
+            }
+
+            lane_f32_store(accumulated_r + x, color.r);
+            lane_f32_store(accumulated_g + x, color.g);
+            lane_f32_store(accumulated_b + x, color.b);
+         }
+
+         r = accumulated_r;
+         g = accumulated_g;
+         b = accumulated_b;
+      }
+
+      write_pixel_span(bitmap, y * bitmap->width, bitmap->width, r, g, b, inverse_sample_count);
+   }
+}
+
+function void
+intersect_wavefront_planes(struct ray_packet *ray, struct hit_packet *hit)
+{
+   // NOTE(law): Like intersect_planes(), but for rays that start at different
+   // points, so the numerators are computed per lane.
+   struct scene_planes *planes = &scene.planes;
+
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_f32 denominator_epsilon = lane_f32_from_float(0.0001f);
+
+   for(u32 plane_index = 0; plane_index < planes->count; ++plane_index)
+   {
+      lane_v3 normal = lane_vec3(lane_f32_from_float(planes->normal_x[plane_index]),
+                                 lane_f32_from_float(planes->normal_y[plane_index]),
+                                 lane_f32_from_float(planes->normal_z[plane_index]));
+
+      lane_f32 denominator = lane_dot3(normal, ray->direction);
+      lane_f32 numerator = lane_sub(lane_sub(zero, lane_f32_from_float(planes->distance[plane_index])),
+                                    lane_dot3(normal, ray->origin));
+
+      lane_f32 t = lane_div(numerator, denominator);
+
+      lane_f32 mask = lane_greater(lane_absolute_value(denominator), denominator_epsilon);
+      mask = lane_and(mask, lane_greater(t, zero));
+      mask = lane_and(mask, lane_less(t, hit->t));
+
+      if(lane_any(mask))
+      {
+         hit->t = lane_select(mask, hit->t, t);
+         hit->mask = lane_or(hit->mask, mask);
+
+         lane_v3 color = lane_vec3(lane_f32_from_float(planes->color_r[plane_index]),
+                                   lane_f32_from_float(planes->color_g[plane_index]),
+                                   lane_f32_from_float(planes->color_b[plane_index]));
+
+         hit->normal = lane_select3(mask, hit->normal, normal);
+         hit->color = lane_select3(mask, hit->color, color);
+
+         hit->surface = lane_select(mask, hit->surface, lane_f32_from_float((float)(plane_index + 1)));
+      }
+   }
+}
+
+function void
+intersect_wavefront_chunk(struct wavefront_chunk *chunk)
+{
+   // NOTE(law): Rays are loaded into packets of LANE_WIDTH consecutive rays.
+   // The last packet of a chunk repeats its last ray in the spare lanes.
+   lane_f32 one = lane_f32_from_float(1.0f);
+   u32 root = 0;
+
+   for(u32 first = chunk->first; first < chunk->first + chunk->count; first += LANE_WIDTH)
+   {
+      u32 lane_count = MINIMUM(chunk->first + chunk->count - first, LANE_WIDTH);
+
+      LANE_ALIGNED float origin_x[LANE_WIDTH];
+      LANE_ALIGNED float origin_y[LANE_WIDTH];
+      LANE_ALIGNED float origin_z[LANE_WIDTH];
+      LANE_ALIGNED float direction_x[LANE_WIDTH];
+      LANE_ALIGNED float direction_y[LANE_WIDTH];
+      LANE_ALIGNED float direction_z[LANE_WIDTH];
+
+      bool any_hit = true;
+      for(u32 lane = 0; lane < LANE_WIDTH; ++lane)
+      {
+         struct wavefront_ray *ray = wavefront.rays + first + MINIMUM(lane, lane_count - 1);
+         origin_x[lane] = ray->origin.x;
+         origin_y[lane] = ray->origin.y;
+         origin_z[lane] = ray->origin.z;
+         direction_x[lane] = ray->direction.x;
+         direction_y[lane] = ray->direction.y;
+         direction_z[lane] = ray->direction.z;
+
+         any_hit = any_hit && (ray->kind == WAVEFRONT_RAY_SHADOW);
+      }
+
+      struct ray_packet packet;
+      packet.origin = lane_v3_load(origin_x, origin_y, origin_z);
+      packet.direction = lane_v3_load(direction_x, direction_y, direction_z);
+      packet.inverse.x = lane_div(one, packet.direction.x);
+      packet.inverse.y = lane_div(one, packet.direction.y);
+      packet.inverse.z = lane_div(one, packet.direction.z);
+
+      struct hit_packet hit = {0};
+      hit.t = lane_f32_from_float(FLT_MAX);
+
+      intersect_wavefront_planes(&packet, &hit);
+      if(!any_hit || lane_mask_bits(hit.mask) != LANE_ALL_BITS)
+      {
+         intersect_bvh(&scene.bvh, scene.primitives, &root, 1, &packet, &hit, any_hit);
+      }
+
+      LANE_ALIGNED float t[LANE_WIDTH];
+      LANE_ALIGNED float surface[LANE_WIDTH];
+      LANE_ALIGNED float normal_x[LANE_WIDTH];
+      LANE_ALIGNED float normal_y[LANE_WIDTH];
+      LANE_ALIGNED float normal_z[LANE_WIDTH];
+      LANE_ALIGNED float color_r[LANE_WIDTH];
+      LANE_ALIGNED float color_g[LANE_WIDTH];
+      LANE_ALIGNED float color_b[LANE_WIDTH];
+      lane_f32_store(t, hit.t);
+      lane_f32_store(surface, hit.surface);
+      lane_f32_store(normal_x, hit.normal.x);
+      lane_f32_store(normal_y, hit.normal.y);
+      lane_f32_store(normal_z, hit.normal.z);
+      lane_f32_store(color_r, hit.color.r);
+      lane_f32_store(color_g, hit.color.g);
+      lane_f32_store(color_b, hit.color.b);
+
+      for(u32 lane = 0; lane < lane_count; ++lane)
+      {
+         struct wavefront_hit *destination = wavefront.hits + first + lane;
+         destination->normal = vec3(normal_x[lane], normal_y[lane], normal_z[lane]);
+         destination->t = t[lane];
+         destination->color = vec3(color_r[lane], color_g[lane], color_b[lane]);
+         destination->surface = surface[lane];
+      }
+   }
+}
+
+function void
+emit_wavefront_ray(struct wavefront_chunk *chunk, u32 kind, u32 depth, u32 pixel, v3 origin, v3 direction, v3 weight)
+{
+   if(weight.r < WAVEFRONT_MINIMUM_WEIGHT && weight.g < WAVEFRONT_MINIMUM_WEIGHT && weight.b < WAVEFRONT_MINIMUM_WEIGHT)
+   {
+      return;
+   }
+
+   struct wavefront_ray *ray = chunk->emitted + chunk->emitted_count++;
+   ray->origin = origin;
+   ray->pixel = pixel;
+   ray->direction = direction;
+   ray->kind = (u16)kind;
+   ray->depth = (u16)depth;
+   ray->weight = weight;
+
+   chunk->bucket_counts[get_wavefront_bucket(kind, direction)]++;
+}
+
+function void
+shade_wavefront_chunk(struct wavefront_chunk *chunk)
+{
+   v3 background = vec3(0.3f, 0.8f, 0.8f);
+   v3 sky = vec3(0, 1, 1);
+   v3 sun = wavefront.sun_direction;
+
+   chunk->emitted_count = 0;
+   memset(chunk->bucket_counts, 0, sizeof(chunk->bucket_counts));
+
+   for(u32 index = chunk->first; index < chunk->first + chunk->count; ++index)
+   {
+      struct wavefront_ray *ray = wavefront.rays + index;
+      struct wavefront_hit *hit = wavefront.hits + index;
+
+      v3 weight = ray->weight;
+
+      if(ray->kind == WAVEFRONT_RAY_SHADOW)
+      {
+         if(!hit->surface)
+         {
+            add_wavefront_color(ray->pixel, weight);
+         }
+         continue;
+      }
+
+      if(!hit->surface)
+      {
+         add_wavefront_color(ray->pixel, vec3(weight.r * sky.r, weight.g * sky.g, weight.b * sky.b));
+         continue;
+      }
+
+      // NOTE(law): The same shading as the primary pass, which uses the normal
+      // as stored, e.g. unnormalized for planes.
+      float facing = -dot3(ray->direction, hit->normal);
+      v3 local = lerp3(background, facing, hit->color);
+      v3 surface_weight = vec3(weight.r * local.r, weight.g * local.g, weight.b * local.b);
+
+      float reflectivity = get_surface_reflectivity((s32)hit->surface);
+
+      v3 normal = noz3(hit->normal);
+      if(dot3(normal, ray->direction) > 0)
+      {
+         normal = mul3(normal, -1.0f);
+      }
+
+      v3 point = add3(ray->origin, mul3(ray->direction, hit->t));
+      v3 origin = add3(point, mul3(normal, WAVEFRONT_RAY_OFFSET));
+
+      v3 direct = mul3(surface_weight, 1.0f - reflectivity);
+      add_wavefront_color(ray->pixel, mul3(direct, WAVEFRONT_SHADOW_AMBIENT));
+      if(dot3(normal, sun) > 0)
+      {
+         emit_wavefront_ray(chunk, WAVEFRONT_RAY_SHADOW, ray->depth, ray->pixel, origin, sun,
+                            mul3(direct, 1.0f - WAVEFRONT_SHADOW_AMBIENT));
+      }
+
+      if(reflectivity > 0)
+      {
+         // NOTE(law): Past the last bounce, the reflection is approximated by
+         // the surface's own color.
+         if(ray->depth < renderer.bounce_count)
+         {
+            v3 reflected = sub3(ray->direction, mul3(normal, 2.0f * dot3(ray->direction, normal)));
+            emit_wavefront_ray(chunk, WAVEFRONT_RAY_EXTENSION, ray->depth + 1, ray->pixel, origin, reflected,
+                               mul3(weight, reflectivity));
+         }
+         else
+         {
+            add_wavefront_color(ray->pixel, mul3(surface_weight, reflectivity));
+         }
+      }
+   }
+}
+
+function void
+compact_wavefront_chunk(struct wavefront_chunk *chunk)
+{
+   u32 offsets[WAVEFRONT_BUCKET_COUNT];
+   memcpy(offsets, chunk->bucket_offsets, sizeof(offsets));
+
+   for(u32 index = 0; index < chunk->emitted_count; ++index)
+   {
+      struct wavefront_ray *ray = chunk->emitted + index;
+      u32 bucket = get_wavefront_bucket(ray->kind, ray->direction);
+      wavefront.next_rays[offsets[bucket]++] = *ray;
+   }
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(generate_wavefront_rows_callback)
+{
+   struct wavefront_rows *rows = (struct wavefront_rows *)data;
+
+   rows->work_start = platform_timestamp();
+
+   u64 profile_start = profile_begin();
+   generate_wavefront_rows(rows->miny, rows->maxy);
+   profile_end(PROFILE_EVENT_GENERATE_RAYS, profile_start, 0, rows->miny);
+
+   rows->work_end = platform_timestamp();
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(resolve_wavefront_rows_callback)
+{
+   struct wavefront_rows *rows = (struct wavefront_rows *)data;
+
+   u64 profile_start = profile_begin();
+   resolve_wavefront_rows(rows->miny, rows->maxy);
+   profile_end(PROFILE_EVENT_RESOLVE, profile_start, wavefront.wave, rows->miny);
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(intersect_wavefront_chunk_callback)
+{
+   struct wavefront_chunk *chunk = (struct wavefront_chunk *)data;
+
+   u64 profile_start = profile_begin();
+   intersect_wavefront_chunk(chunk);
+   profile_end(PROFILE_EVENT_INTERSECT, profile_start, wavefront.wave, chunk->first);
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(shade_wavefront_chunk_callback)
+{
+   struct wavefront_chunk *chunk = (struct wavefront_chunk *)data;
+
+   u64 profile_start = profile_begin();
+   shade_wavefront_chunk(chunk);
+   profile_end(PROFILE_EVENT_SHADE, profile_start, wavefront.wave, chunk->first);
+}
+
+function
+PLATFORM_QUEUE_CALLBACK(compact_wavefront_chunk_callback)
+{
+   struct wavefront_chunk *chunk = (struct wavefront_chunk *)data;
+
+   u64 profile_start = profile_begin();
+   compact_wavefront_chunk(chunk);
+   profile_end(PROFILE_EVENT_COMPACT, profile_start, wavefront.wave, chunk->first);
+}
+
+function void
+enqueue_wavefront_rows(struct platform_work_queue *queue, queue_callback *callback)
+{
+   // NOTE(law): Hand each node the bands of the batch over its own rows, as
+   // with tiles.
+   struct render_bitmap *bitmap = wavefront.bitmap;
+   u32 node_count = MAXIMUM(MINIMUM(platform_get_queue_node_count(queue), TILE_MAX_NODE_COUNT), 1);
+
+   u32 band_count = 0;
+   for(u32 miny = wavefront.batch_miny; miny < wavefront.batch_maxy; miny += REPROJECTION_BAND_HEIGHT)
+   {
+      struct wavefront_rows *rows = wavefront.rows + band_count++;
+      rows->miny = miny;
+      rows->maxy = MINIMUM(miny + REPROJECTION_BAND_HEIGHT, wavefront.batch_maxy);
+   }
+   assert(band_count <= wavefront.rows_capacity);
+   wavefront.rows_count = band_count;
+
+   u32 first = 0;
+   while(first < band_count)
+   {
+      u32 node = get_bitmap_row_node(bitmap, wavefront.rows[first].miny, node_count);
+      u32 count = 1;
+      while(first + count < band_count && get_bitmap_row_node(bitmap, wavefront.rows[first + count].miny, node_count) == node)
+      {
+         count++;
+      }
+
+      platform_enqueue_work_batch(queue, node, wavefront.rows + first, sizeof(struct wavefront_rows), count, callback);
+      first += count;
+   }
+}
+
+function void
+enqueue_wavefront_chunks(struct platform_work_queue *queue, u32 first, u32 count, queue_callback *callback)
+{
+   // NOTE(law): Chunks are spread over the nodes in even runs, since rays in
+   // later waves no longer follow the bitmap's rows.
+   u32 node_count = MAXIMUM(MINIMUM(platform_get_queue_node_count(queue), TILE_MAX_NODE_COUNT), 1);
+   for(u32 node = 0; node < node_count; ++node)
+   {
+      u32 node_first = first + (u32)(((u64)count * node) / node_count);
+      u32 node_last = first + (u32)(((u64)count * (node + 1)) / node_count);
+      if(node_last > node_first)
+      {
+         platform_enqueue_work_batch(queue, node, wavefront.chunks + node_first, sizeof(struct wavefront_chunk),
+                                     node_last - node_first, callback);
+      }
+   }
+}
+
+function u32
+split_wavefront_chunks(u32 first, u32 count)
+{
+   // NOTE(law): Append chunks covering the given rays and return how many.
+   u32 result = 0;
+   for(u32 offset = 0; offset < count; offset += WAVEFRONT_CHUNK_SIZE)
+   {
+      assert(wavefront.chunk_count < wavefront.chunk_capacity);
+      struct wavefront_chunk *chunk = wavefront.chunks + wavefront.chunk_count++;
+      chunk->first = first + offset;
+      chunk->count = MINIMUM(count - offset, WAVEFRONT_CHUNK_SIZE);
+      chunk->emitted = wavefront.emitted + (2 * chunk->first);
+      chunk->emitted_count = 0;
+
+      result++;
+   }
+
+   return(result);
+}
+
+function bool
+begin_wavefront(struct render_bitmap *bitmap)
+{
+   // NOTE(law): Set up this frame's wavefront storage on the frame arena.
+   // Returns false, and the frame falls back to the tile pass, if it does not
+   // fit.
+   wavefront.bitmap = bitmap;
+   wavefront.sun_direction = noz3(WAVEFRONT_SUN_DIRECTION);
+
+   wavefront.stride = LANE_PADDED_COUNT(bitmap->width);
+   wavefront.batch_row_count = MAXIMUM(WAVEFRONT_BATCH_PIXEL_COUNT / wavefront.stride, 1);
+   wavefront.batch_row_count = MINIMUM(wavefront.batch_row_count, bitmap->height);
+
+   u32 batch_pixel_count = wavefront.batch_row_count * wavefront.stride;
+   wavefront.ray_capacity = 2 * batch_pixel_count;
+   wavefront.chunk_capacity = (wavefront.ray_capacity / WAVEFRONT_CHUNK_SIZE) + 2;
+   wavefront.rows_capacity = (wavefront.batch_row_count / REPROJECTION_BAND_HEIGHT) + 1;
+
+   struct memory_arena *arena = &arenas.frame;
+   wavefront.color_r = PUSH_LANE_ARRAY(arena, batch_pixel_count, float);
+   wavefront.color_g = PUSH_LANE_ARRAY(arena, batch_pixel_count, float);
+   wavefront.color_b = PUSH_LANE_ARRAY(arena, batch_pixel_count, float);
+   wavefront.rays = PUSH_ARRAY(arena, wavefront.ray_capacity, struct wavefront_ray);
+   wavefront.next_rays = PUSH_ARRAY(arena, wavefront.ray_capacity, struct wavefront_ray);
+   wavefront.emitted = PUSH_ARRAY(arena, 2 * wavefront.ray_capacity, struct wavefront_ray);
+   wavefront.hits = PUSH_ARRAY(arena, wavefront.ray_capacity, struct wavefront_hit);
+   wavefront.chunks = PUSH_ARRAY(arena, wavefront.chunk_capacity, struct wavefront_chunk);
+   wavefront.rows = PUSH_ARRAY(arena, wavefront.rows_capacity, struct wavefront_rows);
+
+   bool result = (wavefront.color_r && wavefront.color_g && wavefront.color_b && wavefront.rays &&
+                  wavefront.next_rays && wavefront.emitted && wavefront.hits && wavefront.chunks && wavefront.rows);
+   if(!result)
+   {
+      platform_log("ERROR: Not enough frame memory for secondary rays, tracing primary rays only.\n");
+      renderer.bounce_count = 0;
+   }
+
+   renderer.wavefront_ray_count = 0;
+
+   return(result);
+}
+
+function void
+generate_wavefront_batch(struct platform_work_queue *queue, u32 miny)
+{
+   wavefront.wave = 0;
+   wavefront.batch_miny = miny;
+   wavefront.batch_maxy = MINIMUM(miny + wavefront.batch_row_count, wavefront.bitmap->height);
+   wavefront.ray_count = (wavefront.batch_maxy - miny) * wavefront.bitmap->width;
+   wavefront.extension_count = wavefront.ray_count;
+
+   enqueue_wavefront_rows(queue, generate_wavefront_rows_callback);
+}
+
+function void
+trace_wavefront_batch(struct platform_work_queue *queue)
+{
+   // NOTE(law): Run the generated batch through the intersection, shading and
+   // compaction stages until no rays are left, then write it to the bitmap.
+   while(wavefront.ray_count)
+   {
+      renderer.wavefront_ray_count += wavefront.ray_count;
+
+      // NOTE(law): Extension rays come first, so chunks never mix the two
+      // kinds. Shading extension rays adds to their pixels, and so does
+      // shading shadow rays, but a pixel has at most one of each in a wave.
+      // Keeping the two apart is what lets chunks add to pixels without
+      // synchronization.
+      wavefront.chunk_count = 0;
+      u32 extension_chunk_count = split_wavefront_chunks(0, wavefront.extension_count);
+      u32 shadow_chunk_count = split_wavefront_chunks(wavefront.extension_count,
+                                                      wavefront.ray_count - wavefront.extension_count);
+
+      enqueue_wavefront_chunks(queue, 0, wavefront.chunk_count, intersect_wavefront_chunk_callback);
+      platform_complete_queue(queue);
+
+      enqueue_wavefront_chunks(queue, 0, extension_chunk_count, shade_wavefront_chunk_callback);
+      platform_complete_queue(queue);
+
+      // NOTE(law): Assign every bucket its place in the next wave, in bucket
+      // order and then chunk order, so the rays of a chunk stay in order.
+      u32 next_count = 0;
+      u32 next_extension_count = 0;
+      for(u32 bucket = 0; bucket < WAVEFRONT_BUCKET_COUNT; ++bucket)
+      {
+         for(u32 index = 0; index < extension_chunk_count; ++index)
+         {
+            struct wavefront_chunk *chunk = wavefront.chunks + index;
+            chunk->bucket_offsets[bucket] = next_count;
+            next_count += chunk->bucket_counts[bucket];
+         }
+
+         if(bucket == (WAVEFRONT_RAY_SHADOW * 8) - 1)
+         {
+            next_extension_count = next_count;
+         }
+      }
+      assert(next_count <= wavefront.ray_capacity);
+
+      // NOTE(law): Shadow rays emit nothing, so they are shaded alongside the
+      // compaction of the extension rays' emissions.
+      enqueue_wavefront_chunks(queue, 0, extension_chunk_count, compact_wavefront_chunk_callback);
+      enqueue_wavefront_chunks(queue, extension_chunk_count, shadow_chunk_count, shade_wavefront_chunk_callback);
+      platform_complete_queue(queue);
+
+      struct wavefront_ray *rays = wavefront.rays;
+      wavefront.rays = wavefront.next_rays;
+      wavefront.next_rays = rays;
+      wavefront.ray_count = next_count;
+      wavefront.extension_count = next_extension_count;
+      wavefront.wave++;
+   }
+
+   enqueue_wavefront_rows(queue, resolve_wavefront_rows_callback);
+   platform_complete_queue(queue);
+}
+
+function void
+end_wavefront(struct platform_work_queue *queue)
+{
+   // NOTE(law): The first batch's rays were generated by begin_frame().
+   // Batches reuse the same storage, so each is finished before the next one
+   // is generated.
+   trace_wavefront_batch(queue);
+
+   for(u32 miny = wavefront.batch_maxy; miny < wavefront.bitmap->height; miny = wavefront.batch_maxy)
+   {
+      generate_wavefront_batch(queue, miny);
+      platform_complete_queue(queue);
+
+      trace_wavefront_batch(queue);
+   }
+}
+
+function bool
+begin_frame(struct render_bitmap *bitmap, struct user_input *input,
+            struct platform_work_queue *queue, float frame_seconds_elapsed)
+{
+   // NOTE(law): Process input, update the scene and enqueue the tiles of a new
+   // frame without waiting for them. Returns whether a frame was enqueued, in
+   // which case end_frame() must be called before the next begin_frame() and
+   // before bitmap is presented. The scene must not be modified in between.
+
+   profile_next_frame();
+   renderer.frame_profile_start = profile_begin();
+
+   if(!scene.is_initialized)
+   {
+      reset_scene();
+   }
+
+   // NOTE(law): Everything the last frame pushed is dead once its end_frame()
+   // returned.
+   reset_arena(&arenas.frame);
+
+   // NOTE(law): Handle user input.
+   if(input->function_keys[8])
+   {
+      renderer.bounce_count = (renderer.bounce_count + 1) % (WAVEFRONT_MAX_BOUNCE_COUNT + 1);
+      renderer.accumulation_width = 0;
+      platform_log("Reflection bounces: %u\n", renderer.bounce_count);
+   }
+
+   if(input->function_keys[7])
+   {
+      renderer.reprojection_enabled = !renderer.reprojection_enabled;
+      platform_log("Reprojection: %s\n", (renderer.reprojection_enabled) ? "on" : "off");
+   }
+
+   if(input->function_keys[6])
+   {
+      renderer.output_transform = (renderer.output_transform + 1) % OUTPUT_TRANSFORM_COUNT;
+      platform_log("Output transform: %s\n", output_transform_names[renderer.output_transform]);
+   }
+
+   if(input->function_keys[5] && renderer.adaptive_sample_budget > 0)
+   {
+      renderer.adaptive_enabled = !renderer.adaptive_enabled;
+      platform_log("Adaptive sampling: %s\n", (renderer.adaptive_enabled) ? "on" : "off");
+   }
+
+   if(input->function_keys[4] && renderer.render_seconds_budget > 0)
+   {
+      renderer.dynamic_resolution_enabled = !renderer.dynamic_resolution_enabled;
+      renderer.smoothed_render_seconds = 0;
+      platform_log("Dynamic resolution: %s\n", (renderer.dynamic_resolution_enabled) ? "on" : "off");
+   }
+
+   if(input->function_keys[3])
+   {
+      // NOTE(law): Forget the accumulated camera so the next progressive frame
+      // starts over.
+      renderer.progressive_enabled = !renderer.progressive_enabled;
+      renderer.accumulation_width = 0;
+      platform_log("Progressive rendering: %s\n", (renderer.progressive_enabled) ? "on" : "off");
+   }
+
+   if(input->function_keys[2])
+   {
+      renderer.tile_order = (renderer.tile_order + 1) % TILE_ORDER_COUNT;
+      platform_log("Tile order: %s\n", tile_order_names[renderer.tile_order]);
+   }
+
+   if(input->function_keys[1])
+   {
+      // NOTE(law): Reset camera.
+      point_camera(INITIAL_CAMERA_POSITION, INITIAL_TARGET_POSITION, INITIAL_CAMERA_UP);
+      scene.focal_length = INITIAL_FOCAL_LENGTH;
+   }
+   else
+   {
+      if(input->control_scroll)
+      {
+         scene.focal_length += (input->scroll_delta * 0.25f);
+      }
+
+      float move_increment = 10.0f * frame_seconds_elapsed;
+      float turn_increment = 0.25f * frame_seconds_elapsed;
+
+      if(input->move_up)
       {
          scene.camera_position = sub3(scene.camera_position, mul3(scene.camera_z, move_increment));
       }
@@ -540,37 +4093,177 @@ update(struct render_bitmap *bitmap, struct user_input *input,
       }
    }
 
-   // NOTE(law): Draw into bitmap.
+   bool scene_changed = scene.has_changed;
+   scene.has_changed = false;
+
+   if(scene.bvh_is_dirty)
+   {
+      build_bvh(&scene.bvh, scene.primitives, scene.primitive_count, &arenas.frame);
+      scene.bvh_is_dirty = false;
+   }
 
-#define TILE_WIDTH  64
-#define TILE_HEIGHT 64
+   // NOTE(law): Nothing can be traced without the plane terms, so a frame
+   // without room for them is skipped and the bitmap keeps its last contents.
+   renderer.plane_numerators = PUSH_LANE_ARRAY(&arenas.frame, scene.planes.count, float);
+   if(!renderer.plane_numerators)
+   {
+      report_frame_memory_shortage("plane terms, skipping frames");
+      scene.has_changed = scene_changed;
+      profile_end(PROFILE_EVENT_FRAME, renderer.frame_profile_start, 0, 0);
+      return(false);
+   }
+   compute_plane_numerators(renderer.plane_numerators);
 
-   struct tile_data tiles[TILE_WIDTH * TILE_HEIGHT];
+   // NOTE(law): Draw into bitmap. Once a progressive image has converged, the
+   // bitmap already holds the final result and there is nothing left to do.
+   apply_resolution_scale(bitmap);
 
-   u32 tile_count_x = ((bitmap->width - 1) / TILE_WIDTH) + 1;
-   u32 tile_count_y = ((bitmap->height - 1) / TILE_HEIGHT) + 1;
+   bool render_frame = true;
+   if(renderer.progressive_enabled)
+   {
+      render_frame = begin_progressive_sample(bitmap, scene_changed);
+   }
 
-   u32 tile_index = 0;
-   for(u32 y = 0; y < tile_count_y; ++y)
+   if(render_frame)
    {
-      u32 miny = TILE_HEIGHT * y;
-      u32 maxy = MINIMUM(miny + TILE_HEIGHT, bitmap->height);
+      renderer.render_start = platform_timestamp();
+
+      renderer.wavefront_active = (renderer.bounce_count > 0 && begin_wavefront(bitmap));
+      if(renderer.wavefront_active)
+      {
+         // NOTE(law): Refinement and reprojection only know about primary
+         // shading, so they sit these frames out. The reprojection cache is
+         // not recorded either, so it has to start over.
+         renderer.adaptive_active = false;
+         renderer.reprojection_active = false;
+         renderer.reprojection_eligible = false;
+         renderer.reprojection_valid = false;
 
-      for(u32 x = 0; x < tile_count_x; ++x)
+         generate_wavefront_batch(queue, 0);
+      }
+      else
       {
-         u32 minx = TILE_WIDTH * x;
-         u32 maxx = MINIMUM(minx + TILE_WIDTH, bitmap->width);
+         begin_adaptive_sampling(bitmap);
+         begin_reprojection(bitmap, queue, scene_changed);
+
+         generate_tiles(bitmap, platform_get_queue_node_count(queue));
+         enqueue_tiles(queue, render_tile_callback);
+      }
+
+      renderer.render_enqueued = platform_timestamp();
+   }
+   else
+   {
+      profile_end(PROFILE_EVENT_FRAME, renderer.frame_profile_start, 0, 0);
+   }
 
-         struct tile_data *data = tiles + tile_index++;
-         data->bitmap = bitmap;
-         data->minx = minx;
-         data->miny = miny;
-         data->maxx = maxx;
-         data->maxy = maxy;
+   return(render_frame);
+}
 
-         platform_enqueue_work(queue, data, render_tile_callback);
+function u64
+get_enqueued_render_ns(void)
+{
+   // NOTE(law): The platform presents the previous frame between begin_frame()
+   // and end_frame(), and that time must not be charged to rendering. The work
+   // left behind by begin_frame() is timed from its own jobs instead: with
+   // workers they start while enqueueing, and without any they only start
+   // once end_frame() is called.
+   u64 work_start = (u64)-1;
+   u64 work_end = 0;
+   if(renderer.wavefront_active)
+   {
+      for(u32 index = 0; index < wavefront.rows_count; ++index)
+      {
+         work_start = MINIMUM(work_start, wavefront.rows[index].work_start);
+         work_end = MAXIMUM(work_end, wavefront.rows[index].work_end);
+      }
+   }
+   else
+   {
+      u32 tile_count = renderer.tile_node_offsets[renderer.tile_node_count];
+      for(u32 index = 0; index < tile_count; ++index)
+      {
+         work_start = MINIMUM(work_start, renderer.tiles[index].work_start);
+         work_end = MAXIMUM(work_end, renderer.tiles[index].work_end);
       }
    }
 
+   u64 result = renderer.render_enqueued - renderer.render_start;
+
+   u64 overlap_start = MAXIMUM(work_start, renderer.render_enqueued);
+   if(work_end > overlap_start)
+   {
+      result += work_end - overlap_start;
+   }
+
+   return(result);
+}
+
+function void
+end_frame(struct render_bitmap *bitmap, struct platform_work_queue *queue)
+{
+   // NOTE(law): Finish the frame enqueued by the last begin_frame(). The
+   // refinement pass needs every primary sample around a tile, so it can only
+   // start once the whole primary pass is done.
    platform_complete_queue(queue);
+
+   u64 enqueued_work_end = platform_timestamp();
+   u64 render_ns = get_enqueued_render_ns();
+
+   if(renderer.wavefront_active)
+   {
+      end_wavefront(queue);
+   }
+
+   if(renderer.reprojection_active)
+   {
+      u32 tile_count = renderer.tile_node_offsets[renderer.tile_node_count];
+      for(u32 index = 0; index < tile_count; ++index)
+      {
+         renderer.reprojection_reused_count += renderer.tiles[index].reused_count;
+      }
+   }
+
+   if(renderer.adaptive_active)
+   {
+      enqueue_tiles(queue, refine_tile_callback);
+      platform_complete_queue(queue);
+
+      update_adaptive_sampling(bitmap, renderer.tiles, renderer.tile_node_offsets[renderer.tile_node_count]);
+   }
+
+   // NOTE(law): Everything after the first completion ran here, without the
+   // platform presenting in between.
+   render_ns += platform_timestamp() - enqueued_work_end;
+   float render_seconds = (float)render_ns / 1e9f;
+
+   if(renderer.reprojection_eligible)
+   {
+      float *cost = (renderer.reprojection_active) ? &renderer.reprojection_reused_cost : &renderer.reprojection_traced_cost;
+      float pixel_cost = render_seconds / (float)(bitmap->width * bitmap->height);
+
+      // NOTE(law): Probes are too rare to smooth over, so they replace the
+      // estimate of the way not currently in use.
+      bool replace = (*cost == 0 || renderer.reprojection_probing);
+      *cost = (replace) ? pixel_cost : LERP(*cost, 0.25f, pixel_cost);
+   }
+
+   if(renderer.dynamic_resolution_enabled)
+   {
+      update_resolution_scale(bitmap, render_seconds);
+   }
+
+   profile_end(PROFILE_EVENT_FRAME, renderer.frame_profile_start, 0, 0);
+}
+
+function void
+update(struct render_bitmap *bitmap, struct user_input *input,
+       struct platform_work_queue *queue, float frame_seconds_elapsed)
+{
+   // NOTE(law): Synchronous version of the frame, for callers that have nothing
+   // to overlap with rendering.
+   if(begin_frame(bitmap, input, queue, frame_seconds_elapsed))
+   {
+      end_frame(bitmap, queue);
+   }
 }
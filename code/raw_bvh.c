@@ -0,0 +1,628 @@
+/* /////////////////////////////////////////////////////////////////////////// */
+/* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
+/* /////////////////////////////////////////////////////////////////////////// */
+
+// NOTE(law): Bounded primitives and the bounding volume hierarchy built over
+// them. Unbounded primitives (planes) are kept out of the hierarchy and are
+// intersected separately before traversal starts.
+
+#define BVH_BIN_COUNT 12
+#define BVH_LEAF_MAX_COUNT 4
+#define BVH_STACK_SIZE 64
+
+// NOTE(law): The most primitives a leaf can count in bvh_node.count.
+#define BVH_LEAF_COUNT_LIMIT 0xFFFF
+
+enum primitive_kind
+{
+   PRIMITIVE_SPHERE,
+   PRIMITIVE_BOX,
+   PRIMITIVE_TRIANGLE,
+};
+
+// NOTE(law): Reflectivity is stored as a fraction of this, in 16 bits next to
+// the kind, which keeps primitives at 64 bytes.
+#define PRIMITIVE_REFLECTIVITY_ONE 0xFFFF
+
+struct primitive
+{
+   u16 kind;
+   u16 reflectivity;
+   v3 color;
+
+   union
+   {
+      struct
+      {
+         v3 center;
+         float radius;
+      } sphere;
+
+      struct
+      {
+         v3 minimum;
+         v3 maximum;
+      } box;
+
+      struct
+      {
+         // NOTE(law): Triangles are stored in the form the Moller-Trumbore test
+         // consumes: one vertex, the two edges leaving it and the unit normal.
+         v3 vertex;
+         v3 edge1;
+         v3 edge2;
+         v3 normal;
+      } triangle;
+   };
+};
+
+struct bounds
+{
+   v3 minimum;
+   v3 maximum;
+};
+
+struct bvh_node
+{
+   // NOTE(law): Nodes are laid out depth-first, so the first child of an
+   // interior node always immediately follows it. Interior nodes store the
+   // index of their second child in offset, leaves store the index of their
+   // first primitive.
+
+   v3 minimum;
+   u32 offset;
+   v3 maximum;
+   u16 count; // NOTE(law): Zero for interior nodes.
+   u16 axis;
+};
+
+struct bvh
+{
+   // NOTE(law): A hierarchy over n primitives never needs more than 2n - 1
+   // nodes, which is what the node storage must be sized for before a build.
+   // Prebuilt hierarchies loaded from a compiled scene point into the file.
+   u32 node_count;
+   struct bvh_node *nodes;
+};
+
+function struct bounds
+empty_bounds(void)
+{
+   struct bounds result;
+   result.minimum = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+   result.maximum = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+   return(result);
+}
+
+function struct bounds
+bounds_grow(struct bounds bounds, v3 point)
+{
+   bounds.minimum.x = MINIMUM(bounds.minimum.x, point.x);
+   bounds.minimum.y = MINIMUM(bounds.minimum.y, point.y);
+   bounds.minimum.z = MINIMUM(bounds.minimum.z, point.z);
+
+   bounds.maximum.x = MAXIMUM(bounds.maximum.x, point.x);
+   bounds.maximum.y = MAXIMUM(bounds.maximum.y, point.y);
+   bounds.maximum.z = MAXIMUM(bounds.maximum.z, point.z);
+
+   return(bounds);
+}
+
+function struct bounds
+bounds_union(struct bounds a, struct bounds b)
+{
+   a.minimum.x = MINIMUM(a.minimum.x, b.minimum.x);
+   a.minimum.y = MINIMUM(a.minimum.y, b.minimum.y);
+   a.minimum.z = MINIMUM(a.minimum.z, b.minimum.z);
+
+   a.maximum.x = MAXIMUM(a.maximum.x, b.maximum.x);
+   a.maximum.y = MAXIMUM(a.maximum.y, b.maximum.y);
+   a.maximum.z = MAXIMUM(a.maximum.z, b.maximum.z);
+
+   return(a);
+}
+
+function float
+bounds_surface_area(struct bounds bounds)
+{
+   float result = 0;
+
+   v3 extent = sub3(bounds.maximum, bounds.minimum);
+   if(extent.x >= 0 && extent.y >= 0 && extent.z >= 0)
+   {
+      result = 2.0f * ((extent.x * extent.y) + (extent.y * extent.z) + (extent.z * extent.x));
+   }
+
+   return(result);
+}
+
+function float
+v3_axis(v3 vector, u32 axis)
+{
+   float result = (axis == 0) ? vector.x : ((axis == 1) ? vector.y : vector.z);
+   return(result);
+}
+
+function struct bounds
+primitive_bounds(struct primitive *primitive)
+{
+   struct bounds result = empty_bounds();
+
+   switch(primitive->kind)
+   {
+      case PRIMITIVE_SPHERE:
+      {
+         float r = primitive->sphere.radius;
+         result.minimum = sub3(primitive->sphere.center, vec3(r, r, r));
+         result.maximum = add3(primitive->sphere.center, vec3(r, r, r));
+      } break;
+
+      case PRIMITIVE_BOX:
+      {
+         result.minimum = primitive->box.minimum;
+         result.maximum = primitive->box.maximum;
+      } break;
+
+      case PRIMITIVE_TRIANGLE:
+      {
+         v3 a = primitive->triangle.vertex;
+         result = bounds_grow(result, a);
+         result = bounds_grow(result, add3(a, primitive->triangle.edge1));
+         result = bounds_grow(result, add3(a, primitive->triangle.edge2));
+      } break;
+
+      default:
+      {
+         assert(!"Unhandled primitive kind.");
+      } break;
+   }
+
+   return(result);
+}
+
+// NOTE(law): Scratch state for the builder. The build is single-threaded and
+// only runs when the scene changes, so the arrays are temporary memory pushed
+// onto whichever arena the caller passes in.
+global struct
+{
+   struct bvh *bvh;
+
+   u32 *indices;
+   struct bounds *primitive_bounds;
+   v3 *centroids;
+   struct primitive *ordered;
+} bvh_builder;
+
+function u32
+bvh_build_node(u32 first, u32 count, u32 depth)
+{
+   struct bvh *bvh = bvh_builder.bvh;
+
+   u32 node_index = bvh->node_count++;
+   struct bvh_node *node = bvh->nodes + node_index;
+
+   struct bounds bounds = empty_bounds();
+   struct bounds centroid_bounds = empty_bounds();
+   for(u32 index = first; index < first + count; ++index)
+   {
+      u32 primitive_index = bvh_builder.indices[index];
+      bounds = bounds_union(bounds, bvh_builder.primitive_bounds[primitive_index]);
+      centroid_bounds = bounds_grow(centroid_bounds, bvh_builder.centroids[primitive_index]);
+   }
+
+   node->minimum = bounds.minimum;
+   node->maximum = bounds.maximum;
+
+   // NOTE(law): Evaluate the surface area heuristic over binned centroids on
+   // every axis. Costs are relative to a single primitive intersection, with a
+   // traversal step costing the same.
+   float leaf_cost = (float)count;
+   float best_cost = FLT_MAX;
+   u32 best_axis = 0;
+   u32 best_split = 0;
+
+   float parent_area = bounds_surface_area(bounds);
+
+   for(u32 axis = 0; axis < 3 && count > 1; ++axis)
+   {
+      float axis_minimum = v3_axis(centroid_bounds.minimum, axis);
+      float axis_extent = v3_axis(centroid_bounds.maximum, axis) - axis_minimum;
+      if(axis_extent <= 0)
+      {
+         continue;
+      }
+
+      u32 bin_counts[BVH_BIN_COUNT] = {0};
+      struct bounds bin_bounds[BVH_BIN_COUNT];
+      for(u32 bin = 0; bin < BVH_BIN_COUNT; ++bin)
+      {
+         bin_bounds[bin] = empty_bounds();
+      }
+
+      float bin_scale = (float)BVH_BIN_COUNT / axis_extent;
+      for(u32 index = first; index < first + count; ++index)
+      {
+         u32 primitive_index = bvh_builder.indices[index];
+         float centroid = v3_axis(bvh_builder.centroids[primitive_index], axis);
+
+         u32 bin = MINIMUM((u32)((centroid - axis_minimum) * bin_scale), BVH_BIN_COUNT - 1);
+         bin_counts[bin]++;
+         bin_bounds[bin] = bounds_union(bin_bounds[bin], bvh_builder.primitive_bounds[primitive_index]);
+      }
+
+      // NOTE(law): Sweep from the right to accumulate the cost of every
+      // candidate right side, then from the left to evaluate each split.
+      float right_areas[BVH_BIN_COUNT];
+      u32 right_counts[BVH_BIN_COUNT];
+
+      struct bounds right_bounds = empty_bounds();
+      u32 right_count = 0;
+      for(u32 bin = BVH_BIN_COUNT - 1; bin > 0; --bin)
+      {
+         right_bounds = bounds_union(right_bounds, bin_bounds[bin]);
+         right_count += bin_counts[bin];
+
+         right_areas[bin] = bounds_surface_area(right_bounds);
+         right_counts[bin] = right_count;
+      }
+
+      struct bounds left_bounds = empty_bounds();
+      u32 left_count = 0;
+      for(u32 split = 1; split < BVH_BIN_COUNT; ++split)
+      {
+         left_bounds = bounds_union(left_bounds, bin_bounds[split - 1]);
+         left_count += bin_counts[split - 1];
+
+         if(left_count == 0 || right_counts[split] == 0)
+         {
+            continue;
+         }
+
+         float cost = 1.0f + ((bounds_surface_area(left_bounds) * (float)left_count) +
+                              (right_areas[split] * (float)right_counts[split])) / parent_area;
+         if(cost < best_cost)
+         {
+            best_cost = cost;
+            best_axis = axis;
+            best_split = split;
+         }
+      }
+   }
+
+   // NOTE(law): Leaves that the heuristic cannot split, or that sit at the
+   // depth limit, may be too large to count. Those are halved instead, and so
+   // is any subtree too large for its remaining levels to hold even if it was
+   // halved at every one of them. That keeps every leaf within the limit.
+   bool halve = false;
+   if(count > BVH_LEAF_COUNT_LIMIT)
+   {
+      u32 levels_left = BVH_STACK_SIZE - 1 - depth;
+      assert(levels_left > 0);
+
+      u64 halved_capacity = (u64)BVH_LEAF_COUNT_LIMIT << MINIMUM(levels_left - 1, 32);
+      halve = (best_cost == FLT_MAX) || (count > halved_capacity);
+   }
+
+   bool make_leaf = !halve && ((count == 1) || (best_cost == FLT_MAX) || (depth + 1 >= BVH_STACK_SIZE));
+   if(!halve && !make_leaf && count <= BVH_LEAF_MAX_COUNT && leaf_cost <= best_cost)
+   {
+      make_leaf = true;
+   }
+
+   if(make_leaf)
+   {
+      assert(count > 0 && count <= BVH_LEAF_COUNT_LIMIT);
+
+      node->offset = first;
+      node->count = (u16)count;
+      node->axis = 0;
+   }
+   else if(halve)
+   {
+      // NOTE(law): The primitives are left in their current order, which only
+      // costs traversal some culling in these degenerate subtrees.
+      u32 left_count = count - (count / 2);
+
+      node->count = 0;
+      node->axis = (u16)best_axis;
+
+      bvh_build_node(first, left_count, depth + 1);
+      u32 second_child = bvh_build_node(first + left_count, count - left_count, depth + 1);
+      bvh->nodes[node_index].offset = second_child;
+   }
+   else
+   {
+      // NOTE(law): Partition the primitive indices around the chosen bin.
+      float axis_minimum = v3_axis(centroid_bounds.minimum, best_axis);
+      float bin_scale = (float)BVH_BIN_COUNT / (v3_axis(centroid_bounds.maximum, best_axis) - axis_minimum);
+
+      u32 left = first;
+      u32 right = first + count - 1;
+      while(left <= right)
+      {
+         u32 primitive_index = bvh_builder.indices[left];
+         float centroid = v3_axis(bvh_builder.centroids[primitive_index], best_axis);
+
+         u32 bin = MINIMUM((u32)((centroid - axis_minimum) * bin_scale), BVH_BIN_COUNT - 1);
+         if(bin < best_split)
+         {
+            left++;
+         }
+         else
+         {
+            bvh_builder.indices[left] = bvh_builder.indices[right];
+            bvh_builder.indices[right] = primitive_index;
+            if(right == 0)
+            {
+               break;
+            }
+            right--;
+         }
+      }
+
+      u32 left_count = left - first;
+      assert(left_count > 0 && left_count < count);
+
+      node->count = 0;
+      node->axis = (u16)best_axis;
+
+      bvh_build_node(first, left_count, depth + 1);
+      u32 second_child = bvh_build_node(first + left_count, count - left_count, depth + 1);
+      bvh->nodes[node_index].offset = second_child;
+   }
+
+   return(node_index);
+}
+
+function void
+build_bvh(struct bvh *bvh, struct primitive *primitives, u32 primitive_count, struct memory_arena *scratch)
+{
+   // NOTE(law): Build a binned SAH hierarchy, then reorder the primitive array
+   // so every leaf references a contiguous range of primitives. The nodes
+   // array must have room for 2n - 1 nodes.
+
+   bvh->node_count = 0;
+   if(!primitive_count)
+   {
+      return;
+   }
+
+   struct temporary_memory temporary = begin_temporary_memory(scratch);
+
+   bvh_builder.bvh = bvh;
+   bvh_builder.indices = PUSH_ARRAY(scratch, primitive_count, u32);
+   bvh_builder.primitive_bounds = PUSH_ARRAY(scratch, primitive_count, struct bounds);
+   bvh_builder.centroids = PUSH_ARRAY(scratch, primitive_count, v3);
+   bvh_builder.ordered = PUSH_ARRAY(scratch, primitive_count, struct primitive);
+
+   if(!bvh_builder.indices || !bvh_builder.primitive_bounds || !bvh_builder.centroids || !bvh_builder.ordered)
+   {
+      // NOTE(law): Without a hierarchy no bounded primitive is ever hit, which
+      // is the most obvious way to show that the scratch arena is too small.
+      platform_log("ERROR: Not enough scratch memory to build a BVH over %u primitives.\n", primitive_count);
+      end_temporary_memory(temporary);
+      return;
+   }
+
+   for(u32 index = 0; index < primitive_count; ++index)
+   {
+      struct bounds bounds = primitive_bounds(primitives + index);
+
+      bvh_builder.indices[index] = index;
+      bvh_builder.primitive_bounds[index] = bounds;
+      bvh_builder.centroids[index] = mul3(add3(bounds.minimum, bounds.maximum), 0.5f);
+   }
+
+   bvh_build_node(0, primitive_count, 0);
+
+   for(u32 index = 0; index < primitive_count; ++index)
+   {
+      bvh_builder.ordered[index] = primitives[bvh_builder.indices[index]];
+   }
+   for(u32 index = 0; index < primitive_count; ++index)
+   {
+      primitives[index] = bvh_builder.ordered[index];
+   }
+
+   end_temporary_memory(temporary);
+}
+
+function void
+intersect_primitive(struct primitive *primitive, float surface, struct ray_packet *ray, struct hit_packet *hit)
+{
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_f32 one = lane_f32_from_float(1.0f);
+   lane_f32 epsilon = lane_f32_from_float(0.0001f);
+
+   lane_f32 t;
+   lane_f32 mask;
+   lane_v3 normal;
+
+   switch(primitive->kind)
+   {
+      case PRIMITIVE_SPHERE:
+      {
+         lane_v3 offset = lane_sub3(ray->origin, lane_v3_from_v3(primitive->sphere.center));
+
+         lane_f32 b = lane_dot3(offset, ray->direction);
+         lane_f32 c = lane_sub(lane_dot3(offset, offset), lane_f32_from_float(square(primitive->sphere.radius)));
+
+         lane_f32 discriminant = lane_sub(lane_mul(b, b), c);
+         mask = lane_greater(discriminant, zero);
+
+         lane_f32 root = lane_square_root(lane_max(discriminant, zero));
+         lane_f32 t_near = lane_sub(lane_sub(zero, b), root);
+         lane_f32 t_far = lane_add(lane_sub(zero, b), root);
+         t = lane_select(lane_greater(t_near, epsilon), t_far, t_near);
+
+         lane_f32 inverse_radius = lane_f32_from_float(1.0f / primitive->sphere.radius);
+         normal = lane_mul3(lane_add3(offset, lane_mul3(ray->direction, t)), inverse_radius);
+      } break;
+
+      case PRIMITIVE_BOX:
+      {
+         lane_v3 t1 = lane_hadamard3(lane_sub3(lane_v3_from_v3(primitive->box.minimum), ray->origin), ray->inverse);
+         lane_v3 t2 = lane_hadamard3(lane_sub3(lane_v3_from_v3(primitive->box.maximum), ray->origin), ray->inverse);
+
+         lane_v3 near = lane_min3(t1, t2);
+         lane_f32 t_near = lane_horizontal_max3(near);
+         lane_f32 t_far = lane_horizontal_min3(lane_max3(t1, t2));
+
+         mask = lane_less_equal(t_near, t_far);
+         t = lane_select(lane_greater(t_near, epsilon), t_far, t_near);
+
+         // NOTE(law): The face normal points against the ray along whichever
+         // slab produced the entry distance.
+         lane_f32 negative_one = lane_f32_from_float(-1.0f);
+         normal.x = lane_and(lane_equal(t_near, near.x), lane_select(lane_less(ray->direction.x, zero), negative_one, one));
+         normal.y = lane_and(lane_equal(t_near, near.y), lane_select(lane_less(ray->direction.y, zero), negative_one, one));
+         normal.z = lane_and(lane_equal(t_near, near.z), lane_select(lane_less(ray->direction.z, zero), negative_one, one));
+      } break;
+
+      case PRIMITIVE_TRIANGLE:
+      {
+         lane_v3 edge1 = lane_v3_from_v3(primitive->triangle.edge1);
+         lane_v3 edge2 = lane_v3_from_v3(primitive->triangle.edge2);
+
+         // NOTE(law): Moller-Trumbore.
+         lane_v3 p = lane_cross3(ray->direction, edge2);
+
+         lane_f32 determinant = lane_dot3(edge1, p);
+         lane_f32 inverse_determinant = lane_div(one, determinant);
+
+         lane_v3 s = lane_sub3(ray->origin, lane_v3_from_v3(primitive->triangle.vertex));
+         lane_f32 u = lane_mul(lane_dot3(s, p), inverse_determinant);
+
+         lane_v3 q = lane_cross3(s, edge1);
+         lane_f32 v = lane_mul(lane_dot3(ray->direction, q), inverse_determinant);
+
+         t = lane_mul(lane_dot3(edge2, q), inverse_determinant);
+
+         mask = lane_greater(lane_absolute_value(determinant), lane_f32_from_float(1e-8f));
+         mask = lane_and(mask, lane_greater_equal(u, zero));
+         mask = lane_and(mask, lane_greater_equal(v, zero));
+         mask = lane_and(mask, lane_less_equal(lane_add(u, v), one));
+
+         // NOTE(law): Triangles are double-sided, so flip the normal to face
+         // the incoming ray.
+         normal = lane_v3_from_v3(primitive->triangle.normal);
+
+         lane_f32 facing = lane_dot3(normal, ray->direction);
+         lane_f32 flip = lane_select(lane_greater(facing, zero), one, lane_f32_from_float(-1.0f));
+         normal = lane_mul3(normal, flip);
+      } break;
+
+      default:
+      {
+         assert(!"Unhandled primitive kind.");
+         return;
+      } break;
+   }
+
+   mask = lane_and(mask, lane_greater(t, epsilon));
+   mask = lane_and(mask, lane_less(t, hit->t));
+
+   if(lane_any(mask))
+   {
+      hit->t = lane_select(mask, hit->t, t);
+      hit->mask = lane_or(hit->mask, mask);
+
+      hit->normal = lane_select3(mask, hit->normal, normal);
+      hit->color = lane_select3(mask, hit->color, lane_v3_from_v3(primitive->color));
+
+      hit->surface = lane_select(mask, hit->surface, lane_f32_from_float(surface));
+   }
+}
+
+function lane_f32
+intersect_bvh_node(struct bvh_node *node, struct ray_packet *ray, lane_f32 t_maximum)
+{
+   // NOTE(law): Slab test against the node bounds. Returns the lanes whose ray
+   // enters the box in front of the origin and before their closest hit.
+
+   lane_v3 t1 = lane_hadamard3(lane_sub3(lane_v3_from_v3(node->minimum), ray->origin), ray->inverse);
+   lane_v3 t2 = lane_hadamard3(lane_sub3(lane_v3_from_v3(node->maximum), ray->origin), ray->inverse);
+
+   lane_f32 t_near = lane_horizontal_max3(lane_min3(t1, t2));
+   lane_f32 t_far = lane_horizontal_min3(lane_max3(t1, t2));
+
+   lane_f32 result = lane_less_equal(t_near, t_far);
+   result = lane_and(result, lane_greater(t_far, lane_f32_from_float(0.0f)));
+   result = lane_and(result, lane_less(t_near, t_maximum));
+
+   return(result);
+}
+
+function void
+intersect_bvh(struct bvh *bvh, struct primitive *primitives, u32 *roots, u32 root_count,
+              struct ray_packet *ray, struct hit_packet *hit, bool any_hit)
+{
+   // NOTE(law): Packet traversal with a short stack, over the subtrees at the
+   // given roots (a single root of 0 covers the whole hierarchy). A node is
+   // visited if any lane enters it before that lane's current closest hit, so
+   // subtrees behind already-found hits are skipped. Children are visited front
+   // to back along the split axis, using the first lane's direction for the
+   // whole packet. With any_hit, traversal stops as soon as every lane has
+   // some hit, which is all that occlusion tests need.
+
+   if(!bvh->node_count)
+   {
+      return;
+   }
+
+   u32 stack[BVH_STACK_SIZE];
+   u32 stack_count = 0;
+
+   float direction[3] = {lane_first(ray->direction.x), lane_first(ray->direction.y), lane_first(ray->direction.z)};
+
+   for(u32 root_index = 0; root_index < root_count; ++root_index)
+   {
+      u32 node_index = roots[root_index];
+      while(1)
+      {
+         struct bvh_node *node = bvh->nodes + node_index;
+
+         if(lane_any(intersect_bvh_node(node, ray, hit->t)))
+         {
+            if(node->count)
+            {
+               for(u32 index = 0; index < node->count; ++index)
+               {
+                  u32 primitive_index = node->offset + index;
+                  intersect_primitive(primitives + primitive_index, -(float)(primitive_index + 1), ray, hit);
+               }
+
+               if(any_hit && lane_mask_bits(hit->mask) == LANE_ALL_BITS)
+               {
+                  return;
+               }
+            }
+            else
+            {
+               u32 first_child = node_index + 1;
+               u32 second_child = node->offset;
+
+               assert(stack_count < BVH_STACK_SIZE);
+               if(direction[node->axis] < 0)
+               {
+                  stack[stack_count++] = first_child;
+                  node_index = second_child;
+               }
+               else
+               {
+                  stack[stack_count++] = second_child;
+                  node_index = first_child;
+               }
+               continue;
+            }
+         }
+
+         if(!stack_count)
+         {
+            break;
+         }
+         node_index = stack[--stack_count];
+      }
+   }
+}
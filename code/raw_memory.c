@@ -0,0 +1,102 @@
+/* /////////////////////////////////////////////////////////////////////////// */
+/* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
+/* /////////////////////////////////////////////////////////////////////////// */
+
+// NOTE(law): Arenas hand out memory from one block that the platform allocates
+// up front, by bumping an offset. Nothing is freed individually: an arena is
+// either reset as a whole, or rolled back to a marker taken with
+// begin_temporary_memory(). Platforms only back the pages that are touched, so
+// blocks can be sized generously.
+
+struct memory_arena
+{
+   u8 *base;
+   size_t size;
+   size_t used;
+
+   // NOTE(law): Only the peak is interesting, e.g. to size the arena.
+   size_t maximum_used;
+
+   u32 temporary_count;
+};
+
+struct temporary_memory
+{
+   struct memory_arena *arena;
+   size_t used;
+};
+
+#define PUSH_STRUCT(arena, type) (type *)push_size((arena), sizeof(type), 16)
+#define PUSH_ARRAY(arena, count, type) (type *)push_size((arena), (size_t)(count) * sizeof(type), 16)
+#define PUSH_LANE_ARRAY(arena, count, type) (type *)push_size((arena), (size_t)LANE_PADDED_COUNT(count) * sizeof(type), LANE_ALIGNMENT)
+
+function bool
+initialize_arena(struct memory_arena *arena, size_t size)
+{
+   memset(arena, 0, sizeof(*arena));
+
+   arena->base = platform_allocate(size);
+   arena->size = (arena->base) ? size : 0;
+
+   bool result = (arena->base != 0);
+   return(result);
+}
+
+function void
+release_arena(struct memory_arena *arena)
+{
+   if(arena->base)
+   {
+      platform_deallocate(arena->base);
+   }
+   memset(arena, 0, sizeof(*arena));
+}
+
+function void *
+push_size(struct memory_arena *arena, size_t size, size_t alignment)
+{
+   // NOTE(law): Returns 0 when the arena is out of space. The memory is not
+   // cleared, since most callers overwrite it anyway.
+   uintptr_t address = (uintptr_t)arena->base + arena->used;
+   size_t padding = (alignment - (address & (alignment - 1))) & (alignment - 1);
+
+   void *result = 0;
+   if(arena->used + padding + size <= arena->size)
+   {
+      result = arena->base + arena->used + padding;
+      arena->used += padding + size;
+      arena->maximum_used = MAXIMUM(arena->maximum_used, arena->used);
+   }
+
+   return(result);
+}
+
+function void
+reset_arena(struct memory_arena *arena)
+{
+   assert(arena->temporary_count == 0);
+   arena->used = 0;
+}
+
+function struct temporary_memory
+begin_temporary_memory(struct memory_arena *arena)
+{
+   struct temporary_memory result;
+   result.arena = arena;
+   result.used = arena->used;
+
+   arena->temporary_count++;
+
+   return(result);
+}
+
+function void
+end_temporary_memory(struct temporary_memory temporary)
+{
+   struct memory_arena *arena = temporary.arena;
+   assert(arena->used >= temporary.used);
+   assert(arena->temporary_count > 0);
+
+   arena->used = temporary.used;
+   arena->temporary_count--;
+}
@@ -0,0 +1,236 @@
+/* /////////////////////////////////////////////////////////////////////////// */
+/* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
+/* /////////////////////////////////////////////////////////////////////////// */
+
+// NOTE(law): The profiler records timed events into one ring buffer per thread.
+// Only the owning thread ever writes to a ring, so recording an event is just a
+// couple of stores and an index bump. Rings overwrite their oldest events when
+// full, so a trace always holds the most recent PROFILE_RING_CAPACITY events of
+// each thread.
+
+// NOTE(law): Traces are meant to be written at a quiet point, e.g. after
+// platform_complete_queue() or at exit. Events recorded by a worker while the
+// trace is being written may show up torn or not at all.
+
+#include <stdio.h>
+
+#if defined(_MSC_VER)
+#define thread_global static __declspec(thread)
+#define COMPILER_BARRIER() _WriteBarrier()
+#else
+#define thread_global static __thread
+#define COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define PROFILE_MAX_THREAD_COUNT 256
+#define PROFILE_RING_CAPACITY 65536 // NOTE(law): Must be a power of two.
+
+// NOTE(law): Threads that do not run queue work, like the platform's output
+// writer, take the last slot.
+#define PROFILE_OUTPUT_THREAD_INDEX (PROFILE_MAX_THREAD_COUNT - 1)
+
+enum profile_event_kind
+{
+   PROFILE_EVENT_FRAME,
+   PROFILE_EVENT_TILE,
+   PROFILE_EVENT_QUEUE_WAIT,
+   PROFILE_EVENT_COMPLETE_QUEUE,
+   PROFILE_EVENT_DISPLAY,
+   PROFILE_EVENT_REFINE,
+   PROFILE_EVENT_REPROJECT,
+   PROFILE_EVENT_GENERATE_RAYS,
+   PROFILE_EVENT_INTERSECT,
+   PROFILE_EVENT_SHADE,
+   PROFILE_EVENT_COMPACT,
+   PROFILE_EVENT_RESOLVE,
+   PROFILE_EVENT_OUTPUT_WAIT,
+   PROFILE_EVENT_OUTPUT_WRITE,
+
+   PROFILE_EVENT_COUNT,
+};
+
+global char *profile_event_names[PROFILE_EVENT_COUNT] =
+{
+   "frame",
+   "tile",
+   "queue wait",
+   "complete queue",
+   "display",
+   "refine",
+   "reproject",
+   "generate rays",
+   "intersect",
+   "shade",
+   "compact",
+   "resolve",
+   "output wait",
+   "output write",
+};
+
+struct profile_event
+{
+   u64 start;
+   u64 end;
+   u32 kind;
+   u32 frame_index;
+   u32 x;
+   u32 y;
+};
+
+struct profile_ring
+{
+   u32 thread_index;
+   volatile u64 write_index;
+   struct profile_event events[PROFILE_RING_CAPACITY];
+};
+
+global struct
+{
+   bool enabled;
+   u64 base_timestamp;
+   volatile u32 frame_index;
+   struct profile_ring *volatile rings[PROFILE_MAX_THREAD_COUNT];
+} profiler;
+
+thread_global struct profile_ring *profile_thread_ring;
+
+function void
+profile_initialize(void)
+{
+   // NOTE(law): Must be called before any thread registers with the profiler.
+   profiler.enabled = true;
+   profiler.base_timestamp = platform_timestamp();
+}
+
+function void
+profile_register_thread(u32 thread_index)
+{
+   // NOTE(law): Called once on each thread that should record events. The
+   // platform layer hands out thread indices, 0 being the main thread.
+   if(!profiler.enabled || thread_index >= PROFILE_MAX_THREAD_COUNT)
+   {
+      return;
+   }
+
+   struct profile_ring *ring = platform_allocate(sizeof(struct profile_ring));
+   if(ring)
+   {
+      ring->thread_index = thread_index;
+      ring->write_index = 0;
+
+      COMPILER_BARRIER();
+      profiler.rings[thread_index] = ring;
+      profile_thread_ring = ring;
+   }
+}
+
+function u64
+profile_begin(void)
+{
+   u64 result = (profile_thread_ring) ? platform_timestamp() : 0;
+   return(result);
+}
+
+function void
+profile_end(u32 kind, u64 start, u32 x, u32 y)
+{
+   struct profile_ring *ring = profile_thread_ring;
+   if(ring)
+   {
+      u64 write_index = ring->write_index;
+
+      struct profile_event *event = ring->events + (write_index & (PROFILE_RING_CAPACITY - 1));
+      event->start = start;
+      event->end = platform_timestamp();
+      event->kind = kind;
+      event->frame_index = profiler.frame_index;
+      event->x = x;
+      event->y = y;
+
+      COMPILER_BARRIER();
+      ring->write_index = write_index + 1;
+   }
+}
+
+function void
+profile_next_frame(void)
+{
+   profiler.frame_index++;
+}
+
+function bool
+profile_write_chrome_trace(char *path)
+{
+   // NOTE(law): Write every buffered event in the Chrome trace event format,
+   // which both chrome://tracing and ui.perfetto.dev load directly. Timestamps
+   // are in microseconds relative to profile_initialize().
+
+   FILE *file = fopen(path, "w");
+   if(!file)
+   {
+      platform_log("ERROR: Failed to open %s for writing.\n", path);
+      return(false);
+   }
+
+   fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+   bool first_event = true;
+   for(u32 thread_index = 0; thread_index < PROFILE_MAX_THREAD_COUNT; ++thread_index)
+   {
+      struct profile_ring *ring = profiler.rings[thread_index];
+      if(!ring)
+      {
+         continue;
+      }
+
+      char *thread_name = (thread_index) ? "worker" : "main";
+      if(thread_index == PROFILE_OUTPUT_THREAD_INDEX)
+      {
+         thread_name = "output";
+      }
+
+      fprintf(file, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s %u\"}}",
+              (first_event) ? "" : ",\n", thread_index, thread_name, thread_index);
+      first_event = false;
+
+      u64 write_index = ring->write_index;
+      u64 read_index = (write_index > PROFILE_RING_CAPACITY) ? write_index - PROFILE_RING_CAPACITY : 0;
+
+      for(; read_index < write_index; ++read_index)
+      {
+         struct profile_event *event = ring->events + (read_index & (PROFILE_RING_CAPACITY - 1));
+         if(event->kind >= PROFILE_EVENT_COUNT || event->end < event->start)
+         {
+            continue;
+         }
+
+         double start = (double)(event->start - profiler.base_timestamp) / 1000.0;
+         double duration = (double)(event->end - event->start) / 1000.0;
+
+         fprintf(file, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, ",
+                 profile_event_names[event->kind], thread_index, start, duration);
+
+         if(event->kind == PROFILE_EVENT_TILE || event->kind == PROFILE_EVENT_REFINE ||
+            event->kind == PROFILE_EVENT_REPROJECT)
+         {
+            fprintf(file, "\"args\": {\"frame\": %u, \"x\": %u, \"y\": %u}}", event->frame_index, event->x, event->y);
+         }
+         else if(event->kind >= PROFILE_EVENT_GENERATE_RAYS && event->kind <= PROFILE_EVENT_RESOLVE)
+         {
+            fprintf(file, "\"args\": {\"frame\": %u, \"wave\": %u, \"first\": %u}}",
+                    event->frame_index, event->x, event->y);
+         }
+         else
+         {
+            fprintf(file, "\"args\": {\"frame\": %u}}", event->frame_index);
+         }
+      }
+   }
+
+   fprintf(file, "\n]}\n");
+   fclose(file);
+
+   platform_log("Wrote profiler trace to %s.\n", path);
+
+   return(true);
+}
@@ -0,0 +1,531 @@
+/* /////////////////////////////////////////////////////////////////////////// */
+/* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
+/* /////////////////////////////////////////////////////////////////////////// */
+
+// NOTE(law): Scenes come in two forms. The text form is meant to be written by
+// hand, one statement per line:
+//
+//    camera <position x y z> <target x y z> <up x y z> <focal length>
+//    material <name> <r g b> [reflectivity]
+//    plane <normal x y z> <distance> <material>
+//    sphere <center x y z> <radius> <material>
+//    box <minimum x y z> <maximum x y z> <material>
+//    triangle <a x y z> <b x y z> <c x y z> <material>
+//
+// Materials must be defined before they are used, and are not reflective
+// unless given a reflectivity between 0 and 1. # starts a comment. The
+// text is parsed into the runtime storage and the BVH is built as usual.
+//
+// The compiled form is the runtime scene written out as is: the plane arrays,
+// the materials, the primitives in BVH order and the BVH nodes. Sections are
+// located by offsets from the start of the file, so the file is mapped and the
+// scene points straight into it, with no parsing or building at startup.
+// Sections are aligned and plane arrays padded for the widest lane width, so
+// one file serves both SSE2 and AVX2 builds. The file is only meant to be read
+// by builds with the same struct layouts, which the header records.
+
+#define SCENE_FILE_MAGIC 0x53574152 // NOTE(law): "RAWS", little-endian.
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_ALIGNMENT 64
+#define SCENE_FILE_PLANE_GRANULARITY (SCENE_FILE_ALIGNMENT / sizeof(float))
+
+#define SCENE_TOKEN_MAX_LENGTH 64
+
+struct scene_file_header
+{
+   u32 magic;
+   u32 version;
+   u64 size;
+
+   u32 material_size;
+   u32 primitive_size;
+   u32 bvh_node_size;
+   u32 plane_stride; // NOTE(law): Floats per plane array, including padding.
+
+   v3 camera_position;
+   v3 camera_x;
+   v3 camera_y;
+   v3 camera_z;
+   float focal_length;
+
+   u32 material_count;
+   u32 plane_count;
+   u32 primitive_count;
+   u32 bvh_node_count;
+
+   // NOTE(law): The plane section holds the eight plane arrays back to back,
+   // in the order they are declared in struct scene_planes.
+   u64 materials_offset;
+   u64 planes_offset;
+   u64 primitives_offset;
+   u64 bvh_nodes_offset;
+};
+
+struct scene_text_line
+{
+   char *at;
+   char *end;
+};
+
+function bool
+next_scene_token(struct scene_text_line *line, char *token, u32 capacity)
+{
+   // NOTE(law): Copy the next whitespace-separated token of the line into
+   // token. Returns false at the end of the line or at a comment. Tokens that
+   // do not fit are truncated, which no valid number or name ever is.
+   while(line->at < line->end && (*line->at == ' ' || *line->at == '\t' || *line->at == '\r'))
+   {
+      line->at++;
+   }
+
+   if(line->at == line->end || *line->at == '#')
+   {
+      return(false);
+   }
+
+   u32 length = 0;
+   while(line->at < line->end && *line->at != ' ' && *line->at != '\t' && *line->at != '\r')
+   {
+      if(length + 1 < capacity)
+      {
+         token[length++] = *line->at;
+      }
+      line->at++;
+   }
+   token[length] = 0;
+
+   return(true);
+}
+
+function bool
+parse_scene_float(struct scene_text_line *line, float *value)
+{
+   char token[SCENE_TOKEN_MAX_LENGTH];
+
+   bool result = false;
+   if(next_scene_token(line, token, sizeof(token)))
+   {
+      char *end;
+      *value = strtof(token, &end);
+      result = (end != token && *end == 0);
+   }
+
+   return(result);
+}
+
+function bool
+parse_scene_v3(struct scene_text_line *line, v3 *value)
+{
+   bool result = (parse_scene_float(line, &value->x) &&
+                  parse_scene_float(line, &value->y) &&
+                  parse_scene_float(line, &value->z));
+   return(result);
+}
+
+function struct material *
+find_material(char *name)
+{
+   struct material *result = 0;
+   for(u32 index = 0; index < scene.material_count; ++index)
+   {
+      if(strcmp(scene.materials[index].name, name) == 0)
+      {
+         result = scene.materials + index;
+         break;
+      }
+   }
+
+   return(result);
+}
+
+function bool
+parse_scene_material(struct scene_text_line *line, struct material **material, char **error)
+{
+   char name[SCENE_TOKEN_MAX_LENGTH];
+   if(!next_scene_token(line, name, sizeof(name)))
+   {
+      return(false);
+   }
+
+   *material = find_material(name);
+   if(!*material)
+   {
+      *error = "unknown material";
+      return(false);
+   }
+
+   return(true);
+}
+
+function bool
+parse_scene_text(char *text, size_t size)
+{
+   // NOTE(law): Replace the scene with the one described by text. On failure
+   // the scene is left partially built, and an error naming the line has been
+   // logged.
+   clear_scene();
+
+   point_camera(INITIAL_CAMERA_POSITION, INITIAL_TARGET_POSITION, INITIAL_CAMERA_UP);
+   scene.focal_length = INITIAL_FOCAL_LENGTH;
+
+   char *at = text;
+   char *end = text + size;
+   u32 line_number = 0;
+
+   while(at < end)
+   {
+      struct scene_text_line line;
+      line.at = at;
+      line.end = memchr(at, '\n', end - at);
+      if(!line.end)
+      {
+         line.end = end;
+      }
+      at = (line.end < end) ? line.end + 1 : end;
+      line_number++;
+
+      char keyword[SCENE_TOKEN_MAX_LENGTH];
+      if(!next_scene_token(&line, keyword, sizeof(keyword)))
+      {
+         continue;
+      }
+
+      char *error = "malformed statement";
+      bool parsed = false;
+
+      if(strcmp(keyword, "camera") == 0)
+      {
+         v3 position, target, up;
+         float focal_length;
+         parsed = (parse_scene_v3(&line, &position) && parse_scene_v3(&line, &target) &&
+                   parse_scene_v3(&line, &up) && parse_scene_float(&line, &focal_length));
+         if(parsed)
+         {
+            point_camera(position, target, up);
+            scene.focal_length = focal_length;
+         }
+      }
+      else if(strcmp(keyword, "material") == 0)
+      {
+         char name[SCENE_TOKEN_MAX_LENGTH];
+         v3 color;
+         float reflectivity = 0;
+         parsed = (next_scene_token(&line, name, sizeof(name)) && parse_scene_v3(&line, &color));
+
+         // NOTE(law): The reflectivity is optional, so only a value that is
+         // there and malformed is an error.
+         struct scene_text_line rest = line;
+         char token[SCENE_TOKEN_MAX_LENGTH];
+         if(parsed && next_scene_token(&rest, token, sizeof(token)))
+         {
+            parsed = parse_scene_float(&line, &reflectivity);
+         }
+
+         if(parsed && (reflectivity < 0 || reflectivity > 1))
+         {
+            error = "reflectivity outside [0, 1]";
+            parsed = false;
+         }
+         else if(parsed && strlen(name) >= SCENE_MATERIAL_NAME_LENGTH)
+         {
+            error = "material name too long";
+            parsed = false;
+         }
+         else if(parsed && find_material(name))
+         {
+            error = "material already defined";
+            parsed = false;
+         }
+         else if(parsed && scene.material_count == SCENE_MATERIAL_CAPACITY)
+         {
+            error = "too many materials";
+            parsed = false;
+         }
+         else if(parsed)
+         {
+            struct material *material = scene.materials + scene.material_count++;
+            strcpy(material->name, name);
+            material->color = color;
+            material->reflectivity = reflectivity;
+         }
+      }
+      else if(strcmp(keyword, "plane") == 0)
+      {
+         v3 normal;
+         float distance;
+         struct material *material;
+         parsed = (parse_scene_v3(&line, &normal) && parse_scene_float(&line, &distance) &&
+                   parse_scene_material(&line, &material, &error));
+         if(parsed && scene.planes.count == scene.planes.capacity)
+         {
+            error = "too many planes";
+            parsed = false;
+         }
+         else if(parsed)
+         {
+            add_plane(normal, distance, material->color, material->reflectivity);
+         }
+      }
+      else if(strcmp(keyword, "sphere") == 0 || strcmp(keyword, "box") == 0 || strcmp(keyword, "triangle") == 0)
+      {
+         v3 a, b, c;
+         float radius = 0;
+         struct material *material;
+         if(keyword[0] == 's')
+         {
+            parsed = (parse_scene_v3(&line, &a) && parse_scene_float(&line, &radius));
+         }
+         else if(keyword[0] == 'b')
+         {
+            parsed = (parse_scene_v3(&line, &a) && parse_scene_v3(&line, &b));
+         }
+         else
+         {
+            parsed = (parse_scene_v3(&line, &a) && parse_scene_v3(&line, &b) && parse_scene_v3(&line, &c));
+         }
+         parsed = parsed && parse_scene_material(&line, &material, &error);
+
+         if(parsed && scene.primitive_count == scene.primitive_capacity)
+         {
+            error = "too many primitives";
+            parsed = false;
+         }
+         else if(parsed)
+         {
+            switch(keyword[0])
+            {
+               case 's': {add_sphere(a, radius, material->color, material->reflectivity);} break;
+               case 'b': {add_box(a, b, material->color, material->reflectivity);} break;
+               default:  {add_triangle(a, b, c, material->color, material->reflectivity);} break;
+            }
+         }
+      }
+      else
+      {
+         error = "unknown statement";
+      }
+
+      char extra[SCENE_TOKEN_MAX_LENGTH];
+      if(parsed && next_scene_token(&line, extra, sizeof(extra)))
+      {
+         error = "unexpected trailing values";
+         parsed = false;
+      }
+
+      if(!parsed)
+      {
+         platform_log("ERROR: Scene line %u: %s.\n", line_number, error);
+         return(false);
+      }
+   }
+
+   return(true);
+}
+
+function u64
+reserve_scene_file_section(u64 *size, u64 section_size)
+{
+   u64 result = (*size + SCENE_FILE_ALIGNMENT - 1) & ~(u64)(SCENE_FILE_ALIGNMENT - 1);
+   *size = result + section_size;
+
+   return(result);
+}
+
+function size_t
+compile_scene(void *memory, size_t capacity)
+{
+   // NOTE(law): Write the current scene in compiled form to memory and return
+   // its size. When memory is 0 or too small, nothing is written and only the
+   // size is returned. The BVH is built first if it is out of date.
+   if(scene.bvh_is_dirty)
+   {
+      build_bvh(&scene.bvh, scene.primitives, scene.primitive_count, &arenas.frame);
+      scene.bvh_is_dirty = false;
+   }
+
+   struct scene_file_header header = {0};
+   header.magic = SCENE_FILE_MAGIC;
+   header.version = SCENE_FILE_VERSION;
+   header.material_size = sizeof(struct material);
+   header.primitive_size = sizeof(struct primitive);
+   header.bvh_node_size = sizeof(struct bvh_node);
+
+   u32 granularity = SCENE_FILE_PLANE_GRANULARITY;
+   header.plane_stride = ((scene.planes.count + granularity - 1) / granularity) * granularity;
+
+   header.camera_position = scene.camera_position;
+   header.camera_x = scene.camera_x;
+   header.camera_y = scene.camera_y;
+   header.camera_z = scene.camera_z;
+   header.focal_length = scene.focal_length;
+
+   header.material_count = scene.material_count;
+   header.plane_count = scene.planes.count;
+   header.primitive_count = scene.primitive_count;
+   header.bvh_node_count = scene.bvh.node_count;
+
+   u64 size = sizeof(header);
+   header.materials_offset = reserve_scene_file_section(&size, (u64)header.material_count * sizeof(struct material));
+   header.planes_offset = reserve_scene_file_section(&size, 8 * (u64)header.plane_stride * sizeof(float));
+   header.primitives_offset = reserve_scene_file_section(&size, (u64)header.primitive_count * sizeof(struct primitive));
+   header.bvh_nodes_offset = reserve_scene_file_section(&size, (u64)header.bvh_node_count * sizeof(struct bvh_node));
+   header.size = reserve_scene_file_section(&size, 0);
+
+   if(memory && capacity >= header.size)
+   {
+      u8 *base = (u8 *)memory;
+      memset(base, 0, header.size);
+      memcpy(base, &header, sizeof(header));
+
+      memcpy(base + header.materials_offset, scene.materials, header.material_count * sizeof(struct material));
+
+      struct scene_planes *planes = &scene.planes;
+      float *plane_arrays[8] =
+      {
+         planes->normal_x, planes->normal_y, planes->normal_z, planes->distance,
+         planes->color_r, planes->color_g, planes->color_b, planes->reflectivity,
+      };
+
+      float *destination = (float *)(base + header.planes_offset);
+      for(u32 array = 0; array < ARRAY_LENGTH(plane_arrays); ++array)
+      {
+         memcpy(destination + (array * header.plane_stride), plane_arrays[array], planes->count * sizeof(float));
+      }
+
+      memcpy(base + header.primitives_offset, scene.primitives, header.primitive_count * sizeof(struct primitive));
+      memcpy(base + header.bvh_nodes_offset, scene.bvh.nodes, header.bvh_node_count * sizeof(struct bvh_node));
+   }
+
+   return(header.size);
+}
+
+function bool
+scene_file_section_fits(u64 offset, u64 section_size, u64 file_size)
+{
+   bool result = ((offset % SCENE_FILE_ALIGNMENT) == 0 && offset <= file_size && section_size <= file_size - offset);
+   return(result);
+}
+
+function bool
+load_compiled_scene(void *memory, size_t size)
+{
+   // NOTE(law): Point the scene at a compiled scene in memory, which must stay
+   // mapped for as long as the scene uses it. Only the header is checked. The
+   // sections are trusted to be what the compiler wrote.
+   struct scene_file_header *header = (struct scene_file_header *)memory;
+
+   char *error = 0;
+   if(size < sizeof(*header) || header->magic != SCENE_FILE_MAGIC)
+   {
+      error = "not a compiled scene";
+   }
+   else if(header->version != SCENE_FILE_VERSION || header->material_size != sizeof(struct material) ||
+           header->primitive_size != sizeof(struct primitive) || header->bvh_node_size != sizeof(struct bvh_node))
+   {
+      error = "compiled by an incompatible version";
+   }
+   else if(header->size > size ||
+           header->plane_count > header->plane_stride ||
+           (header->plane_stride % SCENE_FILE_PLANE_GRANULARITY) != 0 ||
+           !scene_file_section_fits(header->materials_offset, (u64)header->material_count * sizeof(struct material), size) ||
+           !scene_file_section_fits(header->planes_offset, 8 * (u64)header->plane_stride * sizeof(float), size) ||
+           !scene_file_section_fits(header->primitives_offset, (u64)header->primitive_count * sizeof(struct primitive), size) ||
+           !scene_file_section_fits(header->bvh_nodes_offset, (u64)header->bvh_node_count * sizeof(struct bvh_node), size) ||
+           (header->primitive_count && !header->bvh_node_count))
+   {
+      error = "truncated or corrupt";
+   }
+
+   if(error)
+   {
+      platform_log("ERROR: Failed to load compiled scene: %s.\n", error);
+      return(false);
+   }
+
+   clear_scene();
+
+   u8 *base = (u8 *)memory;
+
+   scene.camera_position = header->camera_position;
+   scene.camera_x = header->camera_x;
+   scene.camera_y = header->camera_y;
+   scene.camera_z = header->camera_z;
+   scene.focal_length = header->focal_length;
+
+   scene.material_count = header->material_count;
+   scene.materials = (struct material *)(base + header->materials_offset);
+
+   float *plane_arrays = (float *)(base + header->planes_offset);
+   struct scene_planes *planes = &scene.planes;
+   planes->count = header->plane_count;
+   planes->capacity = header->plane_count;
+   planes->normal_x = plane_arrays + (0 * header->plane_stride);
+   planes->normal_y = plane_arrays + (1 * header->plane_stride);
+   planes->normal_z = plane_arrays + (2 * header->plane_stride);
+   planes->distance = plane_arrays + (3 * header->plane_stride);
+   planes->color_r = plane_arrays + (4 * header->plane_stride);
+   planes->color_g = plane_arrays + (5 * header->plane_stride);
+   planes->color_b = plane_arrays + (6 * header->plane_stride);
+   planes->reflectivity = plane_arrays + (7 * header->plane_stride);
+
+   scene.primitive_count = header->primitive_count;
+   scene.primitive_capacity = header->primitive_count;
+   scene.primitives = (struct primitive *)(base + header->primitives_offset);
+
+   scene.bvh.node_count = header->bvh_node_count;
+   scene.bvh.nodes = (struct bvh_node *)(base + header->bvh_nodes_offset);
+   scene.bvh_is_dirty = false;
+
+   scene.file_memory = memory;
+   scene.file_size = size;
+
+   return(true);
+}
+
+function bool
+load_scene(char *path)
+{
+   // NOTE(law): Load either form of scene, told apart by the compiled form's
+   // magic number. Compiled scenes stay mapped, text scenes are unmapped once
+   // parsed. If loading fails, the default scene is put back.
+   u64 start = platform_timestamp();
+
+   size_t size;
+   void *memory = platform_map_file(path, &size);
+   if(!memory)
+   {
+      platform_log("ERROR: Failed to open scene %s.\n", path);
+      return(false);
+   }
+
+   bool is_compiled = (size >= sizeof(u32) && *(u32 *)memory == SCENE_FILE_MAGIC);
+
+   bool result;
+   if(is_compiled)
+   {
+      result = load_compiled_scene(memory, size);
+      if(!result)
+      {
+         platform_unmap_file(memory, size);
+      }
+   }
+   else
+   {
+      result = parse_scene_text((char *)memory, size);
+      platform_unmap_file(memory, size);
+   }
+
+   if(result)
+   {
+      float milliseconds = (float)(platform_timestamp() - start) / 1e6f;
+      platform_log("Loaded %s scene %s: %u planes, %u primitives in %.3fms\n",
+                   (is_compiled) ? "compiled" : "text", path, scene.planes.count, scene.primitive_count,
+                   milliseconds);
+   }
+   else
+   {
+      reset_scene();
+   }
+
+   return(result);
+}
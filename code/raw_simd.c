@@ -0,0 +1,399 @@
+/* /////////////////////////////////////////////////////////////////////////// */
+/* (c) copyright 2023 Lawrence D. Kern /////////////////////////////////////// */
+/* /////////////////////////////////////////////////////////////////////////// */
+
+// NOTE(law): Lane types wrap whichever SIMD register width the compiler was
+// told it can target. AVX2 builds process 8 rays per lane group, everything
+// else falls back to the SSE2 baseline guaranteed by x64 and processes 4.
+
+// NOTE(law): Comparison results are stored as lane_f32 values with all bits
+// set in the active lanes, so they can be combined with the bitwise lane
+// operations and passed directly to lane_select().
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define LANE_WIDTH 8
+#define LANE_ALIGNMENT 32
+
+typedef __m256  lane_f32;
+typedef __m256i lane_u32;
+
+#else
+#include <emmintrin.h>
+
+#define LANE_WIDTH 4
+#define LANE_ALIGNMENT 16
+
+typedef __m128  lane_f32;
+typedef __m128i lane_u32;
+
+#endif
+
+// NOTE(law): Arrays that are streamed through lane loads should be declared
+// LANE_ALIGNED and padded out to a multiple of LANE_WIDTH.
+
+#if defined(_MSC_VER)
+#define LANE_ALIGNED __declspec(align(LANE_ALIGNMENT))
+#else
+#define LANE_ALIGNED __attribute__((aligned(LANE_ALIGNMENT)))
+#endif
+
+#define LANE_PADDED_COUNT(count) ((((count) + LANE_WIDTH - 1) / LANE_WIDTH) * LANE_WIDTH)
+
+// NOTE(law): What lane_mask_bits() returns when every lane is set.
+#define LANE_ALL_BITS ((1u << LANE_WIDTH) - 1)
+
+#if LANE_WIDTH == 8
+
+function lane_f32 lane_f32_from_float(float value) {return(_mm256_set1_ps(value));}
+function lane_f32 lane_f32_from_u32(lane_u32 value) {return(_mm256_cvtepi32_ps(value));}
+function lane_u32 lane_u32_from_u32(u32 value) {return(_mm256_set1_epi32(value));}
+function lane_u32 lane_u32_from_f32(lane_f32 value) {return(_mm256_cvttps_epi32(value));}
+function lane_u32 lane_u32_index(u32 base) {return(_mm256_add_epi32(_mm256_set1_epi32(base), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));}
+
+function lane_f32 lane_add(lane_f32 a, lane_f32 b) {return(_mm256_add_ps(a, b));}
+function lane_f32 lane_sub(lane_f32 a, lane_f32 b) {return(_mm256_sub_ps(a, b));}
+function lane_f32 lane_mul(lane_f32 a, lane_f32 b) {return(_mm256_mul_ps(a, b));}
+function lane_f32 lane_div(lane_f32 a, lane_f32 b) {return(_mm256_div_ps(a, b));}
+function lane_f32 lane_square_root(lane_f32 a) {return(_mm256_sqrt_ps(a));}
+function lane_f32 lane_reciprocal_square_root_estimate(lane_f32 a) {return(_mm256_rsqrt_ps(a));}
+function lane_f32 lane_round(lane_f32 a) {return(_mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));}
+function lane_f32 lane_min(lane_f32 a, lane_f32 b) {return(_mm256_min_ps(a, b));}
+function lane_f32 lane_max(lane_f32 a, lane_f32 b) {return(_mm256_max_ps(a, b));}
+
+function lane_f32 lane_and(lane_f32 a, lane_f32 b) {return(_mm256_and_ps(a, b));}
+function lane_f32 lane_or(lane_f32 a, lane_f32 b) {return(_mm256_or_ps(a, b));}
+function lane_f32 lane_and_not(lane_f32 a, lane_f32 b) {return(_mm256_andnot_ps(b, a));}
+
+function lane_f32 lane_greater(lane_f32 a, lane_f32 b) {return(_mm256_cmp_ps(a, b, _CMP_GT_OQ));}
+function lane_f32 lane_less(lane_f32 a, lane_f32 b) {return(_mm256_cmp_ps(a, b, _CMP_LT_OQ));}
+function lane_f32 lane_greater_equal(lane_f32 a, lane_f32 b) {return(_mm256_cmp_ps(a, b, _CMP_GE_OQ));}
+function lane_f32 lane_less_equal(lane_f32 a, lane_f32 b) {return(_mm256_cmp_ps(a, b, _CMP_LE_OQ));}
+function lane_f32 lane_equal(lane_f32 a, lane_f32 b) {return(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));}
+
+function lane_f32 lane_select(lane_f32 mask, lane_f32 a, lane_f32 b) {return(_mm256_blendv_ps(a, b, mask));}
+function bool lane_any(lane_f32 mask) {return(_mm256_movemask_ps(mask) != 0);}
+function float lane_first(lane_f32 a) {return(_mm256_cvtss_f32(a));}
+function u32 lane_mask_bits(lane_f32 mask) {return((u32)_mm256_movemask_ps(mask));}
+
+function lane_u32 lane_u32_and(lane_u32 a, lane_u32 b) {return(_mm256_and_si256(a, b));}
+function lane_u32 lane_u32_or(lane_u32 a, lane_u32 b) {return(_mm256_or_si256(a, b));}
+#define lane_u32_shift_left(a, count) _mm256_slli_epi32((a), (count))
+
+function lane_f32 lane_u32_equal(lane_u32 a, lane_u32 b) {return(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));}
+function lane_u32 lane_u8_subtract_saturate(lane_u32 a, lane_u32 b) {return(_mm256_subs_epu8(a, b));}
+
+function lane_f32 lane_f32_load(float *source) {return(_mm256_load_ps(source));}
+function void lane_f32_store(float *destination, lane_f32 value) {_mm256_store_ps(destination, value);}
+
+function void
+lane_store_interleaved4(float *destination, lane_f32 a, lane_f32 b, lane_f32 c, lane_f32 d)
+{
+   // NOTE(law): Store lane i of a, b, c and d as the ith group of four floats,
+   // e.g. to turn separate color planes into RGBA pixels.
+   __m256 ab_low = _mm256_unpacklo_ps(a, b);
+   __m256 ab_high = _mm256_unpackhi_ps(a, b);
+   __m256 cd_low = _mm256_unpacklo_ps(c, d);
+   __m256 cd_high = _mm256_unpackhi_ps(c, d);
+
+   __m256 groups0 = _mm256_shuffle_ps(ab_low, cd_low, 0x44);  // 0 and 4
+   __m256 groups1 = _mm256_shuffle_ps(ab_low, cd_low, 0xEE);  // 1 and 5
+   __m256 groups2 = _mm256_shuffle_ps(ab_high, cd_high, 0x44); // 2 and 6
+   __m256 groups3 = _mm256_shuffle_ps(ab_high, cd_high, 0xEE); // 3 and 7
+
+   _mm256_storeu_ps(destination + 0,  _mm256_permute2f128_ps(groups0, groups1, 0x20));
+   _mm256_storeu_ps(destination + 8,  _mm256_permute2f128_ps(groups2, groups3, 0x20));
+   _mm256_storeu_ps(destination + 16, _mm256_permute2f128_ps(groups0, groups1, 0x31));
+   _mm256_storeu_ps(destination + 24, _mm256_permute2f128_ps(groups2, groups3, 0x31));
+}
+function void lane_u32_store(u32 *destination, lane_u32 value) {_mm256_storeu_si256((__m256i *)destination, value);}
+function lane_u32 lane_u32_load(u32 *source) {return(_mm256_loadu_si256((__m256i *)source));}
+
+#else
+
+function lane_f32 lane_f32_from_float(float value) {return(_mm_set1_ps(value));}
+function lane_f32 lane_f32_from_u32(lane_u32 value) {return(_mm_cvtepi32_ps(value));}
+function lane_u32 lane_u32_from_u32(u32 value) {return(_mm_set1_epi32(value));}
+function lane_u32 lane_u32_from_f32(lane_f32 value) {return(_mm_cvttps_epi32(value));}
+function lane_u32 lane_u32_index(u32 base) {return(_mm_add_epi32(_mm_set1_epi32(base), _mm_setr_epi32(0, 1, 2, 3)));}
+
+function lane_f32 lane_add(lane_f32 a, lane_f32 b) {return(_mm_add_ps(a, b));}
+function lane_f32 lane_sub(lane_f32 a, lane_f32 b) {return(_mm_sub_ps(a, b));}
+function lane_f32 lane_mul(lane_f32 a, lane_f32 b) {return(_mm_mul_ps(a, b));}
+function lane_f32 lane_div(lane_f32 a, lane_f32 b) {return(_mm_div_ps(a, b));}
+function lane_f32 lane_square_root(lane_f32 a) {return(_mm_sqrt_ps(a));}
+function lane_f32 lane_reciprocal_square_root_estimate(lane_f32 a) {return(_mm_rsqrt_ps(a));}
+
+// NOTE(law): SSE2 has no round instruction. Converting through integers rounds
+// to nearest even as well, and is exact for the magnitudes it is used on.
+function lane_f32 lane_round(lane_f32 a) {return(_mm_cvtepi32_ps(_mm_cvtps_epi32(a)));}
+function lane_f32 lane_min(lane_f32 a, lane_f32 b) {return(_mm_min_ps(a, b));}
+function lane_f32 lane_max(lane_f32 a, lane_f32 b) {return(_mm_max_ps(a, b));}
+
+function lane_f32 lane_and(lane_f32 a, lane_f32 b) {return(_mm_and_ps(a, b));}
+function lane_f32 lane_or(lane_f32 a, lane_f32 b) {return(_mm_or_ps(a, b));}
+function lane_f32 lane_and_not(lane_f32 a, lane_f32 b) {return(_mm_andnot_ps(b, a));}
+
+function lane_f32 lane_greater(lane_f32 a, lane_f32 b) {return(_mm_cmpgt_ps(a, b));}
+function lane_f32 lane_less(lane_f32 a, lane_f32 b) {return(_mm_cmplt_ps(a, b));}
+function lane_f32 lane_greater_equal(lane_f32 a, lane_f32 b) {return(_mm_cmpge_ps(a, b));}
+function lane_f32 lane_less_equal(lane_f32 a, lane_f32 b) {return(_mm_cmple_ps(a, b));}
+function lane_f32 lane_equal(lane_f32 a, lane_f32 b) {return(_mm_cmpeq_ps(a, b));}
+
+function lane_f32 lane_select(lane_f32 mask, lane_f32 a, lane_f32 b) {return(_mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b)));}
+function bool lane_any(lane_f32 mask) {return(_mm_movemask_ps(mask) != 0);}
+function float lane_first(lane_f32 a) {return(_mm_cvtss_f32(a));}
+function u32 lane_mask_bits(lane_f32 mask) {return((u32)_mm_movemask_ps(mask));}
+
+function lane_u32 lane_u32_and(lane_u32 a, lane_u32 b) {return(_mm_and_si128(a, b));}
+function lane_u32 lane_u32_or(lane_u32 a, lane_u32 b) {return(_mm_or_si128(a, b));}
+#define lane_u32_shift_left(a, count) _mm_slli_epi32((a), (count))
+
+function lane_f32 lane_u32_equal(lane_u32 a, lane_u32 b) {return(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));}
+function lane_u32 lane_u8_subtract_saturate(lane_u32 a, lane_u32 b) {return(_mm_subs_epu8(a, b));}
+
+function lane_f32 lane_f32_load(float *source) {return(_mm_load_ps(source));}
+function void lane_f32_store(float *destination, lane_f32 value) {_mm_store_ps(destination, value);}
+
+function void
+lane_store_interleaved4(float *destination, lane_f32 a, lane_f32 b, lane_f32 c, lane_f32 d)
+{
+   // NOTE(law): Store lane i of a, b, c and d as the ith group of four floats,
+   // e.g. to turn separate color planes into RGBA pixels.
+   _MM_TRANSPOSE4_PS(a, b, c, d);
+
+   _mm_storeu_ps(destination + 0,  a);
+   _mm_storeu_ps(destination + 4,  b);
+   _mm_storeu_ps(destination + 8,  c);
+   _mm_storeu_ps(destination + 12, d);
+}
+function void lane_u32_store(u32 *destination, lane_u32 value) {_mm_storeu_si128((__m128i *)destination, value);}
+function lane_u32 lane_u32_load(u32 *source) {return(_mm_loadu_si128((__m128i *)source));}
+
+#endif
+
+function lane_f32
+lane_absolute_value(lane_f32 a)
+{
+   // NOTE(law): Clear the sign bit.
+   lane_f32 sign_mask = lane_f32_from_float(-0.0f);
+
+   lane_f32 result = lane_and_not(a, sign_mask);
+   return(result);
+}
+
+function lane_f32
+lane_reciprocal_square_root(lane_f32 a)
+{
+   // NOTE(law): The hardware estimate is only good to about 12 bits. One
+   // Newton-Raphson step brings it to within a couple of ulps of 1/sqrt(a),
+   // still well short of the cost of a square root followed by a divide.
+   lane_f32 half = lane_f32_from_float(0.5f);
+   lane_f32 three_halves = lane_f32_from_float(1.5f);
+
+   lane_f32 estimate = lane_reciprocal_square_root_estimate(a);
+   lane_f32 correction = lane_sub(three_halves, lane_mul(lane_mul(half, a), lane_mul(estimate, estimate)));
+
+   lane_f32 result = lane_mul(estimate, correction);
+   return(result);
+}
+
+function lane_f32
+lane_sine(lane_f32 turns)
+{
+   // NOTE(law): Like sine(), the angle is measured in turns. Reduce it to
+   // [-1/2, 1/2], fold that onto [-1/4, 1/4] using sin(pi - a) = sin(a), and
+   // evaluate an odd minimax polynomial over the resulting quarter turn. The
+   // absolute error stays within 2.5e-7 for inputs up to a few thousand turns.
+   lane_f32 quarter = lane_f32_from_float(0.25f);
+   lane_f32 half = lane_f32_from_float(0.5f);
+   lane_f32 sign_mask = lane_f32_from_float(-0.0f);
+
+   lane_f32 x = lane_sub(turns, lane_round(turns));
+
+   lane_f32 signed_half = lane_or(lane_and(x, sign_mask), half);
+   lane_f32 fold = lane_greater(lane_absolute_value(x), quarter);
+   x = lane_select(fold, x, lane_sub(signed_half, x));
+
+   lane_f32 a = lane_mul(x, lane_f32_from_float(6.28318530717958647692f));
+   lane_f32 a2 = lane_mul(a, a);
+
+   lane_f32 polynomial = lane_f32_from_float(2.59991612e-6f);
+   polynomial = lane_add(lane_mul(polynomial, a2), lane_f32_from_float(-1.98066540e-4f));
+   polynomial = lane_add(lane_mul(polynomial, a2), lane_f32_from_float(8.33301619e-3f));
+   polynomial = lane_add(lane_mul(polynomial, a2), lane_f32_from_float(-1.66666567e-1f));
+   polynomial = lane_add(lane_mul(polynomial, a2), lane_f32_from_float(1.0f));
+
+   lane_f32 result = lane_mul(a, polynomial);
+   return(result);
+}
+
+function lane_f32
+lane_cosine(lane_f32 turns)
+{
+   // NOTE(law): Reduce before shifting by a quarter turn, so the addition
+   // cannot round away the low bits of large inputs.
+   lane_f32 reduced = lane_sub(turns, lane_round(turns));
+
+   lane_f32 result = lane_sine(lane_add(reduced, lane_f32_from_float(0.25f)));
+   return(result);
+}
+
+function lane_f32
+lane_srgb_encode(lane_f32 value)
+{
+   // NOTE(law): Clamps to [0, 1] and applies the sRGB transfer function. The
+   // power segment uses a fit to square roots instead of a pow() per channel,
+   // which stays within a quarter of a step of 8-bit output.
+   lane_f32 zero = lane_f32_from_float(0.0f);
+   lane_f32 one = lane_f32_from_float(1.0f);
+
+   value = lane_min(lane_max(value, zero), one);
+
+   lane_f32 root2 = lane_square_root(value);
+   lane_f32 root4 = lane_square_root(root2);
+   lane_f32 root8 = lane_square_root(root4);
+
+   lane_f32 curve = lane_mul(lane_f32_from_float(0.662002687f), root2);
+   curve = lane_add(curve, lane_mul(lane_f32_from_float(0.684122060f), root4));
+   curve = lane_sub(curve, lane_mul(lane_f32_from_float(0.323583601f), root8));
+   curve = lane_sub(curve, lane_mul(lane_f32_from_float(0.0225411470f), value));
+
+   lane_f32 linear = lane_mul(lane_f32_from_float(12.92f), value);
+   lane_f32 is_curve = lane_greater(value, lane_f32_from_float(0.0031308f));
+
+   lane_f32 result = lane_min(lane_select(is_curve, linear, curve), one);
+   return(result);
+}
+
+function u16
+f16_from_f32(float value)
+{
+   // NOTE(law): Round to nearest even, with overflow going to infinity and
+   // small values to half denormals or zero. NaNs stay NaNs.
+   union {float f; u32 u;} bits = {value};
+
+   u32 sign = (bits.u >> 16) & 0x8000;
+   u32 magnitude = bits.u & 0x7FFFFFFF;
+
+   u16 result;
+   if(magnitude >= 0x7F800000)
+   {
+      result = (u16)(sign | 0x7C00 | ((magnitude > 0x7F800000) ? 0x200 : 0));
+   }
+   else if(magnitude >= 0x477FF000)
+   {
+      result = (u16)(sign | 0x7C00);
+   }
+   else if(magnitude < 0x38800000)
+   {
+      // NOTE(law): Denormal. Shift the implicit bit in and round.
+      u32 shift = 126 - (magnitude >> 23);
+      if(shift > 24)
+      {
+         result = (u16)sign;
+      }
+      else
+      {
+         u32 mantissa = (magnitude & 0x007FFFFF) | 0x00800000;
+         u32 half = mantissa >> shift;
+         u32 remainder = mantissa & ((1u << shift) - 1);
+         u32 halfway = 1u << (shift - 1);
+         if(remainder > halfway || (remainder == halfway && (half & 1)))
+         {
+            half++;
+         }
+         result = (u16)(sign | half);
+      }
+   }
+   else
+   {
+      u32 rounded = magnitude - 0x38000000 + 0x0FFF + ((magnitude >> 13) & 1);
+      result = (u16)(sign | (rounded >> 13));
+   }
+
+   return(result);
+}
+
+function void
+lane_store_interleaved4_f16(u16 *destination, lane_f32 a, lane_f32 b, lane_f32 c, lane_f32 d)
+{
+   // NOTE(law): Like lane_store_interleaved4(), but converting to half floats.
+   // F16C converts a whole lane group at once. Every AVX2 processor has it,
+   // but it still needs its own check, and SSE2 builds without it fall back to
+   // converting each value.
+#if defined(__F16C__)
+#if LANE_WIDTH == 8
+   __m128i ha = _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT);
+   __m128i hb = _mm256_cvtps_ph(b, _MM_FROUND_TO_NEAREST_INT);
+   __m128i hc = _mm256_cvtps_ph(c, _MM_FROUND_TO_NEAREST_INT);
+   __m128i hd = _mm256_cvtps_ph(d, _MM_FROUND_TO_NEAREST_INT);
+#else
+   __m128i ha = _mm_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT);
+   __m128i hb = _mm_cvtps_ph(b, _MM_FROUND_TO_NEAREST_INT);
+   __m128i hc = _mm_cvtps_ph(c, _MM_FROUND_TO_NEAREST_INT);
+   __m128i hd = _mm_cvtps_ph(d, _MM_FROUND_TO_NEAREST_INT);
+#endif
+
+   __m128i ab_low = _mm_unpacklo_epi16(ha, hb);
+   __m128i cd_low = _mm_unpacklo_epi16(hc, hd);
+   _mm_storeu_si128((__m128i *)(destination + 0), _mm_unpacklo_epi32(ab_low, cd_low));
+   _mm_storeu_si128((__m128i *)(destination + 8), _mm_unpackhi_epi32(ab_low, cd_low));
+
+#if LANE_WIDTH == 8
+   __m128i ab_high = _mm_unpackhi_epi16(ha, hb);
+   __m128i cd_high = _mm_unpackhi_epi16(hc, hd);
+   _mm_storeu_si128((__m128i *)(destination + 16), _mm_unpacklo_epi32(ab_high, cd_high));
+   _mm_storeu_si128((__m128i *)(destination + 24), _mm_unpackhi_epi32(ab_high, cd_high));
+#endif
+#else
+   LANE_ALIGNED float values[4][LANE_WIDTH];
+   lane_f32_store(values[0], a);
+   lane_f32_store(values[1], b);
+   lane_f32_store(values[2], c);
+   lane_f32_store(values[3], d);
+
+   for(u32 lane = 0; lane < LANE_WIDTH; ++lane)
+   {
+      for(u32 component = 0; component < 4; ++component)
+      {
+         destination[(4 * lane) + component] = f16_from_f32(values[component][lane]);
+      }
+   }
+#endif
+}
+
+function lane_f32
+lane_lerp(lane_f32 a, lane_f32 t, lane_f32 b)
+{
+   // NOTE(law): Matches the operation order of the scalar LERP macro so that
+   // packet results are bit-identical to the scalar path.
+   lane_f32 one = lane_f32_from_float(1.0f);
+
+   lane_f32 result = lane_add(lane_mul(lane_sub(one, t), a), lane_mul(t, b));
+   return(result);
+}
+
+function lane_u32
+lane_u8_absolute_difference(lane_u32 a, lane_u32 b)
+{
+   // NOTE(law): Per byte |a - b|. One of the two saturating subtractions is
+   // always zero.
+   lane_u32 result = lane_u32_or(lane_u8_subtract_saturate(a, b), lane_u8_subtract_saturate(b, a));
+   return(result);
+}
+
+function void
+lane_u32_store_partial(u32 *destination, lane_u32 value, u32 count)
+{
+   // NOTE(law): Store only the first count lanes, for lane groups that hang off
+   // the right edge of a tile.
+   u32 lanes[LANE_WIDTH];
+   lane_u32_store(lanes, value);
+
+   for(u32 index = 0; index < count; ++index)
+   {
+      destination[index] = lanes[index];
+   }
+}
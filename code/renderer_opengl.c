@@ -3,6 +3,7 @@
 /* /////////////////////////////////////////////////////////////////////////// */
 
 #include <assert.h>
+#include <string.h>
 
 // NOTE(law): Prefix any typedef'ed OpenGL function pointers with
 // "opengl_function_" to make them uniformly accessible using the macros defined
@@ -43,6 +44,15 @@
    X(glBindBuffer)               \
    X(glBindVertexArray)          \
    X(glBufferData)               \
+   X(glBufferStorage)            \
+   X(glMapBufferRange)           \
+   X(glUnmapBuffer)              \
+   X(glFenceSync)                \
+   X(glClientWaitSync)           \
+   X(glDeleteSync)               \
+   X(glGetStringi)               \
+   X(glGetUniformLocation)       \
+   X(glUniform2f)                \
 
 typedef GLuint opengl_function_glCreateProgram(void);
 typedef   void opengl_function_glLinkProgram(GLuint program);
@@ -66,6 +76,15 @@ typedef   void opengl_function_glGenVertexArrays(GLsizei n, GLuint *arrays);
 typedef   void opengl_function_glBindBuffer(GLenum target, GLuint buffer);
 typedef   void opengl_function_glBindVertexArray(GLuint array);
 typedef   void opengl_function_glBufferData(GLenum target, GLsizeiptr size, const GLvoid *data, GLenum usage);
+typedef   void opengl_function_glBufferStorage(GLenum target, GLsizeiptr size, const GLvoid *data, GLbitfield flags);
+typedef  void *opengl_function_glMapBufferRange(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean opengl_function_glUnmapBuffer(GLenum target);
+typedef GLsync opengl_function_glFenceSync(GLenum condition, GLbitfield flags);
+typedef GLenum opengl_function_glClientWaitSync(GLsync sync, GLbitfield flags, GLuint64 timeout);
+typedef   void opengl_function_glDeleteSync(GLsync sync);
+typedef const GLubyte *opengl_function_glGetStringi(GLenum name, GLuint index);
+typedef  GLint opengl_function_glGetUniformLocation(GLuint program, const GLchar *name);
+typedef   void opengl_function_glUniform2f(GLint location, GLfloat v0, GLfloat v1);
 
 #define X(name) DECLARE_OPENGL_FUNCTION(name);
    OPENGL_FUNCTION_POINTERS
@@ -75,17 +94,68 @@ global GLuint opengl_global_vertex_buffer_object;
 global GLuint opengl_global_vertex_array_object;
 global GLuint opengl_global_shader_program;
 
+// NOTE(law): Frames reach the texture through a ring of pixel buffer objects,
+// so glTexSubImage2D can return as soon as the transfer is queued. Each buffer
+// gets a fence after its upload, and nothing writes into a buffer again before
+// that fence has signaled. With ARB_buffer_storage the buffers stay mapped for
+// their whole lifetime and the platform layer can render straight into them.
+
+#define OPENGL_PIXEL_BUFFER_COUNT 3
+
+struct opengl_pixel_buffer
+{
+   GLuint name;
+   void *mapping;
+   GLsync fence;
+
+   // NOTE(law): Claimed buffers back a bitmap and are only written by the
+   // renderer.
+   bool is_claimed;
+};
+
+global struct
+{
+   GLuint texture;
+   u32 texture_width;
+   u32 texture_height;
+   GLint texture_filter;
+   GLint texture_scale_location;
+   GLint texture_clamp_location;
+
+   // NOTE(law): Bitmaps upload in their own render format, so the driver does
+   // any conversion it needs instead of the renderer.
+   u32 format;
+   GLenum pixel_format;
+   GLenum pixel_type;
+   size_t bytes_per_pixel;
+
+   bool is_persistently_mapped;
+   size_t pixel_buffer_size;
+   u32 next_pixel_buffer_index;
+   struct opengl_pixel_buffer pixel_buffers[OPENGL_PIXEL_BUFFER_COUNT];
+
+   // NOTE(law): Bitmaps inside this range are uploaded straight from where
+   // they are, see opengl_set_external_memory().
+   u8 *external_memory;
+   size_t external_memory_size;
+
+   u32 client_width;
+   u32 client_height;
+   bool has_gutters;
+} opengl_global_stream;
+
 global const char *vertex_shader_code =
 "#version 330 core\n"
 "\n"
 "layout(location = 0) in vec2 position;\n"
 "layout(location = 1) in vec2 vertex_texture_coordinate;\n"
 "out vec2 fragment_texture_coordinate;\n"
+"uniform vec2 texture_scale;\n"
 "\n"
 "void main()\n"
 "{\n"
 "   gl_Position = vec4(position, 0.0f, 1.0f);\n"
-"   fragment_texture_coordinate = vertex_texture_coordinate;\n"
+"   fragment_texture_coordinate = vertex_texture_coordinate * texture_scale;\n"
 "}\n";
 
 global const char *fragment_shader_code =
@@ -94,14 +164,236 @@ global const char *fragment_shader_code =
 "in vec2 fragment_texture_coordinate;\n"
 "out vec4 output_color;\n"
 "uniform sampler2D bitmap_texture;\n"
+"uniform vec2 texture_clamp;\n"
 "\n"
 "void main()\n"
 "{\n"
-"   output_color = texture(bitmap_texture, fragment_texture_coordinate);\n"
+"   output_color = texture(bitmap_texture, min(fragment_texture_coordinate, texture_clamp));\n"
 "}\n";
 
+function bool
+opengl_has_extension(char *name)
+{
+   GLint extension_count = 0;
+   glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+
+   for(GLint index = 0; index < extension_count; ++index)
+   {
+      const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, index);
+      if(extension && strcmp(extension, name) == 0)
+      {
+         return(true);
+      }
+   }
+
+   return(false);
+}
+
+function void
+opengl_wait_for_fence(struct opengl_pixel_buffer *buffer)
+{
+   if(buffer->fence)
+   {
+      GLenum status;
+      do
+      {
+         status = glClientWaitSync(buffer->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+      } while(status == GL_TIMEOUT_EXPIRED);
+
+      glDeleteSync(buffer->fence);
+      buffer->fence = 0;
+   }
+}
+
+function void
+opengl_initialize_streaming(u32 width, u32 height, u32 format)
+{
+   GLint internal_format = GL_RGBA8;
+   GLenum pixel_format = GL_BGRA;
+   GLenum pixel_type = GL_UNSIGNED_BYTE;
+   switch(format)
+   {
+      case RENDER_FORMAT_BGRA8:   {internal_format = GL_RGBA8;   pixel_format = GL_BGRA; pixel_type = GL_UNSIGNED_BYTE;} break;
+      case RENDER_FORMAT_RGBA16F: {internal_format = GL_RGBA16F; pixel_format = GL_RGBA; pixel_type = GL_HALF_FLOAT;} break;
+      case RENDER_FORMAT_RGBA32F: {internal_format = GL_RGBA32F; pixel_format = GL_RGBA; pixel_type = GL_FLOAT;} break;
+      default: {assert(!"Unhandled render format.");} break;
+   }
+
+   opengl_global_stream.format = format;
+   opengl_global_stream.pixel_format = pixel_format;
+   opengl_global_stream.pixel_type = pixel_type;
+   opengl_global_stream.bytes_per_pixel = get_render_format_bytes_per_pixel(format);
+
+   // NOTE(law): The texture storage is allocated once, at the largest size a
+   // bitmap can have. Smaller (dynamically scaled) frames only update and
+   // sample its lower left corner.
+   glGenTextures(1, &opengl_global_stream.texture);
+   glBindTexture(GL_TEXTURE_2D, opengl_global_stream.texture);
+   glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, pixel_format, pixel_type, 0);
+
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+   opengl_global_stream.texture_width = width;
+   opengl_global_stream.texture_height = height;
+   opengl_global_stream.texture_filter = GL_NEAREST;
+   opengl_global_stream.pixel_buffer_size = (size_t)width * height * opengl_global_stream.bytes_per_pixel;
+
+   opengl_global_stream.is_persistently_mapped = opengl_has_extension("GL_ARB_buffer_storage");
+   platform_log("Pixel buffer streaming: %s\n", (opengl_global_stream.is_persistently_mapped) ?
+                "persistently mapped" : "mapped per frame");
+
+   GLbitfield storage_flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+   for(u32 index = 0; index < OPENGL_PIXEL_BUFFER_COUNT; ++index)
+   {
+      struct opengl_pixel_buffer *buffer = opengl_global_stream.pixel_buffers + index;
+
+      glGenBuffers(1, &buffer->name);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->name);
+
+      if(opengl_global_stream.is_persistently_mapped)
+      {
+         glBufferStorage(GL_PIXEL_UNPACK_BUFFER, opengl_global_stream.pixel_buffer_size, 0, storage_flags);
+         buffer->mapping = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, opengl_global_stream.pixel_buffer_size, storage_flags);
+         assert(buffer->mapping);
+      }
+      else
+      {
+         glBufferData(GL_PIXEL_UNPACK_BUFFER, opengl_global_stream.pixel_buffer_size, 0, GL_STREAM_DRAW);
+      }
+   }
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+function void *
+opengl_get_pixel_buffer_memory(u32 index)
+{
+   // NOTE(law): Returns persistently mapped memory that a bitmap can render
+   // into directly, or 0 if the caller has to provide its own. Call
+   // opengl_prepare_bitmap_for_writing() before each frame rendered into it.
+   // NOTE(law): At least one buffer is always left for copying other bitmaps.
+   void *result = 0;
+   if(opengl_global_stream.is_persistently_mapped && index < (OPENGL_PIXEL_BUFFER_COUNT - 1))
+   {
+      struct opengl_pixel_buffer *buffer = opengl_global_stream.pixel_buffers + index;
+      buffer->is_claimed = true;
+
+      result = buffer->mapping;
+   }
+
+   return(result);
+}
+
+function struct opengl_pixel_buffer *
+opengl_find_pixel_buffer(void *memory)
+{
+   struct opengl_pixel_buffer *result = 0;
+   for(u32 index = 0; index < OPENGL_PIXEL_BUFFER_COUNT; ++index)
+   {
+      struct opengl_pixel_buffer *buffer = opengl_global_stream.pixel_buffers + index;
+      if(buffer->is_claimed && buffer->mapping == memory)
+      {
+         result = buffer;
+         break;
+      }
+   }
+
+   return(result);
+}
+
+function void
+opengl_prepare_bitmap_for_writing(struct render_bitmap *bitmap)
+{
+   // NOTE(law): Bitmaps that live in a pixel buffer must not be overwritten
+   // until the upload of their previous contents has finished.
+   struct opengl_pixel_buffer *buffer = opengl_find_pixel_buffer(bitmap->memory);
+   if(buffer)
+   {
+      opengl_wait_for_fence(buffer);
+   }
+}
+
+function void
+opengl_set_external_memory(void *memory, size_t size)
+{
+   // NOTE(law): Memory the caller owns and only keeps stable until the upload
+   // call returns, e.g. frames shared by another process. Those bitmaps are
+   // read by glTexSubImage2D directly instead of being copied into a pixel
+   // buffer first. Without a pixel buffer bound the driver has to consume the
+   // data before the call returns, so the memory can be released right after
+   // opengl_display_bitmap().
+   opengl_global_stream.external_memory = (u8 *)memory;
+   opengl_global_stream.external_memory_size = size;
+}
+
 function void
-opengl_initialize()
+opengl_upload_bitmap(struct render_bitmap *bitmap)
+{
+   assert(bitmap->width <= opengl_global_stream.texture_width);
+   assert(bitmap->height <= opengl_global_stream.texture_height);
+   assert(bitmap->format == opengl_global_stream.format);
+
+   size_t size = (size_t)bitmap->width * bitmap->height * opengl_global_stream.bytes_per_pixel;
+
+   u8 *memory = (u8 *)bitmap->memory;
+   u8 *external_memory = opengl_global_stream.external_memory;
+   if(memory >= external_memory && memory + size <= external_memory + opengl_global_stream.external_memory_size)
+   {
+      glBindTexture(GL_TEXTURE_2D, opengl_global_stream.texture);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bitmap->width, bitmap->height,
+                      opengl_global_stream.pixel_format, opengl_global_stream.pixel_type, memory);
+      return;
+   }
+
+   // NOTE(law): Bitmaps rendered straight into a pixel buffer upload without
+   // touching the CPU. Anything else is copied into the next buffer in the
+   // ring first.
+   struct opengl_pixel_buffer *buffer = opengl_find_pixel_buffer(bitmap->memory);
+   if(!buffer)
+   {
+      u32 index = opengl_global_stream.next_pixel_buffer_index;
+      while(opengl_global_stream.pixel_buffers[index].is_claimed)
+      {
+         index = (index + 1) % OPENGL_PIXEL_BUFFER_COUNT;
+      }
+      opengl_global_stream.next_pixel_buffer_index = (index + 1) % OPENGL_PIXEL_BUFFER_COUNT;
+
+      buffer = opengl_global_stream.pixel_buffers + index;
+      opengl_wait_for_fence(buffer);
+
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->name);
+      if(buffer->mapping)
+      {
+         memcpy(buffer->mapping, bitmap->memory, size);
+      }
+      else
+      {
+         GLbitfield access = GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT|GL_MAP_UNSYNCHRONIZED_BIT;
+         void *mapping = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, access);
+         if(mapping)
+         {
+            memcpy(mapping, bitmap->memory, size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+         }
+      }
+   }
+   else
+   {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->name);
+   }
+
+   glBindTexture(GL_TEXTURE_2D, opengl_global_stream.texture);
+   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bitmap->width, bitmap->height,
+                   opengl_global_stream.pixel_format, opengl_global_stream.pixel_type, 0);
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+   buffer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+function void
+opengl_initialize(u32 bitmap_width, u32 bitmap_height, u32 bitmap_format)
 {
    platform_log("=====\n");
    platform_log("OpenGL Information:\n");
@@ -230,57 +522,83 @@ opengl_initialize()
 
    glDeleteShader(vertex_shader);
    glDeleteShader(fragment_shader);
+
+   opengl_global_stream.texture_scale_location = glGetUniformLocation(opengl_global_shader_program, "texture_scale");
+   opengl_global_stream.texture_clamp_location = glGetUniformLocation(opengl_global_shader_program, "texture_clamp");
+
+   opengl_initialize_streaming(bitmap_width, bitmap_height, bitmap_format);
 }
 
 function void
 opengl_display_bitmap(struct render_bitmap *bitmap, u32 client_width, u32 client_height)
 {
-   float client_aspect_ratio = (float)client_width / (float)client_height;
-   float target_aspect_ratio = (float)RESOLUTION_BASE_WIDTH / (float)RESOLUTION_BASE_HEIGHT;
-
-   float target_width  = (float)client_width;
-   float target_height = (float)client_height;
-   float gutter_width  = 0;
-   float gutter_height = 0;
-
-   if(client_aspect_ratio > target_aspect_ratio)
+   // NOTE(law): Only touch the viewport when the window size changes.
+   if(client_width != opengl_global_stream.client_width || client_height != opengl_global_stream.client_height)
    {
-      // NOTE(law): The window is too wide, fill in the left and right sides
-      // with black gutters.
-      target_width = target_aspect_ratio * (float)client_height;
-      gutter_width = (client_width - target_width) / 2;
+      float client_aspect_ratio = (float)client_width / (float)client_height;
+      float target_aspect_ratio = (float)RESOLUTION_BASE_WIDTH / (float)RESOLUTION_BASE_HEIGHT;
+
+      float target_width  = (float)client_width;
+      float target_height = (float)client_height;
+      float gutter_width  = 0;
+      float gutter_height = 0;
+
+      if(client_aspect_ratio > target_aspect_ratio)
+      {
+         // NOTE(law): The window is too wide, fill in the left and right sides
+         // with black gutters.
+         target_width = target_aspect_ratio * (float)client_height;
+         gutter_width = (client_width - target_width) / 2;
+      }
+      else if(client_aspect_ratio < target_aspect_ratio)
+      {
+         // NOTE(law): The window is too tall, fill in the top and bottom with
+         // black gutters.
+         target_height = (1.0f / target_aspect_ratio) * (float)client_width;
+         gutter_height = (client_height - target_height) / 2;
+      }
+
+      glViewport(gutter_width, gutter_height, target_width, target_height);
+
+      opengl_global_stream.client_width = client_width;
+      opengl_global_stream.client_height = client_height;
+      opengl_global_stream.has_gutters = ((s32)gutter_width > 0 || (s32)gutter_height > 0);
    }
-   else if(client_aspect_ratio < target_aspect_ratio)
+
+   // NOTE(law): The quad covers the whole viewport, so clearing the window to
+   // black is only needed for the gutters.
+   if(opengl_global_stream.has_gutters)
    {
-      // NOTE(law): The window is too tall, fill in the top and bottom with
-      // black gutters.
-      target_height = (1.0f / target_aspect_ratio) * (float)client_width;
-      gutter_height = (client_height - target_height) / 2;
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
    }
 
-   // TODO(law): Should we only set the viewport on resize events?
-   glViewport(gutter_width, gutter_height, target_width, target_height);
-
-   // NOTE(law): Clear the window to black.
-   glClearColor(0, 0, 0, 1);
-   glClear(GL_COLOR_BUFFER_BIT);
-
-   // NOTE(law): Set up the pixel bitmap as an OpenGL texture.
-   glBindTexture(GL_TEXTURE_2D, 1);
-   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, bitmap->width, bitmap->height, 0,
-                GL_BGRA_EXT, GL_UNSIGNED_BYTE, bitmap->memory);
+   opengl_upload_bitmap(bitmap);
 
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP);
-
-   glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-   glEnable(GL_TEXTURE_2D);
+   // NOTE(law): Keep the crisp nearest-neighbor look at full resolution, but
+   // filter when dynamic resolution has scaled the bitmap down.
+   bool is_scaled = (bitmap->width < opengl_global_stream.texture_width ||
+                     bitmap->height < opengl_global_stream.texture_height);
+   GLint filter = (is_scaled) ? GL_LINEAR : GL_NEAREST;
+   if(filter != opengl_global_stream.texture_filter)
+   {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+      opengl_global_stream.texture_filter = filter;
+   }
 
    // NOTE(law): Draw the bitmap using the previously-defined shaders.
    glUseProgram(opengl_global_shader_program);
+   glUniform2f(opengl_global_stream.texture_scale_location,
+               (float)bitmap->width / (float)opengl_global_stream.texture_width,
+               (float)bitmap->height / (float)opengl_global_stream.texture_height);
+
+   // NOTE(law): Only the bitmap's corner of the texture is valid. Stopping at
+   // the center of its last texels keeps filtering from blending in the stale
+   // ones beyond.
+   glUniform2f(opengl_global_stream.texture_clamp_location,
+               ((float)bitmap->width - 0.5f) / (float)opengl_global_stream.texture_width,
+               ((float)bitmap->height - 0.5f) / (float)opengl_global_stream.texture_height);
    glBindVertexArray(opengl_global_vertex_array_object);
 
    glDrawArrays(GL_TRIANGLES, 0, 6);